@@ -41,11 +41,15 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "sais.h"
+#include "sa_build.h"
 #include "FMI_search.h"
 #include "memcpy_bwamem.h"
 #include "profiling.h"
 #include "bwa_shm.h"
+#include "kthread.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -79,7 +83,7 @@ void FMI_search::__build_all_smem_table(uint8_t *seq, int len, all_smem_t *ent)
 	int i;
 	uint8_t a;
 
-	memset(ent, 0, sizeof(all_smem_t));
+	memset(ent, 0, __all_smem_ent_size(len));
 
 	a = seq[0];
 	SMEM smem;
@@ -119,37 +123,23 @@ void FMI_search::__build_all_smem_table(uint8_t *seq, int len, all_smem_t *ent)
 	}
 }
 
-all_smem_t *FMI_search::build_all_smem_table(int len) {
-	all_smem_t *table;
-	int64_t num_entry, num_step;
+/* build the entries [first, first + n) of the all smem table of len-bp.
+   hist[v] counts the entries with last_avail == v. */
+void FMI_search::build_all_smem_table(int len, int64_t first, int64_t n,
+									all_smem_t *table, uint64_t *hist) {
 	uint8_t seq[len];
-	uint64_t i;
-
-	num_entry = __num_smem_table_entry(len);
-	num_step = num_entry / 2;
-	table = (all_smem_t *) _mm_malloc(num_entry * sizeof(all_smem_t), 64);
-	if (!table) {
-		printf("ERROR: cannot allocate memory for all smem table\n");
-		return NULL;
-	}
+	int64_t i;
+	int k;
 
-	for (i = 0; i < len; ++i)
-		seq[i] = 0;
+	for (k = 0; k < len; ++k)
+		seq[k] = (first >> ((len - 1 - k) * 2)) & 3;
 
-	i = 0;
-	__build_all_smem_table(seq, len, &table[i++]);
-	while (__seq_next(seq, len)) {
-		__build_all_smem_table(seq, len, &table[i++]);
-		if (i % num_step == 0) {
-			printf("%s: progress %ld/%ld (%.2f%%)\n",
-					__func__, i, num_entry, 
-					(double) i * 100 / (double) num_entry);
-		}
+	for (i = first; i < first + n; ++i) {
+		all_smem_t *ent = __all_smem_ent(table, len, i);
+		__build_all_smem_table(seq, len, ent);
+		hist[ent->last_avail]++;
+		__seq_next(seq, len);
 	}
-	
-	assert(i == num_entry);
-
-	return table;
 }
 
 void FMI_search::__build_last_smem_table(uint8_t *seq, int len, last_smem_t *ent) {
@@ -193,198 +183,352 @@ void FMI_search::__build_last_smem_table(uint8_t *seq, int len, last_smem_t *ent
 	ent->sls = (uint32_t) (smem.s & 0xffffffff);
 }
 
-last_smem_t *FMI_search::build_last_smem_table(int len) {
-	last_smem_t *table;
-	int64_t num_entry, num_step;
+/* build the entries [first, first + n) of the last smem table of len-bp.
+   hist[v] counts the entries with bp == v. */
+void FMI_search::build_last_smem_table(int len, int64_t first, int64_t n,
+									last_smem_t *table, uint64_t *hist) {
 	uint8_t seq[len];
-	uint64_t i;
-
-	num_entry = __num_smem_table_entry(len);
-	num_step = num_entry / 100;
-	table = (last_smem_t *)_mm_malloc(num_entry * sizeof(last_smem_t), 64);
-	if (!table) {
-		printf("ERROR: cannot allocate memory for last smem table\n");
-		return NULL;
-	}
+	int64_t i;
+	int k;
 
-	for (i = 0; i < len; ++i)
-		seq[i] = 0;
+	for (k = 0; k < len; ++k)
+		seq[k] = (first >> ((len - 1 - k) * 2)) & 3;
 
-	i = 0;
-	__build_last_smem_table(seq, len, &table[i++]);
-	while (__seq_next(seq, len)) {
-		__build_last_smem_table(seq, len, &table[i++]);
-		if (i % num_step == 0) {
-			printf("%s: progress %ld/%ld (%.2f%%)\n",
-					__func__, i, num_entry, 
-					(double) i * 100 / (double) num_entry);
-		}
+	for (i = first; i < first + n; ++i) {
+		__build_last_smem_table(seq, len, &table[i]);
+		hist[table[i].bp]++;
+		__seq_next(seq, len);
 	}
-	
-	assert(i == num_entry);
+}
+
+/* smem is the interval of the last depth bases of a k-mer, idx holds them.
+   only the intervals with more than min_occ rows are extended, so the walk is
+   bounded by the repetitive part of the reference, not by 4^len. */
+void FMI_search::__build_hiocc_table(SMEM smem, uint64_t idx, int depth, int len, hiocc_t *table) {
+	uint8_t a;
 
-	return table;
+	if (depth == len) {
+		__sync_fetch_and_or(&table->bits[idx >> 6], 1ULL << (idx & 63));
+		return;
+	}
+	for (a = 0; a < 4; ++a) {
+		SMEM newSmem = backwardExt(smem, a);
+		if (newSmem.s > table->min_occ)
+			__build_hiocc_table(newSmem, idx | ((uint64_t) a << (depth * 2)), depth + 1, len, table);
+	}
 }
 
-int build_smem_tables(char *prefix) {
-	char all_smem_fn[PATH_MAX];
-	char last_smem_fn[PATH_MAX];
-	FILE *fp;
-	all_smem_t *all_smem_table;
-	last_smem_t *last_smem_table;
-	FMI_search *fmi;
+/* set the bits of the k-mers ending with suffix (suffix_len bp, the last base in the
+   lowest bits) */
+void FMI_search::build_hiocc_table(int len, int64_t suffix, int suffix_len, hiocc_t *table) {
+	uint8_t a = suffix & 3;
+	int d;
 
-	fmi = new FMI_search(prefix);
-	building_smem_table = 1;
-	fmi->load_index();
+	SMEM smem;
+	smem.rid = 0;
+	smem.m = 0;
+	smem.n = 0;
+	smem.k = count[a];
+	smem.l = count[3 - a];
+	smem.s = count[a + 1] - count[a];
+	for (d = 1; d < suffix_len && smem.s > table->min_occ; ++d)
+		smem = backwardExt(smem, (suffix >> (d * 2)) & 3);
 
-	/* all smem table */
-	snprintf_s_si(all_smem_fn, PATH_MAX, "%s.all_smem.%d", prefix, ALL_SMEM_MAX_BP);
-	printf("Build all smem table\n");
-	all_smem_table = fmi->build_all_smem_table(ALL_SMEM_MAX_BP);
-	if (all_smem_table == NULL) {
-		printf("ERROR: failed to build all smem table\n");
-		return -1;
+	if (smem.s > table->min_occ)
+		__build_hiocc_table(smem, suffix, suffix_len, len, table);
+}
+
+/* The skip rate of the smem tables, measured over all k-mers (uniformly) of each length up
+   to the built one, since the entries of a shorter table are the prefixes of the longer one.
+   hist[v] is the number of entries with last_avail == v (all) or with bp == v (last).
+   - all_smem: a lookup takes min(v, len - 1) - 1 steps of forward extension from the table.
+   - last_smem: a lookup jumps over min(v, len) - 1 steps of forward extension. */
+static void smem_table_report_skip(const char *name, int len, const uint64_t *hist, int is_last) {
+	uint64_t total = 0;
+	int l, v;
+
+	for (v = 0; v <= len; ++v)
+		total += hist[v];
+	if (total == 0)
+		return;
+
+	printf("%s table: skip rate per length (uniform k-mers)\n", name);
+	printf("  len  steps/lookup  max  skip-rate  full\n");
+	for (l = SMEM_TABLE_MIN_BP; l <= len; ++l) {
+		uint64_t steps = 0, full = 0;
+		int max_steps = is_last ? l - 1 : l - 2;
+		for (v = 0; v <= len; ++v) {
+			int n = is_last ? (v < l ? v : l) - 1 : (v < l - 1 ? v : l - 1) - 1;
+			if (n <= 0)
+				continue;
+			steps += hist[v] * n;
+			if (n == max_steps)
+				full += hist[v];
+		}
+		printf("  %3d  %12.3f  %3d  %8.2f%%  %.2f%%\n", l,
+				(double) steps / total, max_steps,
+				(double) steps * 100 / ((double) total * max_steps),
+				(double) full * 100 / total);
 	}
-	printf("Write all smem table to %s\n", all_smem_fn);
-	fp = xopen(all_smem_fn, "wb");
-	err_fwrite(all_smem_table, sizeof(all_smem_t),
-				__num_smem_table_entry(ALL_SMEM_MAX_BP), fp);
-	err_fflush(fp);
-	err_fclose(fp);
-	_mm_free(all_smem_table);
-	all_smem_table = NULL;
+}
 
-	/* last smem table */
-	snprintf_s_si(last_smem_fn, PATH_MAX, "%s.last_smem.%d", prefix, LAST_SMEM_MAX_BP);
-	printf("Build last smem table\n");
-	last_smem_table = fmi->build_last_smem_table(LAST_SMEM_MAX_BP);
-	if (last_smem_table == NULL) {
-		printf("ERROR: failed to build last smem table\n");
-		return -1;
+/* the longest one of prefix.suffix.N for N <= max_len, 0 if there is none */
+int smem_table_find_len(const char *prefix, const char *suffix, int max_len) {
+	char fn[PATH_MAX];
+	int len;
+
+	if (max_len > SMEM_TABLE_MAX_BP)
+		max_len = SMEM_TABLE_MAX_BP;
+	for (len = max_len; len >= SMEM_TABLE_MIN_BP; --len) {
+		snprintf(fn, PATH_MAX, "%s%s%d", prefix, suffix, len);
+		if (access(fn, R_OK) == 0)
+			return len;
 	}
-	printf("Write last smem table to %s\n", last_smem_fn);
-	fp = xopen(last_smem_fn, "wb");
-	err_fwrite(last_smem_table, sizeof(last_smem_t),
-				__num_smem_table_entry(LAST_SMEM_MAX_BP), fp);
-	err_fflush(fp);
-	err_fclose(fp);
-	_mm_free(last_smem_table);
-	last_smem_table = NULL;
-	
-	delete(fmi);
 	return 0;
 }
 
-static int __load_smem_table_from_file(const char *prefix, 
-									all_smem_t **__all_smem_table, 
-									last_smem_t **__last_smem_table)
-{
-	FILE *fp;
-	all_smem_t *all_smem_table;
-	last_smem_t *last_smem_table;
+/* A table is written to fn.tmp and only renamed to fn once it is complete, so that
+   smem_table_find_len() and the shm loader never pick up a truncated one. */
+static FILE *smem_table_open(const char *fn) {
+	char tmp_fn[PATH_MAX];
 
-	/* all smem table */
-	if (__all_smem_table) {
-		char all_smem_fn[PATH_MAX];
-		
-		all_smem_table = *__all_smem_table;
-		
-		/* memory allocation if required */
-		if (all_smem_table == NULL) 
-			all_smem_table = (all_smem_t *)_mm_malloc(ALL_SMEM_TABLE_SIZE, 64);
-		
-		if (all_smem_table == NULL) {
-			fprintf(stderr, "ERROR: cannot allocate memory for all smem table\n");
-			exit(EXIT_FAILURE);
-		}
+	snprintf(tmp_fn, PATH_MAX, "%s.tmp", fn);
+	return xopen(tmp_fn, "wb");
+}
 
-		fprintf(stderr, "INFO: load all smem table from file (len: %d)\n", ALL_SMEM_MAX_BP);
-		snprintf(all_smem_fn, PATH_MAX, "%s.all_smem.%d", prefix, ALL_SMEM_MAX_BP);
-		fp = xopen(all_smem_fn, "rb");
-		err_fread_noeof(all_smem_table, sizeof(all_smem_t),
-					__num_smem_table_entry(ALL_SMEM_MAX_BP), fp);
+/* closes a table opened by smem_table_open(); renames it to fn if complete, else removes it */
+static void smem_table_close(FILE *fp, const char *fn, int complete) {
+	char tmp_fn[PATH_MAX];
+
+	snprintf(tmp_fn, PATH_MAX, "%s.tmp", fn);
+	if (complete) {
+		err_fflush(fp);
 		err_fclose(fp);
-	
-		/* return */
-		*__all_smem_table = all_smem_table;
+		if (rename(tmp_fn, fn) != 0)
+			err_fatal(__func__, "cannot rename %s to %s: %s", tmp_fn, fn, strerror(errno));
+	} else {
+		fclose(fp);
+		unlink(tmp_fn);
 	}
+}
 
-	/* last smem table */
-	if (__last_smem_table) {
-		char last_smem_fn[PATH_MAX];
-		
-		last_smem_table = *__last_smem_table;
-		
-		/* memory allocation if required */
-		if (last_smem_table == NULL) 
-			last_smem_table = (last_smem_t *)_mm_malloc(LAST_SMEM_TABLE_SIZE, 64);
-		
-		if (last_smem_table == NULL) {
-			fprintf(stderr, "ERROR: cannot lastocate memory for last smem table\n");
-			exit(EXIT_FAILURE);
-		}
+/* Both tables are built in one parallel region. The k-mer space of each table is split into
+   slices of 4^SMEM_SLICE_BP entries by the leading bases, and each slice is filled by a single
+   worker. The slices of the all table are handed out first, so that a writer thread streams
+   the finished prefix of the all table to disk while the last table is being built. */
+#define SMEM_SLICE_BP 8
+#define SMEM_WRITE_CHUNK (64LL << 20)
 
-		fprintf(stderr, "INFO: load last smem table from file (len: %d)\n", LAST_SMEM_MAX_BP);
-		snprintf(last_smem_fn, PATH_MAX, "%s.last_smem.%d", prefix, LAST_SMEM_MAX_BP);
-		fp = xopen(last_smem_fn, "rb");
-		err_fread_noeof(last_smem_table, sizeof(last_smem_t),
-					__num_smem_table_entry(LAST_SMEM_MAX_BP), fp);
-		err_fclose(fp);
+typedef struct {
+	FMI_search *fmi;
+	int len[2];                 /* 0: all smem, 1: last smem. 0 if it is not built */
+	uint8_t *table[2];
+	size_t ent_size[2];
+	int64_t slice_ent[2];       /* entries per slice */
+	int64_t n_slice[2];
+	volatile uint8_t *done[2];  /* per slice */
+	uint64_t *hist;             /* [n_threads][2][SMEM_TABLE_MAX_BP + 1] */
+	char fn[2][PATH_MAX];
+	FILE *fp[2];                /* open on fn[w].tmp, see smem_table_open() */
+} smem_build_t;
+
+static void smem_build_worker(void *data, long i, long n, int tid) {
+	smem_build_t *b = (smem_build_t *) data;
+	long e;
+
+	for (e = i; e < i + n; ++e) {
+		int w = e < b->n_slice[0] ? 0 : 1;
+		int64_t s = w == 0 ? e : e - b->n_slice[0];
+		uint64_t *hist = &b->hist[(tid * 2 + w) * (SMEM_TABLE_MAX_BP + 1)];
+
+		if (w == 0)
+			b->fmi->build_all_smem_table(b->len[0], s * b->slice_ent[0], b->slice_ent[0],
+										(all_smem_t *) b->table[0], hist);
+		else
+			b->fmi->build_last_smem_table(b->len[1], s * b->slice_ent[1], b->slice_ent[1],
+										(last_smem_t *) b->table[1], hist);
+		__atomic_store_n(&b->done[w][s], 1, __ATOMIC_RELEASE);
+	}
+}
+
+#define HIOCC_SUFFIX_BP 6
+
+typedef struct {
+	FMI_search *fmi;
+	int len, suffix_len;
+	hiocc_t *table;
+} hiocc_build_t;
+
+static void hiocc_build_worker(void *data, long i, long n, int tid) {
+	hiocc_build_t *b = (hiocc_build_t *) data;
+	long e;
 
-		/* return */
-		*__last_smem_table = last_smem_table;
+	for (e = i; e < i + n; ++e)
+		b->fmi->build_hiocc_table(b->len, e, b->suffix_len, b->table);
+}
+
+static int build_hiocc_table(const char *prefix, FMI_search *fmi, kt_pool_t *pool,
+							int len, int64_t min_occ) {
+	char fn[PATH_MAX];
+	hiocc_build_t b;
+	size_t size = __hiocc_table_size(len);
+	int64_t i, n_set = 0, n_word = __num_smem_table_entry(len) >> 6;
+	FILE *fp;
+
+	printf("Build high-occurrence k-mer table (len: %d, occ > %ld, size: %.2fGB)\n",
+			len, (long) min_occ, (double) size / (1LL << 30));
+	b.fmi = fmi;
+	b.len = len;
+	b.suffix_len = len < HIOCC_SUFFIX_BP ? len : HIOCC_SUFFIX_BP;
+	b.table = (hiocc_t *) _mm_malloc(size, 64);
+	if (b.table == NULL) {
+		printf("ERROR: cannot allocate memory for high-occurrence k-mer table\n");
+		return -1;
 	}
-	
+	memset(b.table, 0, size);
+	b.table->len = len;
+	b.table->min_occ = min_occ;
+
+	kt_pool_for(pool, hiocc_build_worker, &b, __num_smem_table_entry(b.suffix_len), 1);
+
+	for (i = 0; i < (n_word > 0 ? n_word : 1); ++i)
+		n_set += __builtin_popcountll(b.table->bits[i]);
+	printf("%ld of %lld %d-mers (%.4f%%) occur more than %ld times\n", (long) n_set,
+			__num_smem_table_entry(len), len, n_set * 100.0 / __num_smem_table_entry(len), (long) min_occ);
+
+	snprintf(fn, PATH_MAX, "%s.hiocc.%d", prefix, len);
+	printf("Write high-occurrence k-mer table to %s\n", fn);
+	fp = smem_table_open(fn);
+	err_fwrite(b.table, 1, size, fp);
+	smem_table_close(fp, fn, 1);
+	_mm_free(b.table);
 	return 0;
 }
 
-#ifdef USE_SHM
-static inline void __load_smem_table_set_shm_ptr(all_smem_t **__all,
-												last_smem_t **__last,
-												uint8_t *shm)
-{
-	if (__all) {
-		*__all = (all_smem_t *) shm;
-		shm += ALL_SMEM_TABLE_SIZE;
-	}
+/* writes the finished slices in order, at least SMEM_WRITE_CHUNK bytes at a time */
+static void *smem_build_writer(void *data) {
+	smem_build_t *b = (smem_build_t *) data;
+	int w;
 
-	if (__last) {
-		*__last = (last_smem_t *) shm;
+	for (w = 0; w < 2; ++w) {
+		int64_t s = 0, e, slice_size, step;
+		if (b->len[w] == 0)
+			continue;
+		slice_size = b->slice_ent[w] * b->ent_size[w];
+		step = b->n_slice[w] / 10 > 0 ? b->n_slice[w] / 10 : 1;
+		while (s < b->n_slice[w]) {
+			for (e = s; e < b->n_slice[w] && __atomic_load_n(&b->done[w][e], __ATOMIC_ACQUIRE); ++e)
+				;
+			if (e < b->n_slice[w] && (e - s) * slice_size < SMEM_WRITE_CHUNK) {
+				usleep(1000);
+				continue;
+			}
+			err_fwrite(b->table[w] + s * slice_size, 1, (e - s) * slice_size, b->fp[w]);
+			if (s / step != e / step)
+				printf("%s: %s smem table %ld/%ld slices written\n", __func__,
+						w == 0 ? "all" : "last", e, b->n_slice[w]);
+			s = e;
+		}
+		err_fflush(b->fp[w]);
 	}
+	return NULL;
 }
 
-static int __load_smem_table_on_shm(const char *prefix,
-									all_smem_t **__all_smem_table, 
-									last_smem_t **__last_smem_table, 
-									uint8_t *shm)
-{
-	__load_smem_table_set_shm_ptr(__all_smem_table, __last_smem_table, shm);
-	return __load_smem_table_from_file(prefix, __all_smem_table, __last_smem_table);
-}
+int build_smem_tables(char *prefix, int all_len, int last_len,
+						int hiocc_len, int64_t hiocc_occ, int n_threads) {
+	smem_build_t b;
+	FMI_search *fmi;
+	kt_pool_t *pool;
+	pthread_t writer;
+	uint64_t hist[SMEM_TABLE_MAX_BP + 1];
+	int w, t, v, ret = 0, written = 0;
 
-static int __load_smem_table_from_shm(all_smem_t **__all_smem_table, 
-									  last_smem_t **__last_smem_table, 
-									  uint8_t *shm)
-{
-	__load_smem_table_set_shm_ptr(__all_smem_table, __last_smem_table, shm);
-	return 0;
+	fmi = new FMI_search(prefix);
+	building_smem_table = 1;
+	fmi->load_index();
+
+	memset(&b, 0, sizeof(b));
+	b.fmi = fmi;
+	b.len[0] = all_len;
+	b.len[1] = last_len;
+	for (w = 0; w < 2; ++w) {
+		int slice_bp;
+		size_t size;
+		if (b.len[w] == 0)
+			continue;
+		b.ent_size[w] = w == 0 ? __all_smem_ent_size(all_len) : sizeof(last_smem_t);
+		size = w == 0 ? __all_smem_table_size(all_len) : __last_smem_table_size(last_len);
+		slice_bp = b.len[w] < SMEM_SLICE_BP ? b.len[w] : SMEM_SLICE_BP;
+		b.slice_ent[w] = __num_smem_table_entry(slice_bp);
+		b.n_slice[w] = __num_smem_table_entry(b.len[w] - slice_bp);
+		printf("Build %s smem table (len: %d, size: %.2fGB, slices: %ld)\n",
+				w == 0 ? "all" : "last", b.len[w], (double) size / (1LL << 30), b.n_slice[w]);
+
+		b.table[w] = (uint8_t *) _mm_malloc(size, 64);
+		b.done[w] = (volatile uint8_t *) calloc(b.n_slice[w], 1);
+		if (b.table[w] == NULL || b.done[w] == NULL) {
+			printf("ERROR: cannot allocate memory for %s smem table\n", w == 0 ? "all" : "last");
+			ret = -1;
+			goto out;
+		}
+		snprintf(b.fn[w], PATH_MAX, "%s.%s_smem.%d", prefix, w == 0 ? "all" : "last", b.len[w]);
+		printf("Write %s smem table to %s\n", w == 0 ? "all" : "last", b.fn[w]);
+		b.fp[w] = smem_table_open(b.fn[w]);
+	}
+	b.hist = (uint64_t *) calloc((size_t) n_threads * 2 * (SMEM_TABLE_MAX_BP + 1), sizeof(uint64_t));
+	assert(b.hist != NULL);
+
+	pool = kt_pool_init(n_threads, 0);
+	pthread_create(&writer, NULL, smem_build_writer, &b);
+	kt_pool_for(pool, smem_build_worker, &b, b.n_slice[0] + b.n_slice[1], 1);
+	pthread_join(writer, NULL);
+	written = 1;
+	if (hiocc_len > 0 && build_hiocc_table(prefix, fmi, pool, hiocc_len, hiocc_occ) != 0)
+		ret = -1;
+	kt_pool_destroy(pool);
+
+	for (w = 0; w < 2; ++w) {
+		if (b.len[w] == 0)
+			continue;
+		memset(hist, 0, sizeof(hist));
+		for (t = 0; t < n_threads; ++t)
+			for (v = 0; v <= SMEM_TABLE_MAX_BP; ++v)
+				hist[v] += b.hist[(t * 2 + w) * (SMEM_TABLE_MAX_BP + 1) + v];
+		smem_table_report_skip(w == 0 ? "all smem" : "last smem", b.len[w], hist, w);
+	}
+	free(b.hist);
+
+out:
+	for (w = 0; w < 2; ++w) {
+		if (b.fp[w])
+			smem_table_close(b.fp[w], b.fn[w], written);
+		if (b.table[w])
+			_mm_free(b.table[w]);
+		free((void *) b.done[w]);
+	}
+	delete(fmi);
+	return ret;
 }
 
+#ifdef USE_SHM
 int _load_smem_table(const char *prefix, 
-					all_smem_t **__all_smem_table, 
-					last_smem_t **__last_smem_table) 
+					int all_len, all_smem_t **__all_smem_table, 
+					int last_len, last_smem_t **__last_smem_table) 
 {
+	char suffix[32];
+
 	fprintf(stderr, "INFO: load smem table (all_smem_len: %d last_smem_len: %d)\n",
-						ALL_SMEM_MAX_BP, LAST_SMEM_MAX_BP);
+						__all_smem_table ? all_len : 0, __last_smem_table ? last_len : 0);
 	
+	snprintf(suffix, sizeof(suffix), ".all_smem.%d", all_len);
 	if (__all_smem_table &&
-			__bwa_shm_load_file(prefix, STR_AND_VAL(".all_smem.", ALL_SMEM_MAX_BP),
+			__bwa_shm_load_file(prefix, suffix,
 								BWA_SHM_SALL, (void **) __all_smem_table) != 0) 
 		return -1;
 	
+	snprintf(suffix, sizeof(suffix), ".last_smem.%d", last_len);
 	if (__last_smem_table &&
-			__bwa_shm_load_file(prefix, STR_AND_VAL(".last_smem.", LAST_SMEM_MAX_BP),
+			__bwa_shm_load_file(prefix, suffix,
 								BWA_SHM_SLAST, (void **) __last_smem_table) != 0) 
 		return -1;
 
@@ -392,24 +536,81 @@ int _load_smem_table(const char *prefix,
 }
 
 void FMI_search::load_smem_table() {
+	/* the lengths chosen by load-shm, or the longest tables if the index is not on shm */
+	all_smem_len = bwa_shm_smem_all_len();
+	if (all_smem_len == 0)
+		all_smem_len = smem_table_len(file_name, ".all_smem.", ALL_SMEM_BP);
+	last_smem_len = bwa_shm_smem_last_len();
+	if (last_smem_len == 0)
+		last_smem_len = smem_table_len(file_name, ".last_smem.", LAST_SMEM_BP);
+
 #ifdef MEMSCALE
 	_load_smem_table(file_name,
-						bwa_shm_info->smem_all_on ? &all_smem_table : NULL,
-						bwa_shm_info->smem_last_on ? &last_smem_table : NULL);
+						all_smem_len, bwa_shm_info->smem_all_on ? &all_smem_table : NULL,
+						last_smem_len, bwa_shm_info->smem_last_on ? &last_smem_table : NULL);
 #else
 	//fprintf(stderr, "[DEBUG] %s all: %p last: %p\n", __func__, all_smem_table, last_smem_table);
-	_load_smem_table(file_name, &all_smem_table, &last_smem_table);
+	_load_smem_table(file_name, all_smem_len, &all_smem_table, last_smem_len, &last_smem_table);
 #endif
 }
+
+int _load_hiocc_table(const char *prefix, int len, hiocc_t **__hiocc_table)
+{
+	char suffix[32];
+
+	fprintf(stderr, "INFO: load high-occurrence k-mer table (len: %d)\n", len);
+	snprintf(suffix, sizeof(suffix), ".hiocc.%d", len);
+	return __bwa_shm_load_file(prefix, suffix, BWA_SHM_HIOCC, (void **) __hiocc_table);
+}
 #else
 void FMI_search::load_smem_table() {
-	all_smem_table = (all_smem_t *) __load_file(file_name, STR_AND_VAL(".all_smem.", ALL_SMEM_MAX_BP),
-									NULL, NULL);
-	last_smem_table = (last_smem_t *) __load_file(file_name, STR_AND_VAL(".last_smem.", LAST_SMEM_MAX_BP),
-									NULL, NULL);
+	char suffix[32];
+
+	all_smem_len = smem_table_len(file_name, ".all_smem.", ALL_SMEM_BP);
+	snprintf(suffix, sizeof(suffix), ".all_smem.%d", all_smem_len);
+	all_smem_table = (all_smem_t *) __load_file(file_name, suffix, NULL, NULL);
+
+	last_smem_len = smem_table_len(file_name, ".last_smem.", LAST_SMEM_BP);
+	snprintf(suffix, sizeof(suffix), ".last_smem.%d", last_smem_len);
+	last_smem_table = (last_smem_t *) __load_file(file_name, suffix, NULL, NULL);
 }
 #endif
 
+/* for 'mem -u', in both of FM-index and ERT modes */
+void FMI_search::load_hiocc_table(int skip) {
+	int len = 0;
+
+#ifdef USE_SHM
+	len = bwa_shm_hiocc_len();
+#endif
+	if (len == 0)
+		len = smem_table_find_len(file_name, ".hiocc.", SMEM_TABLE_MAX_BP);
+	if (len == 0) {
+		fprintf(stderr, "ERROR: no high-occurrence k-mer table (%s.hiocc.N). "
+						"Build it with 'smem-table -k'.\n", file_name);
+		exit(EXIT_FAILURE);
+	}
+#ifdef USE_SHM
+#ifdef MEMSCALE
+	/* not taken by load-shm within gb_limit */
+	if (bwa_shm_info && bwa_shm_info->hiocc_on == 0) {
+		char suffix[32];
+		snprintf(suffix, sizeof(suffix), ".hiocc.%d", len);
+		hiocc_table = (hiocc_t *) __load_file(file_name, suffix, NULL, NULL);
+	} else
+#endif
+	if (_load_hiocc_table(file_name, len, &hiocc_table))
+		exit(EXIT_FAILURE);
+#else
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), ".hiocc.%d", len);
+	hiocc_table = (hiocc_t *) __load_file(file_name, suffix, NULL, NULL);
+#endif
+	hiocc_skip = skip;
+	fprintf(stderr, "* High-occurrence %d-mer table (occ > %ld): LAST %s the pivots on them\n",
+					hiocc_table->len, (long) hiocc_table->min_occ, skip ? "skips" : "counts");
+}
+
 #endif
 
 //#define SMEM_ACCEL_DEBUG
@@ -471,6 +672,9 @@ void FMI_search::init(const char *fname)
     strcpy_s(file_name, PATH_MAX, fname);
     reference_seq_len = 0;
     sentinel_index = 0;
+    smem_lanes = SMEM_LANES;
+    sa_compx = SA_COMPX;
+    sa_compx_mask = (1LL << SA_COMPX) - 1;
 #ifdef PERFECT_MATCH
 	perfect_table = NULL;
 #endif
@@ -478,13 +682,23 @@ void FMI_search::init(const char *fname)
     sa_ls_word = NULL;
     sa_ms_byte = NULL;
     cp_occ = NULL;
+#ifdef FMD_INDEX
+    fmd_occ = NULL;
+#endif
 #ifdef SMEM_ACCEL
 	all_smem_table = NULL;
 	last_smem_table = NULL;
+	all_smem_len = ALL_SMEM_BP;
+	last_smem_len = LAST_SMEM_BP;
+	hiocc_table = NULL;
+	hiocc_skip = 0;
 #endif
 	useErt = 0;
 	kmer_offsets = NULL;
 	mlt_table = NULL;
+#ifdef ERT_INDEX_PREFETCH
+	ert_prefetch = ERT_PREFETCH_DIST;
+#endif
 
 }
 
@@ -530,6 +744,17 @@ FMI_search::~FMI_search()
 #endif
 #endif
 	}
+#ifdef SMEM_ACCEL
+#ifdef USE_SHM
+	if (bwa_shm_unmap(BWA_SHM_HIOCC))
+		_mm_free_safe(hiocc_table);
+#else
+	_mm_free_safe(hiocc_table);
+#endif
+#endif
+#ifdef FMD_INDEX
+	_mm_free_safe(fmd_occ);
+#endif
 #undef _mm_free_safe
 }
 
@@ -608,7 +833,8 @@ void FMI_search::pac2nt(const char *fn_pac, std::string &reference_seq)
 	free(buf2);
 }
 
-int FMI_search::build_fm_index(const char *ref_file_name, char *binary_seq, int64_t ref_seq_len, int64_t *sa_bwt, int64_t *count) {
+int FMI_search::build_fm_index(const char *ref_file_name, char *binary_seq, int64_t ref_seq_len, int64_t *sa_bwt, int64_t *count,
+                               int sa_compx) {
     printf("ref_seq_len = %ld\n", ref_seq_len);
     fflush(stdout);
 
@@ -627,7 +853,12 @@ int FMI_search::build_fm_index(const char *ref_file_name, char *binary_seq, int6
     uint8_t *bwt;
 
     ref_seq_len++;
-    outstream.write((char *)(&ref_seq_len), 1 * sizeof(int64_t));
+    #if SA_COMPRESSION
+    int64_t hdr = bwt_hdr(ref_seq_len, sa_compx);
+    #else
+    int64_t hdr = ref_seq_len;
+    #endif
+    outstream.write((char *)(&hdr), 1 * sizeof(int64_t));
     outstream.write((char*)count, 5 * sizeof(int64_t));
 
     int64_t i;
@@ -722,25 +953,26 @@ int FMI_search::build_fm_index(const char *ref_file_name, char *binary_seq, int6
 
     #if SA_COMPRESSION  
 
-    size = ((ref_seq_len >> SA_COMPX)+ 1)  * sizeof(uint32_t);
+    size = sa_num_samples(ref_seq_len, sa_compx) * sizeof(uint32_t);
     uint32_t *sa_ls_word = (uint32_t *)_mm_malloc(size, 64);
     assert_not_null(sa_ls_word, size, index_alloc);
-    size = ((ref_seq_len >> SA_COMPX) + 1) * sizeof(int8_t);
+    size = sa_num_samples(ref_seq_len, sa_compx) * sizeof(int8_t);
     int8_t *sa_ms_byte = (int8_t *)_mm_malloc(size, 64);
     assert_not_null(sa_ms_byte, size, index_alloc);
     int64_t pos = 0;
+    int64_t sa_mask = (1LL << sa_compx) - 1;
     for(i = 0; i < ref_seq_len; i++)
     {
-        if ((i & SA_COMPX_MASK) == 0)
+        if ((i & sa_mask) == 0)
         {
             sa_ls_word[pos] = sa_bwt[i] & 0xffffffff;
             sa_ms_byte[pos] = (sa_bwt[i] >> 32) & 0xff;
             pos++;
         }
     }
-    fprintf(stderr, "pos: %ld, ref_seq_len__: %ld\n", pos, ref_seq_len >> SA_COMPX);
-    outstream.write((char*)sa_ms_byte, ((ref_seq_len >> SA_COMPX) + 1) * sizeof(int8_t));
-    outstream.write((char*)sa_ls_word, ((ref_seq_len >> SA_COMPX) + 1) * sizeof(uint32_t));
+    fprintf(stderr, "pos: %ld, ref_seq_len__: %ld, SA sampling: 2^%d\n", pos, ref_seq_len >> sa_compx, sa_compx);
+    outstream.write((char*)sa_ms_byte, sa_num_samples(ref_seq_len, sa_compx) * sizeof(int8_t));
+    outstream.write((char*)sa_ls_word, sa_num_samples(ref_seq_len, sa_compx) * sizeof(uint32_t));
     
     #else
     
@@ -770,7 +1002,9 @@ int FMI_search::build_fm_index(const char *ref_file_name, char *binary_seq, int6
     return 0;
 }
 
-int FMI_search::build_index() {
+/* the suffix array is built with n_threads > 1 by sa_build_par(), by saisxx() otherwise.
+   it is sampled every 2^sa_compx rows in the index. */
+int FMI_search::build_index(int n_threads, int sa_compx) {
 
     char *prefix = file_name;
     unsigned long long startTick;
@@ -827,22 +1061,31 @@ int FMI_search::build_index() {
     count[0]=0;
     fprintf(stderr, "ref seq len = %ld\n", pac_len);
     binary_ref_stream.write(binary_ref_seq, pac_len * sizeof(char));
-    fprintf(stderr, "binary seq ticks = %llu\n", __rdtsc() - startTick);
+    fprintf(stderr, "binary seq ticks = %llu, peak RSS = %.2f GB\n", __rdtsc() - startTick,
+            peakrss() / (1024.0 * 1024.0 * 1024.0));
     startTick = __rdtsc();
 
+    if (n_threads > 1)
+        std::string().swap(reference_seq); /* sa_build_par() reads binary_ref_seq */
+
     size = (pac_len + 2) * sizeof(int64_t);
     int64_t *suffix_array=(int64_t *)_mm_malloc(size, 64);
     index_alloc += size;
     assert_not_null(suffix_array, size, index_alloc);
     startTick = __rdtsc();
 	//status = saisxx<const char *, int64_t *, int64_t>(reference_seq.c_str(), suffix_array + 1, pac_len, 4);
-	status = saisxx(reference_seq.c_str(), suffix_array + 1, pac_len);
+	if (n_threads > 1)
+		status = sa_build_par((const uint8_t *) binary_ref_seq, suffix_array + 1, pac_len, n_threads);
+	else
+		status = saisxx(reference_seq.c_str(), suffix_array + 1, pac_len);
 	suffix_array[0] = pac_len;
-    fprintf(stderr, "build suffix-array ticks = %llu\n", __rdtsc() - startTick);
+    fprintf(stderr, "build suffix-array ticks = %llu, threads = %d, peak RSS = %.2f GB\n", __rdtsc() - startTick,
+            n_threads, peakrss() / (1024.0 * 1024.0 * 1024.0));
     startTick = __rdtsc();
 
-	build_fm_index(prefix, binary_ref_seq, pac_len, suffix_array, count);
-    fprintf(stderr, "build fm-index ticks = %llu\n", __rdtsc() - startTick);
+	build_fm_index(prefix, binary_ref_seq, pac_len, suffix_array, count, sa_compx);
+    fprintf(stderr, "build fm-index ticks = %llu, peak RSS = %.2f GB\n", __rdtsc() - startTick,
+            peakrss() / (1024.0 * 1024.0 * 1024.0));
     _mm_free(binary_ref_seq);
     _mm_free(suffix_array);
     return 0;
@@ -854,12 +1097,57 @@ void FMI_search::load_index_other_elements(int which) {
     bwa_idx_load_ele(ref_file_name, which);
 }
 
+/* SA sampling factor of the index, SA_COMPX if the index cannot be read */
+int __load_BWT_sa_compx(const char *ref_file_name)
+{
+	char cp_file_name[PATH_MAX];
+	int64_t hdr = 0;
+	FILE *fp;
+
+	strcpy_s(cp_file_name, PATH_MAX, ref_file_name);
+	strcat_s(cp_file_name, PATH_MAX, CP_FILENAME_SUFFIX);
+	fp = fopen(cp_file_name, "rb");
+	if (fp == NULL)
+		return SA_COMPX;
+	if (fread(&hdr, sizeof(int64_t), 1, fp) != 1)
+		hdr = 0;
+	fclose(fp);
+#if SA_COMPRESSION
+	return bwt_hdr_sa_compx(hdr);
+#else
+	return 0;
+#endif
+}
+
+/* reads n_file SA samples of elem bytes, and keeps every 2^d-th one */
+static void __read_sa_samples(FILE *fp, void *dst, size_t elem, int64_t n_file, int d)
+{
+	const int64_t chunk = 1L << 20;
+	uint8_t *buf;
+	int64_t i, j, k = 0;
+
+	if (d == 0) {
+		err_fread_noeof(dst, elem, n_file, fp);
+		return;
+	}
+	buf = (uint8_t *) malloc(chunk * elem);
+	assert(buf != NULL);
+	for (i = 0; i < n_file; i += chunk) {
+		int64_t m = n_file - i < chunk ? n_file - i : chunk;
+		err_fread_noeof(buf, elem, m, fp);
+		for (j = 0; j < m; j += 1L << d, ++k)
+			memcpy((uint8_t *) dst + k * elem, buf + j * elem, elem);
+	}
+	free(buf);
+}
+
 #ifdef USE_SHM
+/* the SA is sampled every 2^sa_compx rows in memory, which can be sparser than the index */
 int __load_BWT_from_file(char *cp_file_name, int64_t reference_seq_len, 
 						int64_t *count, 
 						CP_OCC *cp_occ, int64_t cp_occ_size,
 						int8_t *sa_ms_byte, uint32_t *sa_ls_word,
-						int64_t *_sentinel_index)
+						int64_t *_sentinel_index, int sa_compx)
 {
 	FILE *cpstream = NULL;
 	int64_t xx;
@@ -873,7 +1161,7 @@ int __load_BWT_from_file(char *cp_file_name, int64_t reference_seq_len,
         fprintf(stderr, "* Index file found. Loading index from %s\n", cp_file_name);
 
     err_fread_noeof(&xx, sizeof(int64_t), 1, cpstream);
-    assert(xx == reference_seq_len);
+    assert(bwt_hdr_rlen(xx) == reference_seq_len);
 	
 	err_fread_noeof(count, sizeof(int64_t), 5, cpstream);
     int64_t ii = 0;
@@ -888,9 +1176,16 @@ int __load_BWT_from_file(char *cp_file_name, int64_t reference_seq_len,
     
 	#if SA_COMPRESSION
 
-    int64_t reference_seq_len_ = (reference_seq_len >> SA_COMPX) + 1;
-    err_fread_noeof(sa_ms_byte, sizeof(int8_t), reference_seq_len_, cpstream);
-    err_fread_noeof(sa_ls_word, sizeof(uint32_t), reference_seq_len_, cpstream);
+    int x_file = bwt_hdr_sa_compx(xx);
+    if (sa_compx < x_file) {
+        fprintf(stderr, "ERROR! the SA of %s is sampled every 2^%d rows, and cannot be loaded denser (2^%d)\n",
+                cp_file_name, x_file, sa_compx);
+        exit(EXIT_FAILURE);
+    }
+    int64_t reference_seq_len_ = sa_num_samples(reference_seq_len, x_file);
+    __read_sa_samples(cpstream, sa_ms_byte, sizeof(int8_t), reference_seq_len_, sa_compx - x_file);
+    __read_sa_samples(cpstream, sa_ls_word, sizeof(uint32_t), reference_seq_len_, sa_compx - x_file);
+    fprintf(stderr, "* SA sampling: 2^%d (index: 2^%d)\n", sa_compx, x_file);
     
     #else
     
@@ -945,6 +1240,7 @@ static int64_t read_rlen_bwt(const char *bwt_file_name) {
 
 	err_fread_noeof(&ret, sizeof(int64_t), 1, f);
 	fclose(f);
+	ret = bwt_hdr_rlen(ret);
 
 	if (ret <= 0 || ret > (0xffffffffU * (int64_t)CP_BLOCK_SIZE))
 		return -1;
@@ -959,6 +1255,7 @@ int64_t __load_BWT_rlen(const char *bwt_file_name) {
 
 	err_fread_noeof(&ret, sizeof(int64_t), 1, fp);
 	err_fclose(fp);
+	ret = bwt_hdr_rlen(ret);
 
 	if (ret <= 0 || ret > (0xffffffffU * (int64_t)CP_BLOCK_SIZE))
 		return -1;
@@ -970,7 +1267,7 @@ int __load_BWT_without_shm(char *ref_file_name, int64_t *_reference_seq_len,
 						int64_t *_count, 
 						CP_OCC **__cp_occ, 
 						int8_t **__sa_ms_byte, uint32_t **__sa_ls_word, 
-						int64_t *_sentinel_index)
+						int64_t *_sentinel_index, int *_sa_compx)
 {
 	char cp_file_name[PATH_MAX];
     strcpy_s(cp_file_name, PATH_MAX, ref_file_name);
@@ -989,8 +1286,9 @@ int __load_BWT_without_shm(char *ref_file_name, int64_t *_reference_seq_len,
 
 	int8_t *sa_ms_byte;
 	uint32_t *sa_ls_word;
+	int sa_compx = __load_BWT_sa_compx(ref_file_name);
 	#if SA_COMPRESSION
-    int64_t reference_seq_len_ = (reference_seq_len >> SA_COMPX) + 1;
+    int64_t reference_seq_len_ = sa_num_samples(reference_seq_len, sa_compx);
     sa_ms_byte = (int8_t *)_mm_malloc(reference_seq_len_ * sizeof(int8_t), 64);
     sa_ls_word = (uint32_t *)_mm_malloc(reference_seq_len_ * sizeof(uint32_t), 64);
     #else
@@ -1007,11 +1305,12 @@ int __load_BWT_without_shm(char *ref_file_name, int64_t *_reference_seq_len,
 	__load_BWT_from_file(cp_file_name, reference_seq_len, _count,
 						 cp_occ, cp_occ_size,
 						 sa_ms_byte, sa_ls_word,
-						 _sentinel_index);
+						 _sentinel_index, sa_compx);
 	
 	*__cp_occ = cp_occ;	
 	*__sa_ms_byte = sa_ms_byte;
 	*__sa_ls_word = sa_ls_word;
+	*_sa_compx = sa_compx;
 	return 0;
 }
 
@@ -1019,7 +1318,7 @@ int __load_BWT_on_shm(const char *ref_file_name, int64_t *_reference_seq_len,
 						int64_t *_count, 
 						CP_OCC **__cp_occ, 
 						int8_t **__sa_ms_byte, uint32_t **__sa_ls_word, 
-						int64_t *_sentinel_index)
+						int64_t *_sentinel_index, int *_sa_compx)
 {
 	shm_bwt_header_t *header;
 	size_t shm_size;
@@ -1033,8 +1332,9 @@ int __load_BWT_on_shm(const char *ref_file_name, int64_t *_reference_seq_len,
 
 	int64_t reference_seq_len = bwa_shm_rlen();
 	if (_reference_seq_len) *_reference_seq_len = reference_seq_len;
+	int sa_compx = bwa_shm_sa_compx();
 
-	shm_size = bwa_shm_size_bwt(reference_seq_len);
+	shm_size = bwa_shm_size_bwt(reference_seq_len, sa_compx);
 
 	fprintf(stderr, "INFO: shm_create for BWT index. hugetlb_flag: %x\n", bwa_shm_hugetlb_flags());
 	fd = bwa_shm_create(BWA_SHM_BWT, shm_size);
@@ -1051,20 +1351,21 @@ int __load_BWT_on_shm(const char *ref_file_name, int64_t *_reference_seq_len,
    	header = (shm_bwt_header_t *) ptr;
 	ptr += bwa_shm_size_bwt_header();
 	header->reference_len = reference_seq_len;
+	header->sa_compx = sa_compx;
 
 	CP_OCC *cp_occ = (CP_OCC *) ptr;
 	ptr += bwa_shm_size_bwt_cp_occ(reference_seq_len);
 	int64_t cp_occ_size = (reference_seq_len >> CP_SHIFT) + 1;
 	
 	int8_t *sa_ms_byte = (int8_t *) ptr;
-	ptr += bwa_shm_size_bwt_sa_ms_byte(reference_seq_len);
+	ptr += bwa_shm_size_bwt_sa_ms_byte(reference_seq_len, sa_compx);
 	uint32_t *sa_ls_word = (uint32_t *) ptr;
 	
 	__load_BWT_from_file(cp_file_name, reference_seq_len,
 						header->count,
 						cp_occ, cp_occ_size,
 						sa_ms_byte, sa_ls_word,
-						&header->sentinel_index);
+						&header->sentinel_index, sa_compx);
 
 	if (__cp_occ) *__cp_occ = cp_occ;
 	if (__sa_ms_byte) *__sa_ms_byte = sa_ms_byte;
@@ -1074,6 +1375,7 @@ int __load_BWT_on_shm(const char *ref_file_name, int64_t *_reference_seq_len,
 			_count[i] = header->count[i];
 	}
 	if (_sentinel_index) *_sentinel_index = header->sentinel_index;
+	if (_sa_compx) *_sa_compx = sa_compx;
 
 	return 0;
 }
@@ -1082,7 +1384,7 @@ int __load_BWT_from_shm(int64_t *_reference_seq_len,
 						int64_t *_count, 
 						CP_OCC **__cp_occ, 
 						int8_t **__sa_ms_byte, uint32_t **__sa_ls_word, 
-						int64_t *_sentinel_index)
+						int64_t *_sentinel_index, int *_sa_compx)
 {
 	int64_t cp_occ_size;
 	int64_t x;
@@ -1099,8 +1401,10 @@ int __load_BWT_from_shm(int64_t *_reference_seq_len,
 	for (x = 0; x < 5; ++x)
 		_count[x] = header->count[x];
 	*_sentinel_index = header->sentinel_index;
+	*_sa_compx = header->sa_compx;
     
 	fprintf(stderr, "* sentinel-index: %ld\n", header->sentinel_index);
+	fprintf(stderr, "* SA sampling: 2^%d\n", (int) header->sa_compx);
     
 	fprintf(stderr, "* Count:\n");
     for(x = 0; x < 5; x++)
@@ -1112,7 +1416,7 @@ int __load_BWT_from_shm(int64_t *_reference_seq_len,
 	*__cp_occ = (CP_OCC *)ptr;
 	ptr += bwa_shm_size_bwt_cp_occ(header->reference_len);
 	*__sa_ms_byte = (int8_t *) ptr;
-	ptr += bwa_shm_size_bwt_sa_ms_byte(header->reference_len);
+	ptr += bwa_shm_size_bwt_sa_ms_byte(header->reference_len, header->sa_compx);
 	*__sa_ls_word = (uint32_t *) ptr;
 	return 0;
 }
@@ -1121,28 +1425,59 @@ static void load_BWT(char *ref_file_name, int64_t *_reference_seq_len,
 					int64_t *_count, 
 					CP_OCC **__cp_occ, 
 					int8_t **__sa_ms_byte, uint32_t **__sa_ls_word, 
-					int64_t *_sentinel_index) 
+					int64_t *_sentinel_index, int *_sa_compx) 
 {
 	if (bwa_shm_mode == BWA_SHM_MATCHED) {
 		if (__load_BWT_from_shm(_reference_seq_len, _count,
 								__cp_occ, __sa_ms_byte, __sa_ls_word,
-								_sentinel_index) == 0)
+								_sentinel_index, _sa_compx) == 0)
 			return;
 	} 
 	
 	if (bwa_shm_mode == BWA_SHM_RENEWAL) {
 		if (__load_BWT_on_shm(ref_file_name, _reference_seq_len,
 							_count, __cp_occ, __sa_ms_byte, __sa_ls_word,
-							_sentinel_index) == 0)
+							_sentinel_index, _sa_compx) == 0)
 			return;
 	}
 
 	__load_BWT_without_shm(ref_file_name, _reference_seq_len,
 							_count, __cp_occ, __sa_ms_byte, __sa_ls_word,
-							_sentinel_index);
+							_sentinel_index, _sa_compx);
 }
 #endif
 
+/* <prefix>.ert_version is written last by buildKmerTrees():
+	ert_version <format> <kmerSize> <xmerSize>
+   An index without it predates the file and has format 1, which every build reads.
+   Returns -1 if the index can't be decoded by this build. */
+int ert_check_version(const char *prefix) {
+	char path[PATH_MAX], line[128];
+	int format = 1, k = kmerSize, x = xmerSize;
+	strcpy_s(path, PATH_MAX, prefix);
+	strcat_s(path, PATH_MAX, ".ert_version");
+	FILE *fp = fopen(path, "r");
+	if (fp) {
+		int n = (fgets(line, sizeof(line), fp) == NULL) ? 0 : sscanf(line, "ert_version %d %d %d", &format, &k, &x);
+		fclose(fp);
+		if (n != 3) {
+			fprintf(stderr, "ERROR! %s is corrupt, rebuild the ERT index\n", path);
+			return -1;
+		}
+	}
+	if (format < 1 || format > ERT_FORMAT_VERSION) {
+		fprintf(stderr, "ERROR! ERT index %s has format %d, this build reads up to format %d\n",
+				prefix, format, ERT_FORMAT_VERSION);
+		return -1;
+	}
+	if (k != kmerSize || x != xmerSize) {
+		fprintf(stderr, "ERROR! ERT index %s was built with k-mer/x-mer sizes %d/%d, this build uses %d/%d\n",
+				prefix, k, x, kmerSize, xmerSize);
+		return -1;
+	}
+	return 0;
+}
+
 #ifdef USE_SHM
 size_t ____size_mlt(const char *prefix, const char *ref_file_name) {
 	char path[PATH_MAX];
@@ -1188,6 +1523,9 @@ size_t ____size_mlt(const char *prefix, const char *ref_file_name) {
 #define __size_mlt(prefix) ____size_mlt(prefix, NULL)
 
 int _load_ert_index(const char *prefix, uint64_t **__kmer_offsets, uint8_t **__mlt_table) {
+	if (ert_check_version(prefix))
+		return -1;
+
 	if (__bwa_shm_load_file(prefix, ".kmer_table", BWA_SHM_KMER, (void **) __kmer_offsets))
 		return -1;
 
@@ -1198,6 +1536,8 @@ int _load_ert_index(const char *prefix, uint64_t **__kmer_offsets, uint8_t **__m
 }
 
 int _load_kmer_table(const char *prefix, uint64_t **__kmer) {
+	if (ert_check_version(prefix))
+		return -1;
 	return __bwa_shm_load_file(prefix, ".kmer_table", BWA_SHM_KMER, (void **) __kmer);
 }
 
@@ -1236,6 +1576,8 @@ void FMI_search::load_ert_index() {
 	fprintf(stderr, "[M::%s::ERT] Reading kmer index to memory\n", __func__);
 
 	allocMem = numKmers * sizeof(uint64_t); 
+	if (ert_check_version(file_name))
+		exit(EXIT_FAILURE);
 	kmer_offsets = (uint64_t *) __load_file(file_name, ".kmer_table", NULL, NULL);
 
    	mlt_table = (uint8_t *) __load_file(file_name, ".mlt_table", NULL, &mlt_size);
@@ -1263,7 +1605,7 @@ void FMI_search::load_index()
     char *ref_file_name = file_name;
 #ifdef USE_SHM
 	load_BWT(ref_file_name, &reference_seq_len, count, 
-			&cp_occ, &sa_ms_byte, &sa_ls_word, &sentinel_index);
+			&cp_occ, &sa_ms_byte, &sa_ls_word, &sentinel_index, &sa_compx);
 #else
     //beCalls = 0;
     char cp_file_name[PATH_MAX];
@@ -1284,6 +1626,10 @@ void FMI_search::load_index()
     }
 
     err_fread_noeof(&reference_seq_len, sizeof(int64_t), 1, cpstream);
+    #if SA_COMPRESSION
+    sa_compx = bwt_hdr_sa_compx(reference_seq_len);
+    #endif
+    reference_seq_len = bwt_hdr_rlen(reference_seq_len);
     assert(reference_seq_len > 0);
     assert(reference_seq_len <= 0x7fffffffffL);
 
@@ -1308,7 +1654,8 @@ void FMI_search::load_index()
 
     #if SA_COMPRESSION
 
-    int64_t reference_seq_len_ = (reference_seq_len >> SA_COMPX) + 1;
+    int64_t reference_seq_len_ = sa_num_samples(reference_seq_len, sa_compx);
+    fprintf(stderr, "* SA sampling: 2^%d\n", sa_compx);
     sa_ms_byte = (int8_t *)_mm_malloc(reference_seq_len_ * sizeof(int8_t), 64);
     sa_ls_word = (uint32_t *)_mm_malloc(reference_seq_len_ * sizeof(uint32_t), 64);
     err_fread_noeof(sa_ms_byte, sizeof(int8_t), reference_seq_len_, cpstream);
@@ -1349,6 +1696,11 @@ void FMI_search::load_index()
     }
     fprintf(stderr, "\n");  
 #endif /* !USE_SHM */
+    sa_compx_mask = (1LL << sa_compx) - 1;
+
+#ifdef FMD_INDEX
+    load_fmd_index();
+#endif
 
 #ifdef SMEM_ACCEL
 	if (building_smem_table == 0) {
@@ -1382,6 +1734,13 @@ void FMI_search::getSMEMsOnePosOneThread(uint8_t *enc_qdb,
                                          SMEM *matchArray,
                                          int64_t *__numTotalSmem)
 {
+    if (smem_lanes > 1 && numReads > 1) {
+        getSMEMsOnePosInterleaved(enc_qdb, query_pos_array, min_intv_array, rid_array,
+                                  numReads, seq_, query_cum_len_ar, max_readlength,
+                                  minSeedLen, matchArray, __numTotalSmem, 0);
+        return;
+    }
+
     int64_t numTotalSmem = *__numTotalSmem;
     SMEM prevArray[max_readlength];
 
@@ -1413,21 +1772,21 @@ void FMI_search::getSMEMsOnePosOneThread(uint8_t *enc_qdb,
 			int j;
 #ifdef SMEM_ACCEL
 #ifdef MEMSCALE
-			if (all_smem_table && readlength - x >= ALL_SMEM_MAX_BP) 
+			if (all_smem_table && readlength - x >= all_smem_len) 
 #else
-			if (readlength - x >= ALL_SMEM_MAX_BP) 
+			if (readlength - x >= all_smem_len) 
 #endif
 			{
 				uint64_t all_smem_idx = 0;
 				int k, last_idx, with_N = 0;
 				uint8_t *enc = &enc_qdb[offset + x];
-				for (k = 0; k < ALL_SMEM_MAX_BP; ++k, ++enc) {
+				for (k = 0; k < all_smem_len; ++k, ++enc) {
 					if ((*enc) >= 4) break;
-					all_smem_idx = all_smem_idx | ((*enc) << (((ALL_SMEM_MAX_BP - 1) - k) * 2));
+					all_smem_idx = all_smem_idx | ((uint64_t) (*enc) << (((all_smem_len - 1) - k) * 2));
 				}
 
-				all_smem_t *ent = &all_smem_table[all_smem_idx];
-				with_N = k < ALL_SMEM_MAX_BP ? 1 : 0;
+				all_smem_t *ent = __all_smem_ent(all_smem_table, all_smem_len, all_smem_idx);
+				with_N = k < all_smem_len ? 1 : 0;
 				last_idx = (k > ent->last_avail ? ent->last_avail : k) - 1;
 
 				for (j = x + 1, k = 0; k < last_idx; ++j, ++k) {
@@ -1496,8 +1855,8 @@ void FMI_search::getSMEMsOnePosOneThread(uint8_t *enc_qdb,
                     }
                     smem = newSmem;
 #ifdef ENABLE_PREFETCH
-                    _mm_prefetch((const char *)(&cp_occ[(smem.k) >> CP_SHIFT]), _MM_HINT_T0);
-                    _mm_prefetch((const char *)(&cp_occ[(smem.l) >> CP_SHIFT]), _MM_HINT_T0);
+                    occ_prefetch(smem.k);
+                    occ_prefetch(smem.l);
 #endif
                 }
                 else
@@ -1556,8 +1915,8 @@ void FMI_search::getSMEMsOnePosOneThread(uint8_t *enc_qdb,
                         curr_s = newSmem.s;
                         prev[numCurr++] = newSmem;
 #ifdef ENABLE_PREFETCH
-                        _mm_prefetch((const char *)(&cp_occ[(newSmem.k) >> CP_SHIFT]), _MM_HINT_T0);
-                        _mm_prefetch((const char *)(&cp_occ[(newSmem.k + newSmem.s) >> CP_SHIFT]), _MM_HINT_T0);
+                        occ_prefetch(newSmem.k);
+                        occ_prefetch(newSmem.k + newSmem.s);
 #endif
                         break;
                     }
@@ -1577,8 +1936,8 @@ void FMI_search::getSMEMsOnePosOneThread(uint8_t *enc_qdb,
                         prev[numCurr++] = newSmem;
 						debug_smem_output("OnePosOne-BWD", &newSmem, 1, &min_intv_array[i]);
 #ifdef ENABLE_PREFETCH
-                        _mm_prefetch((const char *)(&cp_occ[(newSmem.k) >> CP_SHIFT]), _MM_HINT_T0);
-                        _mm_prefetch((const char *)(&cp_occ[(newSmem.k + newSmem.s) >> CP_SHIFT]), _MM_HINT_T0);
+                        occ_prefetch(newSmem.k);
+                        occ_prefetch(newSmem.k + newSmem.s);
 #endif
                     }
                 }
@@ -1605,6 +1964,334 @@ void FMI_search::getSMEMsOnePosOneThread(uint8_t *enc_qdb,
     (*__numTotalSmem) = numTotalSmem;
 }
 
+/* A lane runs the search of getSMEMsOnePosOneThread() for one read, one step at a time:
+   a step is one forward extension, or one backward extension of all prev SMEMs.
+   After a step, the cp_occ blocks of the next step are prefetched. */
+inline void FMI_search::smemLaneStart(smem_lane_t *L, uint8_t *enc_qdb, int32_t rid)
+{
+    int x = L->x;
+    int j;
+    uint8_t a = enc_qdb[L->offset + x];
+
+    L->next_x = x + 1;
+    L->numOut = 0;
+    L->numPrev = 0;
+    if (a >= 4) {
+        L->phase = SMEM_LANE_DONE;
+        return;
+    }
+
+    debug_smem_input("OnePosInterleaved", rid, &enc_qdb[L->offset], x, L->readlength);
+    SMEM smem;
+    smem.rid = rid;
+    smem.m = x;
+    smem.n = x;
+    smem.k = count[a];
+    smem.l = count[3 - a];
+    smem.s = count[a+1] - count[a];
+
+#ifdef SMEM_ACCEL
+#ifdef MEMSCALE
+    if (all_smem_table && L->readlength - x >= all_smem_len)
+#else
+    if (L->readlength - x >= all_smem_len)
+#endif
+    {
+        uint64_t all_smem_idx = 0;
+        int k, last_idx, with_N = 0;
+        uint8_t *enc = &enc_qdb[L->offset + x];
+        for (k = 0; k < all_smem_len; ++k, ++enc) {
+            if ((*enc) >= 4) break;
+            all_smem_idx = all_smem_idx | ((uint64_t) (*enc) << (((all_smem_len - 1) - k) * 2));
+        }
+
+        all_smem_t *ent = __all_smem_ent(all_smem_table, all_smem_len, all_smem_idx);
+        with_N = k < all_smem_len ? 1 : 0;
+        last_idx = (k > ent->last_avail ? ent->last_avail : k) - 1;
+
+        for (j = x + 1, k = 0; k < last_idx; ++j, ++k) {
+            a = enc_qdb[L->offset + j];
+            L->next_x = j + 1;
+
+            SMEM newSmem = smem;
+            newSmem.k = smem.k + ent->list[k].k32;
+            newSmem.l = count[3 - a] + ent->list[k].l32;
+            newSmem.s = ent->list[k].s32;
+            newSmem.n = j;
+
+            int32_t s_neq_mask = newSmem.s != smem.s;
+
+            L->prev[L->numPrev] = smem;
+            L->numPrev += s_neq_mask;
+            if (newSmem.s < L->min_intv)
+            {
+                L->next_x = j;
+                j = L->readlength; // to skip the forward steps
+                break;
+            }
+            smem = newSmem;
+        }
+
+        if (with_N) {
+            L->next_x = j + 1;
+            j = L->readlength;
+        }
+    } else {
+        j = x + 1;
+    }
+#else
+    j = x + 1;
+#endif
+
+    L->smem = smem;
+    L->j = j;
+    L->phase = SMEM_LANE_FWD;
+    if (j >= L->readlength) {
+        smemLaneFwdEnd(L);
+        return;
+    }
+#ifdef ENABLE_PREFETCH
+    occ_prefetch(smem.l);
+    occ_prefetch(smem.l + smem.s);
+#endif
+}
+
+inline void FMI_search::smemLaneFwd(smem_lane_t *L, uint8_t *enc_qdb)
+{
+    int j = L->j;
+    uint8_t a = enc_qdb[L->offset + j];
+    SMEM smem = L->smem;
+
+    L->next_x = j + 1;
+    if (a >= 4) {
+        smemLaneFwdEnd(L);
+        return;
+    }
+
+    // Forward extension is backward extension with the BWT of reverse complement
+    SMEM smem_ = smem;
+    smem_.k = smem.l;
+    smem_.l = smem.k;
+    SMEM newSmem_ = backwardExt(smem_, 3 - a);
+    SMEM newSmem = newSmem_;
+    newSmem.k = newSmem_.l;
+    newSmem.l = newSmem_.k;
+    newSmem.n = j;
+
+    int32_t s_neq_mask = newSmem.s != smem.s;
+
+    L->prev[L->numPrev] = smem;
+    L->numPrev += s_neq_mask;
+    if (newSmem.s < L->min_intv) {
+        L->next_x = j;
+        smemLaneFwdEnd(L);
+        return;
+    }
+    L->smem = newSmem;
+    L->j = j + 1;
+    if (L->j >= L->readlength) {
+        smemLaneFwdEnd(L);
+        return;
+    }
+#ifdef ENABLE_PREFETCH
+    occ_prefetch(newSmem.l);
+    occ_prefetch(newSmem.l + newSmem.s);
+#endif
+}
+
+inline void FMI_search::smemLaneFwdEnd(smem_lane_t *L)
+{
+    SMEM *prev = L->prev;
+    int numPrev = L->numPrev;
+    int p;
+
+    if (L->smem.s >= L->min_intv)
+        prev[numPrev++] = L->smem;
+
+    for (p = 0; p < (numPrev/2); p++)
+    {
+        SMEM temp = prev[p];
+        prev[p] = prev[numPrev - p - 1];
+        prev[numPrev - p - 1] = temp;
+    }
+    L->numPrev = numPrev;
+
+    L->phase = SMEM_LANE_BWD;
+    L->j = L->x - 1;
+#ifdef ENABLE_PREFETCH
+    for (p = 0; p < numPrev; p++) {
+        occ_prefetch(prev[p].k);
+        occ_prefetch(prev[p].k + prev[p].s);
+    }
+#endif
+}
+
+inline void FMI_search::smemLaneBwd(smem_lane_t *L, uint8_t *enc_qdb, int32_t minSeedLen)
+{
+    int j = L->j;
+    SMEM *prev = L->prev;
+    int numPrev = L->numPrev;
+    int numCurr = 0;
+    int curr_s = -1;
+    int p;
+
+    if (j < 0 || enc_qdb[L->offset + j] > 3) {
+        smemLaneFinish(L, minSeedLen);
+        return;
+    }
+    uint8_t a = enc_qdb[L->offset + j];
+
+    for (p = 0; p < numPrev; p++)
+    {
+        SMEM smem = prev[p];
+        SMEM newSmem = backwardExt(smem, a);
+        newSmem.m = j;
+
+        if ((newSmem.s < L->min_intv) && ((smem.n - smem.m + 1) >= minSeedLen))
+        {
+            L->out[L->numOut++] = smem;
+            break;
+        }
+        if ((newSmem.s >= L->min_intv) && (newSmem.s != curr_s))
+        {
+            curr_s = newSmem.s;
+            prev[numCurr++] = newSmem;
+#ifdef ENABLE_PREFETCH
+            occ_prefetch(newSmem.k);
+            occ_prefetch(newSmem.k + newSmem.s);
+#endif
+            break;
+        }
+    }
+    p++;
+    for (; p < numPrev; p++)
+    {
+        SMEM smem = prev[p];
+        SMEM newSmem = backwardExt(smem, a);
+        newSmem.m = j;
+
+        if ((newSmem.s >= L->min_intv) && (newSmem.s != curr_s))
+        {
+            curr_s = newSmem.s;
+            prev[numCurr++] = newSmem;
+#ifdef ENABLE_PREFETCH
+            occ_prefetch(newSmem.k);
+            occ_prefetch(newSmem.k + newSmem.s);
+#endif
+        }
+    }
+    L->numPrev = numCurr;
+    L->j = j - 1;
+    if (numCurr == 0 || L->j < 0)
+        smemLaneFinish(L, minSeedLen);
+}
+
+inline void FMI_search::smemLaneFinish(smem_lane_t *L, int32_t minSeedLen)
+{
+    if (L->numPrev != 0)
+    {
+        SMEM smem = L->prev[0];
+        if (((smem.n - smem.m + 1) >= minSeedLen))
+            L->out[L->numOut++] = smem;
+        L->numPrev = 0;
+    }
+    L->phase = SMEM_LANE_DONE;
+}
+
+/* getSMEMsOnePosOneThread() over smem_lanes reads in lockstep. A free lane takes the next
+   read, while up to smem_lanes * SMEM_LANE_WINDOW reads can be in flight, and the SMEMs
+   are copied to matchArray in read order, so matchArray is the same as the read-by-read search.
+   With allPos, a read is queued again at its next_x when its SMEMs are copied, until it reaches
+   its end. The queue then runs in the order of the rounds of getSMEMsAllPosOneThread() without
+   waiting for the end of a round, and a read has at most one search in the queue, so the
+   searches fit in the numReads entries of rid_array, query_pos_array and min_intv_array. */
+void FMI_search::getSMEMsOnePosInterleaved(uint8_t *enc_qdb,
+                                           int16_t *query_pos_array,
+                                           int32_t *min_intv_array,
+                                           int32_t *rid_array,
+                                           int32_t numReads,
+                                           const bseq1_t *seq_,
+                                           int32_t *query_cum_len_ar,
+                                           int32_t max_readlength,
+                                           int32_t minSeedLen,
+                                           SMEM *matchArray,
+                                           int64_t *__numTotalSmem,
+                                           int allPos)
+{
+    int64_t numTotalSmem = *__numTotalSmem;
+    int K = smem_lanes < numReads ? smem_lanes : numReads;
+    int W = K * SMEM_LANE_WINDOW;
+    int nslot = max_readlength + 1;
+    int32_t next = 0, flushed = 0, queued = numReads;
+    int l;
+
+    SMEM *prevBuf = (SMEM *)_mm_malloc((int64_t) K * nslot * sizeof(SMEM), 64);
+    SMEM *outBuf = (SMEM *)_mm_malloc((int64_t) W * nslot * sizeof(SMEM), 64);
+    int32_t *outN = (int32_t *)_mm_malloc(W * sizeof(int32_t), 64);
+    assert(prevBuf != NULL && outBuf != NULL && outN != NULL);
+    smem_lane_t lane[K];
+
+    for (l = 0; l < K; l++) {
+        lane[l].i = -1;
+        lane[l].prev = prevBuf + (int64_t) l * nslot;
+    }
+    for (l = 0; l < W; l++)
+        outN[l] = -1;
+
+    while (flushed < queued)
+    {
+        for (l = 0; l < K; l++)
+        {
+            smem_lane_t *L = &lane[l];
+            if (L->i < 0) {
+                if (next >= queued || next >= flushed + W)
+                    continue;
+                int32_t q = next % numReads;
+                int32_t rid = rid_array[q];
+                L->i = next++;
+                L->x = query_pos_array[q];
+                L->offset = query_cum_len_ar[rid];
+                L->readlength = seq_[rid].l_seq;
+                L->min_intv = min_intv_array[q];
+                L->out = outBuf + (int64_t) (L->i % W) * nslot;
+                smemLaneStart(L, enc_qdb, rid);
+            } else if (L->phase == SMEM_LANE_FWD) {
+                smemLaneFwd(L, enc_qdb);
+            } else {
+                smemLaneBwd(L, enc_qdb, minSeedLen);
+            }
+
+            if (L->phase == SMEM_LANE_DONE) {
+                outN[L->i % W] = L->numOut;
+                query_pos_array[L->i % numReads] = L->next_x;
+                L->i = -1;
+            }
+        }
+
+        while (flushed < queued && outN[flushed % W] >= 0)
+        {
+            int w = flushed % W;
+            int32_t q = flushed % numReads;
+            memcpy_bwamem(matchArray + numTotalSmem, outN[w] * sizeof(SMEM),
+                          outBuf + (int64_t) w * nslot, outN[w] * sizeof(SMEM), __FILE__, __LINE__);
+            numTotalSmem += outN[w];
+            outN[w] = -1;
+            if (allPos && query_pos_array[q] < seq_[rid_array[q]].l_seq) {
+                int32_t t = queued++ % numReads;
+                rid_array[t] = rid_array[q];
+                query_pos_array[t] = query_pos_array[q];
+                min_intv_array[t] = min_intv_array[q];
+            }
+            flushed++;
+        }
+    }
+
+    _mm_free(prevBuf);
+    _mm_free(outBuf);
+    _mm_free(outN);
+    (*__numTotalSmem) = numTotalSmem;
+}
+
 void FMI_search::getSMEMsAllPosOneThread(uint8_t *enc_qdb,
                                          int32_t *min_intv_array,
                                          int32_t *rid_array,
@@ -1626,6 +2313,26 @@ void FMI_search::getSMEMsAllPosOneThread(uint8_t *enc_qdb,
     int32_t numActive = numReads;
     (*__numTotalSmem) = 0;
 
+    if (smem_lanes > 1 && numReads > 1)
+    {
+        int32_t tail = 0;
+        for(i = 0; i < numReads; i++)
+        {
+            if(seq_[rid_array[i]].l_seq > 0)
+            {
+                rid_array[tail] = rid_array[i];
+                min_intv_array[tail] = min_intv_array[i];
+                tail++;
+            }
+        }
+        if (tail > 0)
+            getSMEMsOnePosInterleaved(enc_qdb, query_pos_array, min_intv_array, rid_array,
+                                      tail, seq_, query_cum_len_ar, max_readlength,
+                                      minSeedLen, matchArray, __numTotalSmem, 1);
+        _mm_free(query_pos_array);
+        return;
+    }
+
     do
     {
         int32_t head = 0;
@@ -1665,7 +2372,9 @@ int64_t FMI_search::bwtSeedStrategyAllPosOneThread(uint8_t *enc_qdb,
                                                    const bseq1_t *seq_,
                                                    int32_t *query_cum_len_ar,
                                                    int32_t minSeedLen,
-                                                   SMEM *matchArray)
+                                                   SMEM *matchArray,
+                                                   const void *const *skip,
+                                                   int tid)
 {
 #if defined(PERFECT_MATCH) && !defined(DO_NORMAL)
 	int32_t pos = -1; /* for max_intv_array */
@@ -1681,12 +2390,29 @@ int64_t FMI_search::bwtSeedStrategyAllPosOneThread(uint8_t *enc_qdb,
 			continue;
 		pos++;
 #endif
+        if (skip && skip[i])
+            continue;
         int readlength = seq_[i].l_seq;
         int16_t x = 0;
+#ifdef SMEM_ACCEL
+        int n_hiocc = 0;
+        uint64_t tim = hiocc_table ? __rdtsc() : 0;
+#endif
         while(x < readlength)
         {
             int next_x = x + 1;
 
+#ifdef SMEM_ACCEL
+            if (hiocc_table && readlength - x >= hiocc_table->len
+                    && hiocc_kmer_set(hiocc_table, &enc_qdb[query_cum_len_ar[i] + x])) {
+                n_hiocc++;
+                if (hiocc_skip) {
+                    x = next_x;
+                    continue;
+                }
+            }
+#endif
+
             // Forward search
             SMEM smem;
             smem.rid = i;
@@ -1707,9 +2433,9 @@ int64_t FMI_search::bwtSeedStrategyAllPosOneThread(uint8_t *enc_qdb,
                 int j;
 #ifdef SMEM_ACCEL
 #ifdef MEMSCALE
-				if (last_smem_table && readlength - x >= LAST_SMEM_MAX_BP) 
+				if (last_smem_table && readlength - x >= last_smem_len) 
 #else
-				if (readlength - x >= LAST_SMEM_MAX_BP) 
+				if (readlength - x >= last_smem_len) 
 #endif
 				{
 					// TODO: use last_smem_table
@@ -1718,8 +2444,8 @@ int64_t FMI_search::bwtSeedStrategyAllPosOneThread(uint8_t *enc_qdb,
 					int k = 0;
 					uint8_t *enc = &enc_qdb[offset + x];
 
-					for (k = 0; k < LAST_SMEM_MAX_BP; ++k, ++enc) {
-						last_smem_idx = last_smem_idx | ((*enc) << (((LAST_SMEM_MAX_BP - 1) - k) * 2));
+					for (k = 0; k < last_smem_len; ++k, ++enc) {
+						last_smem_idx = last_smem_idx | ((uint64_t) (*enc) << (((last_smem_len - 1) - k) * 2));
 						with_N += ((*enc) >> 2); // check *enc >= 4
 					}
 
@@ -1811,6 +2537,14 @@ int64_t FMI_search::bwtSeedStrategyAllPosOneThread(uint8_t *enc_qdb,
             }
             x = next_x;
         }
+#ifdef SMEM_ACCEL
+        if (hiocc_table) {
+            tprof[HIOCC_READ + (n_hiocc > 0)][tid]++;
+            tprof[HIOCC_CYCLE + (n_hiocc > 0)][tid] += __rdtsc() - tim;
+            if (hiocc_skip)
+                tprof[HIOCC_SKIP][tid] += n_hiocc;
+        }
+#endif
     }
     return numTotalSeed;
 }
@@ -2026,12 +2760,186 @@ void FMI_search::sortSMEMs(SMEM *matchArray,
 }
 
 
+#ifdef FMD_INDEX
+int build_fmd_index(const char *prefix)
+{
+    char fn[PATH_MAX];
+    FILE *in, *out;
+    int64_t hdr, rlen, count[5], n_cp, n_fmd, i, j, r;
+    int64_t sentinel = -1, sentinel_bwt;
+    const int64_t chunk = 1L << 16;   /* CP_FMD blocks converted at a time */
+    CP_OCC *cp;
+    CP_FMD *fmd;
+
+    snprintf(fn, PATH_MAX, "%s%s", prefix, CP_FILENAME_SUFFIX);
+    in = xopen(fn, "rb");
+    err_fread_noeof(&hdr, sizeof(int64_t), 1, in);
+    err_fread_noeof(count, sizeof(int64_t), 5, in);
+    rlen = bwt_hdr_rlen(hdr);
+    n_cp = (rlen >> CP_SHIFT) + 1;
+    n_fmd = (rlen >> FMD_SHIFT) + 1;
+
+    snprintf(fn, PATH_MAX, "%s%s", prefix, FMD_FILENAME_SUFFIX);
+    fprintf(stderr, "Build %s: rlen: %ld blocks: %ld (%.2f GB, cp_occ: %.2f GB)\n", fn, rlen, n_fmd,
+            (double) n_fmd * sizeof(CP_FMD) / (1L << 30), (double) n_cp * sizeof(CP_OCC) / (1L << 30));
+    out = xopen(fn, "wb");
+    err_fwrite(&rlen, sizeof(int64_t), 1, out);
+
+    cp = (CP_OCC *) _mm_malloc(chunk * 2 * sizeof(CP_OCC), 64);
+    fmd = (CP_FMD *) _mm_malloc(chunk * sizeof(CP_FMD), 64);
+    assert(cp != NULL && fmd != NULL);
+    for (i = 0; i < n_fmd; i += chunk) {
+        int64_t m = n_fmd - i < chunk ? n_fmd - i : chunk;
+        int64_t n = n_cp - 2 * i < 2 * m ? n_cp - 2 * i : 2 * m;
+        err_fread_noeof(cp, sizeof(CP_OCC), n, in);
+        if (n < 2 * m) /* the last CP_FMD block has no second half */
+            memset(cp + n, 0, (2 * m - n) * sizeof(CP_OCC));
+        for (j = 0; j < m; ++j) {
+            CP_FMD *f = &fmd[j];
+            memcpy(f->cp_count, cp[2 * j].cp_count, sizeof(f->cp_count));
+            memset(f->bwt_str, 0, sizeof(f->bwt_str));
+            for (r = 0; r <= FMD_MASK; ++r) {
+                const CP_OCC *o = &cp[2 * j + (r >> CP_SHIFT)];
+                uint64_t bit = 1ULL << (CP_MASK - (r & CP_MASK));
+                int64_t row = ((i + j) << FMD_SHIFT) + r;
+                uint64_t c = 0;
+                while (c < 4 && !(o->one_hot_bwt_str[c] & bit))
+                    ++c;
+                if (c == 4) { /* the sentinel, or a row past the end */
+                    if (row < rlen) {
+                        if (sentinel >= 0) {
+                            fprintf(stderr, "ERROR! rows %ld and %ld of the BWT are not ACGT\n", sentinel, row);
+                            exit(EXIT_FAILURE);
+                        }
+                        sentinel = row;
+                    }
+                    c = 0;
+                }
+                f->bwt_str[r >> 5] |= c << ((r & 31) << 1);
+            }
+        }
+        err_fwrite(fmd, sizeof(CP_FMD), m, out);
+    }
+
+    /* sentinel_index is the last word of the .bwt.2bit.64 file */
+    err_fseek(in, -((long) sizeof(int64_t)), SEEK_END);
+    err_fread_noeof(&sentinel_bwt, sizeof(int64_t), 1, in);
+    if (sentinel != sentinel_bwt) {
+        fprintf(stderr, "ERROR! the sentinel is at %ld, but the index says %ld\n", sentinel, sentinel_bwt);
+        exit(EXIT_FAILURE);
+    }
+    err_fwrite(&sentinel, sizeof(int64_t), 1, out);
+    err_fflush(out);
+    err_fclose(out);
+    err_fclose(in);
+    _mm_free(cp);
+    _mm_free(fmd);
+    fprintf(stderr, "sentinel-index: %ld\n", sentinel);
+    return 0;
+}
+
+void FMI_search::load_fmd_index()
+{
+    char fn[PATH_MAX];
+    FILE *fp;
+    int64_t rlen, n, sentinel;
+
+    snprintf(fn, PATH_MAX, "%s%s", file_name, FMD_FILENAME_SUFFIX);
+    fp = fopen(fn, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "* No FMD occurrence table (%s). cp_occ is used for the SMEM search\n", fn);
+        fmd_occ = NULL;
+        return;
+    }
+    err_fread_noeof(&rlen, sizeof(int64_t), 1, fp);
+    if (rlen != reference_seq_len) {
+        fprintf(stderr, "ERROR! %s is not built from this index. Rebuild it with 'fmd-index'.\n", fn);
+        exit(EXIT_FAILURE);
+    }
+    n = (rlen >> FMD_SHIFT) + 1;
+    fmd_occ = (CP_FMD *) _mm_malloc(n * sizeof(CP_FMD), 64);
+    assert_not_null(fmd_occ, n * sizeof(CP_FMD), index_alloc);
+    err_fread_noeof(fmd_occ, sizeof(CP_FMD), n, fp);
+    err_fread_noeof(&sentinel, sizeof(int64_t), 1, fp);
+    err_fclose(fp);
+    assert(sentinel == sentinel_index);
+    fprintf(stderr, "* FMD occurrence table loaded from %s (%.2f GB)\n",
+            fn, (double) n * sizeof(CP_FMD) / (1L << 30));
+}
+
+/* occ of A/C/G/T before row y of the block */
+static inline void __fmd_occ4(const CP_FMD *f, int64_t y, int64_t occ[4])
+{
+    const uint64_t lo = 0x5555555555555555ULL;
+    int64_t n1 = 0, n2 = 0, n3 = 0; /* C or T, G or T, and T */
+    int i;
+
+    for (i = 0; i < (y >> 5); ++i) {
+        uint64_t w = f->bwt_str[i];
+        n1 += _mm_countbits_64(w & lo);
+        n2 += _mm_countbits_64((w >> 1) & lo);
+        n3 += _mm_countbits_64(w & (w >> 1) & lo);
+    }
+    if (y & 31) {
+        uint64_t w = f->bwt_str[i] & ((1ULL << ((y & 31) << 1)) - 1);
+        n1 += _mm_countbits_64(w & lo);
+        n2 += _mm_countbits_64((w >> 1) & lo);
+        n3 += _mm_countbits_64(w & (w >> 1) & lo);
+    }
+    occ[0] = f->cp_count[0] + y - n1 - n2 + n3;
+    occ[1] = f->cp_count[1] + n1 - n3;
+    occ[2] = f->cp_count[2] + n2 - n3;
+    occ[3] = f->cp_count[3] + n3;
+}
+
+SMEM FMI_search::backwardExtFmd(SMEM smem, uint8_t a)
+{
+    int64_t sp = smem.k;
+    int64_t ep = smem.k + smem.s;
+    int64_t occ_sp[4], occ_ep[4], l[4];
+
+    __fmd_occ4(&fmd_occ[sp >> FMD_SHIFT], sp & FMD_MASK, occ_sp);
+    __fmd_occ4(&fmd_occ[ep >> FMD_SHIFT], ep & FMD_MASK, occ_ep);
+    /* the sentinel is packed as A, and cp_count does not include it */
+    occ_sp[0] -= (sp >> FMD_SHIFT) == (sentinel_index >> FMD_SHIFT) && sp > sentinel_index;
+    occ_ep[0] -= (ep >> FMD_SHIFT) == (sentinel_index >> FMD_SHIFT) && ep > sentinel_index;
+
+    int64_t sentinel_offset = 0;
+    if((smem.k <= sentinel_index) && ((smem.k + smem.s) > sentinel_index)) sentinel_offset = 1;
+    l[3] = smem.l + sentinel_offset;
+    l[2] = l[3] + occ_ep[3] - occ_sp[3];
+    l[1] = l[2] + occ_ep[2] - occ_sp[2];
+    l[0] = l[1] + occ_ep[1] - occ_sp[1];
+
+    smem.k = count[a] + occ_sp[a];
+    smem.l = l[a];
+    smem.s = occ_ep[a] - occ_sp[a];
+    return smem;
+}
+#endif
+
 SMEM FMI_search::backwardExt(SMEM smem, uint8_t a)
 {
     //beCalls++;
     uint8_t b;
 
+#ifdef FMD_INDEX
+    if (fmd_occ)
+        return backwardExtFmd(smem, a);
+#endif
+
     int64_t k[4], l[4], s[4];
+#if __AVX2__
+    {
+        int64_t sp = (int64_t)(smem.k);
+        int64_t ep = (int64_t)(smem.k) + (int64_t)(smem.s);
+        GET_OCC4(sp, occ4_sp);
+        GET_OCC4(ep, occ4_ep);
+        _mm256_storeu_si256((__m256i *) k,
+                _mm256_add_epi64(_mm256_loadu_si256((const __m256i *) count), occ4_sp));
+        _mm256_storeu_si256((__m256i *) s, _mm256_sub_epi64(occ4_ep, occ4_sp));
+    }
+#else
     for(b = 0; b < 4; b++)
     {
         int64_t sp = (int64_t)(smem.k);
@@ -2041,6 +2949,7 @@ SMEM FMI_search::backwardExt(SMEM smem, uint8_t a)
         k[b] = count[b] + occ_sp;
         s[b] = occ_ep - occ_sp;
     }
+#endif
 
     int64_t sentinel_offset = 0;
     if((smem.k <= sentinel_index) && ((smem.k + smem.s) > sentinel_index)) sentinel_offset = 1;
@@ -2106,10 +3015,10 @@ void FMI_search::get_sa_entries(SMEM *smemArray, int64_t *coordArray, int32_t *c
 // sa_compression
 int64_t FMI_search::get_sa_entry_compressed(int64_t pos, int tid)
 {
-    if ((pos & SA_COMPX_MASK) == 0) {
+    if ((pos & sa_compx_mask) == 0) {
         
         #if  SA_COMPRESSION
-        int64_t sa_entry = sa_ms_byte[pos >> SA_COMPX];
+        int64_t sa_entry = sa_ms_byte[pos >> sa_compx];
         #else
         int64_t sa_entry = sa_ms_byte[pos];     // simulation
         #endif
@@ -2117,7 +3026,7 @@ int64_t FMI_search::get_sa_entry_compressed(int64_t pos, int tid)
         sa_entry = sa_entry << 32;
         
         #if  SA_COMPRESSION
-        sa_entry = sa_entry + sa_ls_word[pos >> SA_COMPX];
+        sa_entry = sa_entry + sa_ls_word[pos >> sa_compx];
         #else
         sa_entry = sa_entry + sa_ls_word[pos];   // simulation
         #endif
@@ -2156,11 +3065,11 @@ int64_t FMI_search::get_sa_entry_compressed(int64_t pos, int tid)
             
             offset ++;
             // tprof[ALIGN1][tid] ++;
-            if ((sp & SA_COMPX_MASK) == 0) break;
+            if ((sp & sa_compx_mask) == 0) break;
         }
-        // assert((reference_seq_len >> SA_COMPX) - 1 >= (sp >> SA_COMPX));
+        // assert((reference_seq_len >> sa_compx) - 1 >= (sp >> sa_compx));
         #if  SA_COMPRESSION
-        int64_t sa_entry = sa_ms_byte[sp >> SA_COMPX];
+        int64_t sa_entry = sa_ms_byte[sp >> sa_compx];
         #else
         int64_t sa_entry = sa_ms_byte[sp];      // simultion
         #endif
@@ -2168,7 +3077,7 @@ int64_t FMI_search::get_sa_entry_compressed(int64_t pos, int tid)
         sa_entry = sa_entry << 32;
 
         #if  SA_COMPRESSION
-        sa_entry = sa_entry + sa_ls_word[sp >> SA_COMPX];
+        sa_entry = sa_entry + sa_ls_word[sp >> sa_compx];
         #else
         sa_entry = sa_entry + sa_ls_word[sp];      // simulation
         #endif
@@ -2202,13 +3111,111 @@ void FMI_search::get_sa_entries(SMEM *smemArray, int64_t *coordArray, int32_t *c
     }
 }
 
+/* BWT symbol at bit y of a checkpoint block, 4 for the sentinel */
+static inline uint8_t __get_bwt_sym(const CP_OCC *cpo, int64_t y)
+{
+#if __AVX512BW__
+    __m512i v = _mm512_castsi256_si512(_mm256_loadu_si256((const __m256i *) cpo->one_hot_bwt_str));
+    uint32_t m = _mm512_mask_test_epi64_mask(0xF, v, _mm512_set1_epi64(1ULL << y));
+#elif __AVX2__
+    __m256i v = _mm256_loadu_si256((const __m256i *) cpo->one_hot_bwt_str);
+    v = _mm256_sllv_epi64(v, _mm256_set1_epi64x(63 - y));   /* bit y to the sign bit */
+    uint32_t m = _mm256_movemask_pd(_mm256_castsi256_pd(v));
+#else
+    uint32_t m = ((cpo->one_hot_bwt_str[0] >> y) & 1) | (((cpo->one_hot_bwt_str[1] >> y) & 1) << 1) |
+                 (((cpo->one_hot_bwt_str[2] >> y) & 1) << 2) | (((cpo->one_hot_bwt_str[3] >> y) & 1) << 3);
+#endif
+    return m ? __builtin_ctz(m) : 4;
+}
+
+#define __sa_prefetch_row(sp) \
+    if (((sp) & sa_compx_mask) == 0) { \
+        _mm_prefetch((const char *)(&sa_ms_byte[(sp) >> sa_compx]), _MM_HINT_T0); \
+        _mm_prefetch((const char *)(&sa_ls_word[(sp) >> sa_compx]), _MM_HINT_T0); \
+    } else { \
+        _mm_prefetch((const char *)(&cp_occ[(sp) >> CP_SHIFT]), _MM_HINT_T0); \
+    }
+
+/* get_sa_entries_prefetch() for all SMEMs of a chunk in one call. The rows of an SMEM
+   are taken as in get_sa_entries(), at most max_occ, and their coordinates are stored
+   in coordArray in SMEM order. SA_RESOLVE_LANES rows are walked at a time: each round
+   takes one LF step for every unresolved row and prefetches what the row reads in the
+   next round, the cp_occ block or, at a sampled row, its sa_ms_byte/sa_ls_word entry.
+   A resolved row is replaced by the next pending one. Returns the number of coordinates. */
+int64_t FMI_search::get_sa_entries_batch(SMEM *smemArray, int64_t num_smem,
+                                         int64_t *coordArray, int32_t max_occ)
+{
+    int64_t lane_pos[SA_RESOLVE_LANES], lane_off[SA_RESOLVE_LANES], lane_dst[SA_RESOLVE_LANES];
+    int n_lane = 0;
+    int64_t i = 0, n_coord = 0;
+    int64_t j = 0, hi = 0, step = 1;
+    int32_t c = max_occ;
+
+    while (true)
+    {
+        // fill the idle lanes with the next rows
+        while (n_lane < SA_RESOLVE_LANES)
+        {
+            if (j >= hi || c >= max_occ) {
+                if (i >= num_smem) break;
+                SMEM *p = &smemArray[i++];
+                j = p->k;
+                hi = p->k + p->s;
+                step = (p->s > max_occ) ? p->s / max_occ : 1;
+                c = 0;
+                continue;
+            }
+            lane_pos[n_lane] = j;
+            lane_off[n_lane] = 0;
+            lane_dst[n_lane] = n_coord++;
+            __sa_prefetch_row(j);
+            n_lane++;
+            j += step;
+            c++;
+        }
+        if (n_lane == 0) break;
+
+        // one step for every lane, a resolved lane takes over the last one
+        int l = 0;
+        while (l < n_lane)
+        {
+            int64_t sp = lane_pos[l];
+            int64_t sa_entry;
+
+            if ((sp & sa_compx_mask) == 0) {
+                sa_entry = sa_ms_byte[sp >> sa_compx];
+                sa_entry = sa_entry << 32;
+                sa_entry = sa_entry + sa_ls_word[sp >> sa_compx];
+                coordArray[lane_dst[l]] = sa_entry + lane_off[l];
+            } else {
+                uint8_t b = __get_bwt_sym(&cp_occ[sp >> CP_SHIFT], CP_BLOCK_SIZE - (sp & CP_MASK) - 1);
+                if (b < 4) {
+                    GET_OCC(sp, b, occ_id_sp, y_sp, occ_sp, one_hot_bwt_str_c_sp, match_mask_sp);
+                    sp = count[b] + occ_sp;
+                    lane_pos[l] = sp;
+                    lane_off[l]++;
+                    __sa_prefetch_row(sp);
+                    l++;
+                    continue;
+                }
+                coordArray[lane_dst[l]] = lane_off[l];  // the sentinel, SA = 0
+            }
+            n_lane--;
+            lane_pos[l] = lane_pos[n_lane];
+            lane_off[l] = lane_off[n_lane];
+            lane_dst[l] = lane_dst[n_lane];
+        }
+    }
+    return n_coord;
+}
+
 // SA_COPMRESSION w/ PREFETCH
 int64_t FMI_search::call_one_step(int64_t pos, int64_t &sa_entry, int64_t &offset)
 {
-    if ((pos & SA_COMPX_MASK) == 0) {        
-        sa_entry = sa_ms_byte[pos >> SA_COMPX];        
+    if ((pos & sa_compx_mask) == 0) {        
+        sa_entry = sa_ms_byte[pos >> sa_compx];        
         sa_entry = sa_entry << 32;        
-        sa_entry = sa_entry + sa_ls_word[pos >> SA_COMPX];        
+        sa_entry = sa_entry + sa_ls_word[pos >> sa_compx];        
         // return sa_entry;
         return 1;
     }
@@ -2241,11 +3248,11 @@ int64_t FMI_search::call_one_step(int64_t pos, int64_t &sa_entry, int64_t &offse
         sp = count[b] + occ_sp;
         
         offset ++;
-        if ((sp & SA_COMPX_MASK) == 0) {
+        if ((sp & sa_compx_mask) == 0) {
     
-            sa_entry = sa_ms_byte[sp >> SA_COMPX];        
+            sa_entry = sa_ms_byte[sp >> sa_compx];        
             sa_entry = sa_entry << 32;
-            sa_entry = sa_entry + sa_ls_word[sp >> SA_COMPX];
+            sa_entry = sa_entry + sa_ls_word[sp >> sa_compx];
             
             sa_entry += offset;
             // return sa_entry;
@@ -2311,9 +3318,9 @@ void FMI_search::get_sa_entries_prefetch(SMEM *smemArray, int64_t *coordArray,
         map_pos[j] = map_ar[i];
         offset[j] = 0;
         
-        if (pos & SA_COMPX_MASK == 0) {
-            _mm_prefetch(&sa_ms_byte[pos >> SA_COMPX], _MM_HINT_T0);
-            _mm_prefetch(&sa_ls_word[pos >> SA_COMPX], _MM_HINT_T0);
+        if ((pos & sa_compx_mask) == 0) {
+            _mm_prefetch(&sa_ms_byte[pos >> sa_compx], _MM_HINT_T0);
+            _mm_prefetch(&sa_ls_word[pos >> sa_compx], _MM_HINT_T0);
         }
         else {
             int64_t occ_id_pp_ = pos >> CP_SHIFT;
@@ -2348,9 +3355,9 @@ void FMI_search::get_sa_entries_prefetch(SMEM *smemArray, int64_t *coordArray,
                     map_pos[k] = map_ar[i++];
                     offset[k] = 0;
                     
-                    if (pos & SA_COMPX_MASK == 0) {
-                        _mm_prefetch(&sa_ms_byte[pos >> SA_COMPX], _MM_HINT_T0);
-                        _mm_prefetch(&sa_ls_word[pos >> SA_COMPX], _MM_HINT_T0);
+                    if ((pos & sa_compx_mask) == 0) {
+                        _mm_prefetch(&sa_ms_byte[pos >> sa_compx], _MM_HINT_T0);
+                        _mm_prefetch(&sa_ls_word[pos >> sa_compx], _MM_HINT_T0);
                     }
                     else {
                         int64_t occ_id_pp_ = pos >> CP_SHIFT;
@@ -2362,9 +3369,9 @@ void FMI_search::get_sa_entries_prefetch(SMEM *smemArray, int64_t *coordArray,
             }
             else {
                 working_set[k] = sp;
-                if (sp & SA_COMPX_MASK == 0) {
-                    _mm_prefetch(&sa_ms_byte[sp >> SA_COMPX], _MM_HINT_T0);
-                    _mm_prefetch(&sa_ls_word[sp >> SA_COMPX], _MM_HINT_T0);
+                if ((sp & sa_compx_mask) == 0) {
+                    _mm_prefetch(&sa_ms_byte[sp >> sa_compx], _MM_HINT_T0);
+                    _mm_prefetch(&sa_ls_word[sp >> sa_compx], _MM_HINT_T0);
                 }
                 else {
                     int64_t occ_id_pp_ = sp >> CP_SHIFT;
@@ -82,6 +82,61 @@ GET_OCC(pp, c, occ_id_pp, y_pp, occ_pp, one_hot_bwt_str_c_pp, match_mask_pp) \
                 uint64_t match_mask_pp = one_hot_bwt_str_c_pp & one_hot_mask_array[y_pp]; \
                 occ_pp += _mm_countbits_64(match_mask_pp);
 
+#if __AVX2__
+/* The occ of A/C/G/T in one vector. cp_count[] and one_hot_bwt_str[] of a CP_OCC block are
+   already laid out base by base, so they are loaded as two 256-bit words and the four masked
+   words are counted together: VPOPCNTQ with AVX-512 (VPOPCNTDQ and VL), otherwise the
+   nibble lookup with VPSHUFB and VPSADBW. */
+static inline __m256i __popcnt4_epi64(__m256i v) {
+#if defined(__AVX512VPOPCNTDQ__) && defined(__AVX512VL__)
+    return _mm256_popcnt_epi64(v);
+#else
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_and_si256(v, low);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low);
+    __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo), _mm256_shuffle_epi8(lut, hi));
+    return _mm256_sad_epu8(cnt, _mm256_setzero_si256());
+#endif
+}
+
+static inline __m256i __cp_occ4(const CP_OCC *cp, uint64_t mask) {
+    __m256i str = _mm256_loadu_si256((const __m256i *) cp->one_hot_bwt_str);
+    __m256i cnt = _mm256_loadu_si256((const __m256i *) cp->cp_count);
+    return _mm256_add_epi64(cnt, __popcnt4_epi64(_mm256_and_si256(str, _mm256_set1_epi64x(mask))));
+}
+
+#define GET_OCC4(pp, occ4_pp) \
+                __m256i occ4_pp = __cp_occ4(&cp_occ[(pp) >> CP_SHIFT], one_hot_mask_array[(pp) & CP_MASK]);
+#endif
+
+#ifdef FMD_INDEX
+/* Experimental occurrence table for the SMEM search (prefix.fmd, built by 'fmd-index').
+   A 64-byte block covers 128 BWT rows, twice the rows of a CP_OCC block: the occ of
+   A/C/G/T at the first row, and the BWT packed in 2 bits (32 rows per word, the first
+   row at the LSBs). A backward or forward step still reads the blocks of both ends of
+   the interval, but the table is half the size of cp_occ, and both ends more often
+   fall in one block. The sentinel row is packed as A and corrected with sentinel_index.
+   cp_occ is kept for the SA lookups. */
+#define FMD_FILENAME_SUFFIX ".fmd"
+#define FMD_SHIFT 7
+#define FMD_MASK 127
+
+typedef struct
+{
+    int64_t cp_count[4];
+    uint64_t bwt_str[4];
+} CP_FMD;
+
+int build_fmd_index(const char *prefix);
+
+#define occ_prefetch(pos) _mm_prefetch((const char *) (fmd_occ ? (const void *) &fmd_occ[(pos) >> FMD_SHIFT] \
+                                                                : (const void *) &cp_occ[(pos) >> CP_SHIFT]), _MM_HINT_T0)
+#else
+#define occ_prefetch(pos) _mm_prefetch((const char *)(&cp_occ[(pos) >> CP_SHIFT]), _MM_HINT_T0)
+#endif
+
 typedef struct smem_struct
 {
 #ifdef DEBUG
@@ -94,17 +149,53 @@ typedef struct smem_struct
 
 #define SAL_PFD 16
 
+/* getSMEMsOnePosOneThread() and getSMEMsAllPosOneThread() search this many reads in lockstep
+   (FMI_search::smem_lanes). A lane issues the prefetches of its next cp_occ blocks after each
+   step, and they are consumed only after the other lanes have taken their steps. 1 for the
+   read-by-read search. */
+#ifndef SMEM_LANES
+#define SMEM_LANES 8
+#endif
+#define SMEM_LANE_WINDOW 4      /* reads in flight: smem_lanes * SMEM_LANE_WINDOW */
+
+#define SA_RESOLVE_LANES 32     /* rows walked at a time by get_sa_entries_batch() */
+
+enum {
+    SMEM_LANE_FWD = 0,
+    SMEM_LANE_BWD,
+    SMEM_LANE_DONE,
+};
+
+typedef struct {
+    int32_t i;                  /* search i, at query_pos_array[i % numReads]; -1 for an idle lane */
+    int phase;
+    int32_t x, j, next_x;
+    int32_t offset, readlength, min_intv;
+    SMEM smem;
+    SMEM *prev;
+    int numPrev;
+    SMEM *out;                  /* SMEMs of read i, copied to matchArray in read order */
+    int numOut;
+} smem_lane_t;
+
 #ifdef SMEM_ACCEL
 
-#define __num_smem_table_entry(len) (1 << ((len) * 2))
+#define __num_smem_table_entry(len) (1LL << ((len) * 2))
+
+/* The length (bp) of the smem tables is chosen by 'smem-table -a/-l' and is part of the file
+ * name (prefix.all_smem.N, prefix.last_smem.N). The longest table that is built (and, with
+ * memscale, that fits in the memory limit) is used. */
+#define SMEM_TABLE_MIN_BP 4
+#define SMEM_TABLE_MAX_BP 16
 
 /* ALL SMEM TABLE
  * we skip the first bp, since it is easily computed with count[].
- * An entry with 2 cache lines (128-byte) stores 11-bp. => 2^22 entries required.
- * 128-byte * 2^22 = 2^7 * 2^22 = 2^29 = 512MB 
+ * An entry of N-bp stores N-1 steps, and it is rounded up to cache lines.
+ * N=11 => 128-byte, 2^22 entries => 2^7 * 2^22 = 2^29 = 512MB (default)
+ * N=12 => 192-byte, 2^24 entries => 3GB
+ * N=13 => 192-byte, 2^26 entries => 12GB
  */
-#define ALL_SMEM_MAX_BP 11
-#define ALL_SMEM_TABLE_SIZE (__aligned_size((__num_smem_table_entry(ALL_SMEM_MAX_BP) * sizeof(all_smem_t)), 64))
+#define ALL_SMEM_BP 11
 typedef struct __attribute__ (( __packed__)) {
 	uint32_t last_avail; /* the last elem with s > 0 */
 	struct {
@@ -112,14 +203,17 @@ typedef struct __attribute__ (( __packed__)) {
 		uint32_t k32; // k = prev_k + k32
 		uint32_t l32; // l = count[3 - b] + l32
 		uint32_t s32; // s = s32
-	} list[ALL_SMEM_MAX_BP - 1]; /* 12 * 10 = 120-byte */
-	uint8_t __pad[__pad_size((sizeof(uint32_t) + (sizeof(uint32_t) * 3)*(ALL_SMEM_MAX_BP - 1)), 64)];
+	} list[0]; /* N - 1 elements, 12 * 10 = 120-byte for 11-bp */
 } all_smem_t;
+#define __all_smem_ent_size(len) __aligned_size((sizeof(uint32_t) + (sizeof(uint32_t) * 3) * ((len) - 1)), 64)
+#define __all_smem_ent(table, len, idx) \
+				((all_smem_t *) (((uint8_t *) (table)) + (idx) * __all_smem_ent_size(len)))
+#define __all_smem_table_size(len) (__num_smem_table_entry(len) * __all_smem_ent_size(len))
 
 /* LAST SMEM TABLE
  * each element takes 16-byte. With N-bp, 2^(2*N) elements are required.
  * Totally, 2^(4 + 2*N) bytes are required.
- * N=13 => 2^30 = 1GB
+ * N=13 => 2^30 = 1GB (default)
  * N=14 => 2^32 = 4GB
  * N=15 => 2^34 = 16GB
  * N=16 => 2^36 = 64GB
@@ -129,15 +223,62 @@ typedef struct __attribute__ ((__packed__)) {
 	int8_t kms, lms, sms;
 	uint32_t kls, lls, sls;
 } last_smem_t;
-#define LAST_SMEM_MAX_BP 13
-#define LAST_SMEM_TABLE_SIZE (__aligned_size((__num_smem_table_entry(LAST_SMEM_MAX_BP) * sizeof(last_smem_t)), 64))
+#define LAST_SMEM_BP 13
+#define __last_smem_table_size(len) (__aligned_size((__num_smem_table_entry(len) * sizeof(last_smem_t)), 64))
 
 #define __combine_ms_ls(ms, ls) ((((int64_t) (ms)) << 32) | ((int64_t) ls))
 
-int build_smem_tables(char *prefix);
+/* HIGH-OCCURRENCE K-MER TABLE
+ * one bit per N-bp k-mer (the first base is the most significant), set if the k-mer occurs
+ * more than min_occ times on both strands. LAST seeding ('mem -u') looks up the k-mer at each
+ * pivot: a seed starting there has to extend far beyond N bp to get below '-y' occurrences.
+ * Totally, 2^(2*N - 3) bytes are required.
+ * N=14 => 32MB
+ * N=16 => 512MB (default)
+ */
+#define HIOCC_BP 16
+#define HIOCC_MIN_OCC 500
+typedef struct {
+	int32_t len;
+	int32_t reserved;
+	int64_t min_occ;
+	uint64_t reserved2[6]; /* bits[] starts at the second cache line */
+	uint64_t bits[0];
+} hiocc_t;
+#define __hiocc_table_size(len) (sizeof(hiocc_t) + (__num_smem_table_entry(len) >> 3))
+
+/* 1 if the k-mer of the table length at seq is set, 0 if it is not or has an N */
+static inline int hiocc_kmer_set(const hiocc_t *t, const uint8_t *seq) {
+	uint64_t idx = 0;
+	int k, n = 0;
+	for (k = 0; k < t->len; ++k) {
+		idx = idx << 2 | (seq[k] & 3);
+		n |= seq[k] >> 2;
+	}
+	return n ? 0 : (int) ((t->bits[idx >> 6] >> (idx & 63)) & 1);
+}
+
+int build_smem_tables(char *prefix, int all_len, int last_len,
+						int hiocc_len, int64_t hiocc_occ, int n_threads);
+int smem_table_find_len(const char *prefix, const char *suffix, int max_len);
+static inline int smem_table_len(const char *prefix, const char *suffix, int def_len) {
+	int len = smem_table_find_len(prefix, suffix, SMEM_TABLE_MAX_BP);
+	return len > 0 ? len : def_len;
+}
 
 #endif /* SMEM_ACCEL */
 
+/* The first word of the .bwt.2bit.64 file is the reference length. With SA_COMPRESSION, its
+   top byte is sa_compx + 1 when the SA is sampled every 2^sa_compx rows, and 0 for SA_COMPX,
+   so that indices with the default sampling are the same as before. */
+#define BWT_HDR_SA_SHIFT 56
+#define bwt_hdr_rlen(h) ((h) & ((1LL << BWT_HDR_SA_SHIFT) - 1))
+#define bwt_hdr_sa_compx(h) (((h) >> BWT_HDR_SA_SHIFT) ? (int) ((h) >> BWT_HDR_SA_SHIFT) - 1 : SA_COMPX)
+#define bwt_hdr(rlen, x) ((x) == SA_COMPX ? (rlen) : ((rlen) | ((int64_t) ((x) + 1) << BWT_HDR_SA_SHIFT)))
+#define sa_num_samples(rlen, x) (((rlen) >> (x)) + 1)
+
+int __load_BWT_sa_compx(const char *ref_file_name);
+
 #ifdef USE_SHM
 size_t ____size_mlt(const char *prefix, const char *ref_file_name);
 #endif
@@ -149,12 +290,16 @@ class FMI_search: public indexEle
     ~FMI_search();
     //int64_t beCalls;
     
-    int build_index();
+    int build_index(int n_threads = 1, int sa_compx = SA_COMPX);
     void load_index();
     void load_index_other_elements(int which);
 #ifdef SMEM_ACCEL
-	all_smem_t *build_all_smem_table(int len);
-	last_smem_t *build_last_smem_table(int len);
+	void build_all_smem_table(int len, int64_t first, int64_t n,
+								all_smem_t *table, uint64_t *hist);
+	void build_last_smem_table(int len, int64_t first, int64_t n,
+								last_smem_t *table, uint64_t *hist);
+	void build_hiocc_table(int len, int64_t suffix, int suffix_len, hiocc_t *table);
+	void load_hiocc_table(int skip);
 #endif
 
     void getSMEMs(uint8_t *enc_qdb,
@@ -179,6 +324,19 @@ class FMI_search: public indexEle
                                  SMEM *matchArray,
                                  int64_t *__numTotalSmem);
     
+    void getSMEMsOnePosInterleaved(uint8_t *enc_qdb,
+                                   int16_t *query_pos_array,
+                                   int32_t *min_intv_array,
+                                   int32_t *rid_array,
+                                   int32_t numReads,
+                                   const bseq1_t *seq_,
+                                   int32_t *query_cum_len_ar,
+                                   int32_t max_readlength,
+                                   int32_t minSeedLen,
+                                   SMEM *matchArray,
+                                   int64_t *__numTotalSmem,
+                                   int allPos);
+
     void getSMEMsAllPosOneThread(uint8_t *enc_qdb,
                                  int32_t *min_intv_array,
                                  int32_t *rid_array,
@@ -198,7 +356,9 @@ class FMI_search: public indexEle
                                            const bseq1_t *seq_,
                                            int32_t *query_cum_len_ar,
                                            int32_t minSeedLen,
-                                           SMEM *matchArray);
+                                           SMEM *matchArray,
+                                           const void *const *skip = NULL, // reads with skip[i] != NULL are not searched
+                                           int tid = 0);
         
     void sortSMEMs(SMEM *matchArray,
                    int64_t numTotalSmem[],
@@ -223,19 +383,35 @@ class FMI_search: public indexEle
                         int32_t max_occ,
                         int tid);
     int64_t call_one_step(int64_t pos, int64_t &sa_entry, int64_t &offset);
+    int64_t get_sa_entries_batch(SMEM *smemArray, int64_t num_smem,
+                                 int64_t *coordArray, int32_t max_occ);
     void get_sa_entries_prefetch(SMEM *smemArray, int64_t *coordArray,
                                  int64_t *coordCountArray, int64_t count,
                                  const int32_t max_occ, int tid, int64_t &id_);
     
     int64_t reference_seq_len;
     int64_t sentinel_index;
+    int smem_lanes;
+    int sa_compx;               /* the SA is sampled every 2^sa_compx rows */
+    int64_t sa_compx_mask;
+#ifdef FMD_INDEX
+    CP_FMD *fmd_occ;            /* used by backwardExt() if not NULL */
+    void load_fmd_index();
+#endif
 #ifdef PERFECT_MATCH
 	perfect_table_t *perfect_table;
 #endif
+#ifdef SMEM_ACCEL
+	hiocc_t *hiocc_table;       /* loaded by load_hiocc_table() only */
+	int hiocc_skip;             /* LAST skips the pivots set in hiocc_table */
+#endif
  	
 	int useErt;
     uint64_t         *kmer_offsets;
     uint8_t          *mlt_table;
+#ifdef ERT_INDEX_PREFETCH
+    int ert_prefetch;           /* mem_kernel1_core_ert() prefetch distance in reads, 0 for none */
+#endif
 	void load_ert_index();
 
 private:
@@ -250,6 +426,8 @@ private:
 #ifdef SMEM_ACCEL
 		all_smem_t *all_smem_table;
 		last_smem_t *last_smem_table;
+		int all_smem_len;
+		int last_smem_len;
 #endif
         uint64_t *one_hot_mask_array;
    
@@ -263,12 +441,23 @@ private:
                                char *binary_seq,
                                int64_t ref_seq_len,
                                int64_t *sa_bwt,
-                               int64_t *count);
+                               int64_t *count,
+                               int sa_compx);
         SMEM backwardExt(SMEM smem, uint8_t a);
+#ifdef FMD_INDEX
+        SMEM backwardExtFmd(SMEM smem, uint8_t a);
+#endif
+
+        inline void smemLaneStart(smem_lane_t *L, uint8_t *enc_qdb, int32_t rid);
+        inline void smemLaneFwd(smem_lane_t *L, uint8_t *enc_qdb);
+        inline void smemLaneFwdEnd(smem_lane_t *L);
+        inline void smemLaneBwd(smem_lane_t *L, uint8_t *enc_qdb, int32_t minSeedLen);
+        inline void smemLaneFinish(smem_lane_t *L, int32_t minSeedLen);
 
 #ifdef SMEM_ACCEL
 		void __build_all_smem_table(uint8_t *seq, int len, all_smem_t *ent);
 		void __build_last_smem_table(uint8_t *seq, int len, last_smem_t *ent);
+		void __build_hiocc_table(SMEM smem, uint64_t idx, int depth, int len, hiocc_t *table);
 		void load_smem_table();
 #endif /* SMEM_ACCEL */
 };
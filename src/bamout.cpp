@@ -0,0 +1,210 @@
+/*************************************************************************************
+                           The MIT License
+
+   BWA-MEM-SCALE (Memory-Scalable Sequence alignment using Burrows-Wheeler Transform),
+   Copyright (C) 2022 Electronics and Telecommunications Research Institute (ETRI), Changdae Kim.
+
+   Permission is hereby granted, free of charge, to any person obtaining
+   a copy of this software and associated documentation files (the
+   "Software"), to deal in the Software without restriction, including
+   without limitation the rights to use, copy, modify, merge, publish,
+   distribute, sublicense, and/or sell copies of the Software, and to
+   permit persons to whom the Software is furnished to do so, subject to
+   the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+
+   Contacts: Changdae Kim <cdkim@etri.re.kr>
+
+** This software builds upon BWA-MEM2, and includes several performance optimization techniques.
+   For BWA-MEM2, refer to the follows.
+
+   BWA-MEM2 (Sequence alignment using Burrows-Wheeler Transform)
+   Copyright ⓒ 2019 Intel Corporation, Heng Li
+   The MIT License
+   Website: https://github.com/bwa-mem2/bwa-mem2
+
+*****************************************************************************************/
+
+#include <stdlib.h>
+#include <errno.h>
+#include <ctype.h>
+#include <zlib.h>
+#include "bamout.h"
+
+size_t bam_begin_rec(kstring_t *s, int32_t rid, int64_t pos, const char *name, int mapq,
+					 int flag, int l_seq, int32_t mrid, int64_t mpos, int64_t tlen)
+{
+	size_t off = s->l;
+	int l_name = strlen(name) + 1;
+	if (l_name > 255) {
+		fprintf(stderr, "[E::%s] read name '%s' is longer than the 254 characters BAM allows\n", __func__, name);
+		exit(EXIT_FAILURE);
+	}
+	int32_t x[9];
+	x[0] = 0;                                   // block_size, patched by bam_end_rec()
+	x[1] = rid, x[2] = pos;
+	x[3] = (uint32_t) mapq << 8 | l_name;       // bin is patched by bam_end_rec()
+	x[4] = (uint32_t) flag << 16;               // n_cigar_op likewise
+	x[5] = l_seq;
+	x[6] = mrid, x[7] = mpos, x[8] = tlen;
+	ks_resize(s, s->l + sizeof(x) + l_name);
+	memcpy(s->s + s->l, x, sizeof(x));
+	memcpy(s->s + s->l + sizeof(x), name, l_name);
+	s->l += sizeof(x) + l_name;
+	return off;
+}
+
+void bam_end_rec(kstring_t *s, size_t off, int n_cigar, int64_t rlen)
+{
+	int32_t x[5];
+	memcpy(x, s->s + off, sizeof(x));
+	if (n_cigar > UINT16_MAX) {
+		fprintf(stderr, "[E::%s] more than %d CIGAR operations\n", __func__, UINT16_MAX);
+		exit(EXIT_FAILURE);
+	}
+	x[0] = s->l - off - 4;
+	x[3] |= (uint32_t) bam_reg2bin(x[2], x[2] + (rlen > 0? rlen : 1)) << 16;
+	x[4] |= n_cigar;
+	memcpy(s->s + off, x, sizeof(x));
+}
+
+static void bam_aux_error(const char *aux)
+{
+	fprintf(stderr, "[E::bam_put_sam_aux] comment is not made of SAM tags: '%s'\n", aux);
+	exit(EXIT_FAILURE);
+}
+
+void bam_put_sam_aux(kstring_t *s, const char *aux)
+{
+	const char *p = aux, *q;
+	char *e;
+	while (*p) {
+		if (*p == '\t') { ++p; continue; }
+		if (!p[0] || !p[1] || p[2] != ':' || !p[3] || p[4] != ':') bam_aux_error(aux);
+		const char tag[2] = {p[0], p[1]};
+		char type = p[3];
+		p += 5;
+		for (q = p; *q && *q != '\t'; ++q);
+		switch (type) {
+		case 'A':
+			if (q - p != 1) bam_aux_error(aux);
+			bam_put_tag(s, tag, 'A'), kputc(*p, s);
+			break;
+		case 'i':
+			bam_put_int(s, tag, strtoll(p, &e, 10));
+			if (e != q) bam_aux_error(aux);
+			break;
+		case 'f': {
+			float f = strtof(p, &e);
+			if (e != q) bam_aux_error(aux);
+			bam_put_tag(s, tag, 'f'), kputsn((char*) &f, 4, s);
+			break;
+		}
+		case 'Z': case 'H':
+			bam_put_tag(s, tag, type), kputsn(p, q - p, s), kputc('\0', s);
+			break;
+		case 'B': {
+			char sub = *p;
+			int32_t n = 0, size = (sub == 'c' || sub == 'C')? 1 : (sub == 's' || sub == 'S')? 2 : 4;
+			if (strchr("cCsSiIf", sub) == 0 || sub == 0) bam_aux_error(aux);
+			bam_put_tag(s, tag, 'B'), kputc(sub, s);
+			size_t n_off = s->l;
+			kputsn((char*) &n, 4, s);
+			for (p = p + 1; p < q && *p == ','; ++n) {
+				union { int64_t i; uint64_t u; float f; } v;
+				if (sub == 'f') v.f = strtof(p + 1, &e);
+				else if (islower(sub)) v.i = strtoll(p + 1, &e, 10);
+				else v.u = strtoull(p + 1, &e, 10);
+				if (e == p + 1) bam_aux_error(aux);
+				kputsn((char*) &v, size, s); // little-endian: the low bytes come first
+				p = e;
+			}
+			if (p != q) bam_aux_error(aux);
+			memcpy(s->s + n_off, &n, 4);
+			break;
+		}
+		default:
+			bam_aux_error(aux);
+		}
+		p = q;
+	}
+}
+
+static void bgzf_put16(uint8_t *p, uint16_t x) { p[0] = x, p[1] = x >> 8; }
+static void bgzf_put32(uint8_t *p, uint32_t x) { bgzf_put16(p, x), bgzf_put16(p + 2, x >> 16); }
+
+void bam_deflate(kstring_t *s, int level)
+{
+	const int max_blk = 0x10000, hdr = 18, ftr = 8;
+	kstring_t out = {0, 0, 0};
+	z_stream zs;
+	size_t i;
+
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		fprintf(stderr, "[E::%s] failed to initialize zlib\n", __func__);
+		exit(EXIT_FAILURE);
+	}
+	ks_resize(&out, (s->l / BGZF_BLOCK_SIZE + 1) * max_blk);
+	for (i = 0; i < s->l; i += BGZF_BLOCK_SIZE) {
+		size_t len = s->l - i < BGZF_BLOCK_SIZE? s->l - i : BGZF_BLOCK_SIZE;
+		uint8_t *b = (uint8_t*) out.s + out.l;
+		deflateReset(&zs);
+		zs.next_in = (Bytef*) s->s + i, zs.avail_in = len;
+		zs.next_out = b + hdr, zs.avail_out = max_blk - hdr - ftr;
+		if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+			fprintf(stderr, "[E::%s] BGZF block overflow\n", __func__);
+			exit(EXIT_FAILURE);
+		}
+		int bsize = hdr + zs.total_out + ftr;
+		static const uint8_t magic[16] = {31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0};
+		memcpy(b, magic, 16);
+		bgzf_put16(b + 16, bsize - 1);
+		bgzf_put32(b + bsize - 8, crc32(crc32(0, 0, 0), (Bytef*) s->s + i, len));
+		bgzf_put32(b + bsize - 4, len);
+		out.l += bsize;
+	}
+	deflateEnd(&zs);
+	free(s->s);
+	*s = out;
+}
+
+void bam_write_hdr(FILE *fp, const bntseq_t *bns, const char *text, size_t l_text, int level)
+{
+	kstring_t s = {0, 0, 0};
+	kputsn("BAM\1", 4, &s);
+	bam_put32(&s, l_text);
+	kputsn(text, l_text, &s);
+	bam_put32(&s, bns->n_seqs);
+	for (int i = 0; i < bns->n_seqs; ++i) {
+		bam_put32(&s, strlen(bns->anns[i].name) + 1);
+		kputs(bns->anns[i].name, &s), kputc('\0', &s);
+		bam_put32(&s, bns->anns[i].len);
+	}
+	bam_deflate(&s, level);
+	if (fwrite(s.s, 1, s.l, fp) != s.l) {
+		fprintf(stderr, "[E::%s] write error: %s\n", __func__, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	free(s.s);
+}
+
+void bam_write_eof(FILE *fp)
+{
+	static const uint8_t eof[28] = {31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0, 27, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+	if (fwrite(eof, 1, 28, fp) != 28) {
+		fprintf(stderr, "[E::%s] write error: %s\n", __func__, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
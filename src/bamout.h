@@ -0,0 +1,145 @@
+/*************************************************************************************
+                           The MIT License
+
+   BWA-MEM-SCALE (Memory-Scalable Sequence alignment using Burrows-Wheeler Transform),
+   Copyright (C) 2022 Electronics and Telecommunications Research Institute (ETRI), Changdae Kim.
+
+   Permission is hereby granted, free of charge, to any person obtaining
+   a copy of this software and associated documentation files (the
+   "Software"), to deal in the Software without restriction, including
+   without limitation the rights to use, copy, modify, merge, publish,
+   distribute, sublicense, and/or sell copies of the Software, and to
+   permit persons to whom the Software is furnished to do so, subject to
+   the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+
+   Contacts: Changdae Kim <cdkim@etri.re.kr>
+
+** This software builds upon BWA-MEM2, and includes several performance optimization techniques.
+   For BWA-MEM2, refer to the follows.
+
+   BWA-MEM2 (Sequence alignment using Burrows-Wheeler Transform)
+   Copyright ⓒ 2019 Intel Corporation, Heng Li
+   The MIT License
+   Website: https://github.com/bwa-mem2/bwa-mem2
+
+*****************************************************************************************/
+
+#ifndef BAMOUT_HPP
+#define BAMOUT_HPP
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "kstring.h"
+#include "bntseq.h"
+
+/* Native BAM output ('mem -z'). mem_aln2sam() and mem_aln2sam_perfect() encode
+   binary records into the batch kstring instead of SAM text; worker_sam() then
+   deflates the batch into complete BGZF blocks, so the write step only has to
+   concatenate batches in order. */
+
+#define BGZF_BLOCK_SIZE 0xff00      // max. uncompressed bytes per BGZF block, as in htslib
+
+/* 4-bit BAM base codes of the 2-bit codes used in bseq1_t::seq (A,C,G,T,N) */
+static const uint8_t bam_nt16[5] = {1, 2, 4, 8, 15};
+/* CIGAR op codes of "MIDSH" */
+static const uint8_t bam_cigar_op[5] = {0, 1, 2, 4, 5};
+
+static inline void bam_put32(kstring_t *s, int32_t x)
+{
+	ks_resize(s, s->l + 4);
+	memcpy(s->s + s->l, &x, 4);
+	s->l += 4;
+}
+
+static inline void bam_put_tag(kstring_t *s, const char tag[2], char type)
+{
+	ks_resize(s, s->l + 3);
+	s->s[s->l++] = tag[0], s->s[s->l++] = tag[1], s->s[s->l++] = type;
+}
+
+/* Integer tag in the smallest type, the same choice as 'samtools view -b' */
+static inline void bam_put_int(kstring_t *s, const char tag[2], int64_t x)
+{
+	ks_resize(s, s->l + 7);
+	if (x < 0) {
+		if (x >= INT8_MIN) bam_put_tag(s, tag, 'c'), s->s[s->l++] = (int8_t) x;
+		else if (x >= INT16_MIN) { int16_t y = x; bam_put_tag(s, tag, 's'); memcpy(s->s + s->l, &y, 2); s->l += 2; }
+		else { int32_t y = x; bam_put_tag(s, tag, 'i'); memcpy(s->s + s->l, &y, 4); s->l += 4; }
+	} else {
+		if (x <= UINT8_MAX) bam_put_tag(s, tag, 'C'), s->s[s->l++] = (uint8_t) x;
+		else if (x <= UINT16_MAX) { uint16_t y = x; bam_put_tag(s, tag, 'S'); memcpy(s->s + s->l, &y, 2); s->l += 2; }
+		else { uint32_t y = x; bam_put_tag(s, tag, 'I'); memcpy(s->s + s->l, &y, 4); s->l += 4; }
+	}
+}
+
+static inline void bam_put_str(kstring_t *s, const char tag[2], const char *v)
+{
+	bam_put_tag(s, tag, 'Z');
+	kputs(v, s); kputc('\0', s);
+}
+
+/* Z tag whose value is appended by the caller and closed with bam_end_str() */
+static inline void bam_begin_str(kstring_t *s, const char tag[2]) { bam_put_tag(s, tag, 'Z'); }
+static inline void bam_end_str(kstring_t *s) { kputc('\0', s); }
+
+/* SEQ and QUAL of query[qb, qe) from 2-bit codes, reverse-complemented if is_rev */
+static inline void bam_put_seq(kstring_t *s, const char *seq, const char *qual, int qb, int qe, int is_rev)
+{
+	int i, l = qe - qb;
+	ks_resize(s, s->l + (l + 1) / 2 + l + 1);
+	uint8_t *p = (uint8_t*) s->s + s->l;
+	for (i = 0; i < l; ++i) {
+		int c = is_rev? seq[qe-1-i] : seq[qb+i];
+		if (is_rev && c < 4) c = 3 - c;
+		if (i & 1) p[i>>1] |= bam_nt16[c];
+		else p[i>>1] = bam_nt16[c] << 4;
+	}
+	p += (l + 1) / 2;
+	for (i = 0; i < l; ++i)
+		p[i] = qual? qual[is_rev? qe-1-i : qb+i] - 33 : 0xff;
+	s->l += (l + 1) / 2 + l;
+}
+
+static inline int bam_reg2bin(int64_t beg, int64_t end)
+{
+	--end;
+	if (beg>>14 == end>>14) return ((1<<15)-1)/7 + (beg>>14);
+	if (beg>>17 == end>>17) return ((1<<12)-1)/7 + (beg>>17);
+	if (beg>>20 == end>>20) return ((1<<9)-1)/7  + (beg>>20);
+	if (beg>>23 == end>>23) return ((1<<6)-1)/7  + (beg>>23);
+	if (beg>>26 == end>>26) return ((1<<3)-1)/7  + (beg>>26);
+	return 0;
+}
+
+/* Appends the fixed part of a record up to read_name; returns its offset so
+   that block_size and n_cigar_op can be patched by bam_end_rec() */
+size_t bam_begin_rec(kstring_t *s, int32_t rid, int64_t pos, const char *name, int mapq,
+					 int flag, int l_seq, int32_t mrid, int64_t mpos, int64_t tlen);
+void bam_end_rec(kstring_t *s, size_t off, int n_cigar, int64_t rlen);
+
+/* Appends TAB-separated SAM optional fields (a FASTA/FASTQ comment with -C) */
+void bam_put_sam_aux(kstring_t *s, const char *aux);
+
+/* Replaces the raw records in s with BGZF blocks deflated at level */
+void bam_deflate(kstring_t *s, int level);
+
+/* Writes the BAM magic, SAM header text and the reference list as BGZF blocks */
+void bam_write_hdr(FILE *fp, const bntseq_t *bns, const char *text, size_t l_text, int level);
+
+/* Writes the empty BGZF block that marks the end of a BAM file */
+void bam_write_eof(FILE *fp);
+
+#endif
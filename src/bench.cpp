@@ -0,0 +1,587 @@
+/*************************************************************************************
+                           The MIT License
+
+   BWA-MEM-SCALE (Memory-Scalable Sequence alignment using Burrows-Wheeler Transform),
+   Copyright (C) 2022 Electronics and Telecommunications Research Institute (ETRI), Changdae Kim.
+
+   Permission is hereby granted, free of charge, to any person obtaining
+   a copy of this software and associated documentation files (the
+   "Software"), to deal in the Software without restriction, including
+   without limitation the rights to use, copy, modify, merge, publish,
+   distribute, sublicense, and/or sell copies of the Software, and to
+   permit persons to whom the Software is furnished to do so, subject to
+   the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+
+   Contacts: Changdae Kim <cdkim@etri.re.kr>
+
+** This software builds upon BWA-MEM2, and includes several performance optimization techniques.
+   For BWA-MEM2, refer to the follows.
+
+   BWA-MEM2 (Sequence alignment using Burrows-Wheeler Transform)
+   Copyright ⓒ 2019 Intel Corporation, Heng Li
+   The MIT License
+   Website: https://github.com/bwa-mem2/bwa-mem2
+
+*****************************************************************************************/
+
+/* Micro-benchmarks for the runtime pieces that are hard to isolate in a full 'mem' run.
+   Usage: bwa-mem2.scale bench <kind> [options] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "macro.h"
+#include "utils.h"
+#include "kthread.h"
+#include "bseq_reader.h"
+#include "fastmap.h"
+#include "FMI_search.h"
+#ifdef USE_SHM
+#include "bwa_shm.h"
+#endif
+#ifdef PERFECT_MATCH
+#include "perfect.h"
+void find_perfect_match_batch(perfect_table_t *pt, bseq1_t *seqs, int n, int *ret);
+#endif
+
+#if AFF && (__linux__)
+#include <sys/sysinfo.h>
+extern int affy[256];
+#endif
+
+void *kopen(const char *fn, int *_fd);
+int kclose(void *a);
+
+typedef struct {
+	int64_t work;               // dummy work per read
+	volatile uint64_t sink[MAX_THREADS * CACHE_LINE];
+} bench_dispatch_t;
+
+static void bench_dispatch_worker(void *data, long st, long n, int tid)
+{
+	bench_dispatch_t *b = (bench_dispatch_t*) data;
+	uint64_t x = st;
+	for (long i = 0; i < n; ++i)
+		for (int64_t k = 0; k < b->work; ++k) x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+	b->sink[tid * CACHE_LINE] += x;
+}
+
+/* Per-chunk dispatch overhead of kt_for(): mem_process_seqs() opens three parallel
+   regions per chunk (worker_bwt, worker_aln, worker_sam). Compare the original
+   spawn/join per region against the persistent pool. */
+static int bench_dispatch(int argc, char *argv[])
+{
+	int c, n_threads = 4, n_chunks = 200, n_reads = 10000;
+	bench_dispatch_t b;
+	memset(&b, 0, sizeof(b));
+	while ((c = getopt(argc, argv, "t:n:r:w:")) >= 0) {
+		if (c == 't') n_threads = atoi(optarg);
+		else if (c == 'n') n_chunks = atoi(optarg);
+		else if (c == 'r') n_reads = atoi(optarg);
+		else if (c == 'w') b.work = atol(optarg);
+	}
+	if (n_threads < 1 || n_threads > MAX_THREADS || n_chunks < 1) {
+		fprintf(stderr, "Usage: bench dispatch [-t threads(<=%d)] [-n chunks] [-r reads/chunk] [-w work/read]\n", MAX_THREADS);
+		return 1;
+	}
+#if AFF && (__linux__)
+	for (int i = 0; i < n_threads; ++i) affy[i] = i % get_nprocs();
+#endif
+
+	double t0 = realtime();
+	for (int i = 0; i < n_chunks; ++i)
+		for (int r = 0; r < 3; ++r) kt_spawn_for(n_threads, bench_dispatch_worker, &b, n_reads);
+	double t_spawn = realtime() - t0;
+
+	t0 = realtime();
+	kt_pool_t *pool = kt_pool_init(n_threads, 1);
+	double t_init = realtime() - t0;
+	t0 = realtime();
+	for (int i = 0; i < n_chunks; ++i)
+		for (int r = 0; r < 3; ++r) kt_pool_for(pool, bench_dispatch_worker, &b, n_reads, BATCH_SIZE);
+	double t_pool = realtime() - t0;
+	kt_pool_destroy(pool);
+
+	fprintf(stderr, "[bench dispatch] threads: %d chunks: %d reads/chunk: %d work/read: %ld\n",
+			n_threads, n_chunks, n_reads, (long) b.work);
+	fprintf(stderr, "\tspawn/join : %10.2f us/chunk %10.2f us/region\n",
+			t_spawn * 1e6 / n_chunks, t_spawn * 1e6 / n_chunks / 3);
+	fprintf(stderr, "\tpool       : %10.2f us/chunk %10.2f us/region (pool init %.2f us)\n",
+			t_pool * 1e6 / n_chunks, t_pool * 1e6 / n_chunks / 3, t_init * 1e6);
+	return 0;
+}
+
+#ifdef OPT_RW
+/* Read step throughput: bseq_read_par() at 1, 2, 4, ... threads. The file is read
+   through the page cache, so run it twice and take the second round. */
+static int bench_input(int argc, char *argv[])
+{
+	int c, max_threads = 8, n_rounds = 1;
+	int64_t chunk_size = 10000000;
+	while ((c = getopt(argc, argv, "t:K:r:")) >= 0) {
+		if (c == 't') max_threads = atoi(optarg);
+		else if (c == 'K') chunk_size = atol(optarg);
+		else if (c == 'r') n_rounds = atoi(optarg);
+	}
+	if (optind >= argc || max_threads < 1 || max_threads > MAX_THREADS || chunk_size < 1) {
+		fprintf(stderr, "Usage: bench input [-t max_threads(<=%d)] [-K chunk_bases] [-r rounds] <in.fq[.gz]>\n", MAX_THREADS);
+		return 1;
+	}
+
+	fprintf(stderr, "[bench input] %s chunk: %ld bases\n", argv[optind], (long) chunk_size);
+	for (int t = 1; t <= max_threads; t = t < max_threads && t * 2 > max_threads? max_threads : t * 2) {
+		for (int r = 0; r < n_rounds; ++r) {
+			int fd, n;
+			int64_t sz, n_seqs = 0, n_bases = 0;
+			void *ko = kopen(argv[optind], &fd);
+			if (ko == 0) {
+				fprintf(stderr, "ERROR: failed to open '%s'\n", argv[optind]);
+				return 1;
+			}
+			double t0 = realtime();
+			bseq_reader_t *br = bseq_reader_init(fd, -1, t);
+			bseq1_t *seqs;
+			while ((seqs = bseq_read_par(br, chunk_size, &n, &sz)) != 0) {
+				for (int i = 0; i < n; ++i) free(seqs[i].strbuf);
+				free(seqs);
+				n_seqs += n, n_bases += sz;
+			}
+			double el = realtime() - t0;
+			double mb = br->n_txt / 1e6;
+			fprintf(stderr, "\tthreads: %3d reads: %ld bases: %ld text: %.1f MB in %.3f s  %8.1f MB/s %8.1f MB/s/thread\n",
+					t, (long) n_seqs, (long) n_bases, mb, el, mb / el, mb / el / t);
+			bseq_reader_destroy(br);
+			kclose(ko);
+		}
+		if (t == max_threads) break;
+	}
+	return 0;
+}
+#endif
+
+#ifdef PERFECT_MATCH
+/* single-threaded lookups into one or more perfect tables of the same reference,
+   e.g. the BST format ('perfect-index -L') and the bucket format. Hits are windows
+   of the reference, misses are random sequences. Every table gets the same queries.
+   Each round runs read-by-read lookups, then batched ones (BATCH_SIZE reads, as mem does). */
+static int bench_perfect(int argc, char *argv[])
+{
+	int c, miss_pct = 50, n_rounds = 3;
+	int64_t n_queries = 1000000;
+	while ((c = getopt(argc, argv, "n:m:r:")) >= 0) {
+		if (c == 'n') n_queries = atol(optarg);
+		else if (c == 'm') miss_pct = atoi(optarg);
+		else if (c == 'r') n_rounds = atoi(optarg);
+	}
+	if (optind + 2 > argc || n_queries < 1 || miss_pct < 0 || miss_pct > 100 || n_rounds < 1) {
+		fprintf(stderr, "Usage: bench perfect [-n queries] [-m miss_percent] [-r rounds] <prefix> <table> [<table>...]\n");
+		return 1;
+	}
+
+	uint8_t *ref_string;
+	load_ref_string(argv[optind], &ref_string);
+
+	for (int k = optind + 1; k < argc; ++k) {
+		perfect_table_t *pt = load_perfect_table_file(argv[k], ref_string);
+		if (pt == NULL) {
+			fprintf(stderr, "ERROR: failed to load '%s'\n", argv[k]);
+			return 1;
+		}
+		int len = pt->seed_len;
+		uint8_t *q = (uint8_t *) malloc(n_queries * len);
+		srand48(11);
+		for (int64_t i = 0; i < n_queries; ++i) {
+			uint8_t *s = q + i * len;
+			if (lrand48() % 100 < miss_pct) {
+				for (int j = 0; j < len; ++j) s[j] = lrand48() & 3;
+				continue;
+			}
+			for (;;) { /* a window of the reference without N */
+				int64_t pos = lrand48() % (pt->seq_len - len);
+				int j;
+				for (j = 0; j < len && ref_string[pos + j] < 4; ++j);
+				if (j < len) continue;
+				memcpy(s, ref_string + pos, len);
+				break;
+			}
+		}
+
+		fprintf(stderr, "[bench perfect] %s format: %s seed_len: %d size: %.1f MB\n", argv[k], 
+				is_bucket_table(pt) ? "bucket" : "bst", len, 
+				(double) pt->num_seed_entry * sizeof(seed_entry_t) / 1e6);
+		for (int r = 0; r < n_rounds; ++r) {
+			bseq1_perfect_t ret;
+			int64_t n_matched = 0;
+			double t0 = realtime();
+			for (int64_t i = 0; i < n_queries; ++i) {
+				int m = find_perfect_match_seed(pt, q + i * len, len, &ret);
+				if (m == FIND_PERFECT_FW_MATCHED || m == FIND_PERFECT_RC_MATCHED) ++n_matched;
+			}
+			double el = realtime() - t0;
+			fprintf(stderr, "\tsingle  queries: %ld matched: %ld in %.3f s  %8.1f ns/lookup\n",
+					(long) n_queries, (long) n_matched, el, el * 1e9 / n_queries);
+
+			n_matched = 0;
+			t0 = realtime();
+			for (int64_t i = 0; i < n_queries; i += BATCH_SIZE) {
+				int n = n_queries - i < BATCH_SIZE ? n_queries - i : BATCH_SIZE;
+				bseq1_t seqs[BATCH_SIZE];
+				int ret[BATCH_SIZE];
+				for (int j = 0; j < n; ++j) {
+					seqs[j].seq = (char *) q + (i + j) * len;
+					seqs[j].l_seq = len;
+				}
+				find_perfect_match_batch(pt, seqs, n, ret);
+				for (int j = 0; j < n; ++j)
+					if (ret[j] == FIND_PERFECT_FW_MATCHED || ret[j] == FIND_PERFECT_RC_MATCHED) ++n_matched;
+			}
+			el = realtime() - t0;
+			fprintf(stderr, "\tbatched queries: %ld matched: %ld in %.3f s  %8.1f ns/lookup\n",
+					(long) n_queries, (long) n_matched, el, el * 1e9 / n_queries);
+		}
+		free(q);
+		destroy_perfect_table_file(pt);
+	}
+	_mm_free(ref_string);
+	return 0;
+}
+#endif
+
+static int bench_smem_differ(const SMEM *a, const SMEM *b, int64_t n)
+{
+	for (int64_t i = 0; i < n; ++i) /* SMEM has padding, no memcmp() */
+		if (a[i].rid != b[i].rid || a[i].m != b[i].m || a[i].n != b[i].n ||
+			a[i].k != b[i].k || a[i].l != b[i].l || a[i].s != b[i].s)
+			return 1;
+	return 0;
+}
+
+/* Single-threaded SMEM search, getSMEMsAllPosOneThread() over BATCH_SIZE reads at a time
+   as mem_collect_smem() calls it, with 1, 2, 4, ... reads searched in lockstep
+   (FMI_search::smem_lanes). The SMEMs of every lane count are checked against lanes=1.
+   With FMD_INDEX and prefix.fmd, each lane count runs with cp_occ and then with the
+   FMD occurrence table, as an A/B of the two layouts (-F 0 for cp_occ only).
+   With USE_SHM, the index is taken from shm if it is loaded ('load-shm'). */
+static int bench_smem(int argc, char *argv[])
+{
+	int c, max_lanes = 16, n_rounds = 1, min_seed_len = 19, use_fmd = 1;
+	int64_t chunk_size = 10000000;
+	while ((c = getopt(argc, argv, "k:K:r:l:F:")) >= 0) {
+		if (c == 'k') max_lanes = atoi(optarg);
+		else if (c == 'K') chunk_size = atol(optarg);
+		else if (c == 'r') n_rounds = atoi(optarg);
+		else if (c == 'l') min_seed_len = atoi(optarg);
+		else if (c == 'F') use_fmd = atoi(optarg);
+	}
+	if (optind + 2 > argc || max_lanes < 1 || chunk_size < 1 || n_rounds < 1) {
+		fprintf(stderr, "Usage: bench smem [-k max_lanes] [-K chunk_bases] [-r rounds] [-l min_seed_len] [-F 0|1] <prefix> <in.fq>\n");
+		return 1;
+	}
+
+	int fd, n_seqs;
+	int64_t n_bases;
+	void *ko = kopen(argv[optind + 1], &fd);
+	if (ko == 0) {
+		fprintf(stderr, "ERROR: failed to open '%s'\n", argv[optind + 1]);
+		return 1;
+	}
+	gzFile fp = gzdopen(fd, "r");
+	kseq_t *ks = kseq_init(fp);
+	bseq1_t *seqs = bseq_read_orig(chunk_size, &n_seqs, ks, NULL, &n_bases);
+	kseq_destroy(ks);
+	err_gzclose(fp);
+	kclose(ko);
+	if (seqs == NULL) {
+		fprintf(stderr, "ERROR: no reads in '%s'\n", argv[optind + 1]);
+		return 1;
+	}
+	for (int i = 0; i < n_seqs; ++i)
+		for (int j = 0; j < seqs[i].l_seq; ++j)
+			seqs[i].seq[j] = (uint8_t) seqs[i].seq[j] < 4 ? seqs[i].seq[j] : nst_nt4_table[(uint8_t) seqs[i].seq[j]];
+
+#ifdef USE_SHM
+	int useErt = 0;
+	bwa_shm_init(argv[optind], &useErt, PT_SEED_LEN_NO_TABLE, BWA_SHM_INIT_READ);
+#endif
+	FMI_search *fmi = new FMI_search(argv[optind]);
+	fmi->load_index();
+#ifdef USE_SHM
+	bwa_shm_complete(BWA_SHM_INIT_READ);
+#endif
+	void *fmd_occ = NULL;
+#ifdef FMD_INDEX
+	fmd_occ = fmi->fmd_occ;
+#endif
+	if (fmd_occ == NULL) use_fmd = 0;
+
+	int max_readlength = 0;
+	int32_t *query_cum_len_ar = (int32_t *) _mm_malloc(BATCH_SIZE * sizeof(int32_t), 64);
+	int32_t *min_intv_ar = (int32_t *) _mm_malloc(BATCH_SIZE * sizeof(int32_t), 64);
+	int32_t *rid = (int32_t *) _mm_malloc(BATCH_SIZE * sizeof(int32_t), 64);
+	for (int i = 0; i < n_seqs; ++i)
+		if (max_readlength < seqs[i].l_seq) max_readlength = seqs[i].l_seq;
+	int64_t wsize = (int64_t) BATCH_SIZE * (max_readlength + SEEDS_PER_READ);
+	uint8_t *enc_qdb = (uint8_t *) _mm_malloc(wsize, 64);
+	SMEM *matchArray = (SMEM *) _mm_malloc(wsize * sizeof(SMEM), 64);
+	SMEM *refArray = NULL;       // SMEMs of lanes=1, the reference
+	int64_t n_ref = -1, m_ref = 0;
+
+	fprintf(stderr, "[bench smem] %s reads: %d bases: %ld max_len: %d\n", argv[optind + 1],
+			n_seqs, (long) n_bases, max_readlength);
+	for (int k = 1; k <= max_lanes; k = k < max_lanes && k * 2 > max_lanes? max_lanes : k * 2) {
+		fmi->smem_lanes = k;
+		for (int r = 0; r < n_rounds * (use_fmd ? 2 : 1); ++r) {
+			const char *layout = "";
+#ifdef FMD_INDEX
+			fmi->fmd_occ = r >= n_rounds ? (CP_FMD *) fmd_occ : NULL;
+			layout = r >= n_rounds ? "fmd" : "cp_occ";
+#endif
+			int64_t n_smem = 0, n_diff = 0;
+			double t0 = realtime();
+			for (int b = 0; b < n_seqs; b += BATCH_SIZE) {
+				int nseq = n_seqs - b < BATCH_SIZE ? n_seqs - b : BATCH_SIZE;
+				int64_t num_smem = 0;
+				int offset = 0;
+				for (int l = 0; l < nseq; ++l) {
+					query_cum_len_ar[l] = offset;
+					min_intv_ar[l] = 1;
+					rid[l] = l;
+					memcpy(enc_qdb + offset, seqs[b + l].seq, seqs[b + l].l_seq);
+					offset += seqs[b + l].l_seq;
+				}
+				fmi->getSMEMsAllPosOneThread(enc_qdb, min_intv_ar, rid, nseq, nseq,
+											 seqs + b, query_cum_len_ar, max_readlength, min_seed_len,
+											 matchArray, &num_smem);
+				if (n_ref < 0) {
+					if (n_smem + num_smem > m_ref) {
+						m_ref = (n_smem + num_smem) * 2;
+						refArray = (SMEM *) realloc(refArray, m_ref * sizeof(SMEM));
+					}
+					memcpy(refArray + n_smem, matchArray, num_smem * sizeof(SMEM));
+				} else if (n_smem + num_smem > n_ref ||
+						   bench_smem_differ(refArray + n_smem, matchArray, num_smem)) {
+					++n_diff;
+				}
+				n_smem += num_smem;
+			}
+			double el = realtime() - t0;
+			if (n_ref < 0) n_ref = n_smem;
+			else if (n_smem != n_ref) n_diff = n_seqs;
+			fprintf(stderr, "\tlanes: %3d %6s SMEMs: %ld in %.3f s  %10.0f SMEMs/s %8.1f ns/base %s\n",
+					k, layout, (long) n_smem, el, n_smem / el, el * 1e9 / n_bases,
+					n_diff ? "MISMATCH" : "");
+			if (n_diff) {
+				fprintf(stderr, "ERROR: %ld batches differ from lanes=1\n", (long) n_diff);
+				return 1;
+			}
+		}
+		if (k == max_lanes) break;
+	}
+#ifdef FMD_INDEX
+	fmi->fmd_occ = (CP_FMD *) fmd_occ;
+#endif
+
+	_mm_free(query_cum_len_ar);
+	_mm_free(min_intv_ar);
+	_mm_free(rid);
+	_mm_free(enc_qdb);
+	_mm_free(matchArray);
+	free(refArray);
+	for (int i = 0; i < n_seqs; ++i) {
+#ifdef OPT_RW
+		free(seqs[i].strbuf);
+#else
+		free(seqs[i].name); free(seqs[i].comment);
+		free(seqs[i].seq); free(seqs[i].qual);
+#endif
+	}
+	free(seqs);
+	delete fmi;
+#ifdef USE_SHM
+	bwa_shm_final(BWA_SHM_INIT_READ);
+#endif
+	return 0;
+}
+
+/* ERT seeding throughput, mem_kernel1_core_ert() (SMEMs, reseeding, LAST and chaining)
+   over BATCH_SIZE reads at a time, single-threaded. Reads longer than READ_LEN take the
+   heap-allocated buffers, so run it on 2x150, 2x250 and 2x300 inputs side by side; -L
+   trims every read to at most that many bases for a same-input comparison. The ERT index
+   must have been built with 'index -a ert'.
+   With ERT_INDEX_PREFETCH, it runs with prefetch distances 0, 1, 2, 4, ... up to -p
+   (FMI_search::ert_prefetch), and the chained seeds of every distance are checked
+   against distance 0. */
+static int bench_ert(int argc, char *argv[])
+{
+	int c, n_rounds = 1, max_len = 0, max_dist = 0;
+#ifdef ERT_INDEX_PREFETCH
+	max_dist = 16;
+#endif
+	int64_t chunk_size = 10000000;
+	while ((c = getopt(argc, argv, "K:r:L:p:")) >= 0) {
+		if (c == 'K') chunk_size = atol(optarg);
+		else if (c == 'r') n_rounds = atoi(optarg);
+		else if (c == 'L') max_len = atoi(optarg);
+		else if (c == 'p') max_dist = atoi(optarg);
+	}
+	if (optind + 2 > argc || chunk_size < 1 || n_rounds < 1 || max_len < 0 || max_dist < 0) {
+		fprintf(stderr, "Usage: bench ert [-K chunk_bases] [-r rounds] [-L max_read_len] [-p max_prefetch_dist] <prefix> <in.fq>\n");
+		return 1;
+	}
+
+	int fd, n_seqs;
+	int64_t n_bases = 0;
+	void *ko = kopen(argv[optind + 1], &fd);
+	if (ko == 0) {
+		fprintf(stderr, "ERROR: failed to open '%s'\n", argv[optind + 1]);
+		return 1;
+	}
+	gzFile fp = gzdopen(fd, "r");
+	kseq_t *ks = kseq_init(fp);
+	bseq1_t *seqs = bseq_read_orig(chunk_size, &n_seqs, ks, NULL, &n_bases);
+	kseq_destroy(ks);
+	err_gzclose(fp);
+	kclose(ko);
+	if (seqs == NULL) {
+		fprintf(stderr, "ERROR: no reads in '%s'\n", argv[optind + 1]);
+		return 1;
+	}
+	int longest = 0;
+	n_bases = 0;
+	for (int i = 0; i < n_seqs; ++i) {
+		if (max_len > 0 && seqs[i].l_seq > max_len) seqs[i].l_seq = max_len;
+		if (longest < seqs[i].l_seq) longest = seqs[i].l_seq;
+		n_bases += seqs[i].l_seq;
+	}
+
+#ifdef USE_SHM
+	int useErt = 1;
+	bwa_shm_init(argv[optind], &useErt, PT_SEED_LEN_NO_TABLE, BWA_SHM_INIT_READ);
+#endif
+	FMI_search *fmi = new FMI_search(argv[optind]);
+	fmi->load_index_other_elements(BWA_IDX_BNS | BWA_IDX_PAC);
+	fmi->load_ert_index();
+	uint8_t *ref_string;
+	load_ref_string(argv[optind], &ref_string);
+#ifdef USE_SHM
+	bwa_shm_complete(BWA_SHM_INIT_READ);
+#endif
+
+	mem_opt_t *opt = mem_opt_init();
+	mem_chain_v *chain_ar = (mem_chain_v *) malloc(BATCH_SIZE * sizeof(mem_chain_v));
+	int64_t seedBufSize = BATCH_SIZE * AVG_SEEDS_PER_READ;
+	mem_seed_t *seedBuf = (mem_seed_t *) calloc(seedBufSize, sizeof(mem_seed_t));
+	mem_v smems;
+	u64v hits;
+	kv_init_base(mem_t, smems, BATCH_MUL * READ_LEN);
+	kv_init_base(uint64_t, hits, MAX_HITS_PER_READ);
+
+	fprintf(stderr, "[bench ert] %s reads: %d bases: %ld max_len: %d\n", argv[optind + 1],
+			n_seqs, (long) n_bases, longest);
+	uint64_t ref_sum = 0;
+	for (int d = 0; d <= max_dist; d = d < max_dist && d * 2 > max_dist? max_dist : (d ? d * 2 : 1)) {
+#ifdef ERT_INDEX_PREFETCH
+		fmi->ert_prefetch = d;
+#endif
+		for (int r = 0; r < n_rounds; ++r) {
+			int64_t n_chain = 0;
+			uint64_t sum = 0;   // of the chained seeds, computed outside the timed kernel
+			double el = 0;
+			for (int b = 0; b < n_seqs; b += BATCH_SIZE) {
+				int nseq = n_seqs - b < BATCH_SIZE ? n_seqs - b : BATCH_SIZE;
+				double t0 = realtime();
+				mem_kernel1_core_ert(fmi, opt, seqs + b, nseq, chain_ar, seedBuf, seedBufSize,
+									 ref_string, &smems, &hits, 0);
+				el += realtime() - t0;
+				for (int l = 0; l < nseq; ++l) {
+					n_chain += chain_ar[l].n;
+					for (size_t i = 0; i < chain_ar[l].n; ++i) {
+						mem_chain_t *p = &chain_ar[l].a[i];
+						for (int j = 0; j < p->n; ++j)
+							sum = sum * 1000003ULL + ((uint64_t) p->seeds[j].rbeg << 24 ^ (uint64_t) p->seeds[j].qbeg << 12 ^ p->seeds[j].len);
+						if (p->m > SEEDS_PER_CHAIN) free(p->seeds);
+					}
+					free(chain_ar[l].a);
+				}
+			}
+			if (d == 0 && r == 0) ref_sum = sum;
+			fprintf(stderr, "\tprefetch: %2d chains: %ld in %.3f s  %10.0f reads/s %8.1f ns/base %s\n",
+					d, (long) n_chain, el, n_seqs / el, el * 1e9 / n_bases,
+					sum != ref_sum ? "MISMATCH" : "");
+			if (sum != ref_sum) {
+				fprintf(stderr, "ERROR: chained seeds differ from prefetch distance 0\n");
+				return 1;
+			}
+		}
+		if (d == max_dist) break;
+	}
+#ifdef ERT_INDEX_PREFETCH
+	fmi->ert_prefetch = ERT_PREFETCH_DIST;
+#endif
+
+	kv_destroy(smems);
+	kv_destroy(hits);
+	free(seedBuf);
+	free(chain_ar);
+	free(opt);
+	for (int i = 0; i < n_seqs; ++i) {
+#ifdef OPT_RW
+		free(seqs[i].strbuf);
+#else
+		free(seqs[i].name); free(seqs[i].comment);
+		free(seqs[i].seq); free(seqs[i].qual);
+#endif
+	}
+	free(seqs);
+#ifdef USE_SHM
+	if (bwa_shm_unmap(BWA_SHM_REF))
+#endif
+		_mm_free(ref_string);
+	delete fmi;
+#ifdef USE_SHM
+	bwa_shm_final(BWA_SHM_INIT_READ);
+#endif
+	return 0;
+}
+
+int bench_main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: bench <kind> [options]\n");
+		fprintf(stderr, "Kinds:\n");
+		fprintf(stderr, "  dispatch      kt_for() dispatch overhead, spawn/join vs. persistent pool\n");
+#ifdef OPT_RW
+		fprintf(stderr, "  input         read step throughput (mem -J) in MB/s per thread\n");
+#endif
+		fprintf(stderr, "  smem          SMEM search throughput for 1, 2, 4, ... reads in lockstep\n");
+		fprintf(stderr, "  ert           ERT seeding throughput by prefetch distance, and for 2x150 vs. 2x250 vs. 2x300 reads\n");
+#ifdef PERFECT_MATCH
+		fprintf(stderr, "  perfect       perfect table lookup latency, e.g. BST vs. bucket format\n");
+#endif
+		return 1;
+	}
+	if (strcmp(argv[1], "dispatch") == 0) return bench_dispatch(argc - 1, argv + 1);
+#ifdef OPT_RW
+	if (strcmp(argv[1], "input") == 0) return bench_input(argc - 1, argv + 1);
+#endif
+	if (strcmp(argv[1], "smem") == 0) return bench_smem(argc - 1, argv + 1);
+	if (strcmp(argv[1], "ert") == 0) return bench_ert(argc - 1, argv + 1);
+#ifdef PERFECT_MATCH
+	if (strcmp(argv[1], "perfect") == 0) return bench_perfect(argc - 1, argv + 1);
+#endif
+	fprintf(stderr, "ERROR: unknown bench kind '%s'\n", argv[1]);
+	return 1;
+}
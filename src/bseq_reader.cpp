@@ -0,0 +1,647 @@
+/*************************************************************************************
+                           The MIT License
+
+   BWA-MEM-SCALE (Memory-Scalable Sequence alignment using Burrows-Wheeler Transform),
+   Copyright (C) 2022 Electronics and Telecommunications Research Institute (ETRI), Changdae Kim.
+
+   Permission is hereby granted, free of charge, to any person obtaining
+   a copy of this software and associated documentation files (the
+   "Software"), to deal in the Software without restriction, including
+   without limitation the rights to use, copy, modify, merge, publish,
+   distribute, sublicense, and/or sell copies of the Software, and to
+   permit persons to whom the Software is furnished to do so, subject to
+   the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+
+   Contacts: Changdae Kim <cdkim@etri.re.kr>
+
+** This software builds upon BWA-MEM2, and includes several performance optimization techniques.
+   For BWA-MEM2, refer to the follows.
+
+   BWA-MEM2 (Sequence alignment using Burrows-Wheeler Transform)
+   Copyright ⓒ 2019 Intel Corporation, Heng Li
+   The MIT License
+   Website: https://github.com/bwa-mem2/bwa-mem2
+
+*****************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bseq_reader.h"
+
+#ifdef OPT_RW
+
+#define BSEQ_READ_SIZE  (1 << 22)   // bytes per read(2) and minimum text per refill
+#define BSEQ_SEG_SIZE   (1 << 20)   // minimum text per parsing task
+#define BSEQ_COPY_BATCH 2048        // reads copied per task; each task owns one strbuf
+
+#define BGZF_HDR_SIZE   18
+#define BGZF_FTR_SIZE   8
+
+typedef struct {
+	int64_t zoff, toff;         // offsets of the block in zbuf and of its text
+	int zlen;
+	uint32_t isize;
+} bgzf_blk_t;
+
+typedef struct {
+	bseq_reader_t *r;
+	bseq_file_t *f;
+	bgzf_blk_t *blk;
+} bgzf_job_t;
+
+typedef struct {
+	int64_t b, e;               // records starting in [b, e)
+	int64_t stop;               // first byte not parsed
+	bseq_rec_t *a;
+	int64_t n, m;
+} bseq_seg_t;
+
+typedef struct {
+	bseq_file_t *f;
+	bseq_seg_t *seg;
+	int n_seg, text_done;
+} bseq_parse_t;
+
+typedef struct {
+	bseq_reader_t *r;
+	bseq1_t *seqs;
+} bseq_copy_t;
+
+static void *bseq_grow(void *p, int64_t *m, int64_t need, size_t esize)
+{
+	if (need <= *m) return p;
+	int64_t nm = *m > 0? *m : 1024;
+	while (nm < need) nm += nm >> 1;
+	p = realloc(p, nm * esize);
+	if (p == NULL) {
+		fprintf(stderr, "ERROR: out of memory %s\n", __func__);
+		exit(EXIT_FAILURE);
+	}
+	*m = nm;
+	return p;
+}
+
+static void bseq_read_raw(bseq_file_t *f, int64_t len)
+{
+	int64_t n = 0;
+	f->zbuf = (uint8_t*) bseq_grow(f->zbuf, &f->zbuf_m, f->zbuf_n + len, 1);
+	while (n < len) {
+		ssize_t ret = read(f->fd, f->zbuf + f->zbuf_n + n, len - n);
+		if (ret == 0) { f->zeof = 1; break; }
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			fprintf(stderr, "[E::%s] read error: %s\n", __func__, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		n += ret;
+	}
+	f->zbuf_n += n;
+}
+
+static inline int bseq_text_done(const bseq_file_t *f)
+{
+	if (f->fmt == BSEQ_MMAP) return f->txt_n == f->map_len;
+	if (f->fmt == BSEQ_GZIP) return f->zeof && f->zs.avail_in == 0;
+	return f->zeof && f->zbuf_n == 0;
+}
+
+/***************
+ * Inflation   *
+ ***************/
+
+static void bgzf_inflate_worker(void *data, long st, long n, int tid)
+{
+	bgzf_job_t *j = (bgzf_job_t*) data;
+	z_stream *zs = &j->r->zs[tid];
+	for (long i = st; i < st + n; ++i) {
+		bgzf_blk_t *b = &j->blk[i];
+		if (b->isize == 0) continue; // EOF marker
+		inflateReset(zs);
+		zs->next_in = j->f->zbuf + b->zoff + BGZF_HDR_SIZE;
+		zs->avail_in = b->zlen - BGZF_HDR_SIZE - BGZF_FTR_SIZE;
+		zs->next_out = (Bytef*) j->f->txt + j->f->txt_n + b->toff;
+		zs->avail_out = b->isize;
+		if (inflate(zs, Z_FINISH) != Z_STREAM_END || zs->avail_out != 0) {
+			fprintf(stderr, "[E::%s] corrupted BGZF block\n", __func__);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static void bseq_fill_bgzf(bseq_reader_t *r, bseq_file_t *f, int64_t want)
+{
+	int64_t end = f->txt_n + want;
+	bgzf_blk_t *blk = 0;
+	int64_t m_blk = 0;
+
+	while (f->txt_n < end && !bseq_text_done(f)) {
+		// FASTQ deflates 3-4x; a short read just takes another round
+		if (!f->zeof) bseq_read_raw(f, want / 4 > BSEQ_READ_SIZE? want / 4 : BSEQ_READ_SIZE);
+
+		int64_t off = 0, toff = 0, nb = 0;
+		while (off + BGZF_HDR_SIZE <= f->zbuf_n) {
+			const uint8_t *z = f->zbuf + off;
+			if (z[0] != 31 || z[1] != 139 || z[12] != 'B' || z[13] != 'C') {
+				fprintf(stderr, "[E::%s] input is not BGZF-compressed throughout\n", __func__);
+				exit(EXIT_FAILURE);
+			}
+			int bsize = (z[16] | z[17] << 8) + 1;
+			if (off + bsize > f->zbuf_n) break;
+			blk = (bgzf_blk_t*) bseq_grow(blk, &m_blk, nb + 1, sizeof(bgzf_blk_t));
+			blk[nb].zoff = off, blk[nb].zlen = bsize, blk[nb].toff = toff;
+			blk[nb].isize = z[bsize-4] | z[bsize-3] << 8 | z[bsize-2] << 16 | (uint32_t) z[bsize-1] << 24;
+			toff += blk[nb++].isize;
+			off += bsize;
+		}
+		if (nb == 0) {
+			if (f->zeof) {
+				fprintf(stderr, "[E::%s] truncated BGZF block at the end of input\n", __func__);
+				exit(EXIT_FAILURE);
+			}
+			continue;
+		}
+
+		f->txt = (char*) bseq_grow(f->txt, &f->txt_m, f->txt_n + toff + 1, 1);
+		bgzf_job_t j = {r, f, blk};
+		kt_pool_for(r->pool, bgzf_inflate_worker, &j, nb, 1);
+		f->txt_n += toff;
+		memmove(f->zbuf, f->zbuf + off, f->zbuf_n - off);
+		f->zbuf_n -= off;
+	}
+	free(blk);
+}
+
+static void bseq_fill_gzip(bseq_file_t *f, int64_t want)
+{
+	int64_t end = f->txt_n + want;
+	while (f->txt_n < end) {
+		if (f->zs.avail_in == 0) {
+			if (f->zeof) break;
+			f->zbuf_n = 0;
+			bseq_read_raw(f, BSEQ_READ_SIZE);
+			f->zs.next_in = f->zbuf, f->zs.avail_in = f->zbuf_n;
+			if (f->zbuf_n == 0) break;
+		}
+		if (f->zs_end) inflateReset(&f->zs), f->zs_end = 0; // next gzip member
+		f->txt = (char*) bseq_grow(f->txt, &f->txt_m, f->txt_n + BSEQ_READ_SIZE + 1, 1);
+		f->zs.next_out = (Bytef*) f->txt + f->txt_n;
+		f->zs.avail_out = f->txt_m - f->txt_n - 1;
+		int ret = inflate(&f->zs, Z_NO_FLUSH);
+		f->txt_n = (char*) f->zs.next_out - f->txt;
+		if (ret == Z_STREAM_END) f->zs_end = 1;
+		else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			fprintf(stderr, "[E::%s] gzip inflate error %d\n", __func__, ret);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static void bseq_fill(bseq_reader_t *r, bseq_file_t *f, int64_t want)
+{
+	if (f->fmt == BSEQ_BGZF) bseq_fill_bgzf(r, f, want);
+	else if (f->fmt == BSEQ_GZIP) bseq_fill_gzip(f, want);
+	else if (f->fmt == BSEQ_MMAP) { // widen the window; the kernel reads ahead of it
+		int64_t pg = sysconf(_SC_PAGESIZE), b = f->txt_n / pg * pg;
+		f->txt_n = f->txt_n + want < f->map_len? f->txt_n + want : f->map_len;
+		madvise(f->txt + b, f->txt_n - b, MADV_WILLNEED);
+	}
+	else {
+		// plain text is read into zbuf and handed over as is
+		f->zbuf = (uint8_t*) f->txt, f->zbuf_n = f->txt_n, f->zbuf_m = f->txt_m;
+		if (!f->zeof) bseq_read_raw(f, want);
+		f->txt = (char*) f->zbuf, f->txt_n = f->zbuf_n, f->txt_m = f->zbuf_m;
+		f->zbuf = 0, f->zbuf_n = f->zbuf_m = 0;
+	}
+}
+
+/***************
+ * Parsing     *
+ ***************/
+
+static inline const char *bseq_eol(const char *t, int64_t p, int64_t n)
+{
+	return p < n? (const char*) memchr(t + p, '\n', n - p) : 0;
+}
+
+static void bseq_malformed(const char *t, int64_t b)
+{
+	fprintf(stderr, "[E::bseq_read_par] malformed or multi-line FASTQ record at '%.32s'. "
+			"Run without -J for such input.\n", t + b);
+	exit(EXIT_FAILURE);
+}
+
+/* Returns the start of the next record, -1 if the record is not complete in t[0, n) */
+static int64_t bseq_parse_fq(const char *t, int64_t n, int64_t b, int text_done, bseq_rec_t *r)
+{
+	const char *p;
+	int64_t l1, l2, l3, l4;
+	if ((p = bseq_eol(t, b, n)) == 0) return -1;
+	l1 = p - t;
+	if ((p = bseq_eol(t, l1 + 1, n)) == 0) return -1;
+	l2 = p - t;
+	if (l2 + 1 >= n) return -1;
+	if (t[l2 + 1] != '+') bseq_malformed(t, b);
+	if ((p = bseq_eol(t, l2 + 1, n)) == 0) return -1;
+	l3 = p - t;
+	if ((p = bseq_eol(t, l3 + 1, n)) == 0) {
+		if (!text_done) return -1;
+		l4 = n;
+	} else l4 = p - t;
+
+	// same '\r' handling as ks_getuntil_line2()
+	int sl = l2 - l1 - 1, ql = l4 - l3 - 1;
+	if (sl > 1 && t[l2 - 1] == '\r') --sl;
+	if (ql > 1 && t[l4 - 1] == '\r') --ql;
+	if (sl != ql) bseq_malformed(t, b);
+	r->b = b, r->he = l1 - b;
+	r->sb = l1 + 1 - b, r->se = r->sb + sl;
+	r->qb = l3 + 1 - b, r->l_seq = sl;
+	return l4 + 1 < n? l4 + 1 : n;
+}
+
+static int64_t bseq_parse_fa(const char *t, int64_t n, int64_t b, int text_done, bseq_rec_t *r)
+{
+	const char *p;
+	int64_t l1, q;
+	int l_seq = 0;
+	if ((p = bseq_eol(t, b, n)) == 0) {
+		if (!text_done) return -1;
+		l1 = n;
+	} else l1 = p - t;
+	for (q = l1 + 1; q < n && t[q] != '>'; ) {
+		int64_t e;
+		if ((p = bseq_eol(t, q, n)) == 0) {
+			if (!text_done) return -1;
+			e = n;
+		} else e = p - t;
+		int ll = e - q;
+		if (ll > 1 && t[e - 1] == '\r') --ll;
+		l_seq += ll;
+		q = e + 1;
+	}
+	if (q >= n && !text_done) return -1; // more sequence lines may follow
+	r->b = b, r->he = l1 - b;
+	r->sb = l1 + 1 - b, r->se = (q < n? q : n) - b;
+	r->qb = -1, r->l_seq = l_seq;
+	return q < n? q : n;
+}
+
+/* First record starting in [p, n), n if none. A quality line may start with '@',
+   but then the line two below it is a sequence, never a '+' line. */
+static int64_t bseq_find_rec(const bseq_file_t *f, int64_t p)
+{
+	const char *t = f->txt, *q;
+	int64_t n = f->txt_n;
+	if (p > 0 && t[p - 1] != '\n') {
+		if ((q = bseq_eol(t, p, n)) == 0) return n;
+		p = q - t + 1;
+	}
+	while (p < n) {
+		if (f->is_fa) {
+			if (t[p] == '>') return p;
+		} else if (t[p] == '@') {
+			const char *q2;
+			if ((q = bseq_eol(t, p, n)) == 0) return n;
+			if ((q2 = bseq_eol(t, q - t + 1, n)) == 0) return n;
+			if (q2 + 1 < t + n && q2[1] == '+') return p;
+		}
+		if ((q = bseq_eol(t, p, n)) == 0) return n;
+		p = q - t + 1;
+	}
+	return n;
+}
+
+static void bseq_parse_worker(void *data, long st, long n, int tid)
+{
+	bseq_parse_t *j = (bseq_parse_t*) data;
+	const bseq_file_t *f = j->f;
+	for (long i = st; i < st + n; ++i) {
+		bseq_seg_t *s = &j->seg[i];
+		int64_t p = s->b;
+		int last = (s->e == f->txt_n); // may end in an incomplete record
+		while (p < s->e) {
+			bseq_rec_t r;
+			int64_t q = f->is_fa? bseq_parse_fa(f->txt, f->txt_n, p, j->text_done, &r)
+								: bseq_parse_fq(f->txt, f->txt_n, p, j->text_done, &r);
+			if (q < 0) {
+				if (!last) bseq_malformed(f->txt, p);
+				break;
+			}
+			s->a = (bseq_rec_t*) bseq_grow(s->a, &s->m, s->n + 1, sizeof(bseq_rec_t));
+			s->a[s->n++] = r;
+			while (q < f->txt_n && (f->txt[q] == '\n' || f->txt[q] == '\r')) ++q; // blank lines
+			p = q;
+		}
+		s->stop = p;
+	}
+}
+
+static void bseq_parse(bseq_reader_t *r, bseq_file_t *f)
+{
+	int64_t len, i;
+	int text_done = bseq_text_done(f);
+
+	if (f->parsed == 0 && f->n_txt == 0) { // start of the file
+		while (f->parsed < f->txt_n && f->txt[f->parsed] != '@' && f->txt[f->parsed] != '>') ++f->parsed;
+		if (f->parsed < f->txt_n) f->is_fa = (f->txt[f->parsed] == '>');
+	}
+	len = f->txt_n - f->parsed;
+	if (len <= 0) return;
+
+	int n_seg = len / BSEQ_SEG_SIZE < r->n_threads? len / BSEQ_SEG_SIZE : r->n_threads;
+	if (n_seg < 1) n_seg = 1;
+	bseq_seg_t *seg = (bseq_seg_t*) calloc(n_seg, sizeof(bseq_seg_t));
+	assert(seg != NULL);
+	seg[0].b = f->parsed;
+	for (i = 1; i < n_seg; ++i) {
+		int64_t b = bseq_find_rec(f, f->parsed + len / n_seg * i);
+		seg[i].b = b > seg[i-1].b? b : seg[i-1].b;
+		seg[i-1].e = seg[i].b;
+	}
+	seg[n_seg-1].e = f->txt_n;
+
+	bseq_parse_t j = {f, seg, n_seg, text_done};
+	kt_pool_for(r->pool, bseq_parse_worker, &j, n_seg, 1);
+
+	int64_t n_new = 0, stop = -1;
+	for (i = 0; i < n_seg; ++i) {
+		n_new += seg[i].n;
+		if (stop < 0 && seg[i].e == f->txt_n) stop = seg[i].stop;
+	}
+	f->recs = (bseq_rec_t*) bseq_grow(f->recs, &f->m_rec, f->n_rec + n_new, sizeof(bseq_rec_t));
+	for (i = 0; i < n_seg; ++i) {
+		for (int64_t k = 0; k < seg[i].n; ++k) f->n_base += seg[i].a[k].l_seq;
+		memcpy(f->recs + f->n_rec, seg[i].a, seg[i].n * sizeof(bseq_rec_t));
+		f->n_rec += seg[i].n;
+		free(seg[i].a);
+	}
+	free(seg);
+
+	if (text_done && stop < f->txt_n) {
+		fprintf(stderr, "[W::%s] truncated record at the end of input is ignored.\n", __func__);
+		stop = f->txt_n;
+	}
+	f->n_txt += stop - f->parsed;
+	f->parsed = stop;
+	if (text_done && f->parsed == f->txt_n) f->eof = 1;
+}
+
+/* Makes at least k+1 unread records available; rem is the number of bases still
+   wanted from this file and sizes the next refill. */
+static int bseq_has(bseq_reader_t *r, bseq_file_t *f, int64_t k, int64_t rem)
+{
+	while (f->head + k >= f->n_rec) {
+		if (f->eof) return 0;
+		double bpb = f->n_base > 0? (double) f->n_txt / f->n_base : 2.5;
+		int64_t want = rem > 0? (int64_t) (rem * bpb * 1.0625) : 0;
+		bseq_fill(r, f, want > BSEQ_READ_SIZE? want : BSEQ_READ_SIZE);
+		bseq_parse(r, f);
+	}
+	return 1;
+}
+
+/* Drops the text of the records handed out so far */
+static void bseq_compact(bseq_file_t *f)
+{
+	int64_t keep = f->head < f->n_rec? f->recs[f->head].b : f->parsed;
+	if (f->fmt == BSEQ_MMAP) keep = 0; // records point into the mapping until they are written
+	if (keep > 0) {
+		memmove(f->txt, f->txt + keep, f->txt_n - keep);
+		f->txt_n -= keep, f->parsed -= keep;
+	}
+	memmove(f->recs, f->recs + f->head, (f->n_rec - f->head) * sizeof(bseq_rec_t));
+	f->n_rec -= f->head, f->head = 0;
+	for (int64_t i = 0; i < f->n_rec; ++i) f->recs[i].b -= keep;
+}
+
+/***************
+ * Copying     *
+ ***************/
+
+static inline const bseq_rec_t *bseq_rec_at(const bseq_reader_t *r, long i, const bseq_file_t **f)
+{
+	if (r->f[1]) {
+		*f = r->f[i & 1];
+		return &(*f)->recs[(*f)->head + (i >> 1)];
+	}
+	*f = r->f[0];
+	return &(*f)->recs[(*f)->head + i];
+}
+
+/* Same fields as kseq_read() + trim_readno() + kseq2bseq1() */
+static void bseq_copy_worker(void *data, long st, long n, int tid)
+{
+	bseq_copy_t *c = (bseq_copy_t*) data;
+	const bseq_file_t *f;
+	const bseq_rec_t *r;
+	int64_t size = 0;
+	long i;
+
+	for (i = st; i < st + n; ++i) {
+		r = bseq_rec_at(c->r, i, &f);
+		size += r->he + (f->fmt == BSEQ_MMAP? 1 : 2) * r->l_seq + 4;
+	}
+	char *buf = (char*) malloc(size), *p = buf;
+	assert(buf != NULL);
+
+	for (i = st; i < st + n; ++i) {
+		bseq1_t *s = &c->seqs[i];
+		r = bseq_rec_at(c->r, i, &f);
+		const char *t = f->txt + r->b;
+		int k, l;
+
+		for (k = 1; k < r->he && !isspace(t[k]); ++k);
+		l = k - 1;
+		if (l > 2 && t[k-2] == '/' && isdigit(t[k-1])) l -= 2;
+		s->name = p;
+		memcpy(p, t + 1, l), p[l] = 0, p += l + 1;
+
+		s->comment = 0;
+		if (k < r->he) {
+			int e = r->he;
+			if (e - k - 1 > 1 && t[e-1] == '\r') --e;
+			if (e > k + 1) {
+				s->comment = p;
+				memcpy(p, t + k + 1, e - k - 1), p[e - k - 1] = 0, p += e - k;
+			}
+		}
+
+		s->seq = p;
+		if (r->qb >= 0) memcpy(p, t + r->sb, r->l_seq), p += r->l_seq;
+		else { // FASTA lines
+			for (int q = r->sb; q < r->se; ) {
+				const char *e = (const char*) memchr(t + q, '\n', r->se - q);
+				int ll = e? e - t - q : r->se - q;
+				int nl = ll;
+				if (ll > 1 && t[q + ll - 1] == '\r') --ll;
+				memcpy(p, t + q, ll), p += ll;
+				q += nl + 1;
+			}
+		}
+		*p++ = 0;
+
+		s->qual = 0;
+		if (f->fmt == BSEQ_MMAP) { // the mapping stays read-only; see mem_kernel1_core()
+			for (k = 0; k < r->l_seq; ++k) s->seq[k] = nst_nt4_table[(uint8_t) s->seq[k]];
+			if (r->qb >= 0 && r->l_seq > 0) s->qual = (char*) t + r->qb; // not NUL-terminated
+		} else if (r->qb >= 0 && r->l_seq > 0) {
+			s->qual = p;
+			memcpy(p, t + r->qb, r->l_seq), p[r->l_seq] = 0, p += r->l_seq + 1;
+		}
+
+		s->l_seq = r->l_seq;
+		s->id = i;
+		s->sam = NULL;
+		s->l_sam = 0;
+		s->strbuf = (i == st)? buf : NULL;
+#ifdef PERFECT_MATCH
+		s->perfect.exist = 0;
+#endif
+	}
+}
+
+/***************
+ * Interface   *
+ ***************/
+
+static bseq_file_t *bseq_file_init(int fd)
+{
+	bseq_file_t *f = (bseq_file_t*) calloc(1, sizeof(bseq_file_t));
+	assert(f != NULL);
+	f->fd = fd;
+
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && lseek(fd, 0, SEEK_CUR) == 0) {
+		uint8_t z[2] = {0, 0};
+		if (pread(fd, z, 2, 0) == 2 && !(z[0] == 31 && z[1] == 139)) {
+			void *m = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (m != MAP_FAILED) {
+				madvise(m, st.st_size, MADV_SEQUENTIAL);
+				f->fmt = BSEQ_MMAP, f->zeof = 1;
+				f->txt = (char*) m, f->map_len = st.st_size;
+				return f;
+			}
+		}
+	}
+	bseq_read_raw(f, BGZF_HDR_SIZE);
+	const uint8_t *z = f->zbuf;
+	if (f->zbuf_n >= 2 && z[0] == 31 && z[1] == 139) {
+		if (f->zbuf_n == BGZF_HDR_SIZE && (z[3] & 4) && z[10] == 6 && z[11] == 0 && z[12] == 'B' && z[13] == 'C')
+			f->fmt = BSEQ_BGZF;
+		else {
+			f->fmt = BSEQ_GZIP;
+			if (inflateInit2(&f->zs, 16 + MAX_WBITS) != Z_OK) {
+				fprintf(stderr, "[E::%s] failed to initialize zlib\n", __func__);
+				exit(EXIT_FAILURE);
+			}
+			f->zs.next_in = f->zbuf, f->zs.avail_in = f->zbuf_n;
+		}
+	} else {
+		f->fmt = BSEQ_PLAIN;
+		f->txt = (char*) f->zbuf, f->txt_n = f->zbuf_n, f->txt_m = f->zbuf_m;
+		f->zbuf = 0, f->zbuf_n = f->zbuf_m = 0;
+	}
+	return f;
+}
+
+static void bseq_file_destroy(bseq_file_t *f)
+{
+	if (f == NULL) return;
+	if (f->fmt == BSEQ_GZIP) inflateEnd(&f->zs);
+	if (f->fmt == BSEQ_MMAP) munmap(f->txt, f->map_len), f->txt = 0;
+	free(f->zbuf); free(f->txt); free(f->recs);
+	free(f);
+}
+
+bseq_reader_t *bseq_reader_init(int fd1, int fd2, int n_threads)
+{
+	bseq_reader_t *r = (bseq_reader_t*) calloc(1, sizeof(bseq_reader_t));
+	assert(r != NULL);
+	r->n_threads = n_threads > 0? n_threads : 1;
+	r->pool = kt_pool_init(r->n_threads, 0);
+	r->zs = (z_stream*) calloc(r->n_threads, sizeof(z_stream));
+	assert(r->zs != NULL);
+	for (int i = 0; i < r->n_threads; ++i) {
+		if (inflateInit2(&r->zs[i], -15) != Z_OK) {
+			fprintf(stderr, "[E::%s] failed to initialize zlib\n", __func__);
+			exit(EXIT_FAILURE);
+		}
+	}
+	r->f[0] = bseq_file_init(fd1);
+	r->f[1] = fd2 >= 0? bseq_file_init(fd2) : 0;
+	return r;
+}
+
+void bseq_reader_destroy(bseq_reader_t *r)
+{
+	if (r == NULL) return;
+	for (int i = 0; i < r->n_threads; ++i) inflateEnd(&r->zs[i]);
+	free(r->zs);
+	kt_pool_destroy(r->pool);
+	bseq_file_destroy(r->f[0]);
+	bseq_file_destroy(r->f[1]);
+	free(r);
+}
+
+bseq1_t *bseq_read_par(bseq_reader_t *r, int64_t chunk_size, int *n_, int64_t *s)
+{
+	bseq_file_t *f1 = r->f[0], *f2 = r->f[1];
+	int64_t size = 0, n = 0, k = 0;
+	bseq1_t *seqs = 0;
+
+	bseq_compact(f1);
+	if (f2) bseq_compact(f2);
+
+	for (;; ++k) {
+		int64_t rem = f2? (chunk_size - size) / 2 : chunk_size - size;
+		if (!bseq_has(r, f1, k, rem)) break;
+		if (f2 && !bseq_has(r, f2, k, rem)) {
+			fprintf(stderr, "[W::%s] the 2nd file has fewer sequences.\n", __func__);
+			break;
+		}
+		size += f1->recs[f1->head + k].l_seq, ++n;
+		if (f2) size += f2->recs[f2->head + k].l_seq, ++n;
+		if (size >= chunk_size && (n&1) == 0) { ++k; break; }
+	}
+	if (size == 0) { // test if the 2nd file is finished
+		if (f2 && bseq_has(r, f2, 0, 0))
+			fprintf(stderr, "[W::%s] the 1st file has fewer sequences.\n", __func__);
+	}
+
+	if (n > 0) {
+		seqs = (bseq1_t*) malloc(n * sizeof(bseq1_t));
+		assert(seqs != NULL);
+		bseq_copy_t c = {r, seqs};
+		kt_pool_for(r->pool, bseq_copy_worker, &c, n, BSEQ_COPY_BATCH);
+		for (int64_t i = 0; i < k; ++i) {
+			r->n_txt += f1->recs[f1->head + i].he + 2 * f1->recs[f1->head + i].l_seq;
+			if (f2) r->n_txt += f2->recs[f2->head + i].he + 2 * f2->recs[f2->head + i].l_seq;
+		}
+		f1->head += k;
+		if (f2) f2->head += k;
+	}
+	*n_ = n;
+	*s = size;
+	return seqs;
+}
+
+#endif /* OPT_RW */
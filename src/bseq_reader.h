@@ -0,0 +1,111 @@
+/*************************************************************************************
+                           The MIT License
+
+   BWA-MEM-SCALE (Memory-Scalable Sequence alignment using Burrows-Wheeler Transform),
+   Copyright (C) 2022 Electronics and Telecommunications Research Institute (ETRI), Changdae Kim.
+
+   Permission is hereby granted, free of charge, to any person obtaining
+   a copy of this software and associated documentation files (the
+   "Software"), to deal in the Software without restriction, including
+   without limitation the rights to use, copy, modify, merge, publish,
+   distribute, sublicense, and/or sell copies of the Software, and to
+   permit persons to whom the Software is furnished to do so, subject to
+   the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+
+   Contacts: Changdae Kim <cdkim@etri.re.kr>
+
+** This software builds upon BWA-MEM2, and includes several performance optimization techniques.
+   For BWA-MEM2, refer to the follows.
+
+   BWA-MEM2 (Sequence alignment using Burrows-Wheeler Transform)
+   Copyright ⓒ 2019 Intel Corporation, Heng Li
+   The MIT License
+   Website: https://github.com/bwa-mem2/bwa-mem2
+
+*****************************************************************************************/
+
+#ifndef BSEQ_READER_HPP
+#define BSEQ_READER_HPP
+
+#include <stdint.h>
+#include <zlib.h>
+#include "bwa.h"
+#include "kthread.h"
+
+#ifdef OPT_RW
+
+/* Multi-threaded replacement of bseq_read_orig() for the read step ('mem -J').
+   BGZF blocks are inflated in parallel (plain gzip is inflated serially, it has
+   no independent blocks), then record boundaries are located, parsed and copied
+   into per-task strbufs in parallel. Only 4-line FASTQ and FASTA are accepted.
+   Chunks are cut at exactly the same reads as bseq_read_orig() does.
+
+   An uncompressed regular file is mapped read-only instead (BSEQ_MMAP): qual
+   points into the mapping, and seq is 2-bit encoded into the strbuf while it
+   is copied. Only names and comments are copied, since they must be
+   NUL-terminated. */
+
+enum bseq_fmt {
+	BSEQ_PLAIN = 0,
+	BSEQ_GZIP,
+	BSEQ_BGZF,
+	BSEQ_MMAP,
+};
+
+typedef struct {
+	int64_t b;                  // offset of '@' or '>' in the text buffer
+	int he;                     // end of the header line, relative to b
+	int sb, se;                 // sequence line(s), relative to b
+	int qb;                     // quality line relative to b, -1 for FASTA
+	int l_seq;
+} bseq_rec_t;
+
+typedef struct {
+	int fd;
+	int fmt;                    // see enum bseq_fmt
+	int is_fa;
+	int zeof;                   // no more bytes from fd
+	int eof;                    // all text is inflated and parsed
+
+	uint8_t *zbuf;              // compressed bytes not inflated yet
+	int64_t zbuf_n, zbuf_m;
+	z_stream zs;                // BSEQ_GZIP only
+	int zs_end;
+
+	char *txt;                  // inflated text, or the mapped file with BSEQ_MMAP
+	int64_t txt_n, txt_m;       // with BSEQ_MMAP, txt_n is the end of the window parsed so far
+	int64_t map_len;
+	int64_t parsed;             // txt[0, parsed) is split into recs
+
+	bseq_rec_t *recs;
+	int64_t n_rec, m_rec, head; // recs[head, n_rec) are not handed out yet
+
+	int64_t n_txt, n_base;      // parsed so far; text bytes per base estimate
+} bseq_file_t;
+
+typedef struct {
+	int n_threads;
+	kt_pool_t *pool;
+	z_stream *zs;               // one raw inflate stream per pool worker
+	bseq_file_t *f[2];
+	int64_t n_txt;              // total text bytes handed out, for 'bench input'
+} bseq_reader_t;
+
+bseq_reader_t *bseq_reader_init(int fd1, int fd2, int n_threads);
+void bseq_reader_destroy(bseq_reader_t *r);
+bseq1_t *bseq_read_par(bseq_reader_t *r, int64_t chunk_size, int *n_, int64_t *s);
+
+#endif /* OPT_RW */
+#endif
@@ -146,7 +146,7 @@ static inline void kseq2bseq1(const kseq_t *ks, bseq1_t *s)
     s->comment = ks->comment.l? strdup(ks->comment.s) : 0;
     s->seq = strdup(ks->seq.s);
     s->qual = ks->qual.l? strdup(ks->qual.s) : 0;
-    s->l_seq = strnlen_s(s->seq, READ_LEN);
+    s->l_seq = ks->seq.l;
 }
 #endif
 
@@ -305,6 +305,7 @@ bseq1_t *bseq_read_orig(int64_t chunk_size, int *n_, void *ks1_, void *ks2_, int
         //}
 #ifdef OPT_RW
 		seqs[n].sam = NULL;
+		seqs[n].l_sam = 0;
 #endif
 #ifdef PERFECT_MATCH
 		seqs[n].perfect.exist = 0;
@@ -319,6 +320,13 @@ bseq1_t *bseq_read_orig(int64_t chunk_size, int *n_, void *ks1_, void *ks2_, int
             kseq2bseq1(ks2, &seqs[n]);
 #endif
             seqs[n].id = n;
+#ifdef OPT_RW
+            seqs[n].sam = NULL;
+            seqs[n].l_sam = 0;
+#endif
+#ifdef PERFECT_MATCH
+            seqs[n].perfect.exist = 0;
+#endif
             size += seqs[n++].l_seq;
         }
         if (size >= chunk_size && (n&1) == 0) break;
@@ -77,7 +77,8 @@ typedef struct {
 	int l_seq, id;
 #ifdef OPT_RW
 	char *strbuf; /* for name, comment, seq, qual, sam */
-	/* sam is not null only if id % BATCH_SIZE == 0 */
+	/* sam is not null only for the first read of each kt_for() block */
+	int l_sam; /* length of sam; BGZF blocks with MEM_F_BAM, 0 for a per-read string */
 #endif
 	char *name, *comment, *seq, *qual, *sam;
 #ifdef PERFECT_MATCH
@@ -115,7 +116,7 @@ extern "C" {
 							 int *n_cigar, int *NM);
 
 	int bwa_idx_build(const char *fa, const char *prefix, int algo_type, int block_size);
-	int bwa_idx_build_mem2(const char *fa, const char *prefix);
+	int bwa_idx_build_mem2(const char *fa, const char *prefix, int n_threads, int sa_compx);
 
 	char *bwa_idx_infer_prefix(const char *hint);
 	bwt_t *bwa_idx_load_bwt(const char *hint);
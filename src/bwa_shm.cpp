@@ -75,7 +75,7 @@ static const char *mmap_prefix = NULL;
 
 void *__load_file(const char *prefix, const char *postfix, void *buf, size_t *size);
 int __bwa_shm_load(const char *prefix, enum hugetlb_mode huge_mode, int huge_force,
-			int pt_seed_len, int pt_mmap, size_t gb_limit);
+			int pt_seed_len, int pt_mmap, size_t gb_limit, int sa_compx);
 
 int use_mmap(int m) {
 #ifdef PERFECT_MATCH
@@ -125,10 +125,13 @@ char *bwa_shm_mmap_filename(int m, char *buf) {
 #endif
 #ifdef SMEM_ACCEL
 	} else if (m == BWA_SHM_SALL) {
-		snprintf(buf, PATH_MAX, "%s.all_smem.%d", mmap_prefix, ALL_SMEM_MAX_BP);
+		snprintf(buf, PATH_MAX, "%s.all_smem.%d", mmap_prefix, bwa_shm_smem_all_len());
 		return buf;
 	} else if (m == BWA_SHM_SLAST) {
-		snprintf(buf, PATH_MAX, "%s.all_smem.%d", mmap_prefix, LAST_SMEM_MAX_BP);
+		snprintf(buf, PATH_MAX, "%s.last_smem.%d", mmap_prefix, bwa_shm_smem_last_len());
+		return buf;
+	} else if (m == BWA_SHM_HIOCC) {
+		snprintf(buf, PATH_MAX, "%s.hiocc.%d", mmap_prefix, bwa_shm_hiocc_len());
 		return buf;
 #endif
 	} else {
@@ -149,6 +152,7 @@ static const char *bwa_shm_type_str[] = {
 #ifdef SMEM_ACCEL
 	"SMEM_ALL",
 	"SMEM_LAST",
+	"HIOCC",
 #endif
 	"others"
 };
@@ -166,6 +170,7 @@ static const char *bwa_shm_name_str[] = {
 #ifdef SMEM_ACCEL
 	"bwa_mem_large_smem_all",
 	"bwa_mem_large_smem_last",
+	"bwa_mem_large_hiocc",
 #endif
 };
 
@@ -183,6 +188,7 @@ static const char *bwa_shm_huge_name_str[] = {
 #ifdef SMEM_ACCEL
 	BWA_SHM_HUGE_DIR "/bwa_mem_large_smem_all",
 	BWA_SHM_HUGE_DIR "/bwa_mem_large_smem_last",
+	BWA_SHM_HUGE_DIR "/bwa_mem_large_hiocc",
 #endif
 };
 
@@ -227,11 +233,11 @@ void show_bwa_shm_info(bwa_shm_info_t *info, const char *name) {
 					info->state, info->num_map_read, info->num_map_manager,
 					info->hugetlb_flags, info->useErt);
 #ifdef MEMSCALE
-	fprintf(stderr, "[BWA_SHM_INFO] [memscale] bwt: %d pac: %d ref: %d kmer: %d mlt: %d perfect: %d smem_all: %d smem_last: %d\n",
+	fprintf(stderr, "[BWA_SHM_INFO] [memscale] bwt: %d pac: %d ref: %d kmer: %d mlt: %d perfect: %d smem_all: %d smem_last: %d hiocc: %d\n",
 					info->bwt_on, info->pac_on, info->ref_on, 
 					info->kmer_on, info->mlt_on,
 					info->perfect_on,
-					info->smem_all_on, info->smem_last_on);
+					info->smem_all_on, info->smem_last_on, info->hiocc_on);
 #endif
 #ifdef PERFECT_MATCH
 	fprintf(stderr, "[BWA_SHM_INFO] perfect_mmap: %d perfect_seed_len: %d perfect_num_loc: %u perfect_num_seed: %u\n",
@@ -239,10 +245,22 @@ void show_bwa_shm_info(bwa_shm_info_t *info, const char *name) {
 					info->pt_seed_len,
 					info->pt_num_loc_entry,
 					info->pt_num_seed_entry);
+	if (info->pt_family_n > 1) {
+		int i;
+		fprintf(stderr, "[BWA_SHM_INFO] perfect_family:");
+		for (i = 0; i < info->pt_family_n; ++i)
+			fprintf(stderr, " %d", info->pt_family_len[i]);
+		fprintf(stderr, " (%.2fGB before the last one)\n", B2GB_DOUBLE(info->pt_family_size));
+	}
 #endif
 #ifdef MEMSCALE
 	fprintf(stderr, "[BWA_SHM_INFO] [memscale] perfect_num_seed_load: %u\n",
 					info->pt_num_seed_entry_loaded);
+#endif
+	fprintf(stderr, "[BWA_SHM_INFO] sa_compx: %d\n", info->sa_compx);
+#ifdef SMEM_ACCEL
+	fprintf(stderr, "[BWA_SHM_INFO] smem_all_len: %d smem_last_len: %d hiocc_len: %d\n",
+					info->smem_all_len, info->smem_last_len, info->hiocc_len);
 #endif
 	fprintf(stderr, "[BWA_SHM_INFO] reference_len: %ld ref_file_name(%d): %s\n",
 					info->reference_len, info->ref_file_name_len, info->ref_file_name);
@@ -321,7 +339,7 @@ static size_t get_bwa_shm_size(int m) {
 						break;
 
 	case BWA_SHM_BWT:	if (info->bwt_on)
-							size = bwa_shm_size_bwt(info->reference_len);
+							size = bwa_shm_size_bwt(info->reference_len, info->sa_compx);
 						break;
 
 	case BWA_SHM_PAC:	if (info->pac_on)
@@ -342,16 +360,20 @@ static size_t get_bwa_shm_size(int m) {
 
 #ifdef PERFECT_MATCH
 	case BWA_SHM_PERFECT: if (info->perfect_on)
-							size = ____lpt_shm_size(info->pt_num_loc_entry, 
+							size = info->pt_family_size
+									+ ____lpt_shm_size(info->pt_num_loc_entry, 
 												  info->pt_num_seed_entry_loaded);
 						break;
 #endif
 #ifdef SMEM_ACCEL
 	case BWA_SHM_SALL:	if (info->smem_all_on)
-							size = bwa_shm_size_sall();
+							size = bwa_shm_size_sall(info->smem_all_len);
 						break;
 	case BWA_SHM_SLAST: if (info->smem_last_on)
-							size = bwa_shm_size_slast();
+							size = bwa_shm_size_slast(info->smem_last_len);
+						break;
+	case BWA_SHM_HIOCC: if (info->hiocc_on)
+							size = bwa_shm_size_hiocc(info->hiocc_len);
 						break;
 #endif
 	default:
@@ -381,7 +403,7 @@ static size_t get_bwa_shm_size(int m) {
 	case BWA_SHM_INFO: size = bwa_shm_size_info(info->ref_file_name_len);
 						return page_aligned_size(size);
 						break;
-	case BWA_SHM_BWT: size = bwa_shm_size_bwt(info->reference_len);
+	case BWA_SHM_BWT: size = bwa_shm_size_bwt(info->reference_len, info->sa_compx);
 						break;
 	case BWA_SHM_PAC: size = bwa_shm_size_pac(info->reference_len);
 						break;
@@ -392,14 +414,18 @@ static size_t get_bwa_shm_size(int m) {
 	case BWA_SHM_MLT: size = bwa_shm_size_mlt(info);
 						break;
 #ifdef PERFECT_MATCH
-	case BWA_SHM_PERFECT: size = ____lpt_shm_size(info->pt_num_loc_entry, 
+	case BWA_SHM_PERFECT: size = info->pt_family_size
+								+ ____lpt_shm_size(info->pt_num_loc_entry, 
 												  info->pt_num_seed_entry);
 						break;
 #endif
 #ifdef SMEM_ACCEL
-	case BWA_SHM_SALL: size = bwa_shm_size_sall();
+	case BWA_SHM_SALL: size = bwa_shm_size_sall(info->smem_all_len);
+						break;
+	case BWA_SHM_SLAST: size = bwa_shm_size_slast(info->smem_last_len);
 						break;
-	case BWA_SHM_SLAST: size = bwa_shm_size_slast();
+	case BWA_SHM_HIOCC: if (info->hiocc_len > 0)
+							size = bwa_shm_size_hiocc(info->hiocc_len);
 						break;
 #endif
 	default:
@@ -751,6 +777,10 @@ void bwa_shm_init(const char *prefix, int *useErt, int pt_seed_len,
 	for (m = BWA_SHM_INFO + 1; m < NUM_BWA_SHM; ++m) {
 		if (use_mmap(m)) /* for mmap'ed region, don't check shm_fd here */
 			continue;
+#ifdef SMEM_ACCEL
+		if (m == BWA_SHM_HIOCC && bwa_shm_info->hiocc_len == 0)
+			continue;
+#endif
 
 		if (bwa_shm_info->useErt) {
 			if (m == BWA_SHM_BWT)
@@ -767,7 +797,8 @@ void bwa_shm_init(const char *prefix, int *useErt, int pt_seed_len,
 		fd = bwa_shm_open(m);
 		if (fd < 0) {
 #ifdef MEMSCALE
-			if (m == BWA_SHM_PERFECT || m == BWA_SHM_SALL || m == BWA_SHM_SLAST)
+			if (m == BWA_SHM_PERFECT || m == BWA_SHM_SALL || m == BWA_SHM_SLAST
+					|| m == BWA_SHM_HIOCC)
 				continue;
 #endif
 			fprintf(stderr, "[bwa_shm] failed to get shared memory of %s\n",
@@ -779,6 +810,10 @@ void bwa_shm_init(const char *prefix, int *useErt, int pt_seed_len,
 	for (m = BWA_SHM_INFO + 1; m < NUM_BWA_SHM; ++m) {
 		if (use_mmap(m)) /* for mmap'ed region, don't check mapping here */
 			continue;
+#ifdef SMEM_ACCEL
+		if (m == BWA_SHM_HIOCC && bwa_shm_info->hiocc_len == 0)
+			continue;
+#endif
 
 		if (bwa_shm_info->useErt) {
 			if (m == BWA_SHM_BWT)
@@ -795,7 +830,8 @@ void bwa_shm_init(const char *prefix, int *useErt, int pt_seed_len,
 		if (bwa_shm_map(m) == NULL) 
 		{
 #ifdef MEMSCALE
-			if (m == BWA_SHM_PERFECT || m == BWA_SHM_SALL || m == BWA_SHM_SLAST)
+			if (m == BWA_SHM_PERFECT || m == BWA_SHM_SALL || m == BWA_SHM_SLAST
+					|| m == BWA_SHM_HIOCC)
 				continue;
 #endif
 			fprintf(stderr, "[bwa_shm] failed to map shared memory of %s\n",
@@ -885,11 +921,14 @@ renewal:
 	info->perfect_on = 0;
 	info->smem_all_on = 0;
 	info->smem_last_on = 0;
+	info->hiocc_on = 0;
 	info->pt_num_seed_entry_loaded = 0;
 #endif
 #ifdef PERFECT_MATCH
 	info->pt_num_loc_entry = 0;
 	info->pt_num_seed_entry = 0;
+	info->pt_family_n = 0;
+	info->pt_family_size = 0;
 	if (pt_seed_len > 0
 			&& pt_seed_len != PT_SEED_LEN_NO_TABLE
 			&& pt_seed_len != PT_SEED_LEN_AUTO_TABLE)
@@ -899,6 +938,12 @@ renewal:
 	info->pt_mmap = DEFAULT_MMAP_PERFECT;
 #endif
 
+	info->sa_compx = __load_BWT_sa_compx(prefix);
+#ifdef SMEM_ACCEL
+	info->smem_all_len = smem_table_len(prefix, ".all_smem.", ALL_SMEM_BP);
+	info->smem_last_len = smem_table_len(prefix, ".last_smem.", LAST_SMEM_BP);
+	info->hiocc_len = smem_table_find_len(prefix, ".hiocc.", SMEM_TABLE_MAX_BP);
+#endif
 	info->reference_len = rlen;
 	info->mtim_ref = mtim_ref;
 	info->ref_file_name_len = abs_path_len;
@@ -916,7 +961,7 @@ renewal:
 #ifdef MEMSCALE
 	if (mode == BWA_SHM_INIT_READ) {
 		__bwa_shm_load(prefix, BWA_SHM_NORMAL_PAGE, 0,
-				info->pt_seed_len, info->pt_mmap, 0);
+				info->pt_seed_len, info->pt_mmap, 0, -1);
 		bwa_shm_mode = BWA_SHM_MATCHED;
 	}
 #endif
@@ -1371,6 +1416,40 @@ static size_t get_perfect_table_size(const char *prefix, int seed_len,
 
 	return size_head + size_loc + size_seed;
 }
+
+/* the seed lengths of the family to load. the family is given by parse_perfect_family(),
+   or it has only pt_seed_len. */
+static int get_perfect_family(int pt_seed_len, int *lens) {
+	if (pt_seed_len <= 0 
+			|| pt_seed_len == PT_SEED_LEN_NO_TABLE
+			|| pt_seed_len == PT_SEED_LEN_AUTO_TABLE)
+		return 0;
+
+	if (perfect_family_n > 0 && perfect_family_len[0] == pt_seed_len) {
+		memcpy(lens, perfect_family_len, sizeof(int) * perfect_family_n);
+		return perfect_family_n;
+	}
+
+	lens[0] = pt_seed_len;
+	return 1;
+}
+
+static inline void set_perfect_family_info(bwa_shm_info_t *info, const int *lens, int n,
+									const uint32_t *num_loc, const uint32_t *num_seed, 
+									size_t size_front) 
+{
+	memcpy(info->pt_family_len, lens, sizeof(int) * n);
+	info->pt_family_n = n;
+	info->pt_family_size = size_front;
+	info->pt_seed_len = n > 0 ? lens[n - 1] : 0;
+	info->pt_num_loc_entry = n > 0 ? num_loc[n - 1] : 0;
+	info->pt_num_seed_entry = n > 0 ? num_seed[n - 1] : 0;
+}
+
+static inline int perfect_family_changed(bwa_shm_info_t *a, bwa_shm_info_t *b) {
+	return a->pt_family_n != b->pt_family_n
+			|| memcmp(a->pt_family_len, b->pt_family_len, sizeof(int) * a->pt_family_n) != 0;
+}
 #endif
 
 static void usage_bwa_shm_load(void)
@@ -1387,7 +1466,7 @@ static void usage_bwa_shm_load(void)
     fprintf(stderr, "    -m                       Modify the loaded index\n");
     fprintf(stderr, "    -g                       The number of gigabytes of memory for index. [0]\n"
 					"                             0 for unlimited. Range for hg38: %lld ~ %lld\n",
-					B2GB(bwa_shm_size_bwt(HG38_RLEN) 
+					B2GB(bwa_shm_size_bwt(HG38_RLEN, SA_COMPX_SPARSE) 
 						+ bwa_shm_size_ref(HG38_RLEN)
 						+ bwa_shm_size_pac(HG38_RLEN)),
 					B2GB(bwa_shm_size_kmer() 
@@ -1398,9 +1477,16 @@ static void usage_bwa_shm_load(void)
 						+ (((HG38_RLEN - 1) / 2) * 11 / 10) * sizeof(seed_entry_t) 
 						+ (((HG38_RLEN - 1) / 2) / 100) * sizeof(uint32_t) * 2)
 					);
+    fprintf(stderr, "    -x INT                   sample the loaded SA every 2^INT rows. It cannot be denser than\n"
+					"                             the index ('index -x'). Default: the densest one from the index\n"
+					"                             up to 2^%d that fits the remaining space of -g.\n", SA_COMPX_SPARSE);
+#else
+    fprintf(stderr, "    -x INT                   sample the loaded SA every 2^INT rows. It cannot be denser than\n"
+					"                             the index ('index -x'). Default: as the index\n");
 #endif
 #ifdef PERFECT_MATCH
-	fprintf(stderr, "    -l INT                   load perfect hash table with the specified seed length\n");
+	fprintf(stderr, "    -l INT[,INT...]          load perfect hash table(s) with the specified seed length(s)\n"
+					"                             With -g, longer ones are loaded first.\n");
 #endif
 }
 
@@ -1446,9 +1532,9 @@ static int __bwa_shm_load_BWT(const char *prefix, size_t size) {
 							int64_t *_count, 
 							CP_OCC **__cp_occ, 
 							int8_t **__sa_ms_byte, uint32_t **__sa_ls_word, 
-							int64_t *_sentinel_index);
+							int64_t *_sentinel_index, int *_sa_compx);
 	
-	if (__load_BWT_on_shm(prefix, NULL, NULL, NULL, NULL, NULL, NULL) != 0) {
+	if (__load_BWT_on_shm(prefix, NULL, NULL, NULL, NULL, NULL, NULL, NULL) != 0) {
 		fprintf(stderr, "ERROR: failed to load shm for BWT index\n");
 		ret = -1;
 	}
@@ -1505,18 +1591,16 @@ static int __bwa_shm_load_mlt(const char *prefix, size_t size) {
 }
 
 #ifdef PERFECT_MATCH
-static int __bwa_shm_load_perfect(const char *prefix, int pt_seed_len, 
+static int __bwa_shm_load_perfect(const char *prefix, const int *lens, int n,
 									uint32_t num_seed_load) 
 {
-	int ____load_perfect_table_on_shm(char *file_name, int len, uint32_t num_seed_load, perfect_table_t **ret_ptr);
+	int ____load_perfect_family_on_shm(const char *prefix, const int *lens, int n,
+									uint32_t num_seed_load, perfect_table_t **pts);
 	
-	char filename[PATH_MAX];
-
-	/* to directly call ____load_perfect_table_on_shm(), it is required to set perfect_table_seed_len. */
-	perfect_table_seed_len = pt_seed_len; 
-	get_perfect_table_filename(filename, prefix, pt_seed_len);
-	if (____load_perfect_table_on_shm(filename, pt_seed_len, num_seed_load, NULL)) {
-		fprintf(stderr, "ERROR: failed to load shm for perfect hash table with seedlen=%d\n", pt_seed_len);
+	/* to directly call ____load_perfect_family_on_shm(), it is required to set perfect_table_seed_len. */
+	perfect_table_seed_len = lens[0]; 
+	if (____load_perfect_family_on_shm(prefix, lens, n, num_seed_load, NULL)) {
+		fprintf(stderr, "ERROR: failed to load shm for perfect hash table with seedlen=%d\n", lens[n - 1]);
 		return -1;
 	}
 	
@@ -1526,11 +1610,12 @@ static int __bwa_shm_load_perfect(const char *prefix, int pt_seed_len,
 
 #ifdef MEMSCALE
 static int __bwa_shm_resize_perfect(const char *prefix, int pt_seed_len,
-									size_t size_head, size_t size_loc,
+									size_t size_front, size_t size_head, size_t size_loc,
 									uint32_t old_num, uint32_t new_num)
 {
-	/* resize the shm */
-	size_t size = size_head + size_loc + sizeof(seed_entry_t) * new_num;
+	/* resize the shm. only the last member of the family is resized. */
+	size_t size = size_front + size_head + size_loc + sizeof(seed_entry_t) * new_num;
+	perfect_table_t *shm_pt = (perfect_table_t *) ((uint8_t *) shm_ptr[BWA_SHM_PERFECT] + size_front);
 
 	/* we cannot resize a shared memory region if hugetlb enabled. */
 	assert(!use_hugetlb(BWA_SHM_PERFECT));
@@ -1554,38 +1639,53 @@ static int __bwa_shm_resize_perfect(const char *prefix, int pt_seed_len,
 			return -1;
 		}
 		
-		__lpt_link_shm_to_pt(&pt, (perfect_table_t *) shm_ptr[BWA_SHM_PERFECT]);
+		__lpt_link_shm_to_pt(&pt, shm_pt);
 		____lpt_load_seed_table(&pt, fp, old_num, new_num);
+		err_fclose(fp);
 	}
+	shm_pt->num_seed_load = new_num;
 	return 0;
 }
 #endif
 
 #ifdef SMEM_ACCEL
 static int __bwa_shm_load_accel(const char *prefix, 
-				const int smem_all_on, const int smem_last_on) 
+				const int smem_all_on, const int smem_all_len,
+				const int smem_last_on, const int smem_last_len) 
 {
 	int _load_smem_table(const char *prefix, 
-						all_smem_t **__all_smem_table, 
-						last_smem_t **__last_smem_table);
+						int all_len, all_smem_t **__all_smem_table, 
+						int last_len, last_smem_t **__last_smem_table);
 	
 	all_smem_t *all_smem_table = NULL;
 	last_smem_t *last_smem_table = NULL;
 
 	if (_load_smem_table(prefix,
-						smem_all_on ? &all_smem_table : NULL,
-						smem_last_on ? &last_smem_table : NULL)) {
+						smem_all_len, smem_all_on ? &all_smem_table : NULL,
+						smem_last_len, smem_last_on ? &last_smem_table : NULL)) {
 		fprintf(stderr, "ERROR: failed to load shm for smem accel index\n");
 		return -1;
 	} else
 		return 0;
 }
+
+static int __bwa_shm_load_hiocc(const char *prefix, const int hiocc_len)
+{
+	int _load_hiocc_table(const char *prefix, int len, hiocc_t **__hiocc_table);
+	hiocc_t *hiocc_table = NULL;
+
+	if (_load_hiocc_table(prefix, hiocc_len, &hiocc_table)) {
+		fprintf(stderr, "ERROR: failed to load shm for high-occurrence k-mer table\n");
+		return -1;
+	} else
+		return 0;
+}
 #endif
 
 int __bwa_shm_load(const char *prefix, 
 						enum hugetlb_mode huge_mode, int huge_force, 
 						int pt_seed_len __maybe_unused, int pt_mmap __maybe_unused,
-						size_t gb_limit __maybe_unused) 
+						size_t gb_limit __maybe_unused, int sa_compx) 
 {
 	int ret = 0;
 	bwa_shm_info_t *old_info;
@@ -1595,12 +1695,18 @@ int __bwa_shm_load(const char *prefix,
 	size_t size_total = 0;
 	size_t size_bwt, size_pac, size_ref;
 	size_t size_kmer, size_mlt;
+	int sa_compx_lo, sa_compx_hi; /* the range of the SA sampling factor to choose from */
 #ifdef PERFECT_MATCH
-	size_t size_pt, size_pt_head, size_pt_loc, size_pt_seed;
-	uint32_t num_pt_loc, num_pt_seed;
+	size_t size_pt, size_pt_front;
+	size_t size_pt_head[PT_FAMILY_MAX], size_pt_loc[PT_FAMILY_MAX], size_pt_seed[PT_FAMILY_MAX];
+	uint32_t num_pt_loc[PT_FAMILY_MAX], num_pt_seed[PT_FAMILY_MAX];
+	int pt_family[PT_FAMILY_MAX], pt_family_n, i;
 #endif
 #ifdef SMEM_ACCEL
-	size_t size_all_smem, size_last_smem;
+	size_t size_all_smem, size_last_smem, size_hiocc;
+#ifdef MEMSCALE
+	int len;
+#endif
 #endif
 #ifdef MEMSCALE
 	size_t size_load = 0;
@@ -1624,13 +1730,33 @@ int __bwa_shm_load(const char *prefix,
 		goto out;
 	}
 
+	/* the SA cannot be denser than the index. -x fixes the sampling factor,
+	   otherwise it is chosen from sa_compx_lo..sa_compx_hi with the memory limit. */
+	sa_compx_lo = __load_BWT_sa_compx(prefix);
+	if (sa_compx >= 0) {
+		if (sa_compx < sa_compx_lo) {
+			fprintf(stderr, "ERROR: the SA of the index is sampled every 2^%d rows. "
+							"It cannot be loaded denser (-x %d).\n", sa_compx_lo, sa_compx);
+			ret = -1;
+			goto out;
+		}
+		sa_compx_lo = sa_compx_hi = sa_compx;
+	} else {
+#ifdef MEMSCALE
+		sa_compx_hi = sa_compx_lo > SA_COMPX_SPARSE ? sa_compx_lo : SA_COMPX_SPARSE;
+#else
+		sa_compx_hi = sa_compx_lo;
+#endif
+	}
+
 reset_newinfo:
 	/* set new info */
 	new_info->hugetlb_flags = get_hugetlb_flag(huge_mode);
+	new_info->sa_compx = sa_compx_hi;
 
 	huge_unit = get_hugetlb_unit(huge_mode);
 
-	size_bwt = __aligned_size(bwa_shm_size_bwt(bwa_shm_rlen()), huge_unit);
+	size_bwt = __aligned_size(bwa_shm_size_bwt(bwa_shm_rlen(), sa_compx_hi), huge_unit);
 	size_pac = __aligned_size(bwa_shm_size_pac(bwa_shm_rlen()), huge_unit);
 	size_ref = __aligned_size(bwa_shm_size_ref(bwa_shm_rlen()), huge_unit);
 	size_kmer = __aligned_size(bwa_shm_size_kmer(), huge_unit);
@@ -1641,30 +1767,43 @@ reset_newinfo:
 		size_total = size_pac + size_ref + size_kmer + size_mlt;
 
 #ifdef PERFECT_MATCH
-	if (pt_seed_len > 0) {
-		size_pt = get_perfect_table_size(prefix, pt_seed_len,
-									&size_pt_head, &size_pt_loc, &size_pt_seed,
-									&num_pt_loc, &num_pt_seed);
+	pt_family_n = get_perfect_family(pt_seed_len, pt_family);
+	size_pt = 0;
+	size_pt_front = 0;
+	for (i = 0; i < pt_family_n; ++i) {
+		size_t size = get_perfect_table_size(prefix, pt_family[i],
+									&size_pt_head[i], &size_pt_loc[i], &size_pt_seed[i],
+									&num_pt_loc[i], &num_pt_seed[i]);
+		if (size == 0) {
+			pt_family_n = i;
+			break;
+		}
+		if (i < pt_family_n - 1)
+			size_pt_front += size;
+		size_pt += size;
+	}
+	if (pt_family_n > 0) {
 		size_pt = __aligned_size(size_pt, huge_unit);
 		size_total += size_pt;
-		new_info->pt_num_loc_entry = num_pt_loc;  
-		new_info->pt_num_seed_entry = num_pt_seed;  
 	} else {
 		fprintf(stderr, "[memscale] Read length is not given. Perfect match table will not be used.\n");
 		size_pt = 0;
-		size_pt_head = 0;
-		size_pt_loc = 0;
-		size_pt_seed = 0;
+		size_pt_front = 0;
 	}
 	new_info->pt_mmap = pt_mmap;
-	new_info->pt_seed_len = pt_seed_len;
-	new_info->pt_num_loc_entry = num_pt_loc;  
-	new_info->pt_num_seed_entry = num_pt_seed;  
+	set_perfect_family_info(new_info, pt_family, pt_family_n, 
+							num_pt_loc, num_pt_seed, size_pt_front);
 #endif
 #ifdef SMEM_ACCEL
-	size_all_smem = __aligned_size(ALL_SMEM_TABLE_SIZE, huge_unit);
-	size_last_smem = __aligned_size(LAST_SMEM_TABLE_SIZE, huge_unit);
-	size_total += size_all_smem + size_last_smem;
+	/* the longest tables built for the index. with memscale, shorter ones may be taken below. */
+	new_info->smem_all_len = smem_table_len(prefix, ".all_smem.", ALL_SMEM_BP);
+	new_info->smem_last_len = smem_table_len(prefix, ".last_smem.", LAST_SMEM_BP);
+	size_all_smem = __aligned_size(bwa_shm_size_sall(new_info->smem_all_len), huge_unit);
+	size_last_smem = __aligned_size(bwa_shm_size_slast(new_info->smem_last_len), huge_unit);
+	new_info->hiocc_len = smem_table_find_len(prefix, ".hiocc.", SMEM_TABLE_MAX_BP);
+	size_hiocc = new_info->hiocc_len > 0 ?
+					__aligned_size(bwa_shm_size_hiocc(new_info->hiocc_len), huge_unit) : 0;
+	size_total += size_all_smem + size_last_smem + size_hiocc;
 #endif
 
 #ifdef MEMSCALE
@@ -1699,46 +1838,99 @@ reset_newinfo:
 	rem -= size_ref;
 	size_load = size_bwt + size_pac + size_ref;
 
-	/* among the optional indices, all_smem and last_smem have the best capacity-performance ratio. */
-	if (rem >= size_all_smem) {
-		new_info->smem_all_on = 1;
-		rem -= size_all_smem;
-		size_load += size_all_smem;
-	} else {
-		new_info->smem_all_on = 0;
+	/* among the optional indices, all_smem and last_smem have the best capacity-performance ratio.
+	   for each, the longest table built for the index that fits is taken. */
+	new_info->smem_all_on = 0;
+	for (len = smem_table_find_len(prefix, ".all_smem.", SMEM_TABLE_MAX_BP); len > 0;
+			len = smem_table_find_len(prefix, ".all_smem.", len - 1)) {
+		size_all_smem = __aligned_size(bwa_shm_size_sall(len), huge_unit);
+		if ((ssize_t) size_all_smem <= rem) {
+			new_info->smem_all_on = 1;
+			new_info->smem_all_len = len;
+			rem -= size_all_smem;
+			size_load += size_all_smem;
+			break;
+		}
 	}
 	
-	if (rem >= size_last_smem) {
-		new_info->smem_last_on = 1;
-		rem -= size_last_smem;
-		size_load += size_last_smem;
-	} else {
-		new_info->smem_last_on = 0;
+	new_info->smem_last_on = 0;
+	for (len = smem_table_find_len(prefix, ".last_smem.", SMEM_TABLE_MAX_BP); len > 0;
+			len = smem_table_find_len(prefix, ".last_smem.", len - 1)) {
+		size_last_smem = __aligned_size(bwa_shm_size_slast(len), huge_unit);
+		if ((ssize_t) size_last_smem <= rem) {
+			new_info->smem_last_on = 1;
+			new_info->smem_last_len = len;
+			rem -= size_last_smem;
+			size_load += size_last_smem;
+			break;
+		}
 	}
+	fprintf(stderr, "[memscale] smem tables: all_smem: %d last_smem: %d\n",
+					new_info->smem_all_on ? new_info->smem_all_len : 0,
+					new_info->smem_last_on ? new_info->smem_last_len : 0);
 
-	/* the second best is the perfect matching. */
-	if (pt_seed_len > 0
-		&& rem >= __aligned_size(size_pt_head + size_pt_loc
-					+ __aligned_size(sizeof(seed_entry_t), 64), 
-					huge_unit)) {
+	/* the second best is the perfect matching.
+	   the members of the family are taken from the longest one,
+	   and only the last taken one can be partially loaded. */
+	new_info->perfect_on = 0;
+	new_info->pt_num_seed_entry_loaded = 0;
+	if (pt_family_n > 0) {
 		size_t size_load_pt;
-		size_t num_seed_load;
+		size_t num_seed_load = 0;
 		size_t rem_pt = (rem / huge_unit) * huge_unit;
-		new_info->perfect_on = 1;
-		rem_pt -= size_pt_head + size_pt_loc;
-		rem_pt -= (rem_pt % 64); /* aligned range for seed entries, in fact, unnecessary now. */
-		num_seed_load = rem_pt / sizeof(seed_entry_t);
-		if (num_seed_load > new_info->pt_num_seed_entry)
-			num_seed_load = new_info->pt_num_seed_entry;
-		size_load_pt = __aligned_size(size_pt_head + size_pt_loc
-										+ __aligned_size(num_seed_load * sizeof(seed_entry_t), 64), 
-									huge_unit);
-		rem -= size_load_pt;
-		size_load += size_load_pt;
-		new_info->pt_num_seed_entry_loaded = num_seed_load;
-	} else {
-		new_info->perfect_on = 0;
-		new_info->pt_num_seed_entry_loaded = 0;
+		size_t size_front = 0, size_need;
+		int n = 0;
+
+		for (i = 0; i < pt_family_n; ++i) {
+			size_need = size_front + size_pt_head[i] + size_pt_loc[i];
+			if (rem_pt < size_need + __aligned_size(sizeof(seed_entry_t), 64))
+				break;
+			num_seed_load = rem_pt - size_need;
+			num_seed_load -= (num_seed_load % 64); /* aligned range for seed entries, in fact, unnecessary now. */
+			num_seed_load /= sizeof(seed_entry_t);
+			if (num_seed_load > num_pt_seed[i])
+				num_seed_load = num_pt_seed[i];
+			set_perfect_family_info(new_info, pt_family, i + 1, 
+									num_pt_loc, num_pt_seed, size_front);
+			n = i + 1;
+			if (num_seed_load < num_pt_seed[i])
+				break;
+			size_front = size_need + size_pt_seed[i];
+		}
+
+		if (n > 0) {
+			new_info->perfect_on = 1;
+			size_load_pt = __aligned_size(new_info->pt_family_size
+											+ size_pt_head[n - 1] + size_pt_loc[n - 1]
+											+ __aligned_size(num_seed_load * sizeof(seed_entry_t), 64), 
+										huge_unit);
+			rem -= size_load_pt;
+			size_load += size_load_pt;
+			new_info->pt_num_seed_entry_loaded = num_seed_load;
+		}
+	}
+
+	/* the third is the density of the SA. each step halves the LF walks to a sampled row
+	   and doubles the size of the samples. */
+	while (new_info->sa_compx > sa_compx_lo) {
+		size_t size = __aligned_size(bwa_shm_size_bwt(bwa_shm_rlen(), new_info->sa_compx - 1), huge_unit);
+		if ((ssize_t) (size - size_bwt) > rem)
+			break;
+		rem -= size - size_bwt;
+		size_load += size - size_bwt;
+		size_bwt = size;
+		new_info->sa_compx--;
+	}
+	fprintf(stderr, "[memscale] SA sampling: 2^%d (range: 2^%d ~ 2^%d)\n",
+					new_info->sa_compx, sa_compx_lo, sa_compx_hi);
+
+	/* the high-occurrence k-mer table only helps 'mem -u', so it comes last.
+	   it is used in both of FM-index and ERT modes. */
+	new_info->hiocc_on = 0;
+	if (size_hiocc > 0 && (ssize_t) size_hiocc <= rem) {
+		new_info->hiocc_on = 1;
+		rem -= size_hiocc;
+		size_load += size_hiocc;
 	}
 	
 	/* check whether loading ERT tables is possible */
@@ -1827,11 +2019,16 @@ reset_newinfo:
 			__bwa_shm_remove(BWA_SHM_SLAST);
 			bwa_shm_info->smem_last_on = 0;
 		}
+
+		if (bwa_shm_info->hiocc_on == 1) {
+			__bwa_shm_remove(BWA_SHM_HIOCC);
+			bwa_shm_info->hiocc_on = 0;
+		}
 		bwa_shm_info->hugetlb_flags = new_info->hugetlb_flags;
 	}
 
 	if (bwa_shm_info->perfect_on == 1
-			&& new_info->pt_seed_len != bwa_shm_info->pt_seed_len) {
+			&& perfect_family_changed(new_info, bwa_shm_info)) {
 		fprintf(stderr, "[memscale] pt_seed_len is changed. Reload perfect_table.\n");
 		__bwa_shm_remove(BWA_SHM_PERFECT);
 		bwa_shm_info->perfect_on = 0;
@@ -1851,6 +2048,13 @@ reset_newinfo:
 		bwa_shm_info->perfect_on = 0;
 	}
 
+	if (bwa_shm_info->bwt_on == 1 && new_info->bwt_on == 1
+			&& new_info->sa_compx != bwa_shm_info->sa_compx) {
+		fprintf(stderr, "[memscale] sa_compx is changed. Reload BWT.\n");
+		__bwa_shm_remove(BWA_SHM_BWT);
+		bwa_shm_info->bwt_on = 0;
+	}
+
 	if (bwa_shm_info->bwt_on == 1 && new_info->bwt_on == 0) {
 		__bwa_shm_remove(BWA_SHM_BWT);
 		bwa_shm_info->bwt_on = 0;
@@ -1871,6 +2075,20 @@ reset_newinfo:
 		bwa_shm_info->perfect_on = 0;
 	}
 	
+	if (bwa_shm_info->smem_all_on == 1 && new_info->smem_all_on == 1
+			&& new_info->smem_all_len != bwa_shm_info->smem_all_len) {
+		fprintf(stderr, "[memscale] smem_all_len is changed. Reload all_smem.\n");
+		__bwa_shm_remove(BWA_SHM_SALL);
+		bwa_shm_info->smem_all_on = 0;
+	}
+
+	if (bwa_shm_info->smem_last_on == 1 && new_info->smem_last_on == 1
+			&& new_info->smem_last_len != bwa_shm_info->smem_last_len) {
+		fprintf(stderr, "[memscale] smem_last_len is changed. Reload last_smem.\n");
+		__bwa_shm_remove(BWA_SHM_SLAST);
+		bwa_shm_info->smem_last_on = 0;
+	}
+
 	if (bwa_shm_info->smem_all_on == 1 && new_info->smem_all_on == 0) {
 		__bwa_shm_remove(BWA_SHM_SALL);
 		bwa_shm_info->smem_all_on = 0;
@@ -1881,6 +2099,18 @@ reset_newinfo:
 		bwa_shm_info->smem_last_on = 0;
 	}
 
+	if (bwa_shm_info->hiocc_on == 1 && new_info->hiocc_on == 1
+			&& new_info->hiocc_len != bwa_shm_info->hiocc_len) {
+		fprintf(stderr, "[memscale] hiocc_len is changed. Reload hiocc.\n");
+		__bwa_shm_remove(BWA_SHM_HIOCC);
+		bwa_shm_info->hiocc_on = 0;
+	}
+
+	if (bwa_shm_info->hiocc_on == 1 && new_info->hiocc_on == 0) {
+		__bwa_shm_remove(BWA_SHM_HIOCC);
+		bwa_shm_info->hiocc_on = 0;
+	}
+
 	memcpy(old_info, bwa_shm_info, 
 				bwa_shm_size_info(bwa_shm_info->ref_file_name_len));
 	unlock_bwa_shm_info();
@@ -1896,6 +2126,7 @@ reset_newinfo:
 #ifdef SMEM_ACCEL
 	__bwa_shm_remove(BWA_SHM_SALL);
 	__bwa_shm_remove(BWA_SHM_SLAST);
+	__bwa_shm_remove(BWA_SHM_HIOCC);
 #endif
 #endif
 	
@@ -1940,14 +2171,16 @@ reset_newinfo:
 
 	if (new_info->perfect_on) {
 		if (old_info->perfect_on == 0) {
-			if (__bwa_shm_load_perfect(prefix, pt_seed_len, 
+			if (__bwa_shm_load_perfect(prefix, new_info->pt_family_len, new_info->pt_family_n,
 						new_info->pt_num_seed_entry_loaded)) {
 					ret = -1;
 					goto out;
 				}
 		} else {
-			if (__bwa_shm_resize_perfect(prefix, pt_seed_len,
-						size_pt_head, size_pt_loc,
+			if (__bwa_shm_resize_perfect(prefix, new_info->pt_seed_len,
+						new_info->pt_family_size,
+						size_pt_head[new_info->pt_family_n - 1], 
+						size_pt_loc[new_info->pt_family_n - 1],
 						old_info->pt_num_seed_entry_loaded,
 						new_info->pt_num_seed_entry_loaded)) {
 					ret = -1;
@@ -1957,12 +2190,19 @@ reset_newinfo:
 	}
 
 	if (new_info->smem_all_on == 1 || new_info->smem_last_on == 1) {
-		if (__bwa_shm_load_accel(prefix, new_info->smem_all_on, new_info->smem_last_on)) {
+		if (__bwa_shm_load_accel(prefix, new_info->smem_all_on, new_info->smem_all_len,
+									new_info->smem_last_on, new_info->smem_last_len)) {
 			ret = -1;
 			goto out;
 		}
 	}
 
+	if (old_info->hiocc_on == 0 && new_info->hiocc_on == 1
+			&& __bwa_shm_load_hiocc(prefix, new_info->hiocc_len)) {
+		ret = -1;
+		goto out;
+	}
+
 #else /* !MEMSCALE */
 	if (__bwa_shm_load_pac(prefix, size_pac)) {
 		ret = -1;
@@ -1981,7 +2221,8 @@ reset_newinfo:
 		}
 
 #ifdef SMEM_ACCEL
-		if (__bwa_shm_load_accel(prefix, 1, 1)) {
+		if (__bwa_shm_load_accel(prefix, 1, new_info->smem_all_len,
+									1, new_info->smem_last_len)) {
 			ret = -1;
 			goto out;
 		}
@@ -1998,7 +2239,15 @@ reset_newinfo:
 		}
 	}
 #ifdef PERFECT_MATCH
-	if (__bwa_shm_load_perfect(prefix, pt_seed_len, 0)) {
+	if (pt_family_n > 0 
+			&& __bwa_shm_load_perfect(prefix, pt_family, pt_family_n, 0)) {
+		ret = -1;
+		goto out;
+	}
+#endif
+#ifdef SMEM_ACCEL
+	if (new_info->hiocc_len > 0
+			&& __bwa_shm_load_hiocc(prefix, new_info->hiocc_len)) {
 		ret = -1;
 		goto out;
 	}
@@ -2009,6 +2258,12 @@ reset_newinfo:
 #define copy_struct_var(dst, src, var) (dst)->var = (src)->var
 	copy_struct_var(bwa_shm_info, new_info, hugetlb_flags);
 	copy_struct_var(bwa_shm_info, new_info, useErt);
+	copy_struct_var(bwa_shm_info, new_info, sa_compx);
+#ifdef SMEM_ACCEL
+	copy_struct_var(bwa_shm_info, new_info, smem_all_len);
+	copy_struct_var(bwa_shm_info, new_info, smem_last_len);
+	copy_struct_var(bwa_shm_info, new_info, hiocc_len);
+#endif
 #ifdef MEMSCALE
 	copy_struct_var(bwa_shm_info, new_info, bwt_on);
 	copy_struct_var(bwa_shm_info, new_info, pac_on);
@@ -2018,6 +2273,7 @@ reset_newinfo:
 	copy_struct_var(bwa_shm_info, new_info, perfect_on);
 	copy_struct_var(bwa_shm_info, new_info, smem_all_on);
 	copy_struct_var(bwa_shm_info, new_info, smem_last_on);
+	copy_struct_var(bwa_shm_info, new_info, hiocc_on);
 	copy_struct_var(bwa_shm_info, new_info, pt_num_seed_entry_loaded);
 #endif
 #ifdef PERFECT_MATCH
@@ -2025,6 +2281,9 @@ reset_newinfo:
 	copy_struct_var(bwa_shm_info, new_info, pt_num_seed_entry);
 	copy_struct_var(bwa_shm_info, new_info, pt_seed_len);
 	copy_struct_var(bwa_shm_info, new_info, pt_mmap);
+	copy_struct_var(bwa_shm_info, new_info, pt_family_n);
+	copy_struct_var(bwa_shm_info, new_info, pt_family_size);
+	memcpy(bwa_shm_info->pt_family_len, new_info->pt_family_len, sizeof(int) * PT_FAMILY_MAX);
 #endif
 #undef copy_struct_var
 	unlock_bwa_shm_info();
@@ -2040,6 +2299,7 @@ int bwa_shm_load(int argc, char *argv[]) {
 	enum hugetlb_mode hugetlb_mode;
 	int opt_force = 0;
 	int opt_modify = 0;
+	int opt_sa_compx = -1;
 	int useErt = DEFAULT_USE_ERT;
 #ifdef MEMSCALE
 	enum bwa_shm_init_mode init_mode = BWA_SHM_INIT_NEW;
@@ -2062,9 +2322,16 @@ int bwa_shm_load(int argc, char *argv[]) {
 	hugetlb_mode = BWA_SHM_NORMAL_PAGE;
 
     /* Parse input arguments */
-    while ((c = getopt(argc, argv, "fH:mg:l:p:Z:")) >= 0)
+    while ((c = getopt(argc, argv, "fH:mg:l:p:x:Z:")) >= 0)
     {
 		if (c == 'f') opt_force = 1;
+		else if (c == 'x') {
+			opt_sa_compx = atoi(optarg);
+			if (opt_sa_compx < 0 || opt_sa_compx > SA_COMPX_MAX) {
+				fprintf(stderr, "ERROR: -x should be in 0..%d\n", SA_COMPX_MAX);
+				exit(EXIT_FAILURE);
+			}
+		}
         else if (c == 'H') hugetlb_mode = parse_hugetlb_mode(optarg);
 		else if (c == 'Z') useErt = atoi(optarg) ? 1 : 0;
 #ifdef MEMSCALE
@@ -2075,12 +2342,13 @@ int bwa_shm_load(int argc, char *argv[]) {
 #endif
 		else if (c == 'l') {
 #ifdef PERFECT_MATCH
-			int seed_len = atoi(optarg);
-			if (seed_len <= 0) {
-				fprintf(stderr, "ERROR: The hash seed length for perfect match should be larger than 0.\n");
+			perfect_family_n = parse_perfect_family(optarg, perfect_family_len);
+			if (perfect_family_n <= 0) {
+				fprintf(stderr, "ERROR: The hash seed length for perfect match should be larger than 0. "
+								"Up to %d lengths can be given.\n", PT_FAMILY_MAX);
 				exit(EXIT_FAILURE);
 			}
-			pt_seed_len = seed_len;
+			pt_seed_len = perfect_family_len[0];
 		} else if (c == 'p') {
 			pt_mmap = atoi(optarg);
 			if (pt_mmap)
@@ -2117,6 +2385,13 @@ int bwa_shm_load(int argc, char *argv[]) {
 		}
 	}
 	
+#ifdef PERFECT_MATCH
+	if (pt_mmap && perfect_family_n > 1) {
+		fprintf(stderr, "ERROR: mmap()ed perfect table (-p) supports a single seed length.\n");
+		exit(EXIT_FAILURE);
+	}
+#endif
+
 	bwa_shm_init(prefix, &useErt, pt_seed_len, init_mode);
 	
 	if (bwa_shm_mode == BWA_SHM_DISABLE) {
@@ -2138,7 +2413,7 @@ int bwa_shm_load(int argc, char *argv[]) {
 	}
 	fprintf(stderr, "========BWA_SHM_LOAD_BEGIN==========================================\n");
 	ret = __bwa_shm_load(prefix, hugetlb_mode, opt_force, 
-					pt_seed_len, pt_mmap, opt_gb);
+					pt_seed_len, pt_mmap, opt_gb, opt_sa_compx);
 	fprintf(stderr, "========BWA_SHM_LOAD_END============================================\n");
 
 out:
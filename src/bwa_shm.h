@@ -84,6 +84,7 @@ enum bwa_shm_type {
 #ifdef SMEM_ACCEL
 	BWA_SHM_SALL, /* SMEM ALL */
 	BWA_SHM_SLAST, /* SMEM LAST */
+	BWA_SHM_HIOCC, /* high-occurrence k-mers */
 #endif
 	NUM_BWA_SHM,
 };
@@ -131,14 +132,27 @@ typedef struct {
 	int perfect_on;
 	int smem_all_on;
 	int smem_last_on;
+	int hiocc_on;
 
 	uint32_t pt_num_seed_entry_loaded;
 #endif
 #ifdef PERFECT_MATCH
+	/* the family of perfect tables is placed back-to-back in BWA_SHM_PERFECT.
+	   pt_seed_len and pt_num_* are for the last member, which can be partially loaded. */
 	uint32_t pt_num_loc_entry;
 	uint32_t pt_num_seed_entry; 
 	int pt_seed_len;
 	int pt_mmap;
+	int pt_family_n;
+	int pt_family_len[PT_FAMILY_MAX]; /* longest first */
+	uint64_t pt_family_size; /* size of the members before the last one */
+#endif
+
+	int sa_compx; /* the SA in BWA_SHM_BWT is sampled every 2^sa_compx rows */
+#ifdef SMEM_ACCEL
+	int smem_all_len; /* bp of the tables in BWA_SHM_SALL and BWA_SHM_SLAST */
+	int smem_last_len;
+	int hiocc_len; /* k of BWA_SHM_HIOCC, 0 if there is no table */
 #endif
 
 	/* to distinguish the loaded index */
@@ -152,6 +166,16 @@ extern bwa_shm_info_t *bwa_shm_info;
 extern bwa_shm_info_t *loading_info; /* for bwa_shm_load */
 
 #define bwa_shm_rlen() (bwa_shm_info ? bwa_shm_info->reference_len : 0)
+#define bwa_shm_sa_compx() (loading_info ? loading_info->sa_compx \
+							: bwa_shm_info ? bwa_shm_info->sa_compx : SA_COMPX)
+#ifdef SMEM_ACCEL
+#define bwa_shm_smem_all_len() (loading_info ? loading_info->smem_all_len \
+							: bwa_shm_info ? bwa_shm_info->smem_all_len : 0)
+#define bwa_shm_smem_last_len() (loading_info ? loading_info->smem_last_len \
+							: bwa_shm_info ? bwa_shm_info->smem_last_len : 0)
+#define bwa_shm_hiocc_len() (loading_info ? loading_info->hiocc_len \
+							: bwa_shm_info ? bwa_shm_info->hiocc_len : 0)
+#endif
 static inline int bwa_shm_hugetlb_flags() {
 	if (loading_info)
 		return loading_info->hugetlb_flags;
@@ -168,22 +192,23 @@ typedef struct {
 	int64_t reference_len;
 	int64_t count[5];
 	int64_t sentinel_index;
+	int64_t sa_compx;
 } shm_bwt_header_t;
 
 #define bwa_shm_size_bwt_header() __aligned_size(sizeof(shm_bwt_header_t), 64) 
 #define bwa_shm_size_bwt_cp_occ(rlen) __aligned_size((sizeof(CP_OCC) * (((rlen) >> CP_SHIFT) + 1)), 64)
 #if SA_COMPRESSION
-#define bwa_shm_size_bwt_sa_ms_byte(rlen) __aligned_size(((((rlen) >> SA_COMPX) + 1) * sizeof(int8_t)), 64)
-#define bwa_shm_size_bwt_sa_ls_word(rlen) __aligned_size(((((rlen) >> SA_COMPX) + 1) * sizeof(uint32_t)), 64)
+#define bwa_shm_size_bwt_sa_ms_byte(rlen, x) __aligned_size((sa_num_samples(rlen, x) * sizeof(int8_t)), 64)
+#define bwa_shm_size_bwt_sa_ls_word(rlen, x) __aligned_size((sa_num_samples(rlen, x) * sizeof(uint32_t)), 64)
 #else
-#define bwa_shm_size_bwt_sa_ms_byte(rlen) __aligned_size(((rlen) * sizeof(int8_t)), 64)
-#define bwa_shm_size_bwt_sa_ls_word(rlen) __aligned_size(((rlen) * sizeof(uint32_t)), 64)
+#define bwa_shm_size_bwt_sa_ms_byte(rlen, x) __aligned_size(((rlen) * sizeof(int8_t)), 64)
+#define bwa_shm_size_bwt_sa_ls_word(rlen, x) __aligned_size(((rlen) * sizeof(uint32_t)), 64)
 #endif
-#define bwa_shm_size_bwt(rlen) \
+#define bwa_shm_size_bwt(rlen, x) \
 							bwa_shm_size_bwt_header() \
 							+ bwa_shm_size_bwt_cp_occ(rlen) \
-							+ bwa_shm_size_bwt_sa_ms_byte(rlen) \
-							+ bwa_shm_size_bwt_sa_ls_word(rlen)
+							+ bwa_shm_size_bwt_sa_ms_byte(rlen, x) \
+							+ bwa_shm_size_bwt_sa_ls_word(rlen, x)
 
 #define bwa_shm_size_ref(rlen) __aligned_size((rlen) - 1, 64)
 
@@ -200,10 +225,11 @@ static inline size_t bwa_shm_size_mlt(bwa_shm_info_t *info) {
 }
 
 #ifdef SMEM_ACCEL
-#define bwa_shm_size_accel() \
-				(ALL_SMEM_TABLE_SIZE + LAST_SMEM_TABLE_SIZE)
-#define bwa_shm_size_sall() (ALL_SMEM_TABLE_SIZE)
-#define bwa_shm_size_slast() (LAST_SMEM_TABLE_SIZE)
+#define bwa_shm_size_accel(all_len, last_len) \
+				(__all_smem_table_size(all_len) + __last_smem_table_size(last_len))
+#define bwa_shm_size_sall(len) (__all_smem_table_size(len))
+#define bwa_shm_size_slast(len) (__last_smem_table_size(len))
+#define bwa_shm_size_hiocc(len) (__hiocc_table_size(len))
 #endif
 
 #define bwa_shm_create_flags (O_RDWR | O_CREAT | O_TRUNC)
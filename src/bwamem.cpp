@@ -41,10 +41,12 @@
 #include "FMI_search.h"
 #include "memcpy_bwamem.h"
 #include "bwa_shm.h"
+#include "bamout.h"
 
 #ifdef PERFECT_MATCH
 /* implemented in perfect_map.cpp */
 int find_perfect_match_entry(perfect_table_t *pt, bseq1_t *seq, int len);
+void find_perfect_match_batch(perfect_table_t *pt, bseq1_t *seqs, int n, int *ret);
 mem_aln_perfect_v get_perfect_locations(bseq1_t *s, const bntseq_t *bns, perfect_table_t *pt);
 int perfect_dedup_patch(const mem_opt_t *opt, int n, int l_seq, 
 						mem_aln_perfect_t *a);
@@ -653,11 +655,11 @@ SMEM *mem_collect_smem(FMI_search *fmi, const mem_opt_t *opt,
 					   int16_t *query_pos_ar,
 					   uint8_t *enc_qdb,
 					   int32_t *rid,
-					   int64_t &tot_smem)
+					   int64_t &tot_smem,
+					   const smem_cache_ent_t **hit,
+					   int tid)
 {
-#ifdef PERFECT_MATCH
-	int n_npm_seq = 0;
-#endif
+	int n_search = 0, nseq_all = nseq;
 	int64_t pos = 0;
 	int split_len = (int)(opt->min_seed_len * opt->split_factor + .499);
 	int64_t num_smem1 = 0, num_smem2 = 0, num_smem3 = 0;
@@ -668,16 +670,17 @@ SMEM *mem_collect_smem(FMI_search *fmi, const mem_opt_t *opt,
 		
 	int offset = 0;
 
-#ifdef PERFECT_MATCH
+	/* perfect-matched reads and reads found in the SMEM cache are not searched */
 	max_readlength = 0;
-	query_cum_len_ar[0] = 0;
 	for (int l=0; l<nseq; l++) {
 		query_cum_len_ar[l] = offset;
-#ifndef DO_NORMAL
+#if defined(PERFECT_MATCH) && !defined(DO_NORMAL)
 		if (seq_[l].perfect.exist)
 			continue;
 #endif
-		n_npm_seq++;
+		if (hit && hit[l])
+			continue;
+		n_search++;
 		min_intv_ar[pos] = 1;
 		for (int j=0; j<seq_[l].l_seq; j++)
 			enc_qdb[offset + j] = seq_[l].seq[j];
@@ -690,32 +693,9 @@ SMEM *mem_collect_smem(FMI_search *fmi, const mem_opt_t *opt,
 
 	pos = 0;
 	
-	fmi->getSMEMsAllPosOneThread(enc_qdb, min_intv_ar, rid, n_npm_seq, nseq,
+	fmi->getSMEMsAllPosOneThread(enc_qdb, min_intv_ar, rid, n_search, nseq,
 								 seq_, query_cum_len_ar, max_readlength, opt->min_seed_len,
 								 matchArray, &num_smem1);
-#else
-	for (int l=0; l<nseq; l++)
-	{
-		min_intv_ar[l] = 1;
-		for (int j=0; j<seq_[l].l_seq; j++) 
-			enc_qdb[offset + j] = seq_[l].seq[j];
-		
-		offset += seq_[l].l_seq;		
-		rid[l] = l;
-	}
-
-	max_readlength = seq_[0].l_seq;
-	query_cum_len_ar[0] = 0;
-	for(int i = 1; i < nseq; i++) {
-		query_cum_len_ar[i] = query_cum_len_ar[i - 1] + seq_[i-1].l_seq;
-		if (max_readlength < seq_[i].l_seq)
-			max_readlength = seq_[i].l_seq;
-	}
-
-	fmi->getSMEMsAllPosOneThread(enc_qdb, min_intv_ar, rid, nseq, nseq,
-								 seq_, query_cum_len_ar, max_readlength, opt->min_seed_len,
-								 matchArray, &num_smem1);
-#endif
 
 
 	for (int64_t i=0; i<num_smem1; i++)
@@ -758,15 +738,14 @@ SMEM *mem_collect_smem(FMI_search *fmi, const mem_opt_t *opt,
 		num_smem3 = fmi->bwtSeedStrategyAllPosOneThread(enc_qdb, min_intv_ar,
 														nseq, seq_, query_cum_len_ar, 
 														opt->min_seed_len + 1,
-														matchArray + num_smem1 + num_smem2);		
+														matchArray + num_smem1 + num_smem2,
+														(const void *const *) hit, tid);
 	}
 	tot_smem = num_smem1 + num_smem2 + num_smem3;
 
 	fmi->sortSMEMs(matchArray, &tot_smem, nseq, seq_[0].l_seq, 1); // seq_[0].l_seq - only used for blocking when using nthreads
 
-#ifdef PERFECT_MATCH
-	nseq = n_npm_seq;
-#endif
+	nseq = n_search;
 	pos = 0;
 	int64_t smem_ptr = 0;
 	for (int l=0; l<nseq && pos < tot_smem - 1; l++) {
@@ -781,6 +760,27 @@ SMEM *mem_collect_smem(FMI_search *fmi, const mem_opt_t *opt,
 		smem_ptr = pos + 1;
 	}
 
+	if (hit) {
+		/* splice the cached SMEMs in, from the back, so that matchArray stays sorted by rid */
+		int64_t n_hit_smem = 0;
+		for (int l=0; l<nseq_all; l++)
+			if (hit[l]) n_hit_smem += hit[l]->n_smem;
+		int64_t r = tot_smem - 1, w = tot_smem + n_hit_smem - 1;
+		for (int l=nseq_all-1; l>=0 && w > r; l--) {
+			if (hit[l]) {
+				const SMEM *p = smem_cache_smem(hit[l]);
+				for (int j=hit[l]->n_smem-1; j>=0; j--) {
+					matchArray[w] = p[j];
+					matchArray[w--].rid = l;
+				}
+			} else {
+				while (r >= 0 && matchArray[r].rid == (uint32_t) l)
+					matchArray[w--] = matchArray[r--];
+			}
+		}
+		tot_smem += n_hit_smem;
+	}
+
 	_mm_free(query_cum_len_ar);
 	return matchArray;
 }
@@ -795,7 +795,9 @@ void mem_chain_seeds(FMI_search *fmi, const mem_opt_t *opt,
 					 mem_seed_t *seedBuf,
 					 int64_t seedBufSize,
 					 SMEM *matchArray,
-					 int64_t num_smem)
+					 int64_t num_smem,
+					 smem_cache_t *smc,
+					 const smem_cache_ent_t **hit)
 {
 	int b, e, l_rep, size = 0;
 	int64_t i, pos = 0;
@@ -804,9 +806,58 @@ void mem_chain_seeds(FMI_search *fmi, const mem_opt_t *opt,
 	
 	int num[nseq];
 	memset_s(num, nseq*sizeof(int), 0);
+#if SA_COMPRESSION
+	/* coordinates of all SMEMs of the chunk, in SMEM order */
+	int64_t n_coord = 0, mypos = 0;
+	for (i = 0; i < num_smem; i++)
+		n_coord += matchArray[i].s < opt->max_occ ? matchArray[i].s : opt->max_occ;
+	int64_t *sa_coord = (int64_t *) _mm_malloc(sizeof(int64_t) * (n_coord + 1), 64);
+	assert(sa_coord != NULL);
+	uint64_t tim_sa = __rdtsc();
+	if (hit == NULL)
+		fmi->get_sa_entries_batch(matchArray, num_smem, sa_coord, opt->max_occ);
+	else {
+		/* look up runs of uncached reads; the coordinates of cached reads are copied */
+		int64_t c = 0;
+		for (i = 0; i < num_smem; ) {
+			const smem_cache_ent_t *ent = hit[matchArray[i].rid];
+			if (ent) {
+				memcpy(sa_coord + c, smem_cache_coord(ent), ent->n_coord * sizeof(int64_t));
+				c += ent->n_coord;
+				i += ent->n_smem;
+			} else {
+				int64_t j = i, c0 = c;
+				for (; j < num_smem && hit[matchArray[j].rid] == NULL; j++)
+					c += matchArray[j].s < opt->max_occ ? matchArray[j].s : opt->max_occ;
+				fmi->get_sa_entries_batch(matchArray + i, j - i, sa_coord + c0, opt->max_occ);
+				i = j;
+			}
+		}
+		assert(c == n_coord);
+	}
+	tprof[MEM_SA][tid] += __rdtsc() - tim_sa;
+
+	if (smc) {
+		/* every read searched in this chunk goes into the cache, even without SMEMs */
+		int64_t j = 0, c = 0;
+		for (int l=0; l<nseq; l++) {
+			int64_t j0 = j, c0 = c;
+			for (; j < num_smem && matchArray[j].rid == (uint32_t) l; j++)
+				c += matchArray[j].s < opt->max_occ ? matchArray[j].s : opt->max_occ;
+#if defined(PERFECT_MATCH) && !defined(DO_NORMAL)
+			if (seq_[l].perfect.exist)
+				continue;
+#endif
+			if (hit[l] == NULL)
+				smem_cache_put(smc, (const uint8_t *) seq_[l].seq, seq_[l].l_seq,
+							   matchArray + j0, j - j0, sa_coord + c0, c - c0);
+		}
+	}
+#else
 	int smem_buf_size = 6000;
 	int64_t *sa_coord = (int64_t *) _mm_malloc(sizeof(int64_t) * opt->max_occ * smem_buf_size, 64);
 	assert(sa_coord != NULL);
+#endif
 	int64_t seedBufCount = 0;
 	
 	for (int l=0; l<nseq; l++)
@@ -846,6 +897,7 @@ void mem_chain_seeds(FMI_search *fmi, const mem_opt_t *opt,
 		l_rep += e - b;
 
 		// bwt_sa
+		#if !SA_COMPRESSION
 		// assert(pos - smem_ptr + 1 < 6000);
 		if (pos - smem_ptr + 1 >= smem_buf_size)
 		{
@@ -855,12 +907,6 @@ void mem_chain_seeds(FMI_search *fmi, const mem_opt_t *opt,
 											   sizeof(int64_t));
 			assert(sa_coord != NULL);
 		}
-		int64_t id = 0, cnt_ = 0, mypos = 0;
-		#if SA_COMPRESSION
-		uint64_t tim = __rdtsc();
-		fmi->get_sa_entries_prefetch(&matchArray[smem_ptr], sa_coord, &cnt_,
-									 pos - smem_ptr + 1, opt->max_occ, tid, id);  // sa compressed prefetch
-		tprof[MEM_SA][tid] += __rdtsc() - tim;
 		#endif
 		
 		for (i = smem_ptr; i <= pos; i++)
@@ -1069,8 +1115,10 @@ int mem_kernel1_core_ert(FMI_search *fmi,
 	mem_chain_v *chn;
 	int64_t seedBufCount = 0;
 	uint64_t tim;
+	int max_len = 0;
 
-	/* convert to 2-bit encoding if we have not done so */
+	/* convert to 2-bit encoding if we have not done so (the -J reader has, for
+	   mapped input, so that seq never points into the read-only mapping) */
 	for (int l=0; l<nseq; l++)
 	{
 		char *seq = seq_[l].seq;
@@ -1078,26 +1126,19 @@ int mem_kernel1_core_ert(FMI_search *fmi,
 			
 		for (i = 0; i < len; ++i)
 			seq[i] = seq[i] < 4? seq[i] : nst_nt4_table[(int)seq[i]]; //nst_nt4??	   
+		max_len = len > max_len? len : max_len;
 	}
 
 #ifdef PERFECT_MATCH
 	tim = __rdtsc();
 	int n_pm_seq = 0;
 	char is_pm[nseq];
-	
+	int pm_ret[nseq];
+
+	find_perfect_match_batch(fmi->perfect_table, seq_, nseq, pm_ret);
 	for (int l=0; l<nseq; l++)
 	{
-		char *seq = seq_[l].seq;
-		int len = seq_[l].l_seq;
-			
-		int ret;
-#ifdef MEMSCALE
-		ret = fmi->perfect_table 
-				? find_perfect_match_entry(fmi->perfect_table, &seq_[l], len)
-				: FIND_PERFECT_NO_TABLE;
-#else
-		ret = find_perfect_match_entry(fmi->perfect_table, &seq_[l], len);
-#endif
+		int ret = pm_ret[l];
 		pprof[tid][ret]++;
 		if (ret == FIND_PERFECT_FW_MATCHED || ret == FIND_PERFECT_RC_MATCHED) {
 			n_pm_seq++;
@@ -1119,8 +1160,54 @@ int mem_kernel1_core_ert(FMI_search *fmi,
 #endif
 
 	tim = __rdtsc();
+	/* reverse complement and LEP bit-vector of a read; on the stack up to READ_LEN,
+	   else sized for the longest read of the block (e.g. 2x250, 2x300 runs) */
+	uint8_t rc_buf[READ_LEN];
+	uint64_t lep_buf[LEP_WORDS(READ_LEN)];
+	uint8_t *unpacked_rc_queue_buf = rc_buf;
+	uint64_t *lep = lep_buf;
+	if (max_len > READ_LEN) {
+		unpacked_rc_queue_buf = (uint8_t*) malloc(max_len);
+		lep = (uint64_t*) malloc(LEP_WORDS(max_len) * sizeof(uint64_t));
+		if (unpacked_rc_queue_buf == NULL || lep == NULL) {
+			fprintf(stderr, "ERROR: out of memory for reads of %d bp\n", max_len);
+			exit(EXIT_FAILURE);
+		}
+	}
+	int split_len = (int)(opt->min_seed_len * opt->split_factor + .499);
+
+	read_aux_t raux;
+	raux.lens = NULL;
+	raux.lens_m = 0;
+
+	index_aux_t iaux;
+	iaux.kmer_offsets = kmer_offsets;
+	iaux.mlt_table = mlt_table;
+	iaux.bns = bns;
+	iaux.pac = pac;
+	iaux.ref_string = ref_string;
+#ifdef SMEM_ACCEL
+	iaux.hiocc = fmi->hiocc_table;
+	iaux.hiocc_skip = fmi->hiocc_skip;
+#endif
+#ifdef ERT_INDEX_PREFETCH
+	/* two-stage software pipeline across the reads of the block: the k-mer table entry
+	   of the first k-mer of read l+2*pf is prefetched, then the root of its tree once it
+	   is read l+pf, so both are in cache when its first right extension starts */
+	int pf = iaux.prefetch = fmi->ert_prefetch;
+	for (int l=0; l<2*pf && l<nseq; l++)
+		prefetchKmerEntry(&iaux, (uint8_t*) seq_[l].seq, 0, seq_[l].l_seq);
+#endif
 	for (int l=0; l<nseq; l++)
 	{
+#ifdef ERT_INDEX_PREFETCH
+		if (pf > 0) {
+			if (l + 2*pf < nseq)
+				prefetchKmerEntry(&iaux, (uint8_t*) seq_[l + 2*pf].seq, 0, seq_[l + 2*pf].l_seq);
+			if (l + pf < nseq)
+				prefetchKmerRoot(&iaux, (uint8_t*) seq_[l + pf].seq, 0, seq_[l + pf].l_seq);
+		}
+#endif
 #if defined(PERFECT_MATCH) && !defined(DO_NORMAL)
 		if (is_pm[l]) {
 			kv_init(chain_ar[l]);
@@ -1131,8 +1218,6 @@ int mem_kernel1_core_ert(FMI_search *fmi,
 		char *seq = seq_[l].seq;
 		int len = seq_[l].l_seq;
 		int hasN = 0;
-		uint8_t unpacked_rc_queue_buf[READ_LEN];
-		assert(len <= READ_LEN);
 		
 		for (i = 0; i < len; ++i) {
 			hasN = seq[i] < 4 ? hasN : 1;
@@ -1142,21 +1227,14 @@ int mem_kernel1_core_ert(FMI_search *fmi,
 #ifdef PRINT_SMEM
 		printf("=====> Processing read '%s' <=====\n", seq_[l].name);
 #endif
-		int split_len = (int)(opt->min_seed_len * opt->split_factor + .499);
 
-		index_aux_t iaux;
-		iaux.kmer_offsets = kmer_offsets;
-		iaux.mlt_table = mlt_table;
-		iaux.bns = bns;
-		iaux.pac = pac;
-		iaux.ref_string = ref_string;
-
-		read_aux_t raux;
 		raux.min_seed_len = opt->min_seed_len;
 		raux.l_seq = len;
 		raux.read_name = seq_[l].name;
 		raux.unpacked_queue_buf = (uint8_t*) seq;
 		raux.unpacked_rc_queue_buf = unpacked_rc_queue_buf;
+		raux.lep = lep;
+		raux.lep_n = LEP_WORDS(len);
 		
 		hits->n = 0;
 
@@ -1188,6 +1266,17 @@ int mem_kernel1_core_ert(FMI_search *fmi,
 		}
 
 		/// 3. Apply LAST heuristic to find out non-overlapping seeds
+#ifdef SMEM_ACCEL
+		if (iaux.hiocc) {
+			uint64_t tim_last = __rdtsc();
+			last(&iaux, &raux, smems, opt->max_mem_intv, hits);
+			int cls = raux.n_hiocc > 0;
+			tprof[HIOCC_READ + cls][tid]++;
+			tprof[HIOCC_CYCLE + cls][tid] += __rdtsc() - tim_last;
+			if (iaux.hiocc_skip) tprof[HIOCC_SKIP][tid] += raux.n_hiocc;
+		}
+		else
+#endif
 		last(&iaux, &raux, smems, opt->max_mem_intv, hits);
 
 		ks_introsort(mem_smem_sort_lt, smems->n, smems->a);
@@ -1202,6 +1291,11 @@ int mem_kernel1_core_ert(FMI_search *fmi,
 		chn->n = mem_chain_flt(opt, chn->n, chn->a, tid);
 		mem_flt_chained_seeds(opt, bns, pac, seq_, chn->n, chn->a);
 	}
+	if (lep != lep_buf) {
+		free(unpacked_rc_queue_buf);
+		free(lep);
+	}
+	free(raux.lens);
 	tprof[MEM_BWT][tid] += __rdtsc() - tim;
 	return 1;
 }
@@ -1241,20 +1335,13 @@ int mem_kernel1_core(FMI_search *fmi,
 	tim = __rdtsc();
 	int n_pm_seq = 0;
 	char is_pm[nseq];
-	
+	int pm_ret[nseq];
+
+	find_perfect_match_batch(fmi->perfect_table, seq_, nseq, pm_ret);
 	for (int l=0; l<nseq; l++)
 	{
-		char *seq = seq_[l].seq;
 		int len = seq_[l].l_seq;
-			
-		int ret;
-#ifdef MEMSCALE
-		ret = fmi->perfect_table 
-				? find_perfect_match_entry(fmi->perfect_table, &seq_[l], len)
-				: FIND_PERFECT_NO_TABLE;
-#else
-		ret = find_perfect_match_entry(fmi->perfect_table, &seq_[l], len);
-#endif
+		int ret = pm_ret[l];
 		pprof[tid][ret]++;
 		if (ret == FIND_PERFECT_FW_MATCHED || ret == FIND_PERFECT_RC_MATCHED) {
 			n_pm_seq++;
@@ -1308,6 +1395,25 @@ int mem_kernel1_core(FMI_search *fmi,
 		// w.mmc.lim[l]		= (int32_t *) _mm_malloc((BATCH_SIZE + 32) * sizeof(int32_t), 64);
 	}
 
+	/* reads seeded before by this thread are taken from its SMEM cache ('mem -e') */
+	smem_cache_t *smc = NULL;
+	const smem_cache_ent_t **hit = NULL, *hit_buf[nseq];
+#if SA_COMPRESSION
+	smc = mmc->smc[tid];
+	if (smc) {
+		hit = hit_buf;
+		for (int l=0; l<nseq; l++) {
+			hit[l] = NULL;
+#if defined(PERFECT_MATCH) && !defined(DO_NORMAL)
+			if (seq_[l].perfect.exist)
+				continue;
+#endif
+			hit[l] = smem_cache_get(smc, (const uint8_t *) seq_[l].seq, seq_[l].l_seq);
+			tprof[hit[l] ? SMEM_CACHE_HIT : SMEM_CACHE_MISS][tid]++;
+		}
+	}
+#endif
+
 	SMEM	*matchArray   = mmc->matchArray[tid];
 	int32_t *min_intv_ar  = mmc->min_intv_ar[tid];
 	int16_t *query_pos_ar = mmc->query_pos_ar[tid];
@@ -1326,7 +1432,8 @@ int mem_kernel1_core(FMI_search *fmi,
 					 query_pos_ar,
 					 enc_qdb,
 					 rid,
-					 num_smem);
+					 num_smem,
+					 hit, tid);
 
 	if (num_smem >= *wsize_mem){
 		fprintf(stderr, "num_smem: %ld\n", num_smem);
@@ -1344,7 +1451,8 @@ int mem_kernel1_core(FMI_search *fmi,
 					seedBuf,
 					seedBufSize,
 					matchArray,
-					num_smem);
+					num_smem,
+					smc, hit);
 	
 	printf_(VER, "5. Done mem_chain..\n");
 	// tprof[MEM_CHAIN][tid] += __rdtsc() - tim;
@@ -1508,13 +1616,9 @@ static void worker_bwt(void *data, long seq_id, long batch_size, int tid)
 {
 	worker_t *w = (worker_t*) data;
 	printf_(VER, "4. Calling mem_kernel1_core..%ld %d\n", seq_id, tid);
-	int seedBufSz = w->seedBufSize;
-
-	int memSize = w->nreads; 
-	if (batch_size < BATCH_SIZE) {
-		seedBufSz = (memSize - seq_id) * AVG_SEEDS_PER_READ;
-		// fprintf(stderr, "[%0.4d] Info: adjusted seedBufSz %d\n", tid, seedBufSz);
-	}
+	// blocks are not all BATCH_SIZE long (kt_sched_t), so a block must not run into the
+	// seed buffer of the next one, which may be in flight on another thread
+	int seedBufSz = batch_size * AVG_SEEDS_PER_READ;
 
 	if (w->useErt) {
 		mem_kernel1_core_ert(w->fmi, w->opt, 
@@ -1583,6 +1687,7 @@ static void show_perfect_and_reg(const mem_opt_t *opt, perfect_table_t *pt,
 	uint32_t multi_loc = __get_multi_location(flags);
 	uint32_t location = s->perfect.location;
 	uint32_t num_fw, num_rc, *loc_fw, *loc_rc;
+	pt = perfect_table_for_len(pt, s->l_seq);
 	GET_MULTI_FW_AND_RC(pt->loc_table, multi_loc,
 						num_fw, loc_fw,
 						num_rc, loc_rc);
@@ -1719,7 +1824,9 @@ static void worker_sam(void *data, long seqid, long batch_size, int tid)
 			free(w->regs[i+1].a);
 		}
 #ifdef OPT_RW
+		if (w->opt->flag & MEM_F_BAM) bam_deflate(&samstr, w->opt->bam_level);
 		w->seqs[start].sam = samstr.s;
+		w->seqs[start].l_sam = samstr.l;
 #endif
 #else   // re-structured
 		// pre-processing
@@ -1754,6 +1861,10 @@ static void worker_sam(void *data, long seqid, long batch_size, int tid)
 		gcnt = 0;
 		pos = start >> 1;
 		kswr_t *myaln = aln;
+#ifdef OPT_RW
+		kstring_t samstr = {0, 0, 0};
+		ks_resize(&samstr, 1024 * batch_size);
+#endif
 		for (int i=start; i< end; i+=2)
 		{
 			mem_sam_pe_batch_post(w->opt, w->fmi->idx->bns,
@@ -1765,11 +1876,21 @@ static void worker_sam(void *data, long seqid, long batch_size, int tid)
 								  &w->mmc,
 								  gcnt,
 								  tid,
-								  w->useErt);
+								  w->useErt,
+#ifdef OPT_RW
+								  &samstr);
+#else
+								  NULL);
+#endif
 
 			free(w->regs[i].a);
 			free(w->regs[i+1].a);
 		}
+#ifdef OPT_RW
+		if (w->opt->flag & MEM_F_BAM) bam_deflate(&samstr, w->opt->bam_level);
+		w->seqs[start].sam = samstr.s;
+		w->seqs[start].l_sam = samstr.l;
+#endif
 		//tprof[SAM3][tid] += __rdtsc() - tim;	  
 		_mm_free(aln);  // kswr_t
 #endif
@@ -1820,7 +1941,9 @@ static void worker_sam(void *data, long seqid, long batch_size, int tid)
 			free(w->regs[i].a);
 		}
 
+		if (w->opt->flag & MEM_F_BAM) bam_deflate(&samstr, w->opt->bam_level);
 		w->seqs[seqid].sam = samstr.s;
+		w->seqs[seqid].l_sam = samstr.l;
 #else /* !OPT_RW */
 		for (int i=seqid; i<seqid + batch_size; i++)
 		{
@@ -1847,6 +1970,15 @@ static void worker_sam(void *data, long seqid, long batch_size, int tid)
 	}
 }
 
+/* Takes one block through seeding, BSW and SAM back to back, while its chains
+   and seeds are still in cache (MEM_F_FUSED). */
+static void worker_fused(void *data, long seq_id, long batch_size, int tid)
+{
+	worker_bwt(data, seq_id, batch_size, tid);
+	worker_aln(data, seq_id, batch_size, tid);
+	worker_sam(data, seq_id, batch_size, tid);
+}
+
 void mem_process_seqs(mem_opt_t *opt,
 					  int64_t n_processed,
 					  int n,
@@ -1867,13 +1999,28 @@ void mem_process_seqs(mem_opt_t *opt,
 	int n_ = n;
 	
 	uint64_t tim = __rdtsc();   
+	if ((opt->flag & MEM_F_FUSED) && (!(opt->flag & MEM_F_PE) || pes0)) {
+		// no insert-size inference needed, so no barrier between BSW and SAM
+		if (pes0)
+			memcpy_bwamem(pes, 4 * sizeof(mem_pestat_t), pes0, 4 * sizeof(mem_pestat_t), __FILE__, __LINE__);
+		fprintf(stderr, "[0000] Calling kt_for - worker_fused\n");
+		
+		kt_for(worker_fused, &w, n_, &w.sched[KT_PHASE_FUSED]); // SMEMs (+SAL), BSW, SAM
+		tprof[WORKER10][0] += __rdtsc() - tim;
+
+		fprintf(stderr, "\t[0000][ M::%s] Processed %d reads in %.3f "
+				"CPU sec, %.3f real sec\n",
+				__func__, n, cputime() - ctime, realtime() - rtime);
+		return;
+	}
+
 	fprintf(stderr, "[0000] 1. Calling kt_for - worker_bwt\n");
 	
-	kt_for(worker_bwt, &w, n_); // SMEMs (+SAL)
+	kt_for(worker_bwt, &w, n_, &w.sched[KT_PHASE_BWT]); // SMEMs (+SAL)
 
 	fprintf(stderr, "[0000] 2. Calling kt_for - worker_aln\n");
 	
-	kt_for(worker_aln, &w, n_); // BSW
+	kt_for(worker_aln, &w, n_, &w.sched[KT_PHASE_ALN]); // BSW
 	tprof[WORKER10][0] += __rdtsc() - tim;	  
 
 
@@ -1893,7 +2040,7 @@ void mem_process_seqs(mem_opt_t *opt,
 	tim = __rdtsc();
 	fprintf(stderr, "[0000] 3. Calling kt_for - worker_sam\n");
 	
-	kt_for(worker_sam, &w,  n_);   // SAM   
+	kt_for(worker_sam, &w,  n_, &w.sched[KT_PHASE_SAM]);   // SAM   
 	tprof[WORKER20][0] += __rdtsc() - tim;
 
 	fprintf(stderr, "\t[0000][ M::%s] Processed %d reads in %.3f "
@@ -2150,6 +2297,33 @@ void mem_reg2sam(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac,
 }
 
 #ifdef PERFECT_MATCH
+/* BAM twin of mem_aln2sam_perfect() (MEM_F_BAM) */
+static void mem_aln2bam_perfect(const mem_opt_t *opt, const bntseq_t *bns, kstring_t *str,
+				 const bseq1_t *s, const mem_aln_perfect_t *p, bool is_secondary)
+{
+	int i, l_seq = (p->flag & 0x100)? 0 : s->l_seq;
+	size_t off = bam_begin_rec(str, p->rid, p->pos, s->name, MAPQ_PERFECT_MATCH, p->flag&0xffff, l_seq, -1, -1, 0);
+
+	bam_put32(str, s->l_seq << 4 | bam_cigar_op[0]); // PERFECT_MATCH_CIGAR
+	bam_put_seq(str, s->seq, s->qual, 0, l_seq, p->is_rev);
+
+	bam_put_int(str, "NM", 0);
+	bam_begin_str(str, "MD"); kputw(s->l_seq, str); bam_end_str(str);
+	bam_put_int(str, "AS", s->l_seq * opt->a);
+	if (!is_secondary) bam_put_int(str, "XS", p->sub);
+	if (bwa_rg_id[0]) bam_put_str(str, "RG", bwa_rg_id);
+	if (s->comment) bam_put_sam_aux(str, s->comment);
+	if ((opt->flag&MEM_F_REF_HDR) && bns->anns[p->rid].anno != 0 && bns->anns[p->rid].anno[0] != 0) {
+		bam_begin_str(str, "XR");
+		int tmp = str->l;
+		kputs(bns->anns[p->rid].anno, str);
+		for (i = tmp; i < str->l; ++i) // replace TAB in the comment to SPACE
+			if (str->s[i] == '\t') str->s[i] = ' ';
+		bam_end_str(str);
+	}
+	bam_end_rec(str, off, 1, s->l_seq);
+}
+
 void mem_aln2sam_perfect(const mem_opt_t *opt, const bntseq_t *bns, kstring_t *str,
 				 bseq1_t *s, mem_aln_perfect_t *p, bool is_secondary)
 {   
@@ -2159,6 +2333,10 @@ void mem_aln2sam_perfect(const mem_opt_t *opt, const bntseq_t *bns, kstring_t *s
 	// set flag
 	p->flag |= p->is_rev ? 0x10 : 0; // is on the reverse strand
 	p->flag |= is_secondary ? 0x100 : 0; // is secondary alignment
+	if (opt->flag & MEM_F_BAM) {
+		mem_aln2bam_perfect(opt, bns, str, s, p, is_secondary);
+		return;
+	}
 
 	// print up to CIGAR
 	l_name = strlen(s->name);
@@ -2390,6 +2568,98 @@ static inline void add_cigar(const mem_opt_t *opt, mem_aln_t *p, kstring_t *str,
 	} else kputc('*', str); // having a coordinate but unaligned (e.g. when copy_mate is true)
 }
 
+/* BAM twin of the output part of mem_aln2sam() (MEM_F_BAM); p and m have their
+   flags and mate fields already set */
+static void mem_aln2bam(const mem_opt_t *opt, const bntseq_t *bns, kstring_t *str,
+				 const bseq1_t *s, int n, const mem_aln_t *list, int which, mem_aln_t *p, mem_aln_t *m)
+{
+	int i, qb = 0, qe = s->l_seq, l_seq, n_cigar = 0;
+	int32_t mrid = -1;
+	int64_t mpos = -1, tlen = 0, rlen = 0;
+
+	if (p->n_cigar && which && !(opt->flag&MEM_F_SOFTCLIP) && !p->is_alt) { // same clipping as SEQ in SAM
+		int l0 = p->cigar[0]>>4, l1 = p->cigar[p->n_cigar-1]>>4;
+		if ((p->cigar[0]&0xf) != 4 && (p->cigar[0]&0xf) != 3) l0 = 0;
+		if ((p->cigar[p->n_cigar-1]&0xf) != 4 && (p->cigar[p->n_cigar-1]&0xf) != 3) l1 = 0;
+		if (!p->is_rev) qb += l0, qe -= l1;
+		else qe -= l0, qb += l1;
+	}
+	l_seq = (p->flag & 0x100)? 0 : qe - qb;
+	if (m && m->rid >= 0) {
+		mrid = m->rid, mpos = m->pos;
+		if (p->rid == m->rid && m->n_cigar && p->n_cigar) {
+			int64_t p0 = p->pos + (p->is_rev? get_rlen(p->n_cigar, p->cigar) - 1 : 0);
+			int64_t p1 = m->pos + (m->is_rev? get_rlen(m->n_cigar, m->cigar) - 1 : 0);
+			tlen = -(p0 - p1 + (p0 > p1? 1 : p0 < p1? -1 : 0));
+		}
+	}
+	size_t off = bam_begin_rec(str, p->rid, p->rid >= 0? p->pos : -1, s->name, p->rid >= 0? p->mapq : 0,
+							   (p->flag&0xffff) | (p->flag&0x10000? 0x100 : 0), l_seq, mrid, mpos, tlen);
+
+	if (p->rid >= 0) { // CIGAR, with the hard clipping of add_cigar()
+		for (i = 0; i < p->n_cigar; ++i) {
+			int c = p->cigar[i]&0xf;
+			if (!(opt->flag&MEM_F_SOFTCLIP) && !p->is_alt && (c == 3 || c == 4))
+				c = which? 4 : 3;
+			if (c == 0 || c == 2) rlen += p->cigar[i]>>4;
+			bam_put32(str, (p->cigar[i]>>4) << 4 | bam_cigar_op[c]);
+		}
+		n_cigar = p->n_cigar;
+	}
+
+	if (l_seq) bam_put_seq(str, s->seq, s->qual, qb, qe, p->is_rev);
+
+	if (p->n_cigar) {
+		bam_put_int(str, "NM", p->NM);
+		bam_put_str(str, "MD", (char*)(p->cigar + p->n_cigar));
+	}
+#if V17
+	if (m && m->n_cigar) { bam_begin_str(str, "MC"); add_cigar(opt, m, str, which); bam_end_str(str); }
+#endif
+	if (p->score >= 0) bam_put_int(str, "AS", p->score);
+	if (p->sub >= 0) bam_put_int(str, "XS", p->sub);
+	if (bwa_rg_id[0]) bam_put_str(str, "RG", bwa_rg_id);
+	if (!(p->flag & 0x100)) { // not multi-hit
+		for (i = 0; i < n; ++i)
+			if (i != which && !(list[i].flag&0x100)) break;
+		if (i < n) { // there are other primary hits; output them
+			bam_begin_str(str, "SA");
+			for (i = 0; i < n; ++i) {
+				const mem_aln_t *r = &list[i];
+				int k;
+				if (i == which || (r->flag&0x100)) continue;
+				kputs(bns->anns[r->rid].name, str); kputc(',', str);
+				kputl(r->pos+1, str); kputc(',', str);
+				kputc("+-"[r->is_rev], str); kputc(',', str);
+				for (k = 0; k < r->n_cigar; ++k) {
+					kputw(r->cigar[k]>>4, str); kputc("MIDSH"[r->cigar[k]&0xf], str);
+				}
+				kputc(',', str); kputw(r->mapq, str);
+				kputc(',', str); kputw(r->NM, str);
+				kputc(';', str);
+			}
+			bam_end_str(str);
+		}
+		if (p->alt_sc > 0) {
+			char buf[32];
+			snprintf(buf, sizeof(buf), "%.3f", (double)p->score / p->alt_sc); // same value as the SAM text
+			float pa = strtof(buf, 0);
+			bam_put_tag(str, "pa", 'f'); kputsn((char*) &pa, 4, str);
+		}
+	}
+	if (p->XA) bam_put_str(str, "XA", p->XA);
+	if (s->comment) bam_put_sam_aux(str, s->comment);
+	if ((opt->flag&MEM_F_REF_HDR) && p->rid >= 0 && bns->anns[p->rid].anno != 0 && bns->anns[p->rid].anno[0] != 0) {
+		bam_begin_str(str, "XR");
+		int tmp = str->l;
+		kputs(bns->anns[p->rid].anno, str);
+		for (i = tmp; i < str->l; ++i) // replace TAB in the comment to SPACE
+			if (str->s[i] == '\t') str->s[i] = ' ';
+		bam_end_str(str);
+	}
+	bam_end_rec(str, off, n_cigar, rlen);
+}
+
 void mem_aln2sam(const mem_opt_t *opt, const bntseq_t *bns, kstring_t *str,
 				 bseq1_t *s, int n, const mem_aln_t *list, int which, const mem_aln_t *m_)
 {   
@@ -2407,6 +2677,10 @@ void mem_aln2sam(const mem_opt_t *opt, const bntseq_t *bns, kstring_t *str,
 		m->rid = p->rid, m->pos = p->pos, m->is_rev = p->is_rev, m->n_cigar = 0;
 	p->flag |= p->is_rev? 0x10 : 0; // is on the reverse strand
 	p->flag |= m && m->is_rev? 0x20 : 0; // is mate on the reverse strand
+	if (opt->flag & MEM_F_BAM) {
+		mem_aln2bam(opt, bns, str, s, n, list, which, p, m);
+		return;
+	}
 
 	// print up to CIGAR
 	l_name = strlen(s->name);
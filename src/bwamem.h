@@ -62,6 +62,7 @@
 #include "profiling.h"
 #include "FMI_search.h"
 #include "ertseeding.h"
+#include "smem_cache.h"
 
 #define MEM_MAPQ_COEF 30.0
 #define MEM_MAPQ_MAX  60
@@ -80,6 +81,8 @@ typedef struct __smem_i smem_i;
 #define MEM_F_PRIMARY5  0x800
 #define MEM_F_KEEP_SUPP_MAPQ 0x1000
 #define MEM_F_XB        0x2000
+#define MEM_F_FUSED     0x4000  // seeding, BSW and SAM per block without global barriers
+#define MEM_F_BAM       0x8000  // BGZF-compressed BAM instead of SAM text (OPT_RW only)
 
 // V17
 #define MEM_F_PRIMARY5  0x800
@@ -120,6 +123,9 @@ typedef struct mem_opt_t {
     int max_ins;            // when estimating insert size distribution, skip pairs with insert longer than this value
     int max_matesw;         // perform maximally max_matesw rounds of mate-SW for each end
     int max_XA_hits, max_XA_hits_alt; // if there are max_hits or fewer, output them all
+    int bam_level;          // deflate level of BAM output (MEM_F_BAM)
+    int64_t smem_cache_size; // bytes of SMEM cache over all threads; 0 to disable
+    int batch_size;         // reads per kt_for() block, up to BATCH_SIZE; 0 to adapt it to per-block timing
     int8_t mat[25];         // scoring matrix; mat[0] == 0 if unset
 } mem_opt_t;
 
@@ -220,6 +226,7 @@ typedef struct
     int32_t *lim[MAX_THREADS];
     int16_t *query_pos_ar[MAX_THREADS];
     uint8_t *enc_qdb[MAX_THREADS];
+    smem_cache_t *smc[MAX_THREADS];     // NULL without 'mem -e'
     
     int64_t wsize_mem[MAX_THREADS];
 } mem_cache;
@@ -250,6 +257,8 @@ typedef struct worker_t {
     int16_t           nthreads;
     int32_t           nreads;
     FMI_search       *fmi;  
+    struct kt_pool_t *pool;     // persistent kt_for() workers, NULL: spawn per call
+    kt_sched_t        sched[KT_NUM_PHASE]; // block sizes of the kt_for() phases
 } worker_t;
 
 
@@ -338,7 +347,7 @@ int mem_sam_pe_batch_post(const mem_opt_t *opt, const bntseq_t *bns,
                           const uint8_t *pac, const mem_pestat_t pes[4],
                           uint64_t id, bseq1_t s[2], mem_alnreg_v a[2],
                           kswr_t **myaln, mem_cache *mmc,
-                          int32_t &gcnt, int tid, int useErt);
+                          int32_t &gcnt, int tid, int useErt, kstring_t *samstr);
 
 int mem_matesw_batch_post_orig(const mem_opt_t *opt, const bntseq_t *bns,
 						  const uint8_t *pac, const mem_pestat_t pes[4],
@@ -982,7 +982,7 @@ int mem_sam_pe_batch_post(const mem_opt_t *opt, const bntseq_t *bns,
                           const uint8_t *pac, const mem_pestat_t pes[4],
                           uint64_t id, bseq1_t s[2], mem_alnreg_v a[2],
                           kswr_t **myaln, mem_cache *mmc, 
-                          int32_t &gcnt, int tid, int useErt)
+                          int32_t &gcnt, int tid, int useErt, kstring_t *samstr)
 {
     extern int mem_mark_primary_se(const mem_opt_t *opt, int n, mem_alnreg_t *a, int64_t id);
     extern int mem_approx_mapq_se(const mem_opt_t *opt, const mem_alnreg_t *a);
@@ -1144,13 +1144,20 @@ int mem_sam_pe_batch_post(const mem_opt_t *opt, const bntseq_t *bns,
                 aa[i][n_aa[i]++] = g[i];
             }
         }
-        for (i = 0; i < n_aa[0]; ++i)
-            mem_aln2sam(opt, bns, &str, &s[0], n_aa[0], aa[0], i, &h[1]); // write read1 hits
-        assert(str.s != 0);
-        s[0].sam = strdup(str.s); str.l = 0;
-        for (i = 0; i < n_aa[1]; ++i)
-            mem_aln2sam(opt, bns, &str, &s[1], n_aa[1], aa[1], i, &h[0]); // write read2 hits
-        s[1].sam = str.s;
+        if (samstr) { // appended to the batch string, as in mem_sam_pe_cont()
+            for (i = 0; i < n_aa[0]; ++i)
+                mem_aln2sam(opt, bns, samstr, &s[0], n_aa[0], aa[0], i, &h[1]); // write read1 hits
+            for (i = 0; i < n_aa[1]; ++i)
+                mem_aln2sam(opt, bns, samstr, &s[1], n_aa[1], aa[1], i, &h[0]); // write read2 hits
+        } else {
+            for (i = 0; i < n_aa[0]; ++i)
+                mem_aln2sam(opt, bns, &str, &s[0], n_aa[0], aa[0], i, &h[1]); // write read1 hits
+            assert(str.s != 0);
+            s[0].sam = strdup(str.s); str.l = 0;
+            for (i = 0; i < n_aa[1]; ++i)
+                mem_aln2sam(opt, bns, &str, &s[1], n_aa[1], aa[1], i, &h[0]); // write read2 hits
+            s[1].sam = str.s;
+        }
         if (strcmp(s[0].name, s[1].name) != 0) err_fatal(__func__, "paired reads have different names: \"%s\", \"%s\"\n", s[0].name, s[1].name);
         // free
         for (i = 0; i < 2; ++i) {
@@ -1179,8 +1186,16 @@ no_pairing:
         d = mem_infer_dir(bns->l_pac, a[0].a[0].rb, a[1].a[0].rb, &dist);
         if (!pes[d].failed && dist >= pes[d].low && dist <= pes[d].high) extra_flag |= 2;
     }
-    mem_reg2sam(opt, bns, pac, &s[0], &a[0], 0x41|extra_flag, &h[1]);
-    mem_reg2sam(opt, bns, pac, &s[1], &a[1], 0x81|extra_flag, &h[0]);
+#ifdef OPT_RW
+    if (samstr) {
+        mem_reg2sam_cont(opt, bns, pac, &s[0], &a[0], 0x41|extra_flag, &h[1], samstr);
+        mem_reg2sam_cont(opt, bns, pac, &s[1], &a[1], 0x81|extra_flag, &h[0], samstr);
+    } else
+#endif
+    {
+        mem_reg2sam(opt, bns, pac, &s[0], &a[0], 0x41|extra_flag, &h[1]);
+        mem_reg2sam(opt, bns, pac, &s[1], &a[1], 0x81|extra_flag, &h[0]);
+    }
     if (strcmp(s[0].name, s[1].name) != 0)
         err_fatal(__func__, "paired reads have different names: \"%s\", \"%s\"\n",
                   s[0].name, s[1].name);
@@ -32,6 +32,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <time.h>
 #include <zlib.h>
 #include "utils.h"
@@ -232,8 +233,19 @@ int bwa_bwt2sa(int argc, char *argv[]) // the "bwt2sa" command
 int bwa_index(int argc, char *argv[]) // the "index" command
 {
 	int c, algo_type = BWTALGO_MEM2, is_64 = 0, block_size = 10000000, readLength = READ_LEN, num_threads = 1;
+	int mh_pack = 1;
+	uint64_t max_mem = 0;
+	int keep_shards = 0;
+	int sa_compx = SA_COMPX;
 	char *prefix = 0, *str;
-	while ((c = getopt(argc, argv, "6a:p:t:")) >= 0) {
+#define INDEX_OPT_MAX_MEM 0x100 /* long options only */
+#define INDEX_OPT_KEEP_SHARDS 0x101
+	static struct option index_long_opts[] = {
+		{ "max-mem", required_argument, NULL, INDEX_OPT_MAX_MEM },
+		{ "keep-shards", no_argument, NULL, INDEX_OPT_KEEP_SHARDS },
+		{ NULL, 0, NULL, 0 }
+	};
+	while ((c = getopt_long(argc, argv, "6a:e:p:t:x:", index_long_opts, NULL)) >= 0) {
 		switch (c) {
 			case 'a': // if -a is not set, algo_type will be determined later
 				if (strcmp(optarg, "rb2") == 0) algo_type = BWTALGO_RB2;
@@ -243,12 +255,40 @@ int bwa_index(int argc, char *argv[]) // the "index" command
 				else if (strcmp(optarg, "ert") == 0) algo_type = BWTALGO_MLTS;
 				else { if (prefix) free(prefix); err_fatal(__func__, "unknown algorithm: '%s'.", optarg); }
 				break;
+			case 'e':
+				if (atoi(optarg) != 1 && atoi(optarg) != 2) {
+					if (prefix) free(prefix);
+					err_fatal(__func__, "ERT leaf encoding should be 1 or 2.");
+				}
+				mh_pack = (atoi(optarg) == 2);
+				break;
 			case 'p': prefix = strdup(optarg); break;
 			case '6': is_64 = 1; break;
 			case 't':
 				num_threads = atoi(optarg); 
 				assert(num_threads > 0 && num_threads < MAX_THREADS);
 				break;
+			case 'x':
+				sa_compx = atoi(optarg);
+				if (sa_compx < 0 || sa_compx > SA_COMPX_MAX) {
+					if (prefix) free(prefix);
+					err_fatal(__func__, "SA sampling factor should be 0 ~ %d.", SA_COMPX_MAX);
+				}
+				break;
+			case INDEX_OPT_MAX_MEM: {
+				char *p;
+				double x = strtod(optarg, &p);
+				if (*p == 'G' || *p == 'g') x *= 1024.0 * 1024.0 * 1024.0;
+				else if (*p == 'M' || *p == 'm') x *= 1024.0 * 1024.0;
+				else if (*p == 'K' || *p == 'k') x *= 1024.0;
+				if (x <= 0) {
+					if (prefix) free(prefix);
+					err_fatal(__func__, "--max-mem should be a positive size such as 64G.");
+				}
+				max_mem = (uint64_t)x;
+				break;
+			}
+			case INDEX_OPT_KEEP_SHARDS: keep_shards = 1; break;
 			default: if (prefix) free(prefix); return 1;
 		}
  	}
@@ -257,13 +297,22 @@ int bwa_index(int argc, char *argv[]) // the "index" command
 		fprintf(stderr, "\n");
 		fprintf(stderr, "Usage:   bwa-mem2 index [options] <in.fasta>\n\n");
 		fprintf(stderr, "Options: -a STR    BWT construction algorithm: bwtsw, is, rb2, mem2 or ert\n");
+		fprintf(stderr, "         -e INT    ERT multi-hit leaf lists: 1 for 5 B per hit, 2 to bit-pack a list when smaller [%d]\n", mh_pack + 1);
 		fprintf(stderr, "         -p STR    prefix of the index [same as fasta name]\n");
-		fprintf(stderr, "         -t INT    number of threads for ERT index building [%d]\n", num_threads);
+		fprintf(stderr, "         -t INT    number of threads for suffix array construction (mem2) and ERT index building [%d]\n", num_threads);
+		fprintf(stderr, "         -x INT    sample the suffix array every 2^INT rows (mem2) [%d]\n", SA_COMPX);
 		fprintf(stderr, "         -6        index files named as <in.fasta>.64.* instead of <in.fasta>.* \n");
+		fprintf(stderr, "         --max-mem SIZE\n");
+		fprintf(stderr, "                   cap the memory of ERT index building, e.g. 64G. Threads wait for memory when it is\n");
+		fprintf(stderr, "                   short; a single k-mer tree larger than the cap is built alone, above it [no cap]\n");
+		fprintf(stderr, "         --keep-shards\n");
+		fprintf(stderr, "                   keep the ERT shards after merging, so that a later build of an edited reference\n");
+		fprintf(stderr, "                   of the same length with the same prefix only rebuilds the shards the edit reaches\n");
 		fprintf(stderr, "\n");
 		fprintf(stderr,	"Warning: `-a bwtsw' does not work for short genomes, while `-a is' and\n");
 		fprintf(stderr, "         `-a div' do not work not for long genomes.\n\n");
-		fprintf(stderr, "         `-a ert' to build ERT index.\n\n");
+		fprintf(stderr, "         `-a ert' to build ERT index. An interrupted ERT build resumes from the\n");
+		fprintf(stderr, "         shards recorded in <prefix>.ert_manifest when rerun with the same options.\n\n");
 		if (prefix) {
 			free(prefix);
 		}
@@ -280,9 +329,19 @@ int bwa_index(int argc, char *argv[]) // the "index" command
 			fprintf(stderr, "[M::%s] Building BWT index with prefix %s ...\n", __func__, prefix);
 		}
 
-		// First build the BWT index with the prefix
-		algo_type = BWTALGO_AUTO;
-		bwa_idx_build(argv[optind], prefix, algo_type, block_size);
+		// First build the BWT index with the prefix, unless an interrupted build of the
+		// same reference already did
+		ert_manifest_t* prev = ert_manifest_load(prefix, argv[optind], readLength, mh_pack);
+		if (prev && prev->resume) {
+			if (bwa_verbose >= 3) {
+				fprintf(stderr, "[M::%s] Resuming ERT build, the BWT index is complete\n", __func__);
+			}
+		}
+		else {
+			ert_manifest_start(prefix, argv[optind], readLength, mh_pack);
+			algo_type = BWTALGO_AUTO;
+			bwa_idx_build(argv[optind], prefix, algo_type, block_size);
+		}
 
 		// Load BWT index
 		bwaidx_t* bid = bwa_idx_load_from_disk(prefix, BWA_IDX_BNS | BWA_IDX_BWT | BWA_IDX_PAC);
@@ -295,7 +354,8 @@ int bwa_index(int argc, char *argv[]) // the "index" command
 		strcat_s(kmer_tbl_file_name, PATH_MAX, ".kmer_table");
 
 		// Build ERT
-		buildKmerTrees(kmer_tbl_file_name, bid, prefix, num_threads, readLength);
+		buildKmerTrees(kmer_tbl_file_name, bid, prefix, num_threads, readLength, mh_pack, max_mem, keep_shards, prev);
+		ert_manifest_destroy(prev);
 
 		// Build reference in .0123 format similar to BWA-MEM2
 		if (bwa_verbose >= 3) {
@@ -305,7 +365,7 @@ int bwa_index(int argc, char *argv[]) // the "index" command
 		bwa_idx_destroy(bid);
 	}
 	else if (algo_type == BWTALGO_MEM2) {
-		bwa_idx_build_mem2(argv[optind], prefix);
+		bwa_idx_build_mem2(argv[optind], prefix, num_threads, sa_compx);
 	}
 	else {
 		bwa_idx_build(argv[optind], prefix, algo_type, block_size);
@@ -314,7 +374,7 @@ int bwa_index(int argc, char *argv[]) // the "index" command
 	return 0;
 }
 
-int bwa_idx_build_mem2(const char *fa, const char *prefix)
+int bwa_idx_build_mem2(const char *fa, const char *prefix, int n_threads, int sa_compx)
 {
 	extern void bwa_pac_rev_core(const char *fn, const char *fn_rev);
 
@@ -329,7 +389,7 @@ int bwa_idx_build_mem2(const char *fa, const char *prefix)
 		fprintf(stderr, "%.2f sec\n", (float)(clock() - t) / CLOCKS_PER_SEC);
 		err_gzclose(fp);
         FMI_search *fmi = new FMI_search(prefix);
-        fmi->build_index();
+        fmi->build_index(n_threads, sa_compx);
         delete fmi;
 	}
 	return 0;
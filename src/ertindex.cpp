@@ -7,7 +7,9 @@
 #include <pthread.h>
 #include <errno.h>
 #include <math.h>
-#include <fstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "utils.h"
 #include "ertindex.h"
 #include "memcpy_bwamem.h"
@@ -28,6 +30,7 @@ extern "C" {
 
 #define _set_pac(pac, l, c) ((pac)[(l)>>2] |= (c)<<(((l)&3)<<1))
 #define _set_pac_orig(pac, l, c) ((pac)[(l)>>2] |= (c)<<((~(l)&3)<<1))
+#define _get_pac(pac, l) ((pac)[(l)>>2]>>((~(l)&3)<<1)&3)
 
 inline void getNumBranchesForKmer(bwtintv_t ok[4], int* numBranches, uint8_t* uniform_bp) {
 	uint8_t i;
@@ -212,7 +215,7 @@ void ert_build_table(const bwt_t* bwt, const bntseq_t *bns, const uint8_t *pac,
 		bwtintv_t ik, bwtintv_t ok[4], uint8_t* mlt_data, uint8_t* mh_data,  
 		uint64_t* size, uint64_t* mh_size, uint8_t* aq, 
 		uint64_t* numHits, uint64_t* max_next_ptr, uint64_t next_ptr_width,
-		int step, int max_depth) {
+		int mh_pack, int step, int max_depth) {
 
 	uint64_t byte_idx = *size;
 	uint64_t mh_byte_idx = *mh_size;
@@ -275,7 +278,7 @@ void ert_build_table(const bwt_t* bwt, const bntseq_t *bns, const uint8_t *pac,
 			n->start_addr = mlt_byte_idx;
 			ert_build_kmertree(bwt, bns, pac, ik, ok, kmerSize+j, n, step, max_depth);
 			ert_traverse_kmertree(n, mlt_data, mh_data, &mlt_byte_idx, &mh_byte_idx, kmerSize+j, numHits, 
-					max_next_ptr, next_ptr_width, step);
+					max_next_ptr, next_ptr_width, mh_pack, step);
 			ert_destroy_kmertree(n);
 		}
 		if (num_hits < 20) {
@@ -332,8 +335,61 @@ void addLeafNode(uint8_t* mlt_data, uint64_t* byte_idx, uint64_t ref_pos, int st
 	*byte_idx += 5;
 }
 
-void addMultiHitLeafNode(uint8_t* mlt_data, uint64_t* byte_idx, uint64_t count, uint64_t* hits, int step) {
-	uint16_t k = 0;
+//
+// Bit width of a packed multi-hit list, or 0 to keep the plain list of 5 B hits.
+// Hits are only known in step 1, so step 0 always sizes the plain list and
+// the mh region of a k-mer can only shrink in step 1.
+//
+int getMultiHitWidth(uint64_t count, uint64_t* hits, int mh_pack, int step) {
+	uint64_t k, min_pos, max_pos;
+	int width = 1;
+	if (step != 1 || mh_pack == 0 || count < 2) {
+		return 0;
+	}
+	min_pos = max_pos = hits[0];
+	for (k = 1; k < count; ++k) {
+		if (hits[k] < min_pos) min_pos = hits[k];
+		if (hits[k] > max_pos) max_pos = hits[k];
+	}
+	while (width < 40 && ((max_pos - min_pos) >> width)) {
+		width++;
+	}
+	if (6 + ((count * width + 7) >> 3) >= 5 * count) {
+		return 0;
+	}
+	return width;
+}
+
+//
+// Plain list: count x 5 B, (ref_pos << 1) | 1
+// Packed list (width > 0): 1 B width, 5 B base (smallest ref_pos), then count x width bits
+// holding ref_pos - base, LSB first. Hits keep their SA order in both, since
+// the seeding samples hits by index when a seed has more than max_occ of them.
+//
+void addMultiHitLeafNode(uint8_t* mlt_data, uint64_t* byte_idx, uint64_t count, uint64_t* hits, int width, int step) {
+	uint64_t k = 0;
+	if (width > 0) {
+		uint64_t base = hits[0];
+		for (k = 1; k < count; ++k) {
+			if (hits[k] < base) base = hits[k];
+		}
+		if (step == 1) {
+			mlt_data[*byte_idx] = width;
+			memcpy_bwamem(&mlt_data[*byte_idx + 1], 5 * sizeof(uint8_t), &base, 5 * sizeof(uint8_t), __FILE__, __LINE__);
+			uint8_t* p = &mlt_data[*byte_idx + 6];
+			uint64_t bit = 0;
+			memset_s(p, (count * width + 7) >> 3, 0);
+			for (k = 0; k < count; ++k, bit += width) {
+				uint64_t v = (hits[k] - base) << (bit & 7);
+				int j;
+				for (j = 0; v; ++j, v >>= 8) {
+					p[(bit >> 3) + j] |= (uint8_t)v;
+				}
+			}
+		}
+		*byte_idx += 6 + ((count * width + 7) >> 3);
+		return;
+	}
 	for (k = 0; k < count; ++k) {
 		if (step == 1) {
 			uint64_t leaf_data = (hits[k] << 1) | 1ULL;
@@ -350,15 +406,18 @@ void addMultiHitLeafCount(uint8_t* mlt_data, uint64_t* byte_idx, uint64_t count,
 	*byte_idx += 2;
 }
 
-void addMultiHitLeafPtr(uint8_t* mlt_data, uint64_t* byte_idx, uint64_t mh_byte_idx, int step) {
+void addMultiHitLeafPtr(uint8_t* mlt_data, uint64_t* byte_idx, uint64_t mh_byte_idx, int width, int step) {
 	if (step == 1) {
 		uint64_t mh_data = (mh_byte_idx << 1) | 1ULL; 
+		if (width > 0) {
+			mh_data |= MH_PACKED_LIST;
+		}
 		memcpy_bwamem(&mlt_data[*byte_idx], 5 * sizeof(uint8_t), &mh_data, 5 * sizeof(uint8_t), __FILE__, __LINE__);
 	}
 	*byte_idx += 5;
 } 
 
-void ert_traverse_kmertree(node_t* n, uint8_t* mlt_data, uint8_t* mh_data, uint64_t* size, uint64_t* mh_size, int depth, uint64_t* numHits, uint64_t* max_ptr, uint64_t next_ptr_width, int step) {
+void ert_traverse_kmertree(node_t* n, uint8_t* mlt_data, uint8_t* mh_data, uint64_t* size, uint64_t* mh_size, int depth, uint64_t* numHits, uint64_t* max_ptr, uint64_t next_ptr_width, int mh_pack, int step) {
 	int j = 0;
 	int cur_depth = depth;
 	uint64_t byte_idx = *size;
@@ -376,9 +435,10 @@ void ert_traverse_kmertree(node_t* n, uint8_t* mlt_data, uint8_t* mh_data, uint6
   // assert(child->numHits > 1);
 			code |= (LEAF << (c << 1));
 			addCode(mlt_data, &byte_idx, code, step);
-			addMultiHitLeafPtr(mlt_data, &byte_idx, mh_byte_idx, step);
+			int width = getMultiHitWidth(child->numHits, child->hits, mh_pack, step);
+			addMultiHitLeafPtr(mlt_data, &byte_idx, mh_byte_idx, width, step);
 			addMultiHitLeafCount(mh_data, &mh_byte_idx, child->numHits, step);
-			addMultiHitLeafNode(mh_data, &mh_byte_idx, child->numHits, child->hits, step);
+			addMultiHitLeafNode(mh_data, &mh_byte_idx, child->numHits, child->hits, width, step);
 			*numHits += child->numHits;
 		}
 		else {
@@ -387,7 +447,7 @@ void ert_traverse_kmertree(node_t* n, uint8_t* mlt_data, uint8_t* mh_data, uint6
 			addCode(mlt_data, &byte_idx, code, step);
 			addUniformNode(mlt_data, &byte_idx, child->num_bp, &child->seq[child->pos], child->numHits, step);
 			ert_traverse_kmertree(child, mlt_data, mh_data, &byte_idx, &mh_byte_idx, cur_depth+child->num_bp, 
-					numHits, max_ptr, next_ptr_width, step);
+					numHits, max_ptr, next_ptr_width, mh_pack, step);
 		}
 	}
 	else {
@@ -425,9 +485,10 @@ void ert_traverse_kmertree(node_t* n, uint8_t* mlt_data, uint8_t* mh_data, uint6
 					addLeafNode(mlt_data, &byte_idx, child->hits[0], step);
 				}
 				else {
-					addMultiHitLeafPtr(mlt_data, &byte_idx, mh_byte_idx, step);
+					int width = getMultiHitWidth(child->numHits, child->hits, mh_pack, step);
+					addMultiHitLeafPtr(mlt_data, &byte_idx, mh_byte_idx, width, step);
 					addMultiHitLeafCount(mh_data, &mh_byte_idx, child->numHits, step);
-					addMultiHitLeafNode(mh_data, &mh_byte_idx, child->numHits, child->hits, step);
+					addMultiHitLeafNode(mh_data, &mh_byte_idx, child->numHits, child->hits, width, step);
 				}
 			}
 		}
@@ -439,7 +500,7 @@ void ert_traverse_kmertree(node_t* n, uint8_t* mlt_data, uint8_t* mh_data, uint6
 			assert(child->type != UNIFORM);
 			if (child->type == DIVERGE) {
 				ert_traverse_kmertree(child, mlt_data, mh_data, &byte_idx, &mh_byte_idx, 
-						cur_depth+1, numHits, max_ptr, next_ptr_width, step);
+						cur_depth+1, numHits, max_ptr, next_ptr_width, mh_pack, step);
 				numHitsForChildren[other_idx] = child->numHits; 
 				other_idx++;
 				ptrToOtherNodes[other_idx] = byte_idx;
@@ -488,81 +549,506 @@ void ert_destroy_kmertree(node_t* n) {
 }
 
 //
-// This function builds the ERT index. 
+// Take bytes from the --max-mem budget. With wait == 0, returns 0 instead of waiting.
+// A thread over the budget waits for the others to release memory. When all others
+// wait too it goes on alone, so a tree larger than the budget is still built, but
+// never next to another one.
+//
+static int acquireMem(thread_data_t* data, uint64_t bytes, int wait) {
+	ert_mem_t* mem = data->mem;
+	if (mem->limit == 0) {
+		return 1;
+	}
+	pthread_mutex_lock(data->lock);
+	while (mem->used + bytes > mem->limit && mem->n_running > 1) {
+		if (!wait) {
+			pthread_mutex_unlock(data->lock);
+			return 0;
+		}
+		mem->n_running--;
+		pthread_cond_wait(&mem->cond, data->lock);
+		mem->n_running++;
+	}
+	if (mem->used + bytes > mem->limit && !mem->over) {
+		fprintf(stderr, "[M::%s] A k-mer tree takes the build %.2f GB over --max-mem, it is built alone\n", 
+				__func__, (mem->used + bytes - mem->limit) / (1024.0 * 1024.0 * 1024.0));
+		mem->over = 1;
+	}
+	mem->used += bytes;
+	if (mem->used > mem->peak) {
+		mem->peak = mem->used;
+	}
+	pthread_mutex_unlock(data->lock);
+	return 1;
+}
+
+static void releaseMem(thread_data_t* data, uint64_t bytes) {
+	ert_mem_t* mem = data->mem;
+	if (mem->limit == 0 || bytes == 0) {
+		return;
+	}
+	pthread_mutex_lock(data->lock);
+	assert(mem->used >= bytes);
+	mem->used -= bytes;
+	pthread_cond_broadcast(&mem->cond);
+	pthread_mutex_unlock(data->lock);
+}
+
+//
+// Upper bound of the memory of a tree with numHits hits: a divergence adds at most
+// 4 children, each with at most one uniform node, and the leaves hold the hits
+//
+static uint64_t treeMem(uint64_t numHits) {
+	return (5 * numHits + 1) * sizeof(node_t) + numHits * sizeof(uint64_t);
+}
+
+//
+// Largest number of hits of the x-mer trees of a FREQUENT k-mer, which
+// ert_build_table() builds one at a time
+//
+static uint64_t maxXmerHits(const bwt_t* bwt, bwtintv_t ik) {
+	bwtintv_t ok[4], ik_x;
+	uint8_t aq1[xmerSize];
+	uint64_t max_hits = 0;
+	int i, j;
+	for (i = 0; i < numXmers; ++i) {
+		kmertoquery(i, aq1, xmerSize);
+		ik_x = ik;
+		for (j = 0; j < xmerSize; ++j) {
+			bwt_extend(bwt, &ik_x, ok, 0);
+			ik_x = ok[3 - aq1[j]];
+			if (ik_x.x[2] == 0) {
+				break;
+			}
+		}
+		if (ik_x.x[2] > max_hits) {
+			max_hits = ik_x.x[2];
+		}
+	}
+	return max_hits;
+}
+
+//
+// Reserve the memory of a tree. If the budget is short, the tree buffers are
+// given back before waiting, reserveTreeBuf() takes them again.
+//
+static void reserveTreeMem(thread_data_t* data, uint64_t bytes, uint8_t** mlt_data, uint64_t* mlt_cap, uint8_t** mh_data, uint64_t* mh_cap) {
+	if (!acquireMem(data, bytes, 0)) {
+		releaseMem(data, *mlt_cap + *mh_cap);
+		free(*mlt_data);
+		free(*mh_data);
+		*mlt_data = *mh_data = NULL;
+		*mlt_cap = *mh_cap = 0;
+		acquireMem(data, bytes, 1);
+	}
+}
+
+//
+// Grow a per-thread tree buffer to at least size bytes. The used part is cleared,
+// so a k-mer tree is written into zeroed memory as with the former per-k-mer calloc().
+//
+static uint8_t* reserveTreeBuf(thread_data_t* data, uint8_t* buf, uint64_t* cap, uint64_t size) {
+	if (size > *cap) {
+		free(buf);
+		acquireMem(data, size - *cap, 1);
+		*cap = size;
+		buf = (uint8_t*) malloc(*cap);
+		assert(buf != NULL);
+	}
+	if (size > 0) {
+		memset_s(buf, size, 0);
+	}
+	return buf;
+}
+
+static void spillKmerEntries(FILE* fd, uint64_t* buf, uint64_t* n) {
+	if (*n > 0 && fwrite(buf, sizeof(uint64_t), *n, fd) != *n) {
+		fprintf(stderr, "[M::%s] Can't write per-shard k-mer table, errno = %d\n", __func__, errno);
+		exit(1);
+	}
+	*n = 0;
+}
+
+static void writeTree(FILE* fd, const uint8_t* buf, uint64_t n) {
+	if (n > 0 && fwrite(buf, sizeof(uint8_t), n, fd) != n) {
+		fprintf(stderr, "[M::%s] Can't write per-shard multi-level tree, errno = %d\n", __func__, errno);
+		exit(1);
+	}
+}
+
+//
+// Backward search of k-mer idx. The LEP has bit i-1 set where the hit set changes at
+// the i-th base. On return, ik and ok[*c] are the intervals from the last extension
+// and *len is the length of the longest prefix of the k-mer with hits.
+//
+static uint64_t getKmerLEP(const bwt_t* bwt, uint64_t idx, uint8_t* aq, bwtintv_t* ik, bwtintv_t ok[4], int* len, uint8_t* c) {
+	uint64_t lep = 0, prevHits;
+	int i;
+	*c = 0;
+	kmertoquery(idx, aq, kmerSize); // represent k-mer as uint8_t*
+	assert(aq[0] >= 0 && aq[0] <= 3);
+	bwt_set_intv(bwt, aq[0], *ik); // the initial interval of a single base
+	ik->info = 1; 
+	prevHits = ik->x[2];
+	for (i = 1; i < kmerSize; ++i) {
+		*c = 3 - aq[i]; 
+		bwt_extend(bwt, ik, ok, 0); // ok contains the result of BWT extension
+		if (ok[*c].x[2] != prevHits) { // hit set changes
+			lep |= (1ULL << (i-1));
+		}
+		//
+		// Extend left till k-mer has zero hits
+		//
+		if (ok[*c].x[2] >= 1) { prevHits = ok[*c].x[2]; *ik = ok[*c]; ik->info = i + 1; }
+		else { break; }
+	}
+	*len = i;
+	return lep;
+}
+
+static void shardFileNames(const char* prefix, int sid, char* ml_tbl_file_name, char* kmer_tbl_file_name) {
+	snprintf_s_si(ml_tbl_file_name, PATH_MAX, "%s.mlt_table_%d", prefix, sid);
+	snprintf_s_si(kmer_tbl_file_name, PATH_MAX, "%s.kmer_table_%d", prefix, sid);
+}
+
+static void manifestFileName(const char* prefix, char* name) {
+	strcpy_s(name, PATH_MAX, prefix);
+	strcat_s(name, PATH_MAX, ".ert_manifest");
+}
+
+static void versionFileName(const char* prefix, char* name) {
+	strcpy_s(name, PATH_MAX, prefix);
+	strcat_s(name, PATH_MAX, ".ert_version");
+}
+
+//
+// Make the renames of shard files durable before the manifest refers to them
+//
+static void syncPrefixDir(const char* prefix) {
+	char dir[PATH_MAX];
+	strcpy_s(dir, PATH_MAX, prefix);
+	char* p = strrchr(dir, '/');
+	if (p == NULL) {
+		strcpy_s(dir, PATH_MAX, ".");
+	}
+	else if (p == dir) {
+		dir[1] = '\0';
+	}
+	else {
+		*p = '\0';
+	}
+	int fd = open(dir, O_RDONLY);
+	if (fd >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+}
+
+static void closeDurable(FILE* fd, const char* tmp_name, const char* name) {
+	if (fflush(fd) != 0 || ferror(fd) || fsync(fileno(fd)) != 0 || fclose(fd) != 0 || rename(tmp_name, name) != 0) {
+		fprintf(stderr, "[M::%s] Can't complete shard file %s, errno = %d\n", __func__, name, errno);
+		exit(1);
+	}
+}
+
+static void appendManifest(FILE* fd, const char* line) {
+	if (fputs(line, fd) < 0 || fflush(fd) != 0 || fsync(fileno(fd)) != 0) {
+		fprintf(stderr, "[M::%s] Can't write ERT manifest, errno = %d\n", __func__, errno);
+		exit(1);
+	}
+}
+
+static uint64_t hashPac(const uint8_t* pac, int64_t l_pac) {
+	uint64_t h = 14695981039346656037ULL; // FNV-1a
+	int64_t i;
+	for (i = 0; i < l_pac/4+1; ++i) {
+		h = (h ^ pac[i]) * 1099511628211ULL;
+	}
+	return h;
+}
+
+static void initShards(ert_shard_t* shards) {
+	int s;
+	memset_s(shards, ert_num_shards * sizeof(ert_shard_t), 0);
+	for (s = 0; s < ert_num_shards; ++s) {
+		shards[s].startKmer = s * (numKmers / ert_num_shards);
+		shards[s].endKmer = (s + 1) * (numKmers / ert_num_shards);
+	}
+}
+
+//
+// Manifest of the ERT build, a text file appended and synced line by line:
+//   ert_manifest <kmerSize> <ert_num_shards> <readLength> <mh_pack>
+//   fasta <size> <mtime> <path>        when the build started
+//   bwt <l_pac> <pac hash>             BWT, SA and .pac are complete
+//   shard <id> <tree bytes> <multi-hit bytes saved> <reused>
+//   merged                             the index files are complete and shards were kept
+// A line cut short by a crash has no newline and is ignored.
+//
+void ert_manifest_start(const char* prefix, const char* fa, int readLength, int mh_pack) {
+	char name[PATH_MAX];
+	struct stat st;
+	manifestFileName(prefix, name);
+	if (stat(fa, &st) != 0) {
+		fprintf(stderr, "[M::%s] Can't stat %s\n", __func__, fa);
+		exit(1);
+	}
+	FILE* fd = fopen(name, "w");
+	if (fd == NULL) {
+		fprintf(stderr, "[M::%s] Can't create ERT manifest %s, errno = %d\n", __func__, name, errno);
+		exit(1);
+	}
+	fprintf(fd, "ert_manifest %d %d %d %d\n", kmerSize, ert_num_shards, readLength, mh_pack);
+	fprintf(fd, "fasta %ld %ld %s\n", (long)st.st_size, (long)st.st_mtime, fa);
+	appendManifest(fd, "");
+	fclose(fd);
+}
+
+static int shardFilesValid(const char* prefix, int sid, const ert_shard_t* shard) {
+	char ml_tbl_file_name[PATH_MAX], kmer_tbl_file_name[PATH_MAX];
+	struct stat st;
+	shardFileNames(prefix, sid, ml_tbl_file_name, kmer_tbl_file_name);
+	if (stat(kmer_tbl_file_name, &st) != 0 || (uint64_t)st.st_size != (shard->endKmer - shard->startKmer) * sizeof(uint64_t)) {
+		return 0;
+	}
+	return stat(ml_tbl_file_name, &st) == 0 && (uint64_t)st.st_size == shard->end_offset;
+}
+
+//
+// Read the manifest of an earlier ERT build of prefix with the same parameters.
+// resume: the build was for the same reference and its BWT is complete.
+// update: the build of another reference was merged with --keep-shards. Its .pac is
+// loaded before the BWT is rebuilt, so buildKmerTrees() reuses unaffected shards.
+// Returns NULL if there is nothing to reuse.
+//
+ert_manifest_t* ert_manifest_load(const char* prefix, const char* fa, int readLength, int mh_pack) {
+	char name[PATH_MAX], line[PATH_MAX + 64], path[PATH_MAX];
+	int k, n_shards, rl, mp, sid, reused, has_bwt = 0, merged = 0, same_fa = 0;
+	long size, mtime;
+	unsigned long end_offset, mh_saved;
+	struct stat st;
+	manifestFileName(prefix, name);
+	FILE* fd = fopen(name, "r");
+	if (fd == NULL) {
+		return NULL;
+	}
+	if (fgets(line, sizeof(line), fd) == NULL || sscanf(line, "ert_manifest %d %d %d %d", &k, &n_shards, &rl, &mp) != 4 ||
+			k != kmerSize || n_shards != ert_num_shards || rl != readLength || mp != mh_pack) {
+		if (bwa_verbose >= 3) {
+			fprintf(stderr, "[M::%s] Ignoring %s of a build with other parameters\n", __func__, name);
+		}
+		fclose(fd);
+		return NULL;
+	}
+	ert_manifest_t* m = (ert_manifest_t*) calloc(1, sizeof(ert_manifest_t));
+	assert(m != NULL);
+	initShards(m->shards);
+	while (fgets(line, sizeof(line), fd) != NULL) {
+		if (strchr(line, '\n') == NULL) {
+			break;
+		}
+		*strchr(line, '\n') = '\0';
+		if (sscanf(line, "fasta %ld %ld %n", &size, &mtime, &k) == 2) {
+			strcpy_s(path, PATH_MAX, line + k);
+			same_fa = stat(fa, &st) == 0 && strcmp(path, fa) == 0 && st.st_size == size && st.st_mtime == mtime;
+		}
+		else if (sscanf(line, "bwt %ld %lu", &m->l_pac, &m->pac_hash) == 2) {
+			has_bwt = 1;
+		}
+		else if (sscanf(line, "shard %d %lu %lu %d", &sid, &end_offset, &mh_saved, &reused) == 4 && sid >= 0 && sid < ert_num_shards) {
+			m->shards[sid].end_offset = end_offset;
+			m->shards[sid].mh_saved = mh_saved;
+			m->shards[sid].reused = reused;
+			m->shards[sid].done = shardFilesValid(prefix, sid, &m->shards[sid]);
+		}
+		else if (strcmp(line, "merged") == 0) {
+			merged = 1;
+		}
+	}
+	fclose(fd);
+	if (!has_bwt || (!same_fa && !merged)) {
+		ert_manifest_destroy(m);
+		return NULL;
+	}
+	if (same_fa) {
+		m->resume = 1;
+		return m;
+	}
+
+	// Keep the earlier reference before bwa_idx_build() overwrites it
+	char pac_file_name[PATH_MAX];
+	strcpy_s(pac_file_name, PATH_MAX, prefix);
+	strcat_s(pac_file_name, PATH_MAX, ".pac");
+	m->old_pac = (uint8_t*) calloc(m->l_pac/4+1, 1);
+	assert(m->old_pac != NULL);
+	fd = fopen(pac_file_name, "rb");
+	if (fd == NULL || fread(m->old_pac, 1, m->l_pac/4+1, fd) != (size_t)(m->l_pac/4+1) || hashPac(m->old_pac, m->l_pac) != m->pac_hash) {
+		if (bwa_verbose >= 3) {
+			fprintf(stderr, "[M::%s] %s does not match %s, kept shards are not reused\n", __func__, pac_file_name, name);
+		}
+		if (fd != NULL) {
+			fclose(fd);
+		}
+		ert_manifest_destroy(m);
+		return NULL;
+	}
+	fclose(fd);
+	m->update = 1;
+	return m;
+}
+
+void ert_manifest_destroy(ert_manifest_t* m) {
+	if (m != NULL) {
+		free(m->old_pac);
+		free(m);
+	}
+}
+
+static inline uint8_t textBase(const uint8_t* pac, int64_t l_pac, int64_t i) {
+	return i < l_pac ? _get_pac(pac, i) : 3 - _get_pac(pac, (l_pac << 1) - 1 - i);
+}
+
+// Index of the k-mer at i of the text indexed by the BWT (forward then reverse complement strand)
+static inline uint64_t textKmer(const uint8_t* pac, int64_t l_pac, int64_t i) {
+	uint64_t idx = 0;
+	int j;
+	if (i < 0 || i + kmerSize > (l_pac << 1)) {
+		return numKmers;
+	}
+	for (j = 0; j < kmerSize; ++j) {
+		idx |= (uint64_t)textBase(pac, l_pac, i + j) << (j << 1);
+	}
+	return idx;
+}
+
+static inline void markShard(uint64_t idx, uint8_t* dirty, int* n_dirty) {
+	if (idx < numKmers && !dirty[idx / (numKmers / ert_num_shards)]) {
+		dirty[idx / (numKmers / ert_num_shards)] = 1;
+		*n_dirty += 1;
+	}
+}
+
+//
+// Mark the shards whose trees differ between the old and new reference of the same length.
+// For each substituted base at e on either strand, the trees of the k-mers at the suffixes
+// starting in [e-readLength+1, e] change, and the k-mers covering e also lose the old hit.
+// The hits of a multi-hit leaf are in suffix array order, so suffixes further left whose
+// repeat extends to e may be reordered: they are followed while T[q, e) occurs more than once.
+//
+static int markDirtyShards(const bwt_t* bwt, const uint8_t* pac, const uint8_t* old_pac, int64_t l_pac, int readLength, uint8_t* dirty) {
+	int64_t p, q, e, j, n_edits = 0;
+	int strand, n_dirty = 0;
+	bwtintv_t ik, ok[4];
+	for (p = 0; p < l_pac && n_dirty < ert_num_shards; ++p) {
+		if ((p & 3) == 0 && pac[p>>2] == old_pac[p>>2]) {
+			p += 3;
+			continue;
+		}
+		if (_get_pac(pac, p) == _get_pac(old_pac, p)) {
+			continue;
+		}
+		++n_edits;
+		for (strand = 0; strand < 2; ++strand) {
+			e = strand == 0 ? p : (l_pac << 1) - 1 - p;
+			q = e - readLength + 1 > 0 ? e - readLength + 1 : 0;
+			for (j = q; j <= e; ++j) {
+				markShard(textKmer(pac, l_pac, j), dirty, &n_dirty);
+				if (j > e - kmerSize) {
+					markShard(textKmer(old_pac, l_pac, j), dirty, &n_dirty);
+				}
+			}
+			if (q == 0 || q == e) {
+				continue;
+			}
+			bwt_set_intv(bwt, textBase(pac, l_pac, e - 1), ik);
+			for (j = e - 2; j >= q; --j) {
+				bwt_extend(bwt, &ik, ok, 1);
+				ik = ok[textBase(pac, l_pac, j)];
+			}
+			while (ik.x[2] > 1 && --q >= 0) {
+				bwt_extend(bwt, &ik, ok, 1);
+				ik = ok[textBase(pac, l_pac, q)];
+				if (ik.x[2] > 1) {
+					markShard(textKmer(pac, l_pac, q), dirty, &n_dirty);
+				}
+			}
+		}
+	}
+	if (bwa_verbose >= 3) {
+		fprintf(stderr, "[M::%s] %ld bases differ from the earlier reference, %d of %d shards are rebuilt\n", 
+				__func__, n_edits, n_dirty, ert_num_shards);
+	}
+	return n_dirty;
+}
+
+//
+// This function builds the ERT index of a shard in a single pass over its k-mers.
+// Each k-mer tree is built once, sized with step-0 traversals and written with a
+// step-1 traversal. Trees are appended to a per-shard file and k-mer entries, with
+// offsets relative to the shard, to a second one. mergeIndex() relocates both.
 // Note on pointers to child nodes: When building the radix tree for each k-mer, 
 // we try 3 values for pointers to child nodes, 2,3,4 B and choose the smallest
 // one possible.
 //
-void* buildIndex(void *arg) {
+static void buildShard(thread_data_t* data, int sid) {
 
-	thread_data_t *data = (thread_data_t *)arg;
+	ert_shard_t* shard = &data->shards[sid];
 	bwtintv_t ik, ok[4];
 	uint64_t idx = 0;
 	uint8_t aq[kmerSize];
 	int i; 
 	uint8_t c;
-	uint64_t lep, prevHits, numBytesPerKmer, numBytesForMh, ref_pos, total_hits = 0, ptr = 0, max_next_ptr = 0;
-	uint64_t next_ptr_width = 0; 
+	uint64_t lep, numBytesPerKmer, numBytesForMh, ref_pos, total_hits = 0, ptr = 0, max_next_ptr = 0;
+	uint64_t next_ptr_width = 0, kmer_hits = 0; 
 	uint64_t nKmerSmallPtr = 0, nKmerMedPtr = 0, nKmerLargePtr = 0;
 	uint16_t kmer_data = 0;
+	uint8_t *mlt_data = 0, *mh_data = 0;
+	uint64_t mlt_cap = 0, mh_cap = 0, num_entries = 0, tree_mem = 0;
+	acquireMem(data, ert_spill_entries * sizeof(uint64_t), 1);
+	uint64_t* kmer_entries = (uint64_t*) malloc(ert_spill_entries * sizeof(uint64_t));
+	assert(kmer_entries != NULL);
 
-	// File to write the multi-level tree index
-	char ml_tbl_file_name[PATH_MAX];
-	snprintf_s_si(ml_tbl_file_name, PATH_MAX, "%s.mlt_table_%d", data->filePrefix, data->tid);
+	// Files of the multi-level tree index and the k-mer entries, renamed once complete
+	char ml_tbl_file_name[PATH_MAX], kmer_tbl_file_name[PATH_MAX];
+	char ml_tmp_file_name[PATH_MAX], kmer_tmp_file_name[PATH_MAX];
+	shardFileNames(data->filePrefix, sid, ml_tbl_file_name, kmer_tbl_file_name);
+	strcpy_s(ml_tmp_file_name, PATH_MAX, ml_tbl_file_name);
+	strcat_s(ml_tmp_file_name, PATH_MAX, ".tmp");
+	strcpy_s(kmer_tmp_file_name, PATH_MAX, kmer_tbl_file_name);
+	strcat_s(kmer_tmp_file_name, PATH_MAX, ".tmp");
 
 	// Log progress
 	char log_file_name[PATH_MAX];
-	snprintf_s_si(log_file_name, PATH_MAX, "%s.log_%d", data->filePrefix, data->tid);
+	snprintf_s_si(log_file_name, PATH_MAX, "%s.log_%d", data->filePrefix, sid);
 
-	FILE *ml_tbl_fd = 0, *log_fd = 0;
+	FILE *ml_tbl_fd = 0, *kmer_tbl_fd = 0, *log_fd = 0;
 
-	ml_tbl_fd = fopen(ml_tbl_file_name, "wb");
-	if (ml_tbl_fd == NULL) {
-		printf("\nCan't open file or file doesn't exist. mlt_table errno = %d\n", errno);
-		pthread_exit(NULL);
+	ml_tbl_fd = fopen(ml_tmp_file_name, "wb");
+	kmer_tbl_fd = fopen(kmer_tmp_file_name, "wb");
+	if (ml_tbl_fd == NULL || kmer_tbl_fd == NULL) {
+		fprintf(stderr, "[M::%s] Can't open per-shard index files for shard %d, errno = %d\n", __func__, sid, errno);
+		exit(1);
 	}
 
 	if (bwa_verbose >= 4) {
 		log_fd = fopen(log_file_name, "w");
 		if (log_fd == NULL) {
-			printf("\nCan't open file or file doesn't exist. log errno = %d\n", errno);
-			pthread_exit(NULL);
+			fprintf(stderr, "[M::%s] Can't open log file for shard %d, errno = %d\n", __func__, sid, errno);
+			exit(1);
 		} 
-		log_file(log_fd, "Start: %lu End: %lu", data->startKmer, data->endKmer);
+		log_file(log_fd, "Start: %lu End: %lu", shard->startKmer, shard->endKmer);
 	}
 
 	//
 	// Loop for each k-mer and compute LEP when the hit set changes
 	//
-	for (idx = data->startKmer; idx < data->endKmer; ++idx) {
+	for (idx = shard->startKmer; idx < shard->endKmer; ++idx) {
 		max_next_ptr = 0;
 		next_ptr_width = 0;
-		c = 0;
-		lep = 0;   // k-1-bit LEP
-		prevHits = 0;
+		kmer_hits = 0;
 		numBytesPerKmer = 0;
 		numBytesForMh = 0;
-		kmertoquery(idx, aq, kmerSize); // represent k-mer as uint8_t*
-		assert(aq[0] >= 0 && aq[0] <= 3);
-		bwt_set_intv(data->bid->bwt, aq[0], ik); // the initial interval of a single base
-		ik.info = 1; 
-		prevHits = ik.x[2];
-
-		//
-		// Backward search k-mer
-		//
-		for (i = 1; i < kmerSize; ++i) {
-			c = 3 - aq[i]; 
-			bwt_extend(data->bid->bwt, &ik, ok, 0); // ok contains the result of BWT extension
-			if (ok[c].x[2] != prevHits) { // hit set changes
-				lep |= (1ULL << (i-1));
-			}
-			//
-			// Extend left till k-mer has zero hits
-			//
-			if (ok[c].x[2] >= 1) { prevHits = ok[c].x[2]; ik = ok[c]; ik.info = i + 1; }
-			else { break; }
-		}
+		lep = getKmerLEP(data->bid->bwt, idx, aq, &ik, ok, &i, &c);   // k-1-bit LEP
 
 		uint64_t num_hits = ok[c].x[2];
 		if (ok[c].x[2] == 0) { // "Empty" - k-mer absent in the reference genome
@@ -572,21 +1058,17 @@ void* buildIndex(void *arg) {
 			kmer_data = ((lep & LEP_MASK) << METADATA_BITWIDTH) | (SINGLE_HIT_LEAF);
 			numBytesPerKmer = 6;
 			uint8_t byte_idx = 0;
-			uint8_t mlt_data[numBytesPerKmer];
-			if (data->step == 1) { 
-				mlt_data[byte_idx] = 0; // Mark that the hit is not a multi-hit
-			}
+			uint8_t leaf[numBytesPerKmer];
+			leaf[byte_idx] = 0; // Mark that the hit is not a multi-hit
 			byte_idx++;
-			data->numHits[idx-data->startKmer] += ok[c].x[2];
-			if (data->step == 1) {
-				//
-				// Look up suffix array to identify the hit position
-				//
-				ref_pos = bwt_sa(data->bid->bwt, ok[c].x[0]);
-				uint64_t leaf_data = ref_pos << 1;
-				memcpy_bwamem(&mlt_data[byte_idx], 5 * sizeof(uint8_t), &leaf_data, 5 * sizeof(uint8_t), __FILE__, __LINE__);
-				fwrite(mlt_data, sizeof(uint8_t), numBytesPerKmer, ml_tbl_fd);
-			}
+			kmer_hits += ok[c].x[2];
+			//
+			// Look up suffix array to identify the hit position
+			//
+			ref_pos = bwt_sa(data->bid->bwt, ok[c].x[0]);
+			uint64_t leaf_data = ref_pos << 1;
+			memcpy_bwamem(&leaf[byte_idx], 5 * sizeof(uint8_t), &leaf_data, 5 * sizeof(uint8_t), __FILE__, __LINE__);
+			writeTree(ml_tbl_fd, leaf, numBytesPerKmer);
 			byte_idx += 5;
 		}
 		//
@@ -608,63 +1090,56 @@ void* buildIndex(void *arg) {
 			n->numHits = ok[c].x[2];
 			n->child_nodes[0] = n->child_nodes[1] = n->child_nodes[2] = n->child_nodes[3] = 0;
 			n->start_addr = 0;
-			uint8_t* mlt_data = 0;
 			next_ptr_width = 2;
-			uint8_t* mh_data = 0;
-			uint64_t size = 0;
-			if (data->step == 1) {
-				if (idx != (numKmers - 1)) {
-					size = (data->byte_offsets[idx+1] >> KMER_DATA_BITWIDTH) - (data->byte_offsets[idx] >> KMER_DATA_BITWIDTH); 
-					assert(size < (1 << 26));
-				} 
-				else { // FIXME: This is a hack. We know the size of every k-mer tree except the last-kmer 
-					size = 1 << 26;
-				}
-				next_ptr_width = (((data->byte_offsets[idx] >> 22) & 3) == 0)? 4 : ((data->byte_offsets[idx] >> 22) & 3);  
-				mlt_data = (uint8_t*) calloc(size, sizeof(uint8_t));
-				assert(mlt_data != NULL);
-				mh_data = (uint8_t*) calloc(size, sizeof(uint8_t));
-				assert(mh_data != NULL);
-			}
-			ert_build_kmertree(data->bid->bwt, data->bid->bns, data->bid->pac, ik, ok, i, n, data->step, data->readLength - 1);
+			tree_mem = treeMem(num_hits);
+			reserveTreeMem(data, tree_mem, &mlt_data, &mlt_cap, &mh_data, &mh_cap);
+			// The tree keeps its hits, so it is built once and traversed to size it
+			ert_build_kmertree(data->bid->bwt, data->bid->bns, data->bid->pac, ik, ok, i, n, 1, data->readLength - 1);
 			//
 			// Reserve space for pointer to start of multi-hit address space
 			//
 			numBytesPerKmer = 4; 
 
-			// Traverse tree and place data in memory space
+			// Size the tree, plain multi-hit lists are an upper bound of packed ones
 			ert_traverse_kmertree(n, mlt_data, mh_data, &numBytesPerKmer, &numBytesForMh, 
-					i, &data->numHits[idx-data->startKmer], &max_next_ptr, next_ptr_width, data->step);
-
-			if (data->step == 0 || data->step == 1) {
-				if (max_next_ptr >= 1024 && max_next_ptr < 262144) {
-					next_ptr_width = 3;
-					max_next_ptr = 0;
-					numBytesPerKmer = 4;
-					numBytesForMh = 0;
-					ert_traverse_kmertree(n, mlt_data, mh_data, &numBytesPerKmer, &numBytesForMh, i, 
-							&data->numHits[idx-data->startKmer], &max_next_ptr, next_ptr_width, data->step); 
-				}
-				if (max_next_ptr >= 262144) {
-					next_ptr_width = 4;
-					max_next_ptr = 0;
-					numBytesPerKmer = 4;
-					numBytesForMh = 0;
-					ert_traverse_kmertree(n, mlt_data, mh_data, &numBytesPerKmer, &numBytesForMh, i, 
-							&data->numHits[idx-data->startKmer], &max_next_ptr, next_ptr_width, data->step); 
-				}
+					i, &kmer_hits, &max_next_ptr, next_ptr_width, data->mh_pack, 0);
+
+			if (max_next_ptr >= 1024 && max_next_ptr < 262144) {
+				next_ptr_width = 3;
+				max_next_ptr = 0;
+				numBytesPerKmer = 4;
+				numBytesForMh = 0;
+				ert_traverse_kmertree(n, mlt_data, mh_data, &numBytesPerKmer, &numBytesForMh, i, 
+						&kmer_hits, &max_next_ptr, next_ptr_width, data->mh_pack, 0); 
 			}
-			ert_destroy_kmertree(n);
-			assert(numBytesPerKmer < (1 << 26));
-			// assert(numBytesForMh < (1 << 24));
-			if (data->step == 1) {
-				if (idx != numKmers-1) assert((numBytesPerKmer+numBytesForMh) == size);
-				memcpy_bwamem(mlt_data, 4*sizeof(uint8_t), &numBytesPerKmer, 4*sizeof(uint8_t), __FILE__, __LINE__);
-				fwrite(mlt_data, sizeof(uint8_t), numBytesPerKmer, ml_tbl_fd);
-				free(mlt_data);
-				fwrite(mh_data, sizeof(uint8_t), numBytesForMh, ml_tbl_fd);
-				free(mh_data);
+			if (max_next_ptr >= 262144) {
+				next_ptr_width = 4;
+				max_next_ptr = 0;
+				numBytesPerKmer = 4;
+				numBytesForMh = 0;
+				ert_traverse_kmertree(n, mlt_data, mh_data, &numBytesPerKmer, &numBytesForMh, i, 
+						&kmer_hits, &max_next_ptr, next_ptr_width, data->mh_pack, 0); 
 			}
+			assert(numBytesPerKmer < (1 << 26));
+			uint64_t size = numBytesPerKmer + numBytesForMh;
+
+			// Traverse tree and place data in memory space
+			mlt_data = reserveTreeBuf(data, mlt_data, &mlt_cap, numBytesPerKmer);
+			mh_data = reserveTreeBuf(data, mh_data, &mh_cap, numBytesForMh);
+			kmer_hits = 0;
+			numBytesPerKmer = 4;
+			numBytesForMh = 0;
+			ert_traverse_kmertree(n, mlt_data, mh_data, &numBytesPerKmer, &numBytesForMh, 
+					i, &kmer_hits, &max_next_ptr, next_ptr_width, data->mh_pack, 1);
+			ert_destroy_kmertree(n);
+			releaseMem(data, tree_mem);
+			// packed multi-hit lists may only shrink the mh region sized in step 0
+			assert((numBytesPerKmer+numBytesForMh) == size || 
+					(data->mh_pack && (numBytesPerKmer+numBytesForMh) < size));
+			shard->mh_saved += size - (numBytesPerKmer+numBytesForMh);
+			memcpy_bwamem(mlt_data, 4*sizeof(uint8_t), &numBytesPerKmer, 4*sizeof(uint8_t), __FILE__, __LINE__);
+			writeTree(ml_tbl_fd, mlt_data, numBytesPerKmer);
+			writeTree(ml_tbl_fd, mh_data, numBytesForMh);
 		}
 		//
 		// If the number of hits for the k-mer exceeds the HIT_THRESHOLD,
@@ -673,67 +1148,59 @@ void* buildIndex(void *arg) {
 		//
 		else {
 			kmer_data = ((lep & LEP_MASK) << METADATA_BITWIDTH) | (FREQUENT); 
-			uint8_t* mlt_data = 0;
-			uint8_t* mh_data = 0;
 			next_ptr_width = 2;
-			uint64_t size = 0;
-			if (data->step == 1) {
-				if (idx != (numKmers - 1)) {
-					size = (data->byte_offsets[idx+1] >> KMER_DATA_BITWIDTH) - (data->byte_offsets[idx] >> KMER_DATA_BITWIDTH); 
-					assert(size < (1 << 26));
-				} 
-				else { //!< FIXME: Hack. We do not store the size of the last-kmer
-					size = 1 << 26;
-				}
-				next_ptr_width = (((data->byte_offsets[idx] >> 22) & 3) == 0)? 4 : ((data->byte_offsets[idx] >> 22) & 3);  
-				mlt_data = (uint8_t*) calloc(size, sizeof(uint8_t));
-				assert(mlt_data != NULL);
-				mh_data = (uint8_t*) calloc(size, sizeof(uint8_t));
-				assert(mh_data != NULL);
-			}
 			numBytesPerKmer = 4;
+			tree_mem = data->mem->limit ? treeMem(maxXmerHits(data->bid->bwt, ik)) : 0;
+			reserveTreeMem(data, tree_mem, &mlt_data, &mlt_cap, &mh_data, &mh_cap);
+			// The x-mer trees are built and dropped one at a time, size them without suffix array lookups
 			ert_build_table(data->bid->bwt, data->bid->bns, data->bid->pac, ik, ok, mlt_data, mh_data, &numBytesPerKmer,
-					&numBytesForMh, aq, &data->numHits[idx-data->startKmer], &max_next_ptr, next_ptr_width, data->step,
+					&numBytesForMh, aq, &kmer_hits, &max_next_ptr, next_ptr_width, data->mh_pack, 0,
 					data->readLength - 1);
-			if (data->step == 0 || data->step == 1) {
-				if (max_next_ptr >= 1024 && max_next_ptr < 262144) {
-					next_ptr_width = 3;
-					max_next_ptr = 0;
-					numBytesPerKmer = 4;
-					numBytesForMh = 0;
-					ert_build_table(data->bid->bwt, data->bid->bns, data->bid->pac, ik, ok, mlt_data, mh_data, 
-							&numBytesPerKmer, &numBytesForMh, aq, &data->numHits[idx-data->startKmer], 
-							&max_next_ptr, next_ptr_width, data->step, data->readLength - 1);
-				}
-				if (max_next_ptr >= 262144) {
-					next_ptr_width = 4;
-					max_next_ptr = 0;
-					numBytesPerKmer = 4;
-					numBytesForMh = 0;
-					ert_build_table(data->bid->bwt, data->bid->bns, data->bid->pac, ik, ok, mlt_data, mh_data, 
-							&numBytesPerKmer, &numBytesForMh, aq, &data->numHits[idx-data->startKmer], 
-							&max_next_ptr, next_ptr_width, data->step, data->readLength - 1);
-				}
+			if (max_next_ptr >= 1024 && max_next_ptr < 262144) {
+				next_ptr_width = 3;
+				max_next_ptr = 0;
+				numBytesPerKmer = 4;
+				numBytesForMh = 0;
+				ert_build_table(data->bid->bwt, data->bid->bns, data->bid->pac, ik, ok, mlt_data, mh_data, 
+						&numBytesPerKmer, &numBytesForMh, aq, &kmer_hits, 
+						&max_next_ptr, next_ptr_width, data->mh_pack, 0, data->readLength - 1);
+			}
+			if (max_next_ptr >= 262144) {
+				next_ptr_width = 4;
+				max_next_ptr = 0;
+				numBytesPerKmer = 4;
+				numBytesForMh = 0;
+				ert_build_table(data->bid->bwt, data->bid->bns, data->bid->pac, ik, ok, mlt_data, mh_data, 
+						&numBytesPerKmer, &numBytesForMh, aq, &kmer_hits, 
+						&max_next_ptr, next_ptr_width, data->mh_pack, 0, data->readLength - 1);
 			}
+			assert(numBytesPerKmer < (1 << 26));
+			uint64_t size = numBytesPerKmer + numBytesForMh;
 			// 
 			// Traverse tree and place data in memory
 			//
-			assert(numBytesPerKmer < (1 << 26));
-			// assert(numBytesForMh < (1 << 24));
-			if (data->step == 1) {
-				if (idx != numKmers-1) assert((numBytesPerKmer+numBytesForMh) == size);
-				memcpy_bwamem(mlt_data, 4*sizeof(uint8_t), &numBytesPerKmer, 4*sizeof(uint8_t), __FILE__, __LINE__);
-				fwrite(mlt_data, sizeof(uint8_t), numBytesPerKmer, ml_tbl_fd);
-				free(mlt_data);
-				fwrite(mh_data, sizeof(uint8_t), numBytesForMh, ml_tbl_fd);
-				free(mh_data);
-			}
+			mlt_data = reserveTreeBuf(data, mlt_data, &mlt_cap, numBytesPerKmer);
+			mh_data = reserveTreeBuf(data, mh_data, &mh_cap, numBytesForMh);
+			kmer_hits = 0;
+			numBytesPerKmer = 4;
+			numBytesForMh = 0;
+			ert_build_table(data->bid->bwt, data->bid->bns, data->bid->pac, ik, ok, mlt_data, mh_data, 
+					&numBytesPerKmer, &numBytesForMh, aq, &kmer_hits, 
+					&max_next_ptr, next_ptr_width, data->mh_pack, 1, data->readLength - 1);
+			releaseMem(data, tree_mem);
+			assert((numBytesPerKmer+numBytesForMh) == size || 
+					(data->mh_pack && (numBytesPerKmer+numBytesForMh) < size));
+			shard->mh_saved += size - (numBytesPerKmer+numBytesForMh);
+			memcpy_bwamem(mlt_data, 4*sizeof(uint8_t), &numBytesPerKmer, 4*sizeof(uint8_t), __FILE__, __LINE__);
+			writeTree(ml_tbl_fd, mlt_data, numBytesPerKmer);
+			writeTree(ml_tbl_fd, mh_data, numBytesForMh);
 		}
+		uint64_t kmer_entry;
 		if (num_hits < 20) {
-			data->kmer_table[idx-data->startKmer] = (ptr << KMER_DATA_BITWIDTH) | (num_hits << 17) | kmer_data;
+			kmer_entry = (ptr << KMER_DATA_BITWIDTH) | (num_hits << 17) | kmer_data;
 		}
 		else {
-			data->kmer_table[idx-data->startKmer] = (ptr << KMER_DATA_BITWIDTH) | kmer_data;
+			kmer_entry = (ptr << KMER_DATA_BITWIDTH) | kmer_data;
 		}
 
 		//
@@ -751,23 +1218,33 @@ void* buildIndex(void *arg) {
 		}
 
 		//
-		data->kmer_table[idx-data->startKmer] |= (next_ptr_width << 22);
+		kmer_entries[num_entries++] = kmer_entry | (next_ptr_width << 22);
+		if (num_entries == ert_spill_entries) {
+			spillKmerEntries(kmer_tbl_fd, kmer_entries, &num_entries);
+		}
 
 		if (bwa_verbose >= 4) {
-			if (idx == data->endKmer-1) {
+			if (idx == shard->endKmer-1) {
 				log_file(log_fd, "TotalSize:%lu\n", ptr);
 			}
-			if ((idx-data->startKmer) % 10000000 == 0) {
+			if ((idx-shard->startKmer) % 10000000 == 0) {
 				log_file(log_fd, "%lu,%lu,%lu", idx, numBytesPerKmer, ptr);
 			}
 		}
 
-		total_hits += data->numHits[idx-data->startKmer];
+		total_hits += kmer_hits;
 
+		if ((idx-shard->startKmer) % ert_rss_interval == 0) {
+			uint64_t rss = currentrss();
+			if (rss > data->peak_rss) {
+				data->peak_rss = rss;
+			}
+		}
 	}
+	spillKmerEntries(kmer_tbl_fd, kmer_entries, &num_entries);
 
 	//
-	data->end_offset = ptr;
+	shard->end_offset = ptr;
 
 	if (bwa_verbose >= 4) {
 		log_file(log_fd, "Hits:%lu\n", total_hits);
@@ -776,37 +1253,215 @@ void* buildIndex(void *arg) {
 		log_file(log_fd, "nKmersLargePtrs:%lu", nKmerLargePtr);
 		fclose(log_fd);
 	}
+	free(kmer_entries);
+	free(mlt_data);
+	free(mh_data);
+	releaseMem(data, ert_spill_entries * sizeof(uint64_t) + mlt_cap + mh_cap);
+	closeDurable(kmer_tbl_fd, kmer_tmp_file_name, kmer_tbl_file_name);
+	closeDurable(ml_tbl_fd, ml_tmp_file_name, ml_tbl_file_name);
+	syncPrefixDir(data->filePrefix);
+
+	char line[128];
+	snprintf(line, sizeof(line), "shard %d %lu %lu 0\n", sid, shard->end_offset, shard->mh_saved);
+	pthread_mutex_lock(data->lock);
+	appendManifest(data->manifest, line);
+	shard->done = 1;
+	pthread_mutex_unlock(data->lock);
+}
+
+static int takeShard(thread_data_t* data) {
+	int sid;
+	pthread_mutex_lock(data->lock);
+	sid = (*data->next_shard)++;
+	pthread_mutex_unlock(data->lock);
+	return sid;
+}
+
+//
+// Threads take shards in order. Shards completed by an earlier run are skipped.
+//
+void* buildIndex(void *arg) {
+
+	thread_data_t *data = (thread_data_t *)arg;
+	int sid;
+	while ((sid = takeShard(data)) < ert_num_shards) {
+		if (!data->shards[sid].done) {
+			buildShard(data, sid);
+		}
+	}
+	// Threads waiting for memory may go on alone now
+	pthread_mutex_lock(data->lock);
+	data->mem->n_running--;
+	pthread_cond_broadcast(&data->mem->cond);
+	pthread_mutex_unlock(data->lock);
+	pthread_exit(NULL);
+}
+
+//
+// Move the files of a shard into the merged index files: k-mer entries are rebased
+// by the shard's start offset in the tree file and both are written at their final
+// positions, so shards merge in parallel. The LEPs of a shard built for an earlier
+// reference are recomputed, since they depend on the hits of neighbouring k-mers.
+//
+static void mergeShard(thread_data_t* data, int sid) {
+
+	ert_shard_t* shard = &data->shards[sid];
+	char ml_tbl_file_name[PATH_MAX], kmer_tbl_file_name[PATH_MAX];
+	shardFileNames(data->filePrefix, sid, ml_tbl_file_name, kmer_tbl_file_name);
+	uint64_t* buf = (uint64_t*) malloc(ert_spill_entries * sizeof(uint64_t));
+	assert(buf != NULL);
+	uint64_t j, n, done = 0, lep;
+	bwtintv_t ik, ok[4];
+	uint8_t aq[kmerSize], c;
+	int len;
+
+	FILE* kmer_tbl_fd = fopen(kmer_tbl_file_name, "rb");
+	if (kmer_tbl_fd == NULL) {
+		fprintf(stderr, "[M::%s] Can't open per-shard index file (k-mer) for shard %d\n", __func__, sid);
+		exit(1);
+	}
+	while ((n = fread(buf, sizeof(uint64_t), ert_spill_entries, kmer_tbl_fd)) > 0) {
+		for (j = 0; j < n; ++j) {
+			buf[j] += (shard->base_offset << KMER_DATA_BITWIDTH);
+			if (shard->reused) {
+				lep = getKmerLEP(data->bid->bwt, shard->startKmer + done + j, aq, &ik, ok, &len, &c);
+				buf[j] = (buf[j] & ~((uint64_t)LEP_MASK << METADATA_BITWIDTH)) | ((lep & LEP_MASK) << METADATA_BITWIDTH);
+			}
+		}
+		if (pwrite(data->kmer_fd, buf, n * sizeof(uint64_t), (shard->startKmer + done) * sizeof(uint64_t)) != (ssize_t)(n * sizeof(uint64_t))) {
+			fprintf(stderr, "[M::%s] Can't write index file (k-mer), errno = %d\n", __func__, errno);
+			exit(1);
+		}
+		done += n;
+	}
+	fclose(kmer_tbl_fd);
+	assert(done == shard->endKmer - shard->startKmer);
+
+	FILE* ml_tbl_fd = fopen(ml_tbl_file_name, "rb");
+	if (ml_tbl_fd == NULL) {
+		fprintf(stderr, "[M::%s] Can't open per-shard index file (tree) for shard %d\n", __func__, sid);
+		exit(1);
+	}
+	done = 0;
+	while ((n = fread(buf, sizeof(uint8_t), ert_spill_entries * sizeof(uint64_t), ml_tbl_fd)) > 0) {
+		if (pwrite(data->mlt_fd, buf, n, shard->base_offset + done) != (ssize_t)n) {
+			fprintf(stderr, "[M::%s] Can't write index file (tree), errno = %d\n", __func__, errno);
+			exit(1);
+		}
+		done += n;
+	}
 	fclose(ml_tbl_fd);
+	assert(done == shard->end_offset);
+	free(buf);
+
+	if (!data->keep_shards && (remove(kmer_tbl_file_name) != 0 || remove(ml_tbl_file_name) != 0)) {
+		fprintf(stderr, "[M::%s] Can't remove per-shard index files for shard %d\n", __func__, sid);
+		exit(1);
+	}
+}
+
+void* mergeIndex(void *arg) {
+
+	thread_data_t *data = (thread_data_t *)arg;
+	int sid;
+	while ((sid = takeShard(data)) < ert_num_shards) {
+		mergeShard(data, sid);
+	}
 	pthread_exit(NULL);
 }
 
-void buildKmerTrees(char* kmer_tbl_file_name, bwaidx_t* bid, char* prefix, int num_threads, int readLength) {
+void buildKmerTrees(char* kmer_tbl_file_name, bwaidx_t* bid, char* prefix, int num_threads, int readLength, int mh_pack, uint64_t max_mem, int keep_shards, ert_manifest_t* prev) {
 
-	FILE* kmer_tbl_fd;
+	int i, s, rc, next_shard = 0, n_done = 0;
+	uint64_t base_rss = currentrss();
 	pthread_t thr[num_threads];
-	int i, rc;
 	thread_data_t thr_data[num_threads];
-	uint64_t numKmersThread = (uint64_t)ceil(((double)(numKmers))/num_threads);
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	//
+	// Threads take the spill buffer, tree buffers and trees they build from the
+	// --max-mem budget left by the loaded index, and wait for memory when it is short
+	//
+	ert_mem_t mem;
+	memset_s(&mem, sizeof(ert_mem_t), 0);
+	if (max_mem > 0) {
+		if (base_rss + ert_spill_entries * sizeof(uint64_t) >= max_mem) {
+			fprintf(stderr, "[M::%s] --max-mem is below the %.3f GB of the loaded index and one spill buffer\n", 
+					__func__, (base_rss + ert_spill_entries * sizeof(uint64_t)) / (1024.0 * 1024.0 * 1024.0));
+			exit(1);
+		}
+		mem.limit = max_mem - base_rss;
+	}
+	mem.n_running = num_threads;
+	pthread_cond_init(&mem.cond, NULL);
+	ert_shard_t* shards = (ert_shard_t*) malloc(ert_num_shards * sizeof(ert_shard_t));
+	assert(shards != NULL);
+	initShards(shards);
+
+	char manifest_file_name[PATH_MAX], line[128];
+	manifestFileName(prefix, manifest_file_name);
+	FILE* manifest = fopen(manifest_file_name, "a");
+	if (manifest == NULL) {
+		fprintf(stderr, "[M::%s] Can't open ERT manifest %s, errno = %d\n", __func__, manifest_file_name, errno);
+		exit(1);
+	}
+	uint64_t pac_hash = hashPac(bid->pac, bid->bns->l_pac);
+	if (prev && prev->resume) {
+		if (prev->l_pac != bid->bns->l_pac || prev->pac_hash != pac_hash) {
+			fprintf(stderr, "[M::%s] %s does not match the reference, remove it to rebuild\n", __func__, manifest_file_name);
+			exit(1);
+		}
+		memcpy_bwamem(shards, ert_num_shards * sizeof(ert_shard_t), prev->shards, sizeof(prev->shards), __FILE__, __LINE__);
+	}
+	else {
+		snprintf(line, sizeof(line), "bwt %ld %lu\n", bid->bns->l_pac, pac_hash);
+		appendManifest(manifest, line);
+		if (prev && prev->update) {
+			uint8_t dirty[ert_num_shards];
+			memset_s(dirty, sizeof(dirty), 0);
+			if (prev->l_pac != bid->bns->l_pac) {
+				if (bwa_verbose >= 3) {
+					fprintf(stderr, "[M::%s] Reference length changed, all shards are rebuilt\n", __func__);
+				}
+			}
+			else {
+				markDirtyShards(bid->bwt, bid->pac, prev->old_pac, bid->bns->l_pac, readLength, dirty);
+				for (s = 0; s < ert_num_shards; ++s) {
+					if (!dirty[s] && prev->shards[s].done) {
+						shards[s] = prev->shards[s];
+						shards[s].reused = 1;
+						snprintf(line, sizeof(line), "shard %d %lu %lu 1\n", s, shards[s].end_offset, shards[s].mh_saved);
+						appendManifest(manifest, line);
+					}
+				}
+			}
+		}
+	}
+	for (s = 0; s < ert_num_shards; ++s) {
+		n_done += shards[s].done;
+	}
 	if (bwa_verbose >= 3) {
-		fprintf(stderr, "[M::%s] Computing tree sizes for each k-mer\n", __func__);
+		if (n_done > 0) {
+			fprintf(stderr, "[M::%s] Reusing %d of %d shards recorded in %s\n", __func__, n_done, ert_num_shards, manifest_file_name);
+		}
+		fprintf(stderr, "[M::%s] Building k-mer trees with %d threads\n", __func__, num_threads);
 	}
 	// 
-	// STEP 1: Create threads. Each thread builds the index for a fraction of the k-mers
+	// STEP 1: Create threads. Threads take the shards left and write each to
+	// durable per-shard files, recorded in the manifest when complete
 	//
 	for (i = 0; i < num_threads; ++i) {
 		thr_data[i].tid = i;
-		thr_data[i].step = 0;
 		thr_data[i].readLength = readLength;
+		thr_data[i].mh_pack = mh_pack;
+		thr_data[i].keep_shards = keep_shards;
 		thr_data[i].bid = bid; 
-		thr_data[i].startKmer = i*numKmersThread;
-		thr_data[i].endKmer = ((i + 1)*numKmersThread > numKmers) ? numKmers : (i + 1)*numKmersThread;  
-		thr_data[i].end_offset = 0;
 		thr_data[i].filePrefix = prefix;
-		uint64_t numKmersToProcess = thr_data[i].endKmer - thr_data[i].startKmer;
-		thr_data[i].kmer_table = (uint64_t*) calloc(numKmersToProcess, sizeof(uint64_t));
-		assert(thr_data[i].kmer_table != NULL);
-		thr_data[i].numHits = (uint64_t*) calloc(numKmersToProcess, sizeof(uint64_t));
-		assert(thr_data[i].numHits != NULL);
+		thr_data[i].shards = shards;
+		thr_data[i].next_shard = &next_shard;
+		thr_data[i].lock = &lock;
+		thr_data[i].manifest = manifest;
+		thr_data[i].mem = &mem;
+		thr_data[i].peak_rss = base_rss;
 		if ((rc = pthread_create(&thr[i], NULL, buildIndex, &thr_data[i]))) {
 			fprintf(stderr, "[M::%s] error: pthread_create, rc: %d\n", __func__, rc);
 			return;
@@ -818,126 +1473,85 @@ void buildKmerTrees(char* kmer_tbl_file_name, bwaidx_t* bid, char* prefix, int n
 	for (i = 0; i < num_threads; ++i) {
 		pthread_join(thr[i], NULL);
 	}
+	pthread_cond_destroy(&mem.cond);
 
 	//
-	// Compute absolute offsets for each kmer's tree from per-thread relative offsets
+	// STEP 2: The start of each shard's trees is the prefix sum of the sizes of the 
+	// preceding shards. Relocate all per-shard files in parallel.
 	//
-	uint64_t* kmer_table = (uint64_t*) calloc(numKmers, sizeof(uint64_t));
-	assert(kmer_table != NULL);
-	int tidx;
-	uint64_t kidx;
-	uint64_t numProcessed = 0;
-	uint64_t offset = 0;
-	for (tidx = 0; tidx < num_threads; ++tidx) {
-		uint64_t numKmersToProcess = thr_data[tidx].endKmer - thr_data[tidx].startKmer;
-		for (kidx = 0; kidx < numKmersToProcess; ++kidx) {
-			uint64_t rel_offset = thr_data[tidx].kmer_table[kidx] >> KMER_DATA_BITWIDTH;
-			uint16_t kmer_data = thr_data[tidx].kmer_table[kidx] & KMER_DATA_MASK;
-			uint64_t ptr_width = (thr_data[tidx].kmer_table[kidx] >> 22) & 3;
-			uint64_t reseed_hits = (thr_data[tidx].kmer_table[kidx] >> 17) & 0x1F;
-			kmer_table[numProcessed + kidx] =   ((offset + rel_offset) << KMER_DATA_BITWIDTH) 
-				| (ptr_width << 22) 
-				| (reseed_hits << 17) 
-				| (kmer_data);        
-		}
-		numProcessed += numKmersToProcess;
-		offset += thr_data[tidx].end_offset;
-		free(thr_data[tidx].kmer_table);
-		free(thr_data[tidx].numHits);
-	}
-
-	// 
-	// STEP 2 : Using estimates of each k-mer's tree size from the previous step, write the index to file
-	// 
-	uint64_t total_size = offset + (numKmers * 8UL);
 	if (bwa_verbose >= 3) {
-		fprintf(stderr, "[M::%s] Total size of ERT index = %lu B (Expected). (k-mer,tree) = (%lu,%lu)\n", __func__, total_size, numKmers * 8UL, offset);
-	}    
+		fprintf(stderr, "[M::%s] Merging per-shard tables ...\n", __func__);
+	}
+	char ml_tbl_file_name[PATH_MAX];
+	strcpy_s(ml_tbl_file_name, PATH_MAX, prefix);
+	strcat_s(ml_tbl_file_name, PATH_MAX, ".mlt_table");
 
+	if (remove(ml_tbl_file_name) == 0) {
+		fprintf(stderr, "[M::%s] Overwriting existing index file (tree)\n", __func__);
+	}
+	// The format is recorded once the index files are complete, see ert_check_version()
+	char version_file_name[PATH_MAX];
+	versionFileName(prefix, version_file_name);
+	remove(version_file_name);
+	int kmer_fd = open(kmer_tbl_file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	int mlt_fd = open(ml_tbl_file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (kmer_fd < 0 || mlt_fd < 0) {
+		fprintf(stderr, "[M::%s] Can't open output index file for writing.\n", __func__);
+		exit(1);
+	}
+	uint64_t offset = 0, mh_saved = 0, peak_rss = currentrss();
+	for (s = 0; s < ert_num_shards; ++s) {
+		assert(shards[s].done);
+		shards[s].base_offset = offset;
+		offset += shards[s].end_offset;
+		mh_saved += shards[s].mh_saved;
+	}
+	next_shard = 0;
 	for (i = 0; i < num_threads; ++i) {
-		thr_data[i].tid = i;
-		thr_data[i].step = 1;
-		thr_data[i].readLength = readLength;
-		thr_data[i].bid = bid; 
-		thr_data[i].startKmer = i*numKmersThread;
-		thr_data[i].endKmer = ((i + 1)*numKmersThread > numKmers) ? numKmers : (i + 1)*numKmersThread;  
-		thr_data[i].end_offset = 0;
-		thr_data[i].filePrefix = prefix; 
-		uint64_t numKmersToProcess = thr_data[i].endKmer - thr_data[i].startKmer;
-		thr_data[i].kmer_table = (uint64_t*) calloc(numKmersToProcess, sizeof(uint64_t));
-		thr_data[i].numHits = (uint64_t*) calloc(numKmersToProcess, sizeof(uint64_t));
-		thr_data[i].byte_offsets = kmer_table;
-		if ((rc = pthread_create(&thr[i], NULL, buildIndex, &thr_data[i]))) {
+		thr_data[i].kmer_fd = kmer_fd;
+		thr_data[i].mlt_fd = mlt_fd;
+		if (thr_data[i].peak_rss > peak_rss) {
+			peak_rss = thr_data[i].peak_rss;
+		}
+		if ((rc = pthread_create(&thr[i], NULL, mergeIndex, &thr_data[i]))) {
 			fprintf(stderr, "[M::%s] error: pthread_create, rc: %d\n", __func__, rc);
 			return;
 		}
 	}
-
 	for (i = 0; i < num_threads; ++i) {
 		pthread_join(thr[i], NULL);
 	}
-
-	if (bwa_verbose >= 3) {
-		fprintf(stderr, "[M::%s] Merging per-thread tables ...\n", __func__);
+	if (fsync(kmer_fd) != 0 || fsync(mlt_fd) != 0) {
+		fprintf(stderr, "[M::%s] Can't sync index files, errno = %d\n", __func__, errno);
+		exit(1);
 	}
-	//
-	// Compute absolute offsets for each k-mer tree's root node
-	//  
-	numProcessed = 0;
-	offset = 0; 
-	for (tidx = 0; tidx < num_threads; ++tidx) {
-		uint64_t numKmersToProcess = thr_data[tidx].endKmer - thr_data[tidx].startKmer;
-		for (kidx = 0; kidx < numKmersToProcess; ++kidx) {
-			uint64_t rel_offset = thr_data[tidx].kmer_table[kidx] >> KMER_DATA_BITWIDTH;
-			uint16_t kmer_data = thr_data[tidx].kmer_table[kidx] & KMER_DATA_MASK;
-			uint64_t ptr_width = (thr_data[tidx].kmer_table[kidx] >> 22) & 3;
-			uint64_t reseed_hits = (thr_data[tidx].kmer_table[kidx] >> 17) & 0x1F;
-			kmer_table[numProcessed + kidx] =   ((offset + rel_offset) << KMER_DATA_BITWIDTH) 
-				| (ptr_width << 22) 
-				| (reseed_hits << 17) 
-				| (kmer_data);        
-		}
-		numProcessed += numKmersToProcess;
-		offset += thr_data[tidx].end_offset;
-		free(thr_data[tidx].kmer_table);
-		free(thr_data[tidx].numHits);
-	}
-	kmer_tbl_fd = fopen(kmer_tbl_file_name, "wb");
-	if (kmer_tbl_fd == NULL) {
-		fprintf(stderr, "[M::%s] Can't open file or file doesn't exist.\n", __func__);
+	close(kmer_fd);
+	close(mlt_fd);
+	FILE* version = fopen(version_file_name, "w");
+	if (version == NULL || fprintf(version, "ert_version %d %d %d\n", mh_pack ? ERT_FORMAT_VERSION : 1, kmerSize, xmerSize) < 0 ||
+			fflush(version) != 0 || fsync(fileno(version)) != 0 || fclose(version) != 0) {
+		fprintf(stderr, "[M::%s] Can't write %s, errno = %d\n", __func__, version_file_name, errno);
 		exit(1);
 	}
-	fwrite(kmer_table, sizeof(uint64_t), numKmers, kmer_tbl_fd);
-	fclose(kmer_tbl_fd);
-	free(kmer_table);
-
-	// 
-	// Merge all per-thread trees
-	//
-	char ml_tbl_file_name[PATH_MAX];
-	strcpy_s(ml_tbl_file_name, PATH_MAX, prefix);
-	strcat_s(ml_tbl_file_name, PATH_MAX, ".mlt_table");
 
-	if (remove(ml_tbl_file_name) == 0) {
-		fprintf(stderr, "[M::%s] Overwriting existing index file (tree)\n", __func__);
+	// Shards kept for a later update stay listed, otherwise the manifest goes with them
+	if (keep_shards) {
+		appendManifest(manifest, "merged\n");
+		fclose(manifest);
 	}
-	std::ofstream o_mlt(ml_tbl_file_name, std::ios::binary | std::ios::app);
-	if (!o_mlt.is_open()) {
-		fprintf(stderr, "[M::%s] Can't open output index file for writing.\n", __func__);
-		exit(1);
+	else {
+		fclose(manifest);
+		remove(manifest_file_name);
 	}
-	for (uint64_t tidx = 0; tidx < num_threads; ++tidx) {
-		snprintf_s_si(ml_tbl_file_name, PATH_MAX, "%s.mlt_table_%d", prefix, tidx);
-		std::ifstream i_mlt(ml_tbl_file_name, std::ios::binary);
-		if (!i_mlt.is_open()) {
-			fprintf(stderr, "[M::%s] Can't open per-thread index file for thread %ld\n", __func__, tidx);
-			exit(1);
-		}
-		o_mlt << i_mlt.rdbuf();
-		if (remove(ml_tbl_file_name) != 0) {
-			fprintf(stderr, "[M::%s] Can't remove per-thread index file (tree) for thread %ld\n", __func__, tidx);
-			exit(1);
+	free(shards);
+
+	if (bwa_verbose >= 3) {
+		fprintf(stderr, "[M::%s] Total size of ERT index = %lu B. (k-mer,tree) = (%lu,%lu). Packed multi-hit lists saved %lu B\n", 
+				__func__, offset + (numKmers * 8UL), numKmers * 8UL, offset, mh_saved);
+		fprintf(stderr, "[M::%s] Peak RSS sampled while building ERT: %.2f GB\n", __func__, peak_rss / (1024.0 * 1024.0 * 1024.0));
+		if (mem.limit > 0) {
+			fprintf(stderr, "[M::%s] Peak memory held by build threads: %.3f of %.3f GB left by --max-mem\n", 
+					__func__, mem.peak / (1024.0 * 1024.0 * 1024.0), mem.limit / (1024.0 * 1024.0 * 1024.0));
 		}
 	}
-
 }
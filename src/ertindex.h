@@ -1,6 +1,8 @@
 #ifndef BWA_ERT_H
 #define BWA_ERT_H
 
+#include <stdio.h>
+#include <pthread.h>
 #include "kvec.h"
 #include "macro.h"
 #include "bwa.h"
@@ -29,27 +31,74 @@ typedef kvec_t(node_t) node_v;
 
 typedef node_t* node_ptr_t;
 
+// A shard is a fixed range of the k-mer space, built into its own durable files
 typedef struct {
-	int tid;
-	int step;
-	int readLength;
-	uint64_t* kmer_table;
 	uint64_t startKmer;
 	uint64_t endKmer;
+	uint64_t end_offset;        // bytes of trees in the shard
+	uint64_t base_offset;       // start of the shard's trees in the merged tree file
+	uint64_t mh_saved;
+	int done;                   // shard files are complete and recorded in the manifest
+	int reused;                 // built for an earlier reference, k-mer LEPs are recomputed on merge
+} ert_shard_t;
+
+// Memory budget of the build threads for --max-mem, guarded by thread_data_t::lock
+typedef struct {
+	uint64_t limit;             // --max-mem less the RSS of the loaded index, 0 if none
+	uint64_t used;              // bytes held by all threads: spill buffers, tree buffers and trees
+	uint64_t peak;              // largest used
+	int n_running;              // threads building, not waiting for memory
+	int over;                   // a tree was built alone above the budget
+	pthread_cond_t cond;        // signalled when memory is released or a thread stops
+} ert_mem_t;
+
+typedef struct {
+	int tid;
+	int readLength;
+	int mh_pack;
+	int keep_shards;
 	bwaidx_t* bid; 
-	uint64_t* numHits;
 	char* filePrefix;
-	uint64_t* byte_offsets;
-	uint64_t end_offset;
+	ert_shard_t* shards;
+	int* next_shard;            // next shard to take, shared by all threads
+	pthread_mutex_t* lock;      // guards next_shard and the manifest
+	FILE* manifest;
+	ert_mem_t* mem;             // --max-mem budget, shared by all threads
+	uint64_t peak_rss;          // largest RSS sampled by the thread
+	int kmer_fd, mlt_fd;        // merged index files, see mergeIndex()
 } thread_data_t;
 
-// FIXME : Add to options later
+// Field widths of the tree encoding, used by addBytesForEntry(). Child pointers are
+// sized per k-mer tree instead: buildKmerTrees() takes the smallest of 2, 3 or 4 B that
+// fits the span of the tree (bits 22-23 of its table entry, 0 for 4 B), with the low 6
+// bits holding the hit count for reseeding, so other_offset_ptr_size_in_bits is only the
+// widest. Leaf hits and multi-hit list pointers are (value << 1) | multi-hit flag in 5 B;
+// with 'index -e 2' a list is bit-packed when smaller (see addMultiHitLeafNode()).
 const uint8_t char_count_size_in_bits = 8;
 const uint8_t hits_count_size_in_bits = 8;
 const uint8_t ref_ptr_size_in_bits = 40;
 const uint8_t leaf_offset_ptr_size_in_bits = 8;
 const uint8_t other_offset_ptr_size_in_bits = 32;
 
+// Single-pass builder: k-mer entries are spilled in chunks of ert_spill_entries, and the
+// RSS is sampled every ert_rss_interval k-mers for the peak reported at the end.
+const uint64_t ert_spill_entries = 1 << 20;
+const uint64_t ert_rss_interval = 1 << 16;
+
+// The k-mer space is cut into ert_num_shards shards of equal size. Completed shards are
+// recorded in <prefix>.ert_manifest, so an interrupted build resumes from it. The k-mers
+// around an edit are spread over the whole space, hence many small shards.
+const int ert_num_shards = 4096;
+
+typedef struct {
+	int resume;                 // the BWT of the same reference is complete, done shards are valid
+	int update;                 // shards of an earlier reference were kept, old_pac holds it
+	int64_t l_pac;
+	uint64_t pac_hash;
+	uint8_t* old_pac;
+	ert_shard_t shards[ert_num_shards];
+} ert_manifest_t;
+
 typedef enum { CODE, EMPTY_NODE, LEAF_COUNT, LEAF_HITS, UNIFORM_COUNT, UNIFORM_BP, LEAF_PTR, OTHER_PTR } byte_type_t;
 
 void ert_build_kmertree(const bwt_t* bwt, const bntseq_t* bns, const uint8_t* pac, bwtintv_t ik, bwtintv_t ok[4], int curDepth, node_t* parent_node, int step, int max_depth);
@@ -58,12 +107,18 @@ void handleDivergence(const bwt_t* bwt, const bntseq_t* bns, const uint8_t* pac,
 
 void handleLeaf(const bwt_t* bwt, const bntseq_t* bns, const uint8_t* pac, bwtintv_t ik, node_t* n, int step);
 
-void ert_build_table(const bwt_t* bwt, const bntseq_t* bns, const uint8_t* pac, bwtintv_t ik, bwtintv_t ok[4], uint8_t* mlt_data, uint8_t* mh_data, uint64_t* size, uint64_t* mh_size, uint8_t* aq, uint64_t* numHits, uint64_t* max_next_ptr, uint64_t next_ptr_width, int step, int max_depth);
+void ert_build_table(const bwt_t* bwt, const bntseq_t* bns, const uint8_t* pac, bwtintv_t ik, bwtintv_t ok[4], uint8_t* mlt_data, uint8_t* mh_data, uint64_t* size, uint64_t* mh_size, uint8_t* aq, uint64_t* numHits, uint64_t* max_next_ptr, uint64_t next_ptr_width, int mh_pack, int step, int max_depth);
 
-void ert_traverse_kmertree(node_t* n, uint8_t* mlt_data, uint8_t* mh_data, uint64_t* byte_idx, uint64_t* mh_byte_idx, int depth, uint64_t* numHits, uint64_t* max_ptr, uint64_t next_ptr_width, int step);
+void ert_traverse_kmertree(node_t* n, uint8_t* mlt_data, uint8_t* mh_data, uint64_t* byte_idx, uint64_t* mh_byte_idx, int depth, uint64_t* numHits, uint64_t* max_ptr, uint64_t next_ptr_width, int mh_pack, int step);
 
 void ert_destroy_kmertree(node_t* n);
 
-void buildKmerTrees(char* kmer_tbl_file_name, bwaidx_t* bid, char* prefix, int num_threads, int readLength);
+ert_manifest_t* ert_manifest_load(const char* prefix, const char* fa, int readLength, int mh_pack);
+
+void ert_manifest_start(const char* prefix, const char* fa, int readLength, int mh_pack);
+
+void ert_manifest_destroy(ert_manifest_t* m);
+
+void buildKmerTrees(char* kmer_tbl_file_name, bwaidx_t* bid, char* prefix, int num_threads, int readLength, int mh_pack, uint64_t max_mem, int keep_shards, ert_manifest_t* prev);
 
 #endif
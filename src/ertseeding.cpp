@@ -452,6 +452,44 @@ inline uint32_t getHashKey (const uint8_t *str, const int keysize, int index, in
 	return key;
 }
 
+#ifdef ERT_INDEX_PREFETCH
+/**
+ * Prefetch the k-mer table entry of the k-mer at read position i
+ *
+ * @param iaux          index related parameters
+ * @param read_buf      read sequence (2-bit encoded)
+ * @param i             Index into read buffer
+ * @param l_seq         Read length
+ */
+void prefetchKmerEntry(const index_aux_t* iaux, const uint8_t* read_buf, int i, int l_seq) {
+	int flag = 0, idx_first_N = -1;
+	uint32_t hashval = getHashKey(&read_buf[i], kmerSize, i, l_seq, &flag, &idx_first_N);
+	_mm_prefetch((const char*) &iaux->kmer_offsets[hashval], _MM_HINT_T0);
+}
+
+/**
+ * Prefetch the root of the tree of the k-mer at read position i. Reads the k-mer
+ * table entry, which should have been prefetched by prefetchKmerEntry() before.
+ *
+ * @param iaux          index related parameters
+ * @param read_buf      read sequence (2-bit encoded)
+ * @param i             Index into read buffer
+ * @param l_seq         Read length
+ */
+void prefetchKmerRoot(const index_aux_t* iaux, const uint8_t* read_buf, int i, int l_seq) {
+	int flag = 0, idx_first_N = -1;
+	uint32_t hashval = getHashKey(&read_buf[i], kmerSize, i, l_seq, &flag, &idx_first_N);
+	uint64_t kmer_entry = iaux->kmer_offsets[hashval];
+	if ((kmer_entry & METADATA_MASK) == INVALID) {
+		return;
+	}
+	// the multi-hit leaf pointer and the first nodes follow the root
+	const char* root = (const char*) &iaux->mlt_table[kmer_entry >> KMER_DATA_BITWIDTH];
+	_mm_prefetch(root, _MM_HINT_T0);
+	_mm_prefetch(root + 64, _MM_HINT_T0);
+}
+#endif
+
 uint8_t *get_seq(int64_t l_pac, const uint8_t *pac, int64_t beg, int64_t end,
                         int64_t *len,  uint8_t *ref_string, uint8_t *seqb)
 {
@@ -472,6 +510,142 @@ uint8_t *get_seq(int64_t l_pac, const uint8_t *pac, int64_t beg, int64_t end,
 }
 
 
+/**
+ * Match the hits of a multi-hit leaf past the end of the tree. Trees are READ_LEN bases deep,
+ * so in a longer read the hits of a leaf on the last level all match the read up to the leaf,
+ * but not necessarily beyond it. Each hit is compared with the reference, as the only hit of a
+ * single-hit leaf is.
+ *
+ * @param iaux              index parameters
+ * @param buf               read (or reverse-complemented read) bases following the leaf
+ * @param len               number of bases in buf
+ * @param off               distance on the reference from a hit to buf[0]
+ * @param limit             minimum number of hits the extension must keep, 1 when seeding
+ * @param hit               hits of the leaf
+ * @param n                 number of hits, at least limit
+ * @param lens              set to the number of matching bases of each hit
+ *
+ * @return                  number of bases matched by at least limit hits
+ */
+int matchLeafHits(index_aux_t* iaux, const uint8_t* buf, int len, int64_t off, int limit, const uint64_t* hit, int n, int* lens) {
+	int k, m, ext;
+	int count[len + 1];
+	memset_s(count, (len + 1) * sizeof(int), 0);
+	for (k = 0; k < n; ++k) {
+		int64_t l;
+		uint8_t* rseq = get_seq(iaux->bns->l_pac, iaux->pac, hit[k] + off, hit[k] + off + len, &l, iaux->ref_string, 0);
+		for (m = 0; m < l; ++m) {
+			if (rseq[m] != buf[m]) {
+				break;
+			}
+		}
+		lens[k] = m;
+		count[m]++;
+	}
+	// Longest extension shared by 'limit' hits
+	for (ext = len, m = 0; ext > 0; --ext) {
+		m += count[ext];
+		if (m >= limit) {
+			break;
+		}
+	}
+	return ext;
+}
+
+/**
+ * Buffer for the matching bases of n leaf hits (see matchLeafHits()), grown as needed and
+ * reused across the reads seeded by a thread
+ *
+ * @param raux              read parameters
+ * @param n                 number of hits
+ *
+ * @return                  buffer of at least n entries
+ */
+static int* leafLens(read_aux_t* raux, int n) {
+	if (n > raux->lens_m) {
+		raux->lens_m = n > 2 * raux->lens_m ? n : 2 * raux->lens_m;
+		raux->lens = (int*) realloc(raux->lens, raux->lens_m * sizeof(int));
+		assert(raux->lens != NULL);
+	}
+	return raux->lens;
+}
+
+/**
+ * Keep the hits of a MEM that match at least ext bases in matchLeafHits(), in their order
+ *
+ * @param mem               MEM whose hits are the last mem->hitcount entries in hits
+ * @param hits              list of hits for read
+ * @param lens              number of matching bases of each hit
+ * @param ext               number of bases to match
+ */
+void keepLeafHits(mem_t* mem, u64v* hits, const int* lens, int ext) {
+	int k, n = mem->hitcount;
+	assert(mem->hitbeg + n == hits->n);
+	mem->hitcount = 0;
+	for (k = 0; k < n; ++k) {
+		if (lens[k] >= ext) {
+			hits->a[mem->hitbeg + mem->hitcount++] = hits->a[mem->hitbeg + k];
+		}
+	}
+	hits->n = mem->hitbeg + mem->hitcount;
+}
+
+/**
+ * Extend a MEM ending at a multi-hit leaf to the right past the end of the tree (see
+ * matchLeafHits()) and keep the hits that match up to the new end. The LEP bit of each
+ * position after which hits drop out is set as the tree would have, had it been deep enough.
+ *
+ * @param iaux              index parameters
+ * @param raux              read parameters
+ * @param i                 index into read buffer past the leaf
+ * @param limit             minimum number of hits the extension must keep, 1 when seeding
+ * @param set_lep           set the LEP bits of the extension
+ * @param mem               MEM whose hits are the last mem->hitcount entries in hits
+ * @param hits              list of hits for read
+ *
+ * @return                  number of bases the MEM is extended by
+ */
+int extendLeafHits(index_aux_t* iaux, read_aux_t* raux, int i, int limit, int set_lep, mem_t* mem, u64v* hits) {
+	int k, ext;
+	int* lens = leafLens(raux, mem->hitcount);
+	ext = matchLeafHits(iaux, &raux->unpacked_queue_buf[i], raux->l_seq - i, i - mem->start, limit, &hits->a[mem->hitbeg], mem->hitcount, lens);
+	if (set_lep) {
+		for (k = 0; k < mem->hitcount; ++k) {
+			if (lens[k] < ext && i + lens[k] > 0) {
+				raux->lep[(i+lens[k]-1) >> 6] |= (1ULL << ((i+lens[k]-1) & (0x3FULL)));
+			}
+		}
+		// Last base of RMEM must have LEP bit set
+		raux->lep[(i+ext-1) >> 6] |= (1ULL << ((i+ext-1) & (0x3FULL)));
+	}
+	keepLeafHits(mem, hits, lens, ext);
+	return ext;
+}
+
+/**
+ * Extend a MEM ending at a multi-hit leaf in the backward search to the left of the read
+ * past the end of the tree (see matchLeafHits()) and keep the hits that match up to the new
+ * start. A single hit left is reported as such, without gathering the leaves again.
+ *
+ * @param iaux              index parameters
+ * @param raux              read parameters, read_buf is the reverse-complemented read
+ * @param limit             minimum number of hits the extension must keep, 1 when seeding
+ * @param mem               MEM whose hits are the last mem->hitcount entries in hits
+ * @param hits              list of hits for read
+ *
+ * @return                  number of bases the MEM is extended by
+ */
+int leftExtendLeafHits(index_aux_t* iaux, read_aux_t* raux, int limit, mem_t* mem, u64v* hits) {
+	int ext;
+	int* lens = leafLens(raux, mem->hitcount);
+	ext = matchLeafHits(iaux, &raux->read_buf[mem->rc_end], raux->l_seq - mem->rc_end, mem->rc_end - mem->rc_start, limit, &hits->a[mem->hitbeg], mem->hitcount, lens);
+	keepLeafHits(mem, hits, lens, ext);
+	if (mem->hitcount == 1) {
+		mem->fetch_leaves = 0;
+	}
+	return ext;
+}
+
 /**
  * Compute offset to child and return address of child node
  *
@@ -508,6 +682,58 @@ inline int getOffsetToLeafData(read_aux_t* raux, uint8_t code, uint8_t c) {
 	return leaf_table[((raux->ptr_width - 2) << 8) + code][c];
 }
 
+/**
+ * Locate the hit list of a multi-hit leaf node
+ *
+ * @param raux              read parameters
+ * @param mlt_data          radix tree of k-mer
+ * @param leaf_data         leaf node, (offset to hit list << 1) | 1, MH_PACKED_LIST set if bit-packed
+ * @param byteIdx           set to the first hit of the list
+ *
+ * @return                  number of hits at the leaf
+ */
+inline int getMultiHitList(read_aux_t* raux, uint8_t* mlt_data, uint64_t leaf_data, uint64_t* byteIdx) {
+	uint16_t num_hits = 0;
+	uint64_t nextByteIdx = raux->mh_start_addr + ((leaf_data & ~MH_PACKED_LIST) >> 1);
+	memcpy_bwamem(&num_hits, 2 * sizeof(uint8_t), &mlt_data[nextByteIdx], 2 * sizeof(uint8_t), __FILE__, __LINE__);
+	*byteIdx = nextByteIdx + 2;
+	return num_hits;
+}
+
+/**
+ * Append the hits of a leaf node in index order. A plain list stores 5 B per hit,
+ * a packed list a 1 B bit width and a 5 B base followed by the bit-packed
+ * offsets of the hits from the base (see addMultiHitLeafNode()).
+ *
+ * @param mlt_data          radix tree of k-mer
+ * @param byteIdx           first hit, the leaf node itself for a single hit
+ * @param leaf_data         leaf node
+ * @param num_hits          number of hits at the leaf
+ * @param hits              list of hits for read
+ */
+inline void pushLeafHits(uint8_t* mlt_data, uint64_t byteIdx, uint64_t leaf_data, int num_hits, u64v* hits) {
+	int k;
+	if ((leaf_data & 1) && (leaf_data & MH_PACKED_LIST)) {
+		int width = mlt_data[byteIdx];
+		uint64_t base = 0, mask = (1ULL << width) - 1, bit = 0;
+		memcpy_bwamem(&base, 5 * sizeof(uint8_t), &mlt_data[byteIdx + 1], 5 * sizeof(uint8_t), __FILE__, __LINE__);
+		uint8_t* packed = &mlt_data[byteIdx + 6];
+		for (k = 0; k < num_hits; ++k, bit += width) {
+			uint64_t v = 0;
+			int n = ((bit & 7) + width + 7) >> 3;
+			memcpy_bwamem(&v, n * sizeof(uint8_t), &packed[bit >> 3], n * sizeof(uint8_t), __FILE__, __LINE__);
+			kv_push(uint64_t, *hits, base + ((v >> (bit & 7)) & mask));
+		}
+		return;
+	}
+	for (k = 0; k < num_hits; ++k) {
+		uint64_t ref_pos = 0;
+		memcpy_bwamem(&ref_pos, 5 * sizeof(uint8_t), &mlt_data[byteIdx], 5 * sizeof(uint8_t), __FILE__, __LINE__);
+		kv_push(uint64_t, *hits, ref_pos >> 1);
+		byteIdx += 5;
+	}
+}
+
 /**
  * This routine does depth-first tree traversal starting from an internal node to obtain all hits at leaf nodes
  * 
@@ -521,7 +747,6 @@ inline int getOffsetToLeafData(read_aux_t* raux, uint8_t code, uint8_t c) {
 void getNextByteIdx_dfs(read_aux_t* raux, uint8_t* mlt_data, uint64_t* byte_idx, mem_t* mem, uint8_t bc, u64v* hits) {
 
 	uint64_t nextByteIdx = *byte_idx;
-	uint64_t ref_pos = 0;
 	uint8_t c;
 	c = 3 - bc;
 	mem->skip_ref_fetch = 1; // MEM cannot be extended by leaf decompression
@@ -529,21 +754,13 @@ void getNextByteIdx_dfs(read_aux_t* raux, uint8_t* mlt_data, uint64_t* byte_idx,
 	uint8_t code_c = (code >> (c << 1)) & 3;
 	assert(code != 0);
 	if (code_c == LEAF) { // Hit a leaf node
-		int k;
 		uint64_t leaf_data = 0;
 		nextByteIdx += getOffsetToLeafData(raux, code, c);
 		memcpy_bwamem(&leaf_data, 5 * sizeof(uint8_t), &mlt_data[nextByteIdx], 5 * sizeof(uint8_t), __FILE__, __LINE__);
 		if (leaf_data & 1) { // Found a multi-hit leaf node
-			nextByteIdx = raux->mh_start_addr + (leaf_data >> 1);
-			memcpy_bwamem(&raux->num_hits, 2 * sizeof(uint8_t), &mlt_data[nextByteIdx], 2 * sizeof(uint8_t), __FILE__, __LINE__);
-			nextByteIdx += 2;
+			raux->num_hits = getMultiHitList(raux, mlt_data, leaf_data, &nextByteIdx);
 			mem->hitcount += raux->num_hits;
-			for (k = 0; k < raux->num_hits; ++k) {
-				memcpy_bwamem(&ref_pos, 5 * sizeof(uint8_t), &mlt_data[nextByteIdx], 5 * sizeof(uint8_t), __FILE__, __LINE__);
-				kv_push(uint64_t, *hits, ref_pos >> 1);
-				nextByteIdx += 5;
-				ref_pos = 0;
-			}
+			pushLeafHits(mlt_data, nextByteIdx, leaf_data, raux->num_hits, hits);
 		}
 		else { // Single-hit leaf node
 			raux->num_hits = 1;
@@ -608,7 +825,6 @@ void leaf_gather(read_aux_t* raux, uint8_t* mlt_data, uint64_t* byte_idx, mem_t*
  */
 void getNextByteIdx_backward(read_aux_t* raux, uint8_t* mlt_data, uint64_t* byte_idx, int* i, mem_t* mem, u64v* hits) {
 	uint64_t nextByteIdx = *byte_idx;
-	uint64_t ref_pos = 0;
 	uint8_t c, code, code_c;
 	if (raux->read_buf[*i] != 4) {
 		c = 3 - raux->read_buf[*i];
@@ -626,21 +842,13 @@ void getNextByteIdx_backward(read_aux_t* raux, uint8_t* mlt_data, uint64_t* byte
 	else if (code_c == LEAF) { // Hit a leaf node
 		*i += 1;
 		mem->rc_end = *i;
-		int k;
 		uint64_t leaf_data = 0;
 		nextByteIdx += getOffsetToLeafData(raux, code, c);
 		memcpy_bwamem(&leaf_data, 5 * sizeof(uint8_t), &mlt_data[nextByteIdx], 5 * sizeof(uint8_t), __FILE__, __LINE__);
 		if (leaf_data & 1) { // Found a multi-hit leaf node
-			nextByteIdx = raux->mh_start_addr + (leaf_data >> 1);
-			memcpy_bwamem(&raux->num_hits, 2 * sizeof(uint8_t), &mlt_data[nextByteIdx], 2 * sizeof(uint8_t), __FILE__, __LINE__);
-			nextByteIdx += 2;
+			raux->num_hits = getMultiHitList(raux, mlt_data, leaf_data, &nextByteIdx);
 			mem->hitcount += raux->num_hits;
-			for (k = 0; k < raux->num_hits; ++k) {
-				memcpy_bwamem(&ref_pos, 5 * sizeof(uint8_t), &mlt_data[nextByteIdx], 5 * sizeof(uint8_t), __FILE__, __LINE__);
-				nextByteIdx += 5;
-				kv_push(uint64_t, *hits, ref_pos >> 1);
-				ref_pos = 0;
-			}
+			pushLeafHits(mlt_data, nextByteIdx, leaf_data, raux->num_hits, hits);
 			//
 			// We found a multi-hit. But to report hits in the same order as BWA-MEM,
 			// we will fetch the hits again in a forward tree traversal
@@ -718,7 +926,6 @@ void getNextByteIdx_backward(read_aux_t* raux, uint8_t* mlt_data, uint64_t* byte
 void getNextByteIdx_backward_wlimit(read_aux_t* raux, uint8_t* mlt_data, uint64_t* byte_idx, int* i, mem_t* mem, u64v* hits) {
 
 	uint64_t nextByteIdx = *byte_idx;
-	uint64_t ref_pos = 0;
 	uint8_t c, code, code_c;
 	if (raux->read_buf[*i] != 4) {
 		c = 3 - raux->read_buf[*i];
@@ -734,23 +941,15 @@ void getNextByteIdx_backward_wlimit(read_aux_t* raux, uint8_t* mlt_data, uint64_
 		mem->fetch_leaves = 1;
 	}
 	else if (code_c == LEAF) { // Hit a leaf node
-		int k;
 		uint64_t leaf_data = 0;
 		nextByteIdx += getOffsetToLeafData(raux, code, c);
 		memcpy_bwamem(&leaf_data, 5 * sizeof(uint8_t), &mlt_data[nextByteIdx], 5 * sizeof(uint8_t), __FILE__, __LINE__);
 		if (leaf_data & 1) { // Found a multi-hit leaf node
-			nextByteIdx = raux->mh_start_addr + (leaf_data >> 1);
-			memcpy_bwamem(&raux->num_hits, 2 * sizeof(uint8_t), &mlt_data[nextByteIdx], 2 * sizeof(uint8_t), __FILE__, __LINE__);
-			nextByteIdx += 2;
+			raux->num_hits = getMultiHitList(raux, mlt_data, leaf_data, &nextByteIdx);
 			// Hits exceed reseeding threshold
 			if (raux->num_hits >= raux->limit) {
 				mem->hitcount += raux->num_hits;
-				for (k = 0; k < raux->num_hits; ++k) {
-					memcpy_bwamem(&ref_pos, 5 * sizeof(uint8_t), &mlt_data[nextByteIdx], 5 * sizeof(uint8_t), __FILE__, __LINE__);
-					nextByteIdx += 5;
-					kv_push(uint64_t, *hits, ref_pos >> 1);
-					ref_pos = 0;
-				}
+				pushLeafHits(mlt_data, nextByteIdx, leaf_data, raux->num_hits, hits);
 				*i += 1;
 			} 
 		}
@@ -837,7 +1036,6 @@ void getNextByteIdx(read_aux_t* raux, uint8_t* mlt_data, uint64_t* byte_idx, int
 
 	uint64_t nextByteIdx = *byte_idx;
 	uint64_t parent_byte_idx = nextByteIdx;
-	uint64_t ref_pos = 0;
 	uint8_t c, code, code_c;
 	if (raux->read_buf[*i] != 4) {
 		c = 3 - raux->read_buf[*i];
@@ -865,21 +1063,13 @@ void getNextByteIdx(read_aux_t* raux, uint8_t* mlt_data, uint64_t* byte_idx, int
 		raux->nextLEPBit += 1;
 	}
 	else if (code_c == LEAF) { // Hit a leaf node
-		int k;
 		uint64_t leaf_data = 0;
 		nextByteIdx += getOffsetToLeafData(raux, code, c);
 		memcpy_bwamem(&leaf_data, 5 * sizeof(uint8_t), &mlt_data[nextByteIdx], 5 * sizeof(uint8_t), __FILE__, __LINE__);
 		if (leaf_data & 1) { // Found a multi-hit leaf node
-			nextByteIdx = raux->mh_start_addr + (leaf_data >> 1);
-			memcpy_bwamem(&raux->num_hits, 2 * sizeof(uint8_t), &mlt_data[nextByteIdx], 2 * sizeof(uint8_t), __FILE__, __LINE__);
-			nextByteIdx += 2;
+			raux->num_hits = getMultiHitList(raux, mlt_data, leaf_data, &nextByteIdx);
 			mem->hitcount += raux->num_hits;
-			for (k = 0; k < raux->num_hits; ++k) {
-				memcpy_bwamem(&ref_pos, 5 * sizeof(uint8_t), &mlt_data[nextByteIdx], 5 * sizeof(uint8_t), __FILE__, __LINE__);
-				kv_push(uint64_t, *hits, ref_pos >> 1);
-				nextByteIdx += 5;
-				ref_pos = 0;
-			}
+			pushLeafHits(mlt_data, nextByteIdx, leaf_data, raux->num_hits, hits);
 		}
 		else { // Single-hit leaf node
 			raux->num_hits = 1;
@@ -990,7 +1180,6 @@ void getNextByteIdx_wlimit(read_aux_t* raux, uint8_t* mlt_data, uint64_t* byte_i
 
 	uint64_t nextByteIdx = *byte_idx;
 	uint64_t parent_byte_idx = nextByteIdx;
-	uint64_t ref_pos = 0;
 	uint8_t c, code, code_c;
 	if (raux->read_buf[*i] != 4) {
 		c = 3 - raux->read_buf[*i];
@@ -1017,14 +1206,11 @@ void getNextByteIdx_wlimit(read_aux_t* raux, uint8_t* mlt_data, uint64_t* byte_i
 		raux->nextLEPBit += 1;
 	}
 	else if (code_c == LEAF) { // Hit a leaf node
-		int k;
 		uint64_t leaf_data = 0;
 		nextByteIdx += getOffsetToLeafData(raux, code, c);
 		memcpy_bwamem(&leaf_data, 5 * sizeof(uint8_t), &mlt_data[nextByteIdx], 5 * sizeof(uint8_t), __FILE__, __LINE__);
 		if (leaf_data & 1) { // Found a multi-hit leaf node
-			nextByteIdx = raux->mh_start_addr + (leaf_data >> 1);
-			memcpy_bwamem(&raux->num_hits, 2 * sizeof(uint8_t), &mlt_data[nextByteIdx], 2 * sizeof(uint8_t), __FILE__, __LINE__);
-			nextByteIdx += 2;
+			raux->num_hits = getMultiHitList(raux, mlt_data, leaf_data, &nextByteIdx);
 		}
 		else { // Single-hit leaf node
 			raux->num_hits = 1;
@@ -1032,12 +1218,7 @@ void getNextByteIdx_wlimit(read_aux_t* raux, uint8_t* mlt_data, uint64_t* byte_i
 		// Hits exceed reseeding threshold
 		if (raux->num_hits >= raux->limit) {
 			mem->hitcount += raux->num_hits;
-			for (k = 0; k < raux->num_hits; ++k) {
-				memcpy_bwamem(&ref_pos, 5 * sizeof(uint8_t), &mlt_data[nextByteIdx], 5 * sizeof(uint8_t), __FILE__, __LINE__);
-				kv_push(uint64_t, *hits, ref_pos >> 1);
-				nextByteIdx += 5;
-				ref_pos = 0;
-			}
+			pushLeafHits(mlt_data, nextByteIdx, leaf_data, raux->num_hits, hits);
 			*i += 1;
 		}
 		else {
@@ -1168,7 +1349,6 @@ void getNextByteIdx_wlimit(read_aux_t* raux, uint8_t* mlt_data, uint64_t* byte_i
 void getNextByteIdx_last(read_aux_t* raux, uint8_t* mlt_data, uint64_t* byte_idx, int* i, mem_t* mem, u64v* hits) {
 
 	uint64_t nextByteIdx = *byte_idx;
-	uint64_t ref_pos = 0;
 	uint8_t c, code, code_c;
 	if (raux->read_buf[*i] != 4) {
 		c = 3 - raux->read_buf[*i];
@@ -1183,21 +1363,13 @@ void getNextByteIdx_last(read_aux_t* raux, uint8_t* mlt_data, uint64_t* byte_idx
 		*i += 1;
 	}
 	else if (code_c == LEAF) { // Hit a leaf node
-		int k;
 		uint64_t leaf_data = 0;
 		nextByteIdx += getOffsetToLeafData(raux, code, c);
 		memcpy_bwamem(&leaf_data, 5 * sizeof(uint8_t), &mlt_data[nextByteIdx], 5 * sizeof(uint8_t), __FILE__, __LINE__);
 		if (leaf_data & 1) { // multi-hit leaf
-			nextByteIdx = raux->mh_start_addr + (leaf_data >> 1);
-			memcpy_bwamem(&raux->num_hits, 2 * sizeof(uint8_t), &mlt_data[nextByteIdx], 2 * sizeof(uint8_t), __FILE__, __LINE__);
-			nextByteIdx += 2;
+			raux->num_hits = getMultiHitList(raux, mlt_data, leaf_data, &nextByteIdx);
 			mem->hitcount += raux->num_hits;
-			for (k = 0; k < raux->num_hits; ++k) {
-				memcpy_bwamem(&ref_pos, 5 * sizeof(uint8_t), &mlt_data[nextByteIdx], 5 * sizeof(uint8_t), __FILE__, __LINE__);
-				kv_push(uint64_t, *hits, ref_pos >> 1);
-				nextByteIdx += 5;
-				ref_pos = 0;
-			}
+			pushLeafHits(mlt_data, nextByteIdx, leaf_data, raux->num_hits, hits);
 		}
 		else { // single-hit leaf
 			raux->num_hits = 1;
@@ -1506,7 +1678,6 @@ void getNextByteIdx_fetch_leaves_prefix_reseed(read_aux_t* raux, uint8_t* mlt_da
 
 	uint64_t nextByteIdx = *byte_idx;
 	uint64_t parent_byte_idx = nextByteIdx;
-	uint64_t ref_pos = 0;
 	uint8_t c;
 	int i = idx;
 	assert(raux->read_buf[i] != 4); // Should not see N in SMEMs
@@ -1522,26 +1693,18 @@ void getNextByteIdx_fetch_leaves_prefix_reseed(read_aux_t* raux, uint8_t* mlt_da
 		}
 	}
 	else if (code_c == LEAF) {
-		int k;
 		uint64_t leaf_data = 0;
 		nextByteIdx += getOffsetToLeafData(raux, code, c);
 		memcpy_bwamem(&leaf_data, 5 * sizeof(uint8_t), &mlt_data[nextByteIdx], 5 * sizeof(uint8_t), __FILE__, __LINE__);
 		if (leaf_data & 1) {
-			nextByteIdx = raux->mh_start_addr + (leaf_data >> 1);
-			memcpy_bwamem(&raux->num_hits, 2 * sizeof(uint8_t), &mlt_data[nextByteIdx], 2 * sizeof(uint8_t), __FILE__, __LINE__);
-			nextByteIdx += 2;
+			raux->num_hits = getMultiHitList(raux, mlt_data, leaf_data, &nextByteIdx);
 		}
 		else {
 			raux->num_hits = 1;
 		}
 		if (raux->num_hits >= raux->limit) {
 			mem->hitcount += raux->num_hits;
-			for (k = 0; k < raux->num_hits; ++k) {
-				memcpy_bwamem(&ref_pos, 5 * sizeof(uint8_t), &mlt_data[nextByteIdx], 5 * sizeof(uint8_t), __FILE__, __LINE__);
-				kv_push(uint64_t, *hits, ref_pos >> 1);
-				nextByteIdx += 5;
-				ref_pos = 0;
-			}
+			pushLeafHits(mlt_data, nextByteIdx, leaf_data, raux->num_hits, hits);
 			i += 1;
 			mem->end = i;
 			mem->is_multi_hit = 1; // decompress leaf node for potentially longer match
@@ -1644,7 +1807,6 @@ void getNextByteIdx_fetch_leaves_prefix_reseed(read_aux_t* raux, uint8_t* mlt_da
 void getNextByteIdx_fetch_leaves_prefix(read_aux_t* raux, uint8_t* mlt_data, uint64_t* byte_idx, int idx, mem_t* mem, u64v* hits) {
 
 	uint64_t nextByteIdx = *byte_idx;
-	uint64_t ref_pos = 0;
 	uint8_t c;
 	int i = idx;
 	assert(raux->read_buf[i] != 4); // Should not see N in SMEMs
@@ -1661,21 +1823,13 @@ void getNextByteIdx_fetch_leaves_prefix(read_aux_t* raux, uint8_t* mlt_data, uin
 		}
 	}
 	else if (code_c == LEAF) {
-		int k;
 		uint64_t leaf_data = 0;
 		nextByteIdx += getOffsetToLeafData(raux, code, c);
 		memcpy_bwamem(&leaf_data, 5 * sizeof(uint8_t), &mlt_data[nextByteIdx], 5 * sizeof(uint8_t), __FILE__, __LINE__);
 		if (leaf_data & 1) {
-			nextByteIdx = raux->mh_start_addr + (leaf_data >> 1);
-			memcpy_bwamem(&raux->num_hits, 2 * sizeof(uint8_t), &mlt_data[nextByteIdx], 2 * sizeof(uint8_t), __FILE__, __LINE__);
-			nextByteIdx += 2;
+			raux->num_hits = getMultiHitList(raux, mlt_data, leaf_data, &nextByteIdx);
 			mem->hitcount += raux->num_hits;
-			for (k = 0; k < raux->num_hits; ++k) {
-				memcpy_bwamem(&ref_pos, 5 * sizeof(uint8_t), &mlt_data[nextByteIdx], 5 * sizeof(uint8_t), __FILE__, __LINE__);
-				kv_push(uint64_t, *hits, ref_pos >> 1);
-				nextByteIdx += 5;
-				ref_pos = 0;
-			}
+			pushLeafHits(mlt_data, nextByteIdx, leaf_data, raux->num_hits, hits);
 		}
 		else {
 			raux->num_hits = 1;
@@ -1759,7 +1913,6 @@ void getNextByteIdx_fetch_leaves_prefix(read_aux_t* raux, uint8_t* mlt_data, uin
 void getNextByteIdx_fetch_leaves(read_aux_t* raux, uint8_t* mlt_data, uint64_t* byte_idx, int idx, mem_t* mem, u64v* hits) {
 
 	uint64_t nextByteIdx = *byte_idx;
-	uint64_t ref_pos = 0;
 	uint8_t c;
 	int i = idx;
 	assert(raux->read_buf[i] != 4); // Should not see N in SMEMs
@@ -1769,21 +1922,13 @@ void getNextByteIdx_fetch_leaves(read_aux_t* raux, uint8_t* mlt_data, uint64_t*
 	assert(code != 0);
 	assert(code_c != EMPTY);
 	if (code_c == LEAF) {
-		int k;
 		uint64_t leaf_data = 0;
 		nextByteIdx += getOffsetToLeafData(raux, code, c);
 		memcpy_bwamem(&leaf_data, 5 * sizeof(uint8_t), &mlt_data[nextByteIdx], 5 * sizeof(uint8_t), __FILE__, __LINE__);
 		if (leaf_data & 1) {
-			nextByteIdx = raux->mh_start_addr + (leaf_data >> 1);
-			memcpy_bwamem(&raux->num_hits, 2 * sizeof(uint8_t), &mlt_data[nextByteIdx], 2 * sizeof(uint8_t), __FILE__, __LINE__);
-			nextByteIdx += 2;
+			raux->num_hits = getMultiHitList(raux, mlt_data, leaf_data, &nextByteIdx);
 			mem->hitcount += raux->num_hits;
-			for (k = 0; k < raux->num_hits; ++k) {
-				memcpy_bwamem(&ref_pos, 5 * sizeof(uint8_t), &mlt_data[nextByteIdx], 5 * sizeof(uint8_t), __FILE__, __LINE__);
-				kv_push(uint64_t, *hits, ref_pos >> 1);
-				nextByteIdx += 5;
-				ref_pos = 0;
-			}
+			pushLeafHits(mlt_data, nextByteIdx, leaf_data, raux->num_hits, hits);
 		}
 		else {
 			raux->num_hits = 1;
@@ -2130,6 +2275,23 @@ void rightExtend_fetch_leaves(index_aux_t* iaux, read_aux_t* raux, mem_t* mem, u
 	}
 }
 
+/**
+ * Copy the LEP bits of a k-mer table entry into the LEP bit-vector of the read.
+ * The kmerSize-1 bits start at read position i and may straddle two words.
+ * 
+ * @param raux              read parameters
+ * @param i                 Index into read buffer
+ * @param lep_data          LEP bits of the k-mer table entry
+ */
+static inline void setKmerLEP(read_aux_t* raux, int i, uint64_t lep_data) {
+	int w = i >> 6, off = i & 63;
+	assert(w + 1 < raux->lep_n);
+	raux->lep[w] |= (lep_data << off);
+	if (off > 64-kmerSize) {
+		raux->lep[w+1] |= (lep_data >> (64-off));
+	}
+}
+
 /**
  * Main forward search function (seeding). Lookup up k-mer and/or x-mer table and identify root of ERT 
  * 
@@ -2161,37 +2323,7 @@ void rightExtend(index_aux_t* iaux, read_aux_t* raux, int* i, mem_t* mem, u64v*
 	// width used for internal pointers in tree
 	raux->ptr_width = (((kmer_entry >> 22) & 3) == 0) ? 4 : ((kmer_entry >> 22) & 3);
 	// LEP takes up kmerSize-1 bits. Last LEP bit is at position = kmerSize-2.
-	if (*i <= 64-kmerSize) {
-		raux->lep[0] |= (lep_data << *i);
-	}
-	else if (*i < 64) { 
-		raux->lep[0] |= (lep_data << *i);
-		raux->lep[1] |= (lep_data >> (64-*i));
-	}
-	else if (*i <= 128-kmerSize) {
-		raux->lep[1] |= (lep_data << (*i-64));
-	}
-	else if (*i < 128) {
-		raux->lep[1] |= (lep_data << (*i-64));
-		raux->lep[2] |= (lep_data >> (128-*i));
-	}
-	else if (*i <= 192-kmerSize) {
-		raux->lep[2] |= (lep_data << (*i-128));
-	}
-	else if (*i < 192) {
-		raux->lep[2] |= (lep_data << (*i-128));
-		raux->lep[3] |= (lep_data >> (192-*i));
-	}
-	else if (*i <= 256-kmerSize) { 
-		raux->lep[3] |= (lep_data << (*i-192));
-	}
-	else if (*i < 256) {
-		raux->lep[3] |= (lep_data << (*i-192));
-		raux->lep[4] |= (lep_data >> (256-*i));
-	}
-	else {
-		raux->lep[4] |= (lep_data << (*i-256));
-	}
+	setKmerLEP(raux, *i, lep_data);
 	raux->nextLEPBit = *i + kmerSize - 1;
 	byte_idx = 0;
 	// We found an ambiguous base in the kmer. Stop extension at ambiguous base and record LEP
@@ -2337,37 +2469,7 @@ void rightExtend_wlimit(index_aux_t* iaux, read_aux_t* raux, int* i, mem_t* mem,
 	raux->ptr_width = (((kmer_entry >> 22) & 3) == 0) ? 4 : ((kmer_entry >> 22) & 3);
 	raux->num_hits = (kmer_entry >> 17) & 0x1F;
 	// LEP takes up kmerSize-1 bits. Last LEP bit is at position = kmerSize-2.
-	if (*i <= 64-kmerSize) {
-		raux->lep[0] |= (lep_data << *i);
-	}
-	else if (*i < 64) { 
-		raux->lep[0] |= (lep_data << *i);
-		raux->lep[1] |= (lep_data >> (64-*i));
-	}
-	else if (*i <= 128-kmerSize) {
-		raux->lep[1] |= (lep_data << (*i-64));
-	}
-	else if (*i < 128) {
-		raux->lep[1] |= (lep_data << (*i-64));
-		raux->lep[2] |= (lep_data >> (128-*i));
-	}
-	else if (*i <= 192-kmerSize) {
-		raux->lep[2] |= (lep_data << (*i-128));
-	}
-	else if (*i < 192) {
-		raux->lep[2] |= (lep_data << (*i-128));
-		raux->lep[3] |= (lep_data >> (192-*i));
-	}
-	else if (*i <= 256-kmerSize) { 
-		raux->lep[3] |= (lep_data << (*i-192));
-	}
-	else if (*i < 256) {
-		raux->lep[3] |= (lep_data << (*i-192));
-		raux->lep[4] |= (lep_data >> (256-*i));
-	}
-	else {
-		raux->lep[4] |= (lep_data << (*i-256));
-	}
+	setKmerLEP(raux, *i, lep_data);
 	raux->nextLEPBit = *i + kmerSize - 1;
 	byte_idx = 0;
 	// We found an ambiguous base in the kmer. Stop extension at ambiguous base and record LEP
@@ -2641,6 +2743,8 @@ int check_and_add_smem_prefix_reseed(index_aux_t* iaux, read_aux_t* raux, mem_t*
 	mem->start = raux->l_seq - mem->rc_end; // Adjust start position of LMEM
 	int lmemLen = mem->end - mem->start, rmemLen = -1, next_be_point;
 	if (mem->hitcount > 0 && !mem->skip_ref_fetch) {
+		// Multi-hit leaf at the depth of the tree, keep the hits extending furthest to the left
+		int leafExt = (mem->hitcount > 1) ? leftExtendLeafHits(iaux, raux, raux->limit, mem, hits) : -1;
 		int64_t len;
 		int64_t start_ref_pos = hits->a[mem->hitbeg] - mem->rc_start;
 		int64_t end_ref_pos = hits->a[mem->hitbeg];
@@ -2662,14 +2766,19 @@ int check_and_add_smem_prefix_reseed(index_aux_t* iaux, read_aux_t* raux, mem_t*
 		end_ref_pos = start_ref_pos + mem->start;
 
 		// Fetch reference to check for extra matching bps on the left
-		rseq = get_seq(iaux->bns->l_pac, iaux->pac, start_ref_pos, end_ref_pos, &len, iaux->ref_string, 0); 
-		numMatchingBP = 0;
-		for (m = 0; m < len; ++m) {
-			if (rseq[m] == raux->read_buf[mem->rc_end + m]) {
-				numMatchingBP++;
-			}
-			else {
-				break;
+		if (leafExt >= 0) {
+			numMatchingBP = leafExt;
+		}
+		else {
+			rseq = get_seq(iaux->bns->l_pac, iaux->pac, start_ref_pos, end_ref_pos, &len, iaux->ref_string, 0); 
+			numMatchingBP = 0;
+			for (m = 0; m < len; ++m) {
+				if (rseq[m] == raux->read_buf[mem->rc_end + m]) {
+					numMatchingBP++;
+				}
+				else {
+					break;
+				}
 			}
 		}
 		mem->start -= numMatchingBP;
@@ -2696,7 +2805,12 @@ int check_and_add_smem_prefix_reseed(index_aux_t* iaux, read_aux_t* raux, mem_t*
 		rmemLen = mem->end - mem->start;
 		next_be_point = mem->end;
 		if (mem->hitcount > 0) {
-			if (mem->is_multi_hit) {
+			if (mem->is_multi_hit && mem->hitcount > 1) { // multi-hit leaf at the depth of the tree
+				mem->end += extendLeafHits(iaux, raux, mem->end, raux->limit, 0, mem, hits);
+				rmemLen = mem->end - mem->start;
+				next_be_point = mem->end;
+			}
+			else if (mem->is_multi_hit) {
 				int64_t len;
 				int64_t start_ref_pos = hits->a[mem->hitbeg] + rmemLen;
 				int64_t end_ref_pos = hits->a[mem->hitbeg] + raux->l_seq - mem->start;
@@ -2758,6 +2872,8 @@ int check_and_add_smem_prefix(index_aux_t* iaux, read_aux_t* raux, mem_t* mem, s
 	mem->start = raux->l_seq - mem->rc_end; // Adjust start position of LMEM
 	int lmemLen = mem->end - mem->start, rmemLen = -1, next_be_point;
 	if (mem->hitcount > 0 && !mem->skip_ref_fetch) {
+		// Multi-hit leaf at the depth of the tree, keep the hits extending furthest to the left
+		int leafExt = (mem->hitcount > 1) ? leftExtendLeafHits(iaux, raux, 1, mem, hits) : -1;
 		int64_t len;
 		int64_t start_ref_pos = hits->a[mem->hitbeg] - mem->rc_start;
 		int64_t end_ref_pos = hits->a[mem->hitbeg];
@@ -2778,17 +2894,22 @@ int check_and_add_smem_prefix(index_aux_t* iaux, read_aux_t* raux, mem_t* mem, s
 		start_ref_pos = hits->a[mem->hitbeg] + lmemLen;
 		end_ref_pos = start_ref_pos + mem->start;
 		// Fetch reference to check for extra matching bps
-		rseq = get_seq(iaux->bns->l_pac, iaux->pac, start_ref_pos, end_ref_pos, &len, iaux->ref_string, 0); 
-		numMatchingBP = 0;
-		for (m = 0; m < len; ++m) {
-			if (rseq[m] == raux->read_buf[mem->rc_end + m]) {
-				numMatchingBP++;
-			}
-			else {
-				break;
+		if (leafExt >= 0) {
+			numMatchingBP = leafExt;
+		}
+		else {
+			rseq = get_seq(iaux->bns->l_pac, iaux->pac, start_ref_pos, end_ref_pos, &len, iaux->ref_string, 0); 
+			numMatchingBP = 0;
+			for (m = 0; m < len; ++m) {
+				if (rseq[m] == raux->read_buf[mem->rc_end + m]) {
+					numMatchingBP++;
+				}
+				else {
+					break;
+				}
 			}
+			// free(rseq);
 		}
-		// free(rseq);
 		mem->start -= numMatchingBP;
 	}
 	lmemLen = mem->end - mem->start;
@@ -2812,23 +2933,28 @@ int check_and_add_smem_prefix(index_aux_t* iaux, read_aux_t* raux, mem_t* mem, s
 		rmemLen = mem->end - mem->start;
 		next_be_point = mem->end;
 		if (mem->hitcount > 0) {
-			int64_t len;
-			int64_t start_ref_pos = hits->a[mem->hitbeg] + rmemLen;
-			int64_t end_ref_pos = hits->a[mem->hitbeg] + raux->l_seq - mem->start;
-			/// Fetch reference
-			uint8_t* rseq = get_seq(iaux->bns->l_pac, iaux->pac, start_ref_pos, end_ref_pos, &len, iaux->ref_string, 0); 
-			int m;
-			int numMatchingBP = 0;
-			/// Check for matching bases
-			for (m = 0; m < len; ++m) {
-				if (rseq[m] == raux->unpacked_queue_buf[mem->end + m]) {
-					numMatchingBP++;
-				}
-				else {
-					break;
+			if (mem->hitcount > 1 && !mem->skip_ref_fetch) { // multi-hit leaf at the depth of the tree
+				mem->end += extendLeafHits(iaux, raux, mem->end, 1, 0, mem, hits);
+			}
+			else {
+				int64_t len;
+				int64_t start_ref_pos = hits->a[mem->hitbeg] + rmemLen;
+				int64_t end_ref_pos = hits->a[mem->hitbeg] + raux->l_seq - mem->start;
+				/// Fetch reference
+				uint8_t* rseq = get_seq(iaux->bns->l_pac, iaux->pac, start_ref_pos, end_ref_pos, &len, iaux->ref_string, 0); 
+				int m;
+				int numMatchingBP = 0;
+				/// Check for matching bases
+				for (m = 0; m < len; ++m) {
+					if (rseq[m] == raux->unpacked_queue_buf[mem->end + m]) {
+						numMatchingBP++;
+					}
+					else {
+						break;
+					}
 				}
+				mem->end += numMatchingBP;
 			}
-			mem->end += numMatchingBP;
 			rmemLen = mem->end - mem->start;
 			next_be_point = mem->end;
 			if (rmemLen >= raux->min_seed_len) {
@@ -2863,24 +2989,33 @@ int check_and_add_smem_prefix(index_aux_t* iaux, read_aux_t* raux, mem_t* mem, s
  * @param sh            helper data structure to keep track of start and end positions of previously identified MEMs
  * @param smems         list of SMEMs
  * @param hits          list of hits for read
+ * @param limit         minimum number of hits of the MEM, 1 when seeding
  */
-void check_and_add_smem(index_aux_t* iaux, read_aux_t* raux, mem_t* mem, smem_helper_t* sh, mem_v* smems, u64v* hits) {
+void check_and_add_smem(index_aux_t* iaux, read_aux_t* raux, mem_t* mem, smem_helper_t* sh, mem_v* smems, u64v* hits, int limit) {
 
 	mem->start = raux->l_seq - mem->rc_end; // Adjust start position of LMEM
 	int lmemLen = mem->end - mem->start;
 	if (mem->hitcount > 0 && !mem->skip_ref_fetch) {
+		// Multi-hit leaf at the depth of the tree, keep the hits extending furthest to the left
+		int leafExt = (mem->hitcount > 1) ? leftExtendLeafHits(iaux, raux, limit, mem, hits) : -1;
 		int64_t len;
 		int64_t start_ref_pos = hits->a[mem->hitbeg] + lmemLen;
 		int64_t end_ref_pos = start_ref_pos + mem->start;
 		// Fetch reference to check for extra matching bps
-		uint8_t* rseq = get_seq(iaux->bns->l_pac, iaux->pac, start_ref_pos, end_ref_pos, &len, iaux->ref_string, 0);
-		int m, numMatchingBP = 0;
-		for (m = 0; m < len; ++m) {
-			if (rseq[m] == raux->read_buf[mem->rc_end + m]) {
-				numMatchingBP++;
-			}
-			else {
-				break;
+		int numMatchingBP = 0;
+		if (leafExt >= 0) {
+			numMatchingBP = leafExt;
+		}
+		else {
+			uint8_t* rseq = get_seq(iaux->bns->l_pac, iaux->pac, start_ref_pos, end_ref_pos, &len, iaux->ref_string, 0);
+			int m;
+			for (m = 0; m < len; ++m) {
+				if (rseq[m] == raux->read_buf[mem->rc_end + m]) {
+					numMatchingBP++;
+				}
+				else {
+					break;
+				}
 			}
 		}
 		// Adjust start position of MEM by extra matching bps
@@ -2898,6 +3033,12 @@ void check_and_add_smem(index_aux_t* iaux, read_aux_t* raux, mem_t* mem, smem_he
 				raux->read_buf = raux->unpacked_queue_buf;
 				rightExtend_fetch_leaves(iaux, raux, mem, hits);
 				raux->read_buf = raux->unpacked_rc_queue_buf;
+				if (mem->hitcount > 1 && !mem->skip_ref_fetch) { // leaf at the depth of the tree, keep the hits of the whole MEM
+					int len = mem->end - mem->start;
+					int* lens = leafLens(raux, mem->hitcount);
+					matchLeafHits(iaux, &raux->unpacked_queue_buf[mem->start], len, 0, 1, &hits->a[mem->hitbeg], mem->hitcount, lens);
+					keepLeafHits(mem, hits, lens, len);
+				}
 			}
 			if (mem->hitcount > 0) {
 				mem->pt.c_pivot = sh->curr_pivot;
@@ -2931,7 +3072,7 @@ void get_seeds_prefix(index_aux_t* iaux, read_aux_t* raux, mem_v* smems, u64v* h
 	int i = 0, j = 0;
 	sh.prev_pivot = -1;
 	sh.prev_prev_pivot = -1;
-	memset_s(raux->lep, 5 * sizeof(uint64_t), 0);
+	memset_s(raux->lep, raux->lep_n * sizeof(uint64_t), 0);
 	while (i < raux->l_seq) { // Begin identifying RMEMs
 		mem_t rm;
 		memset_s(&rm, sizeof(mem_t), 0);
@@ -2942,7 +3083,10 @@ void get_seeds_prefix(index_aux_t* iaux, read_aux_t* raux, mem_v* smems, u64v* h
 		raux->read_buf = raux->unpacked_queue_buf;
 		rightExtend(iaux, raux, &i, &rm, hits); //!< Compute LEP.
 		// Lazy expansion of leaf nodes. 
-		if (rm.hitcount > 0 && !rm.skip_ref_fetch) {
+		if (rm.hitcount > 1 && !rm.skip_ref_fetch) { // multi-hit leaf at the depth of the tree
+			i += extendLeafHits(iaux, raux, i, 1, 1, &rm, hits);
+		}
+		else if (rm.hitcount > 0 && !rm.skip_ref_fetch) {
 			int64_t len;
 			int64_t start_ref_pos = hits->a[rm.hitbeg] + i - rm.start;
 			int64_t end_ref_pos = hits->a[rm.hitbeg] + raux->l_seq - rm.start;
@@ -2979,7 +3123,7 @@ void get_seeds_prefix(index_aux_t* iaux, read_aux_t* raux, mem_v* smems, u64v* h
 			else {
 				hits->n -= rm.hitcount;
 			}
-			memset_s(raux->lep, 5 * sizeof(uint64_t), 0);
+			memset_s(raux->lep, raux->lep_n * sizeof(uint64_t), 0);
 		}
 		else { // perform all backward extensions
 			hits->n -= rm.hitcount;
@@ -3001,12 +3145,25 @@ void get_seeds_prefix(index_aux_t* iaux, read_aux_t* raux, mem_v* smems, u64v* h
 					be_point = j + 1;
 					if (be_point >= min_seed_len) {
 						int rc_i = seq_len - be_point; 
+#ifdef ERT_INDEX_PREFETCH
+						// k-mer entry of the next LEP position, while this one extends
+						if (iaux->prefetch > 0) {
+							int pj = j + 1;
+							while (pj <= max_j && !((lep[pj >> 6] >> (pj & 63)) & 1)) {
+								++pj;
+							}
+							if (pj <= max_j) {
+								prefetchKmerEntry(iaux, raux->unpacked_rc_queue_buf, seq_len - pj - 1, seq_len);
+							}
+						}
+#endif
 						raux->read_buf = raux->unpacked_rc_queue_buf;
 						leftExtend(iaux, raux, &rc_i, &m, hits);
 						next_j = check_and_add_smem_prefix(iaux, raux, &m, &sh, smems, hits);
 					}
 				}
-				j = next_j;
+				// a read longer than the tree depth may not advance past j
+				j = next_j > j ? next_j : j + 1;
 				if (m.end > i) {
 					i = m.end;
 				}
@@ -3032,7 +3189,7 @@ void get_seeds_prefix(index_aux_t* iaux, read_aux_t* raux, mem_v* smems, u64v* h
 		}
 		sh.prev_prev_pivot = sh.prev_pivot;
 		sh.prev_pivot = rm.start;
-		memset_s(raux->lep, 5 * sizeof(uint64_t), 0);
+		memset_s(raux->lep, raux->lep_n * sizeof(uint64_t), 0);
 	}
 #ifdef PRINT_SMEM
 	ks_introsort(mem_smem_sort_lt_ert, smems->n, smems->a); // Sort SMEMs based on start pos in read. For DEBUG.
@@ -3068,7 +3225,7 @@ void get_seeds(index_aux_t* iaux, read_aux_t* raux, mem_v* smems, u64v* hits) {
 	int i = 0, j = 0;
 	sh.prev_pivot = -1;
 	sh.prev_prev_pivot = -1;
-	memset_s(raux->lep, 5 * sizeof(uint64_t), 0);
+	memset_s(raux->lep, raux->lep_n * sizeof(uint64_t), 0);
 	while (i < raux->l_seq) { // Begin identifying RMEMs
 		mem_t rm;
 		memset_s(&rm, sizeof(mem_t), 0);
@@ -3079,7 +3236,10 @@ void get_seeds(index_aux_t* iaux, read_aux_t* raux, mem_v* smems, u64v* hits) {
 		raux->read_buf = raux->unpacked_queue_buf;
 		rightExtend(iaux, raux, &i, &rm, hits); // Compute LEP.
 		// Lazy expansion of leaf nodes. 
-		if (rm.hitcount > 0 && !rm.skip_ref_fetch) {
+		if (rm.hitcount > 1 && !rm.skip_ref_fetch) { // multi-hit leaf at the depth of the tree
+			i += extendLeafHits(iaux, raux, i, 1, 1, &rm, hits);
+		}
+		else if (rm.hitcount > 0 && !rm.skip_ref_fetch) {
 			int64_t len;
 			int64_t start_ref_pos = hits->a[rm.hitbeg] + i - rm.start;
 			int64_t end_ref_pos = hits->a[rm.hitbeg] + raux->l_seq - rm.start;
@@ -3119,7 +3279,7 @@ void get_seeds(index_aux_t* iaux, read_aux_t* raux, mem_v* smems, u64v* hits) {
 			else {
 				hits->n -= rm.hitcount;
 			}
-			memset_s(raux->lep, 5 * sizeof(uint64_t), 0);
+			memset_s(raux->lep, raux->lep_n * sizeof(uint64_t), 0);
 		}
 		else {
 			hits->n -= rm.hitcount;
@@ -3140,7 +3300,7 @@ void get_seeds(index_aux_t* iaux, read_aux_t* raux, mem_v* smems, u64v* hits) {
 						int rc_i = seq_len - be_point; 
 						raux->read_buf = raux->unpacked_rc_queue_buf;
 						leftExtend(iaux, raux, &rc_i, &m, hits);
-						check_and_add_smem(iaux, raux, &m, &sh, smems, hits);
+						check_and_add_smem(iaux, raux, &m, &sh, smems, hits, 1);
 						if (sh.stop_be) break;
 					}
 				}
@@ -3167,7 +3327,7 @@ void get_seeds(index_aux_t* iaux, read_aux_t* raux, mem_v* smems, u64v* hits) {
 		}
 		sh.prev_prev_pivot = sh.prev_pivot;
 		sh.prev_pivot = rm.start;
-		memset_s(raux->lep, 5 * sizeof(uint64_t), 0);
+		memset_s(raux->lep, raux->lep_n * sizeof(uint64_t), 0);
 	}
 #ifdef PRINT_SMEM
 	ks_introsort(mem_smem_sort_lt_ert, smems->n, smems->a); // Sort SMEMs based on start pos in read. For DEBUG. 
@@ -3207,7 +3367,7 @@ void reseed_prefix(index_aux_t* iaux, read_aux_t* raux, mem_v* smems, int start,
 #ifdef PRINT_SMEM
 	int old_n = smems->n;
 #endif
-	memset_s(raux->lep, 5 * sizeof(uint64_t), 0);
+	memset_s(raux->lep, raux->lep_n * sizeof(uint64_t), 0);
 	mem_t rm;
 	memset_s(&rm, sizeof(mem_t), 0);
 	rm.start = i;
@@ -3218,7 +3378,10 @@ void reseed_prefix(index_aux_t* iaux, read_aux_t* raux, mem_v* smems, int start,
 	raux->limit = limit;
 	rightExtend_wlimit(iaux, raux, &i, &rm, hits); // Compute LEP.
 	// Lazy expansion of leaf nodes. 
-	if (rm.hitcount > 0 && !rm.skip_ref_fetch) {
+	if (rm.hitcount > 1 && !rm.skip_ref_fetch) { // multi-hit leaf at the depth of the tree
+		i += extendLeafHits(iaux, raux, i, limit, 1, &rm, hits);
+	}
+	else if (rm.hitcount > 0 && !rm.skip_ref_fetch) {
 		int64_t len;
 		int64_t start_ref_pos = hits->a[rm.hitbeg] + i - rm.start;
 		int64_t end_ref_pos = hits->a[rm.hitbeg] + raux->l_seq - rm.start;
@@ -3253,7 +3416,7 @@ void reseed_prefix(index_aux_t* iaux, read_aux_t* raux, mem_v* smems, int start,
 		else {
 			hits->n -= rm.hitcount;
 		}
-		memset_s(raux->lep, 5 * sizeof(uint64_t), 0);
+		memset_s(raux->lep, raux->lep_n * sizeof(uint64_t), 0);
 	}
 	// Begin left-extension, i.e., right extension on reverse complemented read
 	else {
@@ -3282,7 +3445,8 @@ void reseed_prefix(index_aux_t* iaux, read_aux_t* raux, mem_v* smems, int start,
 					next_j = check_and_add_smem_prefix_reseed(iaux, raux, &m, &sh, smems, hits);
 				}
 			}
-			j = next_j;
+			// a read longer than the tree depth may not advance past j
+			j = next_j > j ? next_j : j + 1;
 		}
 	}
 #ifdef PRINT_SMEM
@@ -3322,7 +3486,7 @@ void reseed(index_aux_t* iaux, read_aux_t* raux, mem_v* smems, int start, int li
 #ifdef PRINT_SMEM
 	int old_n = smems->n;
 #endif
-	memset_s(raux->lep, 5 * sizeof(uint64_t), 0);
+	memset_s(raux->lep, raux->lep_n * sizeof(uint64_t), 0);
 	mem_t rm;
 	memset_s(&rm, sizeof(mem_t), 0);
 	rm.start = i;
@@ -3333,7 +3497,10 @@ void reseed(index_aux_t* iaux, read_aux_t* raux, mem_v* smems, int start, int li
 	raux->limit = limit;
 	rightExtend_wlimit(iaux, raux, &i, &rm, hits); //!< Compute LEP.
 	// Lazy expansion of leaf nodes. 
-	if (rm.hitcount > 0 && !rm.skip_ref_fetch) {
+	if (rm.hitcount > 1 && !rm.skip_ref_fetch) { // multi-hit leaf at the depth of the tree
+		i += extendLeafHits(iaux, raux, i, limit, 1, &rm, hits);
+	}
+	else if (rm.hitcount > 0 && !rm.skip_ref_fetch) {
 		int64_t len;
 		int64_t start_ref_pos = hits->a[rm.hitbeg] + i - rm.start;
 		int64_t end_ref_pos = hits->a[rm.hitbeg] + raux->l_seq - rm.start;
@@ -3368,7 +3535,7 @@ void reseed(index_aux_t* iaux, read_aux_t* raux, mem_v* smems, int start, int li
 		else {
 			hits->n -= rm.hitcount;
 		}
-		memset_s(raux->lep, 5 * sizeof(uint64_t), 0);
+		memset_s(raux->lep, raux->lep_n * sizeof(uint64_t), 0);
 	}
 	// Begin left-extension, i.e., right extension on reverse complemented read
 	else {
@@ -3390,7 +3557,7 @@ void reseed(index_aux_t* iaux, read_aux_t* raux, mem_v* smems, int start, int li
 					int rc_i = seq_len - be_point; 
 					raux->read_buf = raux->unpacked_rc_queue_buf;
 					leftExtend_wlimit(iaux, raux, &rc_i, &m, hits);
-					check_and_add_smem(iaux, raux, &m, &sh, smems, hits);
+					check_and_add_smem(iaux, raux, &m, &sh, smems, hits, limit);
 					if (sh.stop_be) break;
 				}
 			}
@@ -3430,7 +3597,17 @@ void last(index_aux_t* iaux, read_aux_t* raux, mem_v* smems, int limit, u64v* hi
 #endif
 	const uint8_t minSeedLen = raux->min_seed_len + 1; // LAST exits seeding only when seed length >= 20
 	raux->limit = limit;
+#ifdef SMEM_ACCEL
+	raux->n_hiocc = 0;
+#endif
 	while (i < raux->l_seq) { // Begin identifying RMEMs
+#ifdef SMEM_ACCEL
+		if (iaux->hiocc && raux->l_seq - i >= iaux->hiocc->len &&
+			hiocc_kmer_set(iaux->hiocc, raux->unpacked_queue_buf + i)) {
+			raux->n_hiocc++;
+			if (iaux->hiocc_skip) { ++i; continue; }
+		}
+#endif
 		mem_t rm;
 		rm.start = i; rm.end = 0;
 		rm.forward = 1;
@@ -3440,7 +3617,33 @@ void last(index_aux_t* iaux, read_aux_t* raux, mem_v* smems, int limit, u64v* hi
 		raux->read_buf = raux->unpacked_queue_buf;
 		rightExtend_last(iaux, raux, &i, &rm, hits);
 		// Lazy expansion of leaf nodes. 
-		if (rm.hitcount > 0 && !rm.skip_ref_fetch) {
+		if (rm.hitcount > 1 && !rm.skip_ref_fetch) { // multi-hit leaf at the depth of the tree
+			int k, m, n = rm.hitcount, left = n, len = raux->l_seq - i;
+			int* lens = leafLens(raux, n);
+			matchLeafHits(iaux, &raux->unpacked_queue_buf[i], len, i - rm.start, 1, &hits->a[rm.hitbeg], n, lens);
+			int count[len + 1];
+			memset_s(count, (len + 1) * sizeof(int), 0);
+			for (k = 0; k < n; ++k) {
+				count[lens[k]]++;
+			}
+			// Same stop criterion as for a single hit, on the hits left after each base
+			for (m = 0; m < len; ++m) {
+				int seedLen = (i + m) - rm.start;
+				if (seedLen >= minSeedLen && left < raux->limit) {
+					break;
+				}
+				left -= count[m];
+				if (left == 0) {
+					break;
+				}
+			}
+			if (left == 0) { // Increment i on every mismatch for LAST to match BWA-MEM, no hit is left
+				++m;
+			}
+			keepLeafHits(&rm, hits, lens, m);
+			i += m;
+		}
+		else if (rm.hitcount > 0 && !rm.skip_ref_fetch) {
 			int64_t len;
 			int64_t start_ref_pos = hits->a[rm.hitbeg] + i - rm.start;
 			int64_t end_ref_pos = hits->a[rm.hitbeg] + raux->l_seq - rm.start;
@@ -19,6 +19,9 @@
 #include "bwa.h"
 #include "macro.h"
 #include "profiling.h"
+#ifdef SMEM_ACCEL
+#include "FMI_search.h"
+#endif
 
 #include "memcpy_bwamem.h"
 
@@ -86,8 +89,21 @@ typedef struct {
 	const bntseq_t* bns;        // Input reads sequences
 	const uint8_t* pac;         // Reference genome (2-bit encoded)
   uint8_t* ref_string;
+#ifdef SMEM_ACCEL
+	const hiocc_t* hiocc;       // High-occurrence k-mer filter for LAST ('mem -u'), or NULL
+	int hiocc_skip;             // Skip pivots starting a high-occurrence k-mer
+#endif
+#ifdef ERT_INDEX_PREFETCH
+	int prefetch;               // Prefetch distance in reads (FMI_search::ert_prefetch), 0 for none
+#endif
 } index_aux_t;
 
+/**
+ * Words of the LEP bit-vector of a read of length l. The LEP bits of the last
+ * k-mer may run up to kmerSize-1 bits past the end of the read, hence the spare word.
+ */
+#define LEP_WORDS(l) (((l) >> 6) + 2)
+
 /**
  * 'Read' auxiliary data structures
  */
@@ -97,7 +113,10 @@ typedef struct {
 	int ptr_width;                  // Size of pointers to child nodes in ERT
 	int num_hits;                   // Number of hits for each node in the ERT
 	int limit;                      // Number of hits after which extension must be stopped
-	uint64_t lep[5];                // FIXME: Can support up to 320bp
+	uint64_t* lep;                  // LEP bit-vector, lep_n words (see LEP_WORDS)
+	int lep_n;
+	int* lens;                      // Matching bases of multi-hit leaf hits, lens_m entries
+	int lens_m;
 	uint64_t nextLEPBit;            // Index into the LEP bit-vector
 	uint64_t mlt_start_addr;        // Start address of multi-level ERT
 	uint64_t mh_start_addr;         // Start address of multi-hits for each k-mer
@@ -105,6 +124,9 @@ typedef struct {
 	uint8_t* unpacked_queue_buf;    // Read sequence (2-bit encoded)
 	uint8_t* unpacked_rc_queue_buf; // Reverse complemented read (2-bit encoded)
 	uint8_t* read_buf;              // == queue_buf (forward) and == rc_queue_buf (backward)
+#ifdef SMEM_ACCEL
+	int n_hiocc;                    // LAST pivots starting a high-occurrence k-mer
+#endif
 } read_aux_t;
 
 /**
@@ -120,6 +142,12 @@ typedef struct {
 	int mem_end_limit;
 } smem_helper_t;
 
+#ifdef ERT_INDEX_PREFETCH
+void prefetchKmerEntry(const index_aux_t* iaux, const uint8_t* read_buf, int i, int l_seq);
+
+void prefetchKmerRoot(const index_aux_t* iaux, const uint8_t* read_buf, int i, int l_seq);
+
+#endif
 void get_seeds(index_aux_t* iaux, read_aux_t* raux, mem_v* smems, u64v* hits);
 
 void get_seeds_prefix(index_aux_t* iaux, read_aux_t* raux, mem_v* smems, u64v* hits);
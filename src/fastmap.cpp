@@ -44,6 +44,7 @@
 #include "fastmap.h"
 #include "FMI_search.h"
 #include <errno.h>
+#include <getopt.h>
 #ifdef PERFECT_MATCH
 #include "perfect.h"
 #endif
@@ -51,6 +52,7 @@
 #include <limits.h>
 #include "bwa_shm.h"
 #endif
+#include "bamout.h"
 
 #if AFF && (__linux__)
 #include <sys/sysinfo.h>
@@ -292,6 +294,7 @@ void memoryAlloc(ktp_aux_t *aux, worker_t &w, int32_t nreads, int32_t nthreads)
         w.mmc.enc_qdb[l]       = (uint8_t *) malloc(w.mmc.wsize_mem[l] * sizeof(uint8_t));
         w.mmc.rid[l]           = (int32_t *) malloc(w.mmc.wsize_mem[l] * sizeof(int32_t));
         w.mmc.lim[l]           = (int32_t *) _mm_malloc((BATCH_SIZE + 32) * sizeof(int32_t), 64); // candidate not for reallocation, deferred for next round of changes.
+        w.mmc.smc[l]           = opt->smem_cache_size > 0 ? smem_cache_init(opt->smem_cache_size / nthreads) : NULL;
     }
 
     allocMem = BATCH_MUL * BATCH_SIZE * readLen * sizeof(SMEM) +
@@ -300,6 +303,9 @@ void memoryAlloc(ktp_aux_t *aux, worker_t &w, int32_t nreads, int32_t nthreads)
 				BATCH_MUL * BATCH_SIZE * readLen *sizeof(int32_t) +
 				(BATCH_SIZE + 32) * sizeof(int32_t);
     fprintf(stderr, "3. Memory pre-allocation for BWT: %0.4lf MB = %0.4lf MB * %d threads\n", allocMem*nthreads/1e6, allocMem/1e6, nthreads);
+    if (opt->smem_cache_size > 0)
+        fprintf(stderr, "4. Memory pre-allocation for SMEM cache: %0.4lf MB = %0.4lf MB * %d threads\n",
+                opt->smem_cache_size/1e6, opt->smem_cache_size/nthreads/1e6, nthreads);
     fprintf(stderr, "------------------------------------------\n");
 	w.useErt = 0;
 }
@@ -318,6 +324,11 @@ ktp_data_t *kt_pipeline(void *shared, int step, void *data, mem_opt_t *opt, work
 
         /* Read "reads" from input file (fread) */
         int64_t sz = 0;
+#ifdef OPT_RW
+        if (aux->br)
+            ret->seqs = bseq_read_par(aux->br, aux->task_size, &ret->n_seqs, &sz);
+        else
+#endif
         ret->seqs = bseq_read_orig(aux->task_size,
                                    &ret->n_seqs,
                                    aux->ks, aux->ks2,
@@ -332,6 +343,7 @@ ktp_data_t *kt_pipeline(void *shared, int step, void *data, mem_opt_t *opt, work
             free(ret);
             return 0;
         }
+        ret->seq = aux->seq_read++;
         if (!aux->copy_comment){
             for (int i = 0; i < ret->n_seqs; ++i){
 #ifndef OPT_RW
@@ -396,8 +408,12 @@ ktp_data_t *kt_pipeline(void *shared, int step, void *data, mem_opt_t *opt, work
                                  0,
                                  w);
                 
-                for (int i = 0; i < n_sep[0]; ++i)
+                for (int i = 0; i < n_sep[0]; ++i) {
                     ret->seqs[sep[0][i].id].sam = sep[0][i].sam;
+#ifdef OPT_RW
+                    ret->seqs[sep[0][i].id].l_sam = sep[0][i].l_sam;
+#endif
+                }
             }
             if (n_sep[1]) {
                 tmp_opt.flag |= MEM_F_PE;
@@ -409,8 +425,12 @@ ktp_data_t *kt_pipeline(void *shared, int step, void *data, mem_opt_t *opt, work
                                  aux->pes0,
                                  w);
                                 
-                for (int i = 0; i < n_sep[1]; ++i)
+                for (int i = 0; i < n_sep[1]; ++i) {
                     ret->seqs[sep[1][i].id].sam = sep[1][i].sam;
+#ifdef OPT_RW
+                    ret->seqs[sep[1][i].id].l_sam = sep[1][i].l_sam;
+#endif
+                }
             }
             free(sep[0]); free(sep[1]);
         }
@@ -424,6 +444,8 @@ ktp_data_t *kt_pipeline(void *shared, int step, void *data, mem_opt_t *opt, work
                              w);
         }               
         tprof[MEM_PROCESS2][0] += __rdtsc() - tim;
+        // counted here, not in the write step, since compute may run ahead of writing
+        aux->n_processed += ret->n_seqs;
                 
         return ret;
     }           
@@ -431,7 +453,8 @@ ktp_data_t *kt_pipeline(void *shared, int step, void *data, mem_opt_t *opt, work
     else if (step == 2)
     {
 		double rtime = realtime();
-        aux->n_processed += ret->n_seqs;
+        assert(ret->seq == aux->seq_written);
+        aux->seq_written++;
         uint64_t tim = __rdtsc();
         
 		for (int i = 0; i < ret->n_seqs; ++i)
@@ -439,7 +462,8 @@ ktp_data_t *kt_pipeline(void *shared, int step, void *data, mem_opt_t *opt, work
             if (ret->seqs[i].sam) {
                 // err_fputs(ret->seqs[i].sam, stderr);
 #ifdef OPT_RW
-                fputs(ret->seqs[i].sam, aux->fp);
+                if (ret->seqs[i].l_sam) fwrite(ret->seqs[i].sam, 1, ret->seqs[i].l_sam, aux->fp);
+                else fputs(ret->seqs[i].sam, aux->fp);
 				free(ret->seqs[i].sam);
 #else
                 fputs(ret->seqs[i].sam, aux->fp);
@@ -467,44 +491,21 @@ ktp_data_t *kt_pipeline(void *shared, int step, void *data, mem_opt_t *opt, work
     return 0;
 }
 
-static void *ktp_worker(void *data)
-{   
-    ktp_worker_t *w = (ktp_worker_t*) data;
-    ktp_t *p = w->pl;
+/* Each step runs on its own thread; chunks flow through bounded rings in read
+   order, so the write step sees them in sequence without any global lock. */
+static void *ktp_stage_worker(void *data)
+{
+    ktp_stage_t *st = (ktp_stage_t*) data;
     
-    while (w->step < p->n_steps) {
-        // test whether we can kick off the job with this worker
-        int pthread_ret = pthread_mutex_lock(&p->mutex);
-        assert(pthread_ret == 0);
-        for (;;) {
-            int i;
-            // test whether another worker is doing the same step
-            for (i = 0; i < p->n_workers; ++i) {
-                if (w == &p->workers[i]) continue; // ignore itself
-                if (p->workers[i].step <= w->step && p->workers[i].index < w->index)
-                    break;
-            }
-            if (i == p->n_workers) break; // no workers with smaller indices are doing w->step or the previous steps
-            pthread_ret = pthread_cond_wait(&p->cv, &p->mutex);
-            assert(pthread_ret == 0);
-        }
-        pthread_ret = pthread_mutex_unlock(&p->mutex);
-        assert(pthread_ret == 0);
-
-        // working on w->step
-        w->data = kt_pipeline(p->shared, w->step, w->step? w->data : 0, w->opt, *(w->w)); // for the first step, input is NULL
-
-        // update step and let other workers know
-        pthread_ret = pthread_mutex_lock(&p->mutex);
-        assert(pthread_ret == 0);
-        w->step = w->step == p->n_steps - 1 || w->data? (w->step + 1) % p->n_steps : p->n_steps;
-
-        if (w->step == 0) w->index = p->index++;
-        pthread_ret = pthread_cond_broadcast(&p->cv);
-        assert(pthread_ret == 0);
-        pthread_ret = pthread_mutex_unlock(&p->mutex);
-        assert(pthread_ret == 0);
+    for (;;) {
+        void *in = st->in? kt_ring_pop(st->in) : 0;
+        if (st->in && in == 0) break; // end of input from the previous step
+
+        void *out = kt_pipeline(st->shared, st->step, in, st->opt, *(st->w));
+        if (st->in == 0 && out == 0) break; // no more reads
+        if (st->out) kt_ring_push(st->out, out);
     }
+    if (st->out) kt_ring_push(st->out, 0);
     pthread_exit(0);
 }
 
@@ -621,53 +622,43 @@ static int process(void *shared, gzFile gfp, gzFile gfp2, int pipe_threads)
     fprintf(stderr, "* Threads used (compute): %d\n", nthreads);
     
     /* pipeline using pthreads */
-    ktp_t aux_;
-    int p_nt = pipe_threads; // 2;
     int n_steps = 3;
+    int depth = pipe_threads > 1? pipe_threads - 1 : 1; // chunks queued between two steps
+    ktp_stage_t st[3];
+    kt_ring_t *ring[2];
    
     w.ref_string = aux->ref_string;
     w.fmi = aux->fmi;
     w.nreads  = nreads;
     // w.memSize = nreads;
+    w.pool = kt_pool_init(nthreads, 1);
+    // even block sizes, since paired-end SAM takes two reads at a time
+    for (int i = 0; i < KT_NUM_PHASE; ++i)
+        kt_sched_init(&w.sched[i], i, opt->batch_size, 2);
     
-    aux_.n_workers = p_nt;
-    aux_.n_steps = n_steps;
-    aux_.shared = aux;
-    aux_.index = 0;
-    int pthread_ret = pthread_mutex_init(&aux_.mutex, 0);
-    assert(pthread_ret == 0);
-    pthread_ret = pthread_cond_init(&aux_.cv, 0);
-    assert(pthread_ret == 0);
-
-    fprintf(stderr, "* No. of pipeline threads: %d\n\n", p_nt);
-    aux_.workers = (ktp_worker_t*) malloc(p_nt * sizeof(ktp_worker_t));
-    assert(aux_.workers != NULL);
+    fprintf(stderr, "* Pipeline queue depth: %d\n\n", depth);
+    for (int i = 0; i < n_steps - 1; ++i)
+        ring[i] = kt_ring_init(depth);
     
-    for (int i = 0; i < p_nt; ++i) {
-        ktp_worker_t *wr = &aux_.workers[i];
-        wr->step = 0; wr->pl = &aux_; wr->data = 0;
-        wr->index = aux_.index++;
-        wr->i = i;
-        wr->opt = opt;
-        wr->w = &w;
+    for (int i = 0; i < n_steps; ++i) {
+        st[i].step = i;
+        st[i].shared = aux;
+        st[i].in = i > 0? ring[i-1] : 0;
+        st[i].out = i < n_steps - 1? ring[i] : 0;
+        st[i].opt = opt;
+        st[i].w = &w;
     }
     
-    pthread_t *ptid = (pthread_t *) calloc(p_nt, sizeof(pthread_t));
-    assert(ptid != NULL);
-    
-    for (int i = 0; i < p_nt; ++i)
-        pthread_create(&ptid[i], 0, ktp_worker, (void*) &aux_.workers[i]);
+    pthread_t ptid[3];
+    for (int i = 0; i < n_steps; ++i)
+        pthread_create(&ptid[i], 0, ktp_stage_worker, (void*) &st[i]);
     
-    for (int i = 0; i < p_nt; ++i)
+    for (int i = 0; i < n_steps; ++i)
         pthread_join(ptid[i], 0);
 
-    pthread_ret = pthread_mutex_destroy(&aux_.mutex);
-    assert(pthread_ret == 0);
-    pthread_ret = pthread_cond_destroy(&aux_.cv);
-    assert(pthread_ret == 0);
-
-    free(ptid);
-    free(aux_.workers);
+    for (int i = 0; i < n_steps - 1; ++i)
+        kt_ring_destroy(ring[i]);
+    kt_pool_destroy(w.pool);
     /***** pipeline ends ******/
     
     fprintf(stderr, "[0000] Computation ends..\n");
@@ -707,6 +698,7 @@ static int process(void *shared, gzFile gfp, gzFile gfp2, int pipe_threads)
             free(w.mmc.enc_qdb[l]);
             free(w.mmc.rid[l]);
             _mm_free(w.mmc.lim[l]);
+            smem_cache_destroy(w.mmc.smc[l]);
         }
 	}
 
@@ -861,9 +853,11 @@ static void usage(const mem_opt_t *opt)
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  Algorithm options:\n");
     fprintf(stderr, "    -o STR        Output SAM file name\n");
+    fprintf(stderr, "    -z INT        write BAM instead of SAM, deflated in the compute threads at level INT (0-9)\n");
     fprintf(stderr, "    -t INT        number of threads [%d]\n", opt->n_threads);
 #ifdef PERFECT_MATCH
-	fprintf(stderr, "    -l INT        use perfect table with the specified seed length. 0 for auto detection.\n");
+	fprintf(stderr, "    -l INT[,INT]  use perfect table(s) with the specified seed length(s). 0 for auto detection.\n"
+	                "                  each read uses the longest table not longer than the read.\n");
 #else
 	fprintf(stderr, "    -l INT        hint for average sequence length\n");
 #endif
@@ -878,6 +872,17 @@ static void usage(const mem_opt_t *opt)
     fprintf(stderr, "    -m INT        perform at most INT rounds of mate rescues for each read [%d]\n", opt->max_matesw);
     fprintf(stderr, "    -S            skip mate rescue\n");
     fprintf(stderr, "    -P            skip pairing; mate rescue performed unless -S also in use\n");
+    fprintf(stderr, "    -F            run seeding, extension and SAM per block without global barriers\n");
+    fprintf(stderr, "                  (paired-end only with -I)\n");
+    fprintf(stderr, "    --batch INT   reads per block of a thread, rounded up to even, up to %d;\n"
+                    "                  0 to adapt it to the per-block timing of the previous chunk [0]\n", BATCH_SIZE);
+    fprintf(stderr, "    -e INT        cache SMEMs and seed coordinates of seeded reads in INT MB (split over threads),\n"
+                    "                  so that repeated reads skip the FM-index; 0 to disable [0]\n"
+                    "                  (FM-index only, ignored with -Z 1)\n");
+#ifdef SMEM_ACCEL
+    fprintf(stderr, "    -u INT        high-occurrence k-mer filter in LAST seeding (needs 'smem-table -k'):\n"
+                    "                  0: off, 1: only count the pivots on the k-mers, 2: skip the pivots [0]\n");
+#endif
     fprintf(stderr, "Scoring options:\n");
     fprintf(stderr, "   -A INT        score for a sequence match, which scales options -TdBOELU unless overridden [%d]\n", opt->a);
     fprintf(stderr, "   -B INT        penalty for a mismatch [%d]\n", opt->b);
@@ -897,6 +902,9 @@ static void usage(const mem_opt_t *opt)
     fprintf(stderr, "   -5            for split alignment, take the alignment with the smallest coordinate as primary\n");
     fprintf(stderr, "   -q            don't modify mapQ of supplementary alignments\n");
     fprintf(stderr, "   -K INT        process INT input bases in each batch regardless of nThreads (for reproducibility) []\n");    
+    fprintf(stderr, "   -i INT        pipeline width; INT-1 chunks are queued between read, compute and write [2]\n");
+    fprintf(stderr, "   -J INT        number of threads inflating (BGZF) and parsing 4-line FASTQ/FASTA input;\n"
+                    "                 uncompressed files are mmap()ed; 0 for kseq [0]\n");
     fprintf(stderr, "   -v INT        verbose level: 1=error, 2=warning, 3=message, 4+=debugging [%d]\n", bwa_verbose);
     fprintf(stderr, "   -T INT        minimum score to output [%d]\n", opt->T);
     fprintf(stderr, "   -h INT[,INT]  if there are <INT hits with score >80%% of the max score, output all in XA [%d,%d]\n", opt->max_XA_hits, opt->max_XA_hits_alt);
@@ -910,12 +918,17 @@ static void usage(const mem_opt_t *opt)
     fprintf(stderr, "                 (4 sigma from the mean if absent) and min of the insert size distribution.\n");
     fprintf(stderr, "                 FR orientation only. [inferred]\n");
     fprintf(stderr, "   -Z            Use ERT index for seeding\n");
+#ifdef ERT_INDEX_PREFETCH
+    fprintf(stderr, "   --ert-prefetch INT\n");
+    fprintf(stderr, "                 prefetch the k-mer table entries and tree roots of ERT seeding INT reads\n");
+    fprintf(stderr, "                 ahead in a block; 0 to disable [%d]\n", ERT_PREFETCH_DIST);
+#endif
     fprintf(stderr, "Note: Please read the man page for detailed description of the command line and options.\n");
 }
 
 int main_mem(int argc, char *argv[])
 {
-    int          i, c, ignore_alt = 0, n_mt_io = 2;
+    int          i, c, ignore_alt = 0, n_mt_io = 2, n_in_threads = 0;
     int          fixed_chunk_size          = -1;
     char        *p, *rg_line               = 0, *hdr_line = 0;
     const char  *mode                      = 0;
@@ -924,9 +937,15 @@ int main_mem(int argc, char *argv[])
 #else
     int useErt = DEFAULT_USE_ERT;
 #endif
+#ifdef SMEM_ACCEL
+    int hiocc_mode = 0; /* -u */
+#endif
+#ifdef ERT_INDEX_PREFETCH
+    int ert_prefetch = ERT_PREFETCH_DIST; /* --ert-prefetch */
+#endif
     
     mem_opt_t    *opt, opt0;
-    gzFile        fp, fp2 = 0;
+    gzFile        fp = 0, fp2 = 0;
     void         *ko = 0, *ko2 = 0;
     int           fd, fd2;
     mem_pestat_t  pes[4];
@@ -949,11 +968,22 @@ int main_mem(int argc, char *argv[])
     memset_s(&opt0, sizeof(mem_opt_t), 0);
     /* Parse input arguments */
     // comment: added option '5' in the list
-    while ((c = getopt(argc, argv, "5i:qpaMCSPVYjk:c:v:s:r:t:R:A:B:O:E:U:w:L:d:T:Q:D:m:I:N:W:x:G:h:y:K:X:H:o:f:l:bZ:")) >= 0)
+#define MEM_OPT_BATCH 0x100 /* long options only */
+#define MEM_OPT_ERT_PREFETCH 0x101
+    static struct option mem_long_opts[] = {
+        { "batch", required_argument, NULL, MEM_OPT_BATCH },
+#ifdef ERT_INDEX_PREFETCH
+        { "ert-prefetch", required_argument, NULL, MEM_OPT_ERT_PREFETCH },
+#endif
+        { NULL, 0, NULL, 0 }
+    };
+    while ((c = getopt_long(argc, argv, "5i:J:e:u:qpaMCSPVYjFz:k:c:v:s:r:t:R:A:B:O:E:U:w:L:d:T:Q:D:m:I:N:W:x:G:h:y:K:X:H:o:f:l:bZ:",
+                            mem_long_opts, NULL)) >= 0)
     {
         if (c == 'k') opt->min_seed_len = atoi(optarg), opt0.min_seed_len = 1;
 		else if (c == 'b') opt_bwa_shm_map_touch = 1;
         else if (c == 'i') n_mt_io = atoi(optarg);
+        else if (c == 'J') n_in_threads = atoi(optarg);
         else if (c == 'x') mode = optarg;
         else if (c == 'w') opt->w = atoi(optarg), opt0.w = 1;
         else if (c == 'A') opt->a = atoi(optarg), opt0.a = 1, assert(opt->a >= INT_MIN && opt->a <= INT_MAX);
@@ -969,7 +999,13 @@ int main_mem(int argc, char *argv[])
 			int p = atoi(optarg);
 			if (p > 0) {
 #ifdef PERFECT_MATCH
-				perfect_table_seed_len = p;
+				/* -l 151,125,100 for a family of perfect tables */
+				perfect_family_n = parse_perfect_family(optarg, perfect_family_len);
+				if (perfect_family_n <= 0) {
+					fprintf(stderr, "[ERROR] wrong seed length(s) for perfect tables: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				perfect_table_seed_len = perfect_family_len[0];
 #endif
 #ifdef USE_SHM
 				hint_readLen = p;
@@ -996,6 +1032,46 @@ int main_mem(int argc, char *argv[])
         else if (c == 'a') opt->flag |= MEM_F_ALL;
         else if (c == 'p') opt->flag |= MEM_F_PE | MEM_F_SMARTPE;
         else if (c == 'M') opt->flag |= MEM_F_NO_MULTI;
+        else if (c == 'F') opt->flag |= MEM_F_FUSED;
+        else if (c == 'z') {
+            opt->flag |= MEM_F_BAM, opt->bam_level = atoi(optarg);
+            if (opt->bam_level < 0 || opt->bam_level > 9) {
+                fprintf(stderr, "[E::%s] BAM compression level must be 0-9\n", __func__);
+                return 1;
+            }
+        }
+#ifdef SMEM_ACCEL
+        else if (c == 'u') {
+            hiocc_mode = atoi(optarg);
+            if (hiocc_mode < 0 || hiocc_mode > 2) {
+                fprintf(stderr, "[E::%s] -u must be 0, 1 or 2\n", __func__);
+                return 1;
+            }
+        }
+#endif
+        else if (c == MEM_OPT_BATCH) {
+            opt->batch_size = atoi(optarg);
+            if (opt->batch_size < 0 || opt->batch_size > BATCH_SIZE) {
+                fprintf(stderr, "[E::%s] --batch must be 0 ~ %d (BATCH_SIZE)\n", __func__, BATCH_SIZE);
+                return 1;
+            }
+        }
+#ifdef ERT_INDEX_PREFETCH
+        else if (c == MEM_OPT_ERT_PREFETCH) {
+            ert_prefetch = atoi(optarg);
+            if (ert_prefetch < 0 || ert_prefetch > BATCH_SIZE) {
+                fprintf(stderr, "[E::%s] --ert-prefetch must be 0 ~ %d (BATCH_SIZE)\n", __func__, BATCH_SIZE);
+                return 1;
+            }
+        }
+#endif
+        else if (c == 'e') {
+            opt->smem_cache_size = atol(optarg) << 20;
+            if (opt->smem_cache_size < 0) {
+                fprintf(stderr, "[E::%s] SMEM cache size must not be negative\n", __func__);
+                return 1;
+            }
+        }
         else if (c == 'S') opt->flag |= MEM_F_NO_RESCUE;
         else if (c == 'Y') opt->flag |= MEM_F_SOFTCLIP;
         else if (c == 'V') opt->flag |= MEM_F_REF_HDR;
@@ -1178,6 +1254,10 @@ int main_mem(int argc, char *argv[])
 #ifdef USE_SHM
 	bwa_shm_init(argv[optind], &useErt, perfect_table_seed_len, BWA_SHM_INIT_READ);
 #endif
+    if (useErt && opt->smem_cache_size > 0) { // the cache is only looked up by the FM-index seeding
+        fprintf(stderr, "[W::%s] '-e' is ignored with the ERT index ('-Z 1').\n", __func__);
+        opt->smem_cache_size = 0;
+    }
     
     /* Matrix for SWA */
     bwa_fill_scmat(opt->a, opt->b, opt->mat);
@@ -1197,6 +1277,13 @@ int main_mem(int argc, char *argv[])
 		aux.fmi->load_ert_index();
     }
 	aux.fmi->useErt = useErt;
+#ifdef ERT_INDEX_PREFETCH
+	aux.fmi->ert_prefetch = ert_prefetch;
+#endif
+#ifdef SMEM_ACCEL
+	if (hiocc_mode > 0)
+		aux.fmi->load_hiocc_table(hiocc_mode == 2);
+#endif
 	
 	end = __rdtsc();
     tprof[FMI][0] += end - beg;
@@ -1240,9 +1327,14 @@ int main_mem(int argc, char *argv[])
 		retval = EXIT_FAILURE;
 		goto out;
     }
-    // fp = gzopen(argv[optind + 1], "r");
-    fp = gzdopen(fd, "r");
-    aux.ks = kseq_init(fp);
+#ifdef OPT_RW
+    if (n_in_threads <= 0)
+#endif
+    {
+        // fp = gzopen(argv[optind + 1], "r");
+        fp = gzdopen(fd, "r");
+        aux.ks = kseq_init(fp);
+    }
     
     // PAIRED_END
     /* Handling Paired-end reads */
@@ -1260,15 +1352,44 @@ int main_mem(int argc, char *argv[])
                 retval = EXIT_FAILURE;
 				goto out;
             }            
-            // fp2 = gzopen(argv[optind + 2], "r");
-            fp2 = gzdopen(fd2, "r");
-            aux.ks2 = kseq_init(fp2);
             opt->flag |= MEM_F_PE;
-            assert(aux.ks2 != 0);
+#ifdef OPT_RW
+            if (n_in_threads <= 0)
+#endif
+            {
+                // fp2 = gzopen(argv[optind + 2], "r");
+                fp2 = gzdopen(fd2, "r");
+                aux.ks2 = kseq_init(fp2);
+                assert(aux.ks2 != 0);
+            }
         }
     }
+#ifdef OPT_RW
+    if (n_in_threads > 0) {
+        aux.br = bseq_reader_init(fd, ko2? fd2 : -1, n_in_threads);
+        fprintf(stderr, "* Input threads (-J): %d\n", n_in_threads);
+    }
+#else
+    if (n_in_threads > 0)
+        fprintf(stderr, "[W::%s] '-J' needs a build with OPT_RW; reading with kseq.\n", __func__);
+#endif
 
-    bwa_print_sam_hdr(aux.fmi->idx->bns, hdr_line, aux.fp);
+#ifndef OPT_RW
+    if (opt->flag & MEM_F_BAM) {
+        fprintf(stderr, "[W::%s] BAM output ('-z') needs a build with OPT_RW; writing SAM.\n", __func__);
+        opt->flag &= ~MEM_F_BAM;
+    }
+#endif
+    if (opt->flag & MEM_F_BAM) {
+        char *text = 0;
+        size_t l_text = 0;
+        FILE *hfp = open_memstream(&text, &l_text);
+        bwa_print_sam_hdr(aux.fmi->idx->bns, hdr_line, hfp);
+        fclose(hfp);
+        bam_write_hdr(aux.fp, aux.fmi->idx->bns, text, l_text, opt->bam_level);
+        free(text);
+    } else
+        bwa_print_sam_hdr(aux.fmi->idx->bns, hdr_line, aux.fp);
 
     if (fixed_chunk_size > 0)
         aux.task_size = fixed_chunk_size;
@@ -1282,6 +1403,7 @@ int main_mem(int argc, char *argv[])
 
     /* Relay process function */
     process(&aux, fp, fp2, n_mt_io);
+    if (opt->flag & MEM_F_BAM) bam_write_eof(aux.fp);
    
    	end = __rdtsc();
     tprof[PROCESS][0] += end - beg;
@@ -1295,6 +1417,9 @@ int main_mem(int argc, char *argv[])
 out:
 	if (hdr_line) free(hdr_line);
     if (opt) free(opt);
+#ifdef OPT_RW
+    if (aux.br) bseq_reader_destroy(aux.br);
+#endif
     if (aux.ks) kseq_destroy(aux.ks);   
     if (fp) err_gzclose(fp); 
 	if (ko) kclose(ko);
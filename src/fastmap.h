@@ -57,15 +57,20 @@
 #include "utils.h"
 #include "bntseq.h"
 #include "kseq.h"
+#include "bseq_reader.h"
 #include "profiling.h"
 
 KSEQ_DECLARE(gzFile)
 
 typedef struct {
 	kseq_t *ks, *ks2;
+#ifdef OPT_RW
+	bseq_reader_t *br;          // multi-threaded input ('-J'), replaces ks/ks2
+#endif
 	mem_opt_t *opt;
 	mem_pestat_t *pes0;
 	int64_t n_processed;
+	int64_t seq_read, seq_written; // chunk sequence numbers seen by the read and write steps
 	int copy_comment;
 	int64_t my_ntasks;
 	int64_t ntasks;
@@ -79,6 +84,7 @@ typedef struct {
 
 typedef struct {
 	ktp_aux_t *aux;
+	int64_t seq;
 	int n_seqs;
 	bseq1_t *seqs;
 } ktp_data_t;
@@ -88,8 +94,6 @@ void *kopen(const char *fn, int *_fd);
 int kclose(void *a);
 int main_mem(int argc, char *argv[]);
 
-#ifdef PERFECT_MATCH
 void load_ref_string(const char *prefix, uint8_t **ret_ptr);
-#endif
 
 #endif
@@ -30,7 +30,15 @@
 *****************************************************************************************/
 
 #include "kthread.h"
+#include "bwamem.h"
 #include <stdio.h>
+#include <limits.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/sysinfo.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <immintrin.h>
 
 #if AFF && (__linux__)
 extern int affy[256];
@@ -46,69 +54,339 @@ static inline long steal_work(kt_for_t *t)
 		if (min > t->w[i].i) min = t->w[i].i, min_i = i;
 	k = __sync_fetch_and_add(&t->w[min_i].i, t->n_threads);
 	// return k >= t->n? -1 : k;
-	return k*BATCH_SIZE >= t->n? -1 : k;
+	return k*t->bs >= t->n? -1 : k;
+}
+
+/* the next guided block of t->s; returns its size, 0 when all items are handed out */
+static inline long ktf_claim(kt_for_t *t, long *st)
+{
+	kt_sched_t *s = t->s;
+	long cur = __atomic_load_n(&t->next, __ATOMIC_RELAXED), sz;
+
+	do {
+		if (cur >= t->n) return 0;
+		sz = (t->n - cur) / ((long) t->n_threads * KT_GUIDED_DIV);
+		if (sz > s->bs) sz = s->bs;
+		if (sz < s->min_bs) sz = s->min_bs;
+		sz = (sz + s->gran - 1) / s->gran * s->gran;
+		if (sz > t->n - cur) sz = t->n - cur;
+	} while (!__atomic_compare_exchange_n(&t->next, &cur, cur + sz, 0,
+											__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	*st = cur;
+	return sz;
+}
+
+static inline void ktf_run_sched(ktf_worker_t *w)
+{
+	kt_for_t *t = w->t;
+	long st, sz;
+
+	w->max_rate = 0;
+	while ((sz = ktf_claim(t, &st)) > 0) {
+		uint64_t tim = __rdtsc();
+		t->func(t->data, st, sz, w->tid);
+		// the smallest tail blocks are too noisy to tell the cost of a full one
+		if (sz >= 2 * t->s->min_bs || sz == t->s->bs) {
+			double rate = (double) (__rdtsc() - tim) / sz;
+			if (rate > w->max_rate) w->max_rate = rate;
+		}
+	}
+	w->fin = __rdtsc();
 }
 
 /******** Current working code *********/
-static void *ktf_worker(void *data)
+static inline void ktf_run(ktf_worker_t *w)
 {
-	ktf_worker_t *w = (ktf_worker_t*)data;
 	long i;
 	int tid = w->tid;
 
-#if AFF && (__linux__)
-	//fprintf(stderr, "i: %d, CPU: %d\n", tid , sched_getcpu());
-#endif
-	
+	if (w->t->s) {
+		ktf_run_sched(w);
+		return;
+	}
 	for (;;) {
 		i = __sync_fetch_and_add(&w->i, w->t->n_threads);
-		long st = i * BATCH_SIZE;
+		long st = i * w->t->bs;
 		if (st >= w->t->n) break;
-		long ed = (i + 1) * BATCH_SIZE < w->t->n? (i + 1) * BATCH_SIZE : w->t->n;
+		long ed = (i + 1) * w->t->bs < w->t->n? (i + 1) * w->t->bs : w->t->n;
 		w->t->func(w->t->data, st, ed-st, tid);
 	}
 
 	while ((i = steal_work(w->t)) >= 0) {
-		int st = i * BATCH_SIZE;
-		int ed = (i + 1) * BATCH_SIZE < w->t->n? (i + 1) * BATCH_SIZE : w->t->n;
+		int st = i * w->t->bs;
+		int ed = (i + 1) * w->t->bs < w->t->n? (i + 1) * w->t->bs : w->t->n;
 		w->t->func(w->t->data, st, ed-st, tid);
 	}
+}
+
+static void *ktf_worker(void *data)
+{
+	ktf_worker_t *w = (ktf_worker_t*)data;
+
+#if AFF && (__linux__)
+	//fprintf(stderr, "i: %d, CPU: %d\n", tid , sched_getcpu());
+#endif
+	ktf_run(w);
 	pthread_exit(0);
 }
 
-void kt_for(void (*func)(void*, long, long, int), void *data, int n)
+/* Records the wall time and the tail of a kt_sched_t phase, i.e. the time from the
+   first worker running out of blocks to the last one finishing, and picks bs for
+   the next call. */
+static void kt_sched_update(kt_for_t *t, uint64_t beg, uint64_t end)
+{
+	kt_sched_t *s = t->s;
+	uint64_t fin_min = UINT64_MAX, fin_max = 0, wall = end - beg, tail;
+	double rate = 0;
+	int i;
+
+	for (i = 0; i < t->n_threads; ++i) {
+		if (t->w[i].fin < fin_min) fin_min = t->w[i].fin;
+		if (t->w[i].fin > fin_max) fin_max = t->w[i].fin;
+		if (t->w[i].max_rate > rate) rate = t->w[i].max_rate;
+	}
+	tail = fin_max > fin_min? fin_max - fin_min : 0;
+	tprof[KT_WALL][s->phase] += wall;
+	tprof[KT_TAIL][s->phase] += tail;
+	if (tail > tprof[KT_TAIL_MAX][s->phase]) tprof[KT_TAIL_MAX][s->phase] = tail;
+	tprof[KT_CALLS][s->phase]++;
+
+	if (s->adapt && rate > 0) {
+		long bs = (long) (KT_TAIL_FRAC * wall / rate);
+		// at most halve or double per call, since one chunk of reads is a noisy sample
+		if (bs < s->bs / 2) bs = s->bs / 2;
+		if (bs > s->bs * 2) bs = s->bs * 2;
+		// smaller full blocks cost more in the batched kernels than they save in the tail
+		if (bs < s->max_bs / KT_ADAPT_DIV) bs = s->max_bs / KT_ADAPT_DIV;
+		if (bs < s->min_bs) bs = s->min_bs;
+		if (bs > s->max_bs) bs = s->max_bs;
+		s->bs = bs / s->gran * s->gran;
+	}
+	tprof[KT_BS][s->phase] = s->bs;
+}
+
+void kt_sched_init(kt_sched_t *s, int phase, int bs, int gran)
+{
+	s->phase = phase;
+	s->gran = gran > 0? gran : 1;
+	s->max_bs = BATCH_SIZE / s->gran * s->gran;
+	s->min_bs = (KT_MIN_BS + s->gran - 1) / s->gran * s->gran;
+	s->adapt = bs <= 0;
+	s->bs = bs <= 0 || bs > s->max_bs? s->max_bs : (bs + s->gran - 1) / s->gran * s->gran;
+	if (s->min_bs > s->bs) s->min_bs = s->bs;
+}
+
+static void ktf_spawn(kt_for_t *t)
 {
 	int i;
-	kt_for_t t;
 	pthread_t *tid;
-	worker_t *w = (worker_t*) data;
-	t.func = func, t.data = data, t.n_threads = w->nthreads, t.n = n;
-	t.w = (ktf_worker_t*) malloc (t.n_threads * sizeof(ktf_worker_t));
-    assert(t.w != NULL);
-	tid = (pthread_t*) malloc (t.n_threads * sizeof(pthread_t));
+	uint64_t beg = __rdtsc();
+	t->w = (ktf_worker_t*) malloc (t->n_threads * sizeof(ktf_worker_t));
+    assert(t->w != NULL);
+	tid = (pthread_t*) malloc (t->n_threads * sizeof(pthread_t));
     assert(tid != NULL);
-	for (i = 0; i < t.n_threads; ++i)
-		t.w[i].t = &t, t.w[i].i = i, t.w[i].tid = i;
+	for (i = 0; i < t->n_threads; ++i)
+		t->w[i].t = t, t->w[i].i = i, t->w[i].tid = i;
 
 	pthread_attr_t attr;
     pthread_attr_init(&attr);
 	
 	// printf("getcpu: %d\n", sched_getcpu());
-	for (i = 0; i < t.n_threads; ++i) {
+	for (i = 0; i < t->n_threads; ++i) {
 #if AFF && (__linux__)
 		cpu_set_t cpus;
 		CPU_ZERO(&cpus);
 		// CPU_SET(i, &cpus);
 		CPU_SET(affy[i], &cpus);
 		pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpus);	
-		pthread_create(&tid[i], &attr, ktf_worker, &t.w[i]);
+		pthread_create(&tid[i], &attr, ktf_worker, &t->w[i]);
 #else
-		pthread_create(&tid[i], NULL, ktf_worker, &t.w[i]);
+		pthread_create(&tid[i], NULL, ktf_worker, &t->w[i]);
 #endif
 	}
-	for (i = 0; i < t.n_threads; ++i) pthread_join(tid[i], 0);
+	for (i = 0; i < t->n_threads; ++i) pthread_join(tid[i], 0);
+	if (t->s) kt_sched_update(t, beg, __rdtsc());
 
     pthread_attr_destroy(&attr);
-    free(t.w);
+    free(t->w);
 	free(tid);
 }
+
+/* Original per-call spawn/join; kept for callers without a pool and for 'bench dispatch' */
+void kt_spawn_for(int n_threads, void (*func)(void*, long, long, int), void *data, int n)
+{
+	kt_for_t t;
+	t.func = func, t.data = data, t.n_threads = n_threads, t.n = n, t.bs = BATCH_SIZE;
+	t.s = NULL, t.next = 0;
+	ktf_spawn(&t);
+}
+
+static void kt_pool_run(kt_pool_t *p, void (*func)(void*, long, long, int), void *data, int n, int bs,
+						kt_sched_t *s);
+
+/* With s, blocks are guided by s (see kt_sched_t); without, BATCH_SIZE blocks as before. */
+void kt_for(void (*func)(void*, long, long, int), void *data, int n, kt_sched_t *s)
+{
+	worker_t *w = (worker_t*) data;
+	if (w->pool) kt_pool_run(w->pool, func, data, n, BATCH_SIZE, s);
+	else if (s == NULL) kt_spawn_for(w->nthreads, func, data, n);
+	else {
+		kt_for_t t;
+		t.func = func, t.data = data, t.n_threads = w->nthreads, t.n = n, t.bs = s->bs;
+		t.s = s, t.next = 0;
+		ktf_spawn(&t);
+	}
+}
+
+// ---------------
+// kt_pool
+// ---------------
+
+#define KT_POOL_SPIN 4096   // pause-loop iterations before a worker parks on the futex
+
+static inline void kt_futex_wait(volatile int *addr, int val)
+{
+	syscall(SYS_futex, (int*)addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline void kt_futex_wake(volatile int *addr, int n)
+{
+	syscall(SYS_futex, (int*)addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+static void *kt_pool_worker(void *data)
+{
+	kt_pool_worker_t *pw = (kt_pool_worker_t*) data;
+	kt_pool_t *p = pw->p;
+	int seen = 0;
+
+	for (;;) {
+		int g, spin = 0;
+		while ((g = __atomic_load_n(&p->gen, __ATOMIC_ACQUIRE)) == seen) {
+			if (spin < p->spin) { _mm_pause(); ++spin; }
+			else kt_futex_wait(&p->gen, seen);
+		}
+		seen = g;
+		if (p->quit) break;
+
+		ktf_run(&p->t.w[pw->tid]);
+
+		if (__atomic_sub_fetch(&p->pending, 1, __ATOMIC_ACQ_REL) == 0)
+			kt_futex_wake(&p->pending, 1);
+	}
+	pthread_exit(0);
+}
+
+kt_pool_t *kt_pool_init(int n_threads, int pin)
+{
+	int i;
+	kt_pool_t *p = (kt_pool_t*) calloc(1, sizeof(kt_pool_t));
+	assert(p != NULL);
+	p->n_threads = n_threads;
+	p->tid = (pthread_t*) malloc(n_threads * sizeof(pthread_t));
+	p->pw = (kt_pool_worker_t*) malloc(n_threads * sizeof(kt_pool_worker_t));
+	p->t.w = (ktf_worker_t*) malloc(n_threads * sizeof(ktf_worker_t));
+	assert(p->tid != NULL && p->pw != NULL && p->t.w != NULL);
+	p->t.n_threads = n_threads;
+	// spinning only pays off when every worker (plus the dispatcher) owns a cpu
+	p->spin = n_threads < get_nprocs()? KT_POOL_SPIN : 0;
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	for (i = 0; i < n_threads; ++i) {
+		p->pw[i].p = p, p->pw[i].tid = i;
+		p->t.w[i].t = &p->t, p->t.w[i].tid = i, p->t.w[i].i = 0;
+#if AFF && (__linux__)
+		if (pin) {
+			cpu_set_t cpus;
+			CPU_ZERO(&cpus);
+			CPU_SET(affy[i], &cpus);
+			pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpus);
+			pthread_create(&p->tid[i], &attr, kt_pool_worker, &p->pw[i]);
+			continue;
+		}
+#endif
+		pthread_create(&p->tid[i], NULL, kt_pool_worker, &p->pw[i]);
+	}
+	pthread_attr_destroy(&attr);
+	return p;
+}
+
+static void kt_pool_run(kt_pool_t *p, void (*func)(void*, long, long, int), void *data, int n, int bs,
+						kt_sched_t *s)
+{
+	int i, v;
+	uint64_t beg = __rdtsc();
+	p->t.func = func, p->t.data = data, p->t.n = n, p->t.bs = bs;
+	p->t.s = s, p->t.next = 0;
+	for (i = 0; i < p->n_threads; ++i) p->t.w[i].i = i;
+	__atomic_store_n(&p->pending, p->n_threads, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&p->gen, 1, __ATOMIC_RELEASE);
+	kt_futex_wake(&p->gen, INT_MAX);
+
+	while ((v = __atomic_load_n(&p->pending, __ATOMIC_ACQUIRE)) != 0)
+		kt_futex_wait(&p->pending, v);
+	if (s) kt_sched_update(&p->t, beg, __rdtsc());
+}
+
+void kt_pool_for(kt_pool_t *p, void (*func)(void*, long, long, int), void *data, int n, int bs)
+{
+	kt_pool_run(p, func, data, n, bs, NULL);
+}
+
+void kt_pool_destroy(kt_pool_t *p)
+{
+	int i;
+	if (p == NULL) return;
+	p->quit = 1;
+	__atomic_add_fetch(&p->gen, 1, __ATOMIC_RELEASE);
+	kt_futex_wake(&p->gen, INT_MAX);
+	for (i = 0; i < p->n_threads; ++i) pthread_join(p->tid[i], 0);
+	free(p->t.w); free(p->pw); free(p->tid);
+	free(p);
+}
+
+// ---------------
+// kt_ring
+// ---------------
+
+kt_ring_t *kt_ring_init(int size)
+{
+	kt_ring_t *r = (kt_ring_t*) calloc(1, sizeof(kt_ring_t));
+	assert(r != NULL);
+	r->size = size > 0? size : 1;
+	r->a = (void**) calloc(r->size, sizeof(void*));
+	assert(r->a != NULL);
+	return r;
+}
+
+void kt_ring_destroy(kt_ring_t *r)
+{
+	if (r == NULL) return;
+	free(r->a);
+	free(r);
+}
+
+/* Single producer: blocks while the ring is full */
+void kt_ring_push(kt_ring_t *r, void *p)
+{
+	int t = r->tail, h;
+	while (t - (h = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) == r->size)
+		kt_futex_wait(&r->head, h);
+	r->a[(unsigned) t % r->size] = p;
+	__atomic_store_n(&r->tail, t + 1, __ATOMIC_RELEASE);
+	kt_futex_wake(&r->tail, 1);
+}
+
+/* Single consumer: blocks while the ring is empty */
+void *kt_ring_pop(kt_ring_t *r)
+{
+	int h = r->head, t;
+	void *p;
+	while ((t = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) == h)
+		kt_futex_wait(&r->tail, t);
+	p = r->a[(unsigned) h % r->size];
+	__atomic_store_n(&r->head, h + 1, __ATOMIC_RELEASE);
+	kt_futex_wake(&r->head, 1);
+	return p;
+}
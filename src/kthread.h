@@ -34,36 +34,31 @@
 
 #include <stdint.h>
 #include "macro.h"
-#include "bwamem.h"
 #include <pthread.h>
 
 // ----------------
 //  kt_pipeline() 
 // -------------------
 
-struct ktp_t;
+/* Bounded single-producer/single-consumer queue between two pipeline stages.
+   head and tail only grow; both sides park on the other's counter via futex. */
+typedef struct {
+	void **a;
+	int size;
+	volatile int head;          // next slot to pop, written by the consumer only
+	volatile int tail;          // next slot to push, written by the producer only
+} kt_ring_t;
+
 struct mem_opt_t;
 struct worker_t;
 
 typedef struct {
-	struct ktp_t *pl;
-	int64_t index;
 	int step;
-	void *data;
+	void *shared;
+	kt_ring_t *in, *out;        // NULL for the first (in) and the last (out) stage
 	worker_t *w;
 	mem_opt_t *opt;
-	int i;
-} ktp_worker_t;
-
-typedef struct ktp_t {
-	void *shared;
-	int (*func)(void*);
-	int64_t index;
-	int n_workers, n_steps;
-	ktp_worker_t *workers;
-	pthread_mutex_t mutex;
-	pthread_cond_t cv;
-} ktp_t;
+} ktp_stage_t;
 
 // ---------------
 // kt_for() 
@@ -75,17 +70,77 @@ typedef struct {
 	struct kt_for_t *t;
 	int tid;
 	long i;
+	uint64_t fin;               // rdtsc when the worker ran out of blocks (kt_sched_t only)
+	double max_rate;            // max cycles per item over its blocks (kt_sched_t only)
 } ktf_worker_t;
 
+/* Block size control of one kt_for() phase ('mem --batch').
+   Blocks are handed out from a shared cursor, guided: bs items while there is
+   plenty of work left, then smaller ones down to min_bs, so that the reads of the
+   last batches of a phase are spread over the idle threads instead of being left
+   to whoever took the batch. With adapt set, bs for the next call is derived from
+   the per-block timing of this one: a full block of the slowest kind should take
+   at most KT_TAIL_FRAC of the wall time of the phase. */
+#define KT_TAIL_FRAC 0.05
+#define KT_GUIDED_DIV 2         // a block is at most 1/(KT_GUIDED_DIV * n_threads) of the rest
+#define KT_MIN_BS 16
+#define KT_ADAPT_DIV 8          // adapt bs down to BATCH_SIZE / KT_ADAPT_DIV at most
+typedef struct {
+	int bs;                     // current full block size
+	int min_bs, max_bs;
+	int gran;                   // sizes and boundaries are multiples of gran (2 for read pairs)
+	int adapt;
+	int phase;                  // column of the KT_* rows of tprof
+} kt_sched_t;
+
 typedef struct kt_for_t {
 	int n_threads;
 	long n;
+	int bs;                     // items handed out per func() call
 	ktf_worker_t *w;
 	void (*func)(void*, long, long, int);
 	void *data;
+	kt_sched_t *s;              // guided blocks from next if set, fixed bs blocks otherwise
+	volatile long next;
 } kt_for_t;
 
+// ---------------
+// kt_pool: long-lived kt_for() workers
+// ---------------
+
+struct kt_pool_t;
+
+typedef struct {
+	struct kt_pool_t *p;
+	int tid;
+} kt_pool_worker_t;
+
+typedef struct kt_pool_t {
+	int n_threads;
+	pthread_t *tid;
+	kt_pool_worker_t *pw;
+	kt_for_t t;                 // the parallel region currently dispatched
+	volatile int gen;           // bumped once per region; workers park on it
+	volatile int pending;       // workers still inside the current region
+	volatile int quit;
+	int spin;                   // busy-wait iterations before parking
+} kt_pool_t;
 
 void kt_pipeline(int n_threads, int (*func)(void*), void *shared_data, int n_steps);
-void kt_for(void (*func)(void*,long,long,int), void *data, int n);
+void kt_for(void (*func)(void*,long,long,int), void *data, int n, kt_sched_t *s);
+void kt_sched_init(kt_sched_t *s, int phase, int bs, int gran);
+
+/* Pool workers are created once, pinned with affy[] if pin is set (AFF builds) and
+   parked on a futex between parallel regions. kt_for() dispatches to ((worker_t*)data)->pool
+   when it is set and falls back to per-call pthread_create() otherwise.
+   Only one region may be in flight per pool at a time. */
+kt_pool_t *kt_pool_init(int n_threads, int pin);
+void kt_pool_destroy(kt_pool_t *p);
+void kt_pool_for(kt_pool_t *p, void (*func)(void*,long,long,int), void *data, int n, int bs);
+void kt_spawn_for(int n_threads, void (*func)(void*,long,long,int), void *data, int n);
+
+kt_ring_t *kt_ring_init(int size);
+void kt_ring_destroy(kt_ring_t *r);
+void kt_ring_push(kt_ring_t *r, void *p);
+void *kt_ring_pop(kt_ring_t *r);
 #endif
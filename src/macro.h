@@ -78,8 +78,10 @@
 #define LIM_C 128
 
 #define SA_COMPRESSION 1
-#define SA_COMPX 03 // (= power of 2)
+#define SA_COMPX 03 // (= power of 2), default of 'index -x'. FMI_search::sa_compx at runtime
 #define SA_COMPX_MASK 0x7    // 0x7 or 0x3 or 0x1
+#define SA_COMPX_MAX 7       // the sparsest sampling of an index or of the loaded SA
+#define SA_COMPX_SPARSE 5    // the sparsest one 'load-shm -g' chooses by itself
 
 #ifndef DEFAULT_USE_ERT
 #define DEFAULT_USE_ERT 0
@@ -195,6 +197,22 @@
 #define PERFECT_TABLE_READ 114
 #define DO_PERFECT_MATCH 115
 #endif
+#define SMEM_CACHE_HIT 116
+#define SMEM_CACHE_MISS 117
+#define HIOCC_SKIP 118	/* LAST pivots skipped with 'mem -u 2' */
+#define HIOCC_READ 119	/* +0: reads whose LAST met no high-occurrence k-mer, +1: the others */
+#define HIOCC_CYCLE 121	/* LAST cycles of the two classes of HIOCC_READ */
+/* kt_for() phases of mem_process_seqs(), indexed by KT_PHASE_* instead of tid */
+#define KT_WALL 123
+#define KT_TAIL 124
+#define KT_TAIL_MAX 125
+#define KT_CALLS 126
+#define KT_BS 127	/* the block size for the next call */
+#define KT_PHASE_BWT 0
+#define KT_PHASE_ALN 1
+#define KT_PHASE_SAM 2
+#define KT_PHASE_FUSED 3
+#define KT_NUM_PHASE 4
 
 
 //////////////////////
@@ -222,8 +240,11 @@
 #define LEAF_TBL_BASE_PTR_WIDTH 3
 #define LEAF_TBL_HIT_COUNT_WIDTH 3
 #define MAX_HITS_PER_READ 2000000
+#define MH_PACKED_LIST (1ULL << 39) /* multi-hit leaf pointer flag, see addMultiHitLeafNode() */
+#define ERT_FORMAT_VERSION 2 /* 1: plain multi-hit lists, 2: packed lists (MH_PACKED_LIST) */
 //#define MMAP_ERT_INDEX 1
-//#define ERT_INDEX_PREFETCH 1
+#define ERT_INDEX_PREFETCH 1
+#define ERT_PREFETCH_DIST 4 /* reads, see mem_kernel1_core_ert() */
 
 #define log_file(fd, M, ...) \
 	fprintf(fd, M "\n", ##__VA_ARGS__); \
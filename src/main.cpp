@@ -55,9 +55,13 @@ int usage()
     fprintf(stderr, "  index         create index\n");
     fprintf(stderr, "  perfect-index create index for perfect match\n");
     fprintf(stderr, "  smem-table    create index for FM-index accelerator\n");
+#ifdef FMD_INDEX
+    fprintf(stderr, "  fmd-index     create the 128-row occurrence table for SMEM search (experimental)\n");
+#endif
     fprintf(stderr, "  mem           alignment\n");
     fprintf(stderr, "  load-shm      load index on process shared memory\n");
     fprintf(stderr, "  remove-shm    remove index from process shared memory\n");
+    fprintf(stderr, "  bench         run micro-benchmarks\n");
     fprintf(stderr, "  version       print version number\n");
     return 1;
 }
@@ -130,19 +134,57 @@ int main(int argc, char* argv[])
 	else if (strcmp(argv[1], "smem-table") == 0)
 	{
 		// build two tables for FM-index walking
-		if (argc < 3) {
-			printf("usage: %s accel <idxbase>\n"
-				   "       build two smem tables for FM-index walking acceleration.\n",
-				   argv[0]);
+		int c, all_len = ALL_SMEM_BP, last_len = LAST_SMEM_BP, n_threads = 1;
+		int hiocc_len = 0;
+		int64_t hiocc_occ = HIOCC_MIN_OCC;
+		optind = 2;
+		while ((c = getopt(argc, argv, "a:l:t:k:c:")) >= 0) {
+			if (c == 'a') all_len = atoi(optarg);
+			else if (c == 'l') last_len = atoi(optarg);
+			else if (c == 't') n_threads = atoi(optarg);
+			else if (c == 'k') hiocc_len = atoi(optarg);
+			else if (c == 'c') hiocc_occ = atol(optarg);
+			else break;
+		}
+		if (optind + 1 > argc || c >= 0 || n_threads <= 0 || n_threads >= MAX_THREADS
+				|| (all_len != 0 && (all_len < SMEM_TABLE_MIN_BP || all_len > SMEM_TABLE_MAX_BP))
+				|| (last_len != 0 && (last_len < SMEM_TABLE_MIN_BP || last_len > SMEM_TABLE_MAX_BP))
+				|| (hiocc_len != 0 && (hiocc_len < SMEM_TABLE_MIN_BP || hiocc_len > SMEM_TABLE_MAX_BP))
+				|| hiocc_occ <= 0) {
+			printf("usage: %s smem-table [-a INT] [-l INT] [-k INT] [-c INT] [-t INT] <idxbase>\n"
+				   "       build two smem tables for FM-index walking acceleration.\n"
+				   "       -a INT  length (bp) of the all smem table, 0 to skip it [%d]\n"
+				   "       -l INT  length (bp) of the last smem table, 0 to skip it [%d]\n"
+				   "       -k INT  length (bp) of the high-occurrence k-mer table for 'mem -u', 0 to skip it [0]\n"
+				   "       -c INT  k-mers occurring more than INT times are high-occurrence [%d]\n"
+				   "       -t INT  number of threads [1]\n"
+				   "       lengths are %d ~ %d. the longest tables built are used at runtime.\n",
+				   argv[0], ALL_SMEM_BP, LAST_SMEM_BP, HIOCC_MIN_OCC, SMEM_TABLE_MIN_BP, SMEM_TABLE_MAX_BP);
 			return -1;
 		}
 		uint64_t tim = __rdtsc();
-		if (build_smem_tables(argv[2]) != 0) 
+		if (build_smem_tables(argv[optind], all_len, last_len,
+								hiocc_len, hiocc_occ, n_threads) != 0) 
 			fprintf(stderr, "Failed to build tables for smem acceleration\n");
         fprintf(stderr, "Total time taken: %0.4lf\n", (__rdtsc() - tim)*1.0/proc_freq);
         return 0;
 	}
 #endif
+#ifdef FMD_INDEX
+	else if (strcmp(argv[1], "fmd-index") == 0)
+	{
+		if (argc < 3) {
+			fprintf(stderr, "usage: %s fmd-index <idxbase>\n"
+				   "       convert <idxbase>.bwt.2bit.64 into <idxbase>.fmd for SMEM search.\n",
+				   argv[0]);
+			return -1;
+		}
+		uint64_t tim = __rdtsc();
+		ret = build_fmd_index(argv[2]);
+        fprintf(stderr, "Total time taken: %0.4lf\n", (__rdtsc() - tim)*1.0/proc_freq);
+        return ret;
+	}
+#endif
 #ifdef USE_SHM
 	else if (strcmp(argv[1], "load-shm") == 0) {
 		uint64_t tim = __rdtsc();
@@ -158,6 +200,10 @@ int main(int argc, char* argv[])
 		return ret;
 	}
 #endif
+    else if (strcmp(argv[1], "bench") == 0)
+    {
+        return bench_main(argc-1, argv+1);
+    }
     else if (strcmp(argv[1], "version") == 0)
     {
         puts(PACKAGE_VERSION);
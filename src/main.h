@@ -49,6 +49,7 @@
 #include "fastmap.h"
 
 int bwa_index(int argc, char *argv[]);
+int bench_main(int argc, char *argv[]);
 #ifdef PERFECT_MATCH
 int perfect_index(int argc, char *argv[]);
 int perfect_map(int argc, char *argv[]);
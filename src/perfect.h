@@ -208,10 +208,48 @@ typedef struct __attribute__ ((__packed__)) perfect_table {
 	uint32_t seq_len;
 	uint32_t num_seed_used; // # seed entries in use (including collision entries)
 	uint32_t num_seed_key; // # non-collision entries in use (distinguished hash key values)
+	uint32_t format; /* PT_FORMAT_BUCKET, or anything else for the BST format */
 	
-	uint8_t __pad[__pad_size(sizeof(int) + sizeof(uint32_t) * 6 + sizeof(void *) * 3, 64)];
+	uint8_t __pad[__pad_size(sizeof(int) + sizeof(uint32_t) * 7 + sizeof(void *) * 3, 64)];
 } perfect_table_t;
 
+/* BUCKET FORMAT
+ *
+ * seed_table is an array of 64-byte buckets instead of seed entries with collision BSTs.
+ * a bucket has PT_BUCKET_SLOTS entries (flags and location of seed_entry_t) and
+ * their 16-bit fingerprints, so that most lookups touch a single cache line,
+ * and ref_string is compared only for the fingerprint-matched entries.
+ * a full bucket spills to the next bucket (linear probing), and @overflow of 
+ * every bucket passed by the spill is set.
+ *
+ * num_seed_entry and num_seed_load are still in the unit of seed_entry_t,
+ * thus loading and shm code are shared by both formats.
+ *
+ * The field for the format was a padding in old tables, and it might have any value.
+ * A magic value is used to distinguish the bucket format.
+ */
+#define PT_FORMAT_BUCKET 0x54424b42 /* "BKBT" */
+#define PT_BUCKET_SLOTS 6
+
+typedef struct {
+	uint16_t fp[PT_BUCKET_SLOTS]; /* 0 for an empty slot */
+	uint16_t n; /* # used slots */
+	uint16_t overflow;
+	struct {
+		uint32_t flags; /* same as seed_entry_t, but FLAG_COLLISION is not used */
+		uint32_t location;
+	} ent[PT_BUCKET_SLOTS];
+} seed_bucket_t;
+
+#define PT_BUCKET_UNIT (sizeof(seed_bucket_t) / sizeof(seed_entry_t))
+#define is_bucket_table(pt) ((pt)->format == PT_FORMAT_BUCKET)
+#define get_num_bucket(pt) ((pt)->num_seed_entry / PT_BUCKET_UNIT)
+
+static inline uint16_t get_bucket_fp(uint64_t hash) {
+	uint16_t fp = (uint16_t) (hash >> 48);
+	return fp ? fp : 1;
+}
+
 
 #define get_seed_loc(pt, loc) (*((pt)->ref_string + (loc)))
 
@@ -538,7 +576,7 @@ static inline int64_t __get_hash_idx_fw(perfect_table_t *pt, const uint8_t *seed
 }
 #endif
 
-static inline int64_t __get_hash_idx_fw(perfect_table_t *pt, const uint8_t *seed, int len) {
+static inline uint64_t __get_hash64_fw(const uint8_t *seed, int len) {
 	uint64_t s = 0, h = 0;
 	int i;
 
@@ -609,7 +647,7 @@ static inline int64_t __get_hash_idx_fw(perfect_table_t *pt, const uint8_t *seed
 	h ^= s;
 
 out:	
-	return (int64_t) (__fmix64(h) % pt->num_seed_entry); 
+	return __fmix64(h); 
 }
 
 #if 0
@@ -631,7 +669,7 @@ static inline int64_t __get_hash_idx_rc(perfect_table_t *pt, const uint8_t *seed
 }
 #endif
 
-static inline int64_t __get_hash_idx_rc(perfect_table_t *pt, const uint8_t *__seed, int len) {
+static inline uint64_t __get_hash64_rc(const uint8_t *__seed, int len) {
 	uint64_t s = 0, h = 0;
 	const uint8_t *seed = __seed + len;
 	int i;
@@ -703,7 +741,15 @@ static inline int64_t __get_hash_idx_rc(perfect_table_t *pt, const uint8_t *__se
 	h ^= s;
 
 out:	
-	return (int64_t) (__fmix64(h) % pt->num_seed_entry); 
+	return __fmix64(h); 
+}
+
+static inline int64_t __get_hash_idx_fw(perfect_table_t *pt, const uint8_t *seed, int len) {
+	return (int64_t) (__get_hash64_fw(seed, len) % pt->num_seed_entry);
+}
+
+static inline int64_t __get_hash_idx_rc(perfect_table_t *pt, const uint8_t *seed, int len) {
+	return (int64_t) (__get_hash64_rc(seed, len) % pt->num_seed_entry);
 }
 
 static inline int __compare_fw_rc(const uint8_t *seed, int len);
@@ -757,6 +803,15 @@ static inline seed_entry_t *get_seed_entry(perfect_table_t *pt, int64_t key) {
 #endif
 }
 
+static inline seed_bucket_t *get_seed_bucket(perfect_table_t *pt, uint64_t b) {
+#ifdef MEMSCALE
+	return (b + 1) * PT_BUCKET_UNIT <= pt->num_seed_load 
+				? (seed_bucket_t *) pt->seed_table + b : NULL;
+#else
+	return (seed_bucket_t *) pt->seed_table + b;
+#endif
+}
+
 //int64_t get_hash_idx(perfect_table_t *pt, const uint64_t *seed);
 void show_seed_entry(perfect_table_t *pt, uint32_t key);
 void show_perfect_table_related(perfect_table_t *pt, uint32_t start);
@@ -764,8 +819,33 @@ void show_perfect_table_related(perfect_table_t *pt, uint32_t start);
 extern perfect_table_t *perfect_table;
 extern int perfect_table_seed_len;
 
+/* A family of perfect tables for several seed lengths (e.g., -l 151,125,100).
+ * Each member is a separate "<prefix>.perfect.<len>" table, and all members share ref_string.
+ * A read is looked up in the longest member whose seed_len is not larger than the read length.
+ * perfect_family[] is sorted by seed_len in descending order.
+ * A NULL member is not loaded (e.g., out of the memory budget of bwa_shm).
+ */
+#define PT_FAMILY_MAX 8
+extern perfect_table_t *perfect_family[PT_FAMILY_MAX];
+extern int perfect_family_len[PT_FAMILY_MAX];
+extern int perfect_family_n;
+
+int parse_perfect_family(const char *str, int *lens);
+
+static inline perfect_table_t *perfect_table_for_len(perfect_table_t *pt, int len) {
+	int i;
+	for (i = 0; i < perfect_family_n; ++i)
+		if (perfect_family[i] && perfect_family[i]->seed_len <= len)
+			return perfect_family[i];
+	return pt;
+}
+
 void free_perfect_table();
 
+perfect_table_t *load_perfect_table_file(const char *file_name, uint8_t *ref_string);
+void destroy_perfect_table_file(perfect_table_t *pt);
+int find_perfect_match_seed(perfect_table_t *pt, uint8_t *seed, int len, bseq1_perfect_t *ret);
+
 /***************************************/
 /* Load Perfect Table helper functions */
 /***************************************/
@@ -94,6 +94,7 @@ static uint32_t total_moved_entry = 0;
 
 
 int mode_build = 0; /* use this variable only for debugging. now, affect to "show_seed_entry()" */
+static int build_format = PT_FORMAT_BUCKET; /* 0 for the BST format ('perfect-index -L') */
 
 #define get_num_seed(start, end, len) ((end) - (start) >= (len) ? ((end) - (start) - (len) + 1) : 0)
 
@@ -923,6 +924,81 @@ static inline void convert_to_bst(perfect_table_t *pt, uint32_t *idx_list,
 	}
 }
 
+/* convert the BST format into the bucket format (see seed_bucket_t).
+   the table is sized for a load factor of 2/3 (16 bytes per seed), 
+   which keeps most buckets from overflowing. */
+static void convert_to_bucket_table(perfect_table_t *pt) {
+	uint64_t num_bucket, b, hash;
+	uint32_t idx, num_overflow = 0, num_spilled = 0;
+	seed_bucket_t *table, *bucket;
+	seed_entry_t *ent;
+	uint8_t *seed;
+	uint32_t num_loc_entry;
+	uint32_t *loc_table;
+
+	num_bucket = (uint64_t) pt->num_seed_used * 3 / (PT_BUCKET_SLOTS * 2) + 1;
+	if (num_bucket * PT_BUCKET_UNIT > UINT32_MAX) {
+		fprintf(stderr, "ERROR: too many seed entries for the bucket format (%u). Use 'perfect-index -L'.\n", pt->num_seed_used);
+		exit(EXIT_FAILURE);
+	}
+	printf("[Rebuilding#3] convert %u seed entries into %lu buckets (%.3fGB)\n",
+			pt->num_seed_used, num_bucket,
+			(double) num_bucket * sizeof(seed_bucket_t) / (1024*1024*1024));
+	fflush(stdout);
+
+	table = (seed_bucket_t *) _mm_malloc(num_bucket * sizeof(seed_bucket_t), 64);
+	if (!table) {
+		fprintf(stderr, "ERROR: failed to allocate memory for the bucket table\n");
+		exit(EXIT_FAILURE);
+	}
+	memset(table, 0, num_bucket * sizeof(seed_bucket_t));
+
+	for (idx = 0; idx < pt->num_seed_entry; idx++) {
+		ent = get_seed_entry(pt, idx);
+		if (!is_valid_entry(ent))
+			continue;
+
+		seed = pt->ref_string + ent->location;
+		hash = is_fw_less_entry(ent) ? __get_hash64_fw(seed, pt->seed_len)
+									 : __get_hash64_rc(seed, pt->seed_len);
+		b = hash % num_bucket;
+		while ((bucket = &table[b])->n == PT_BUCKET_SLOTS) {
+			if (!bucket->overflow)
+				num_overflow++;
+			bucket->overflow = 1;
+			b = b + 1 == num_bucket ? 0 : b + 1;
+		}
+		if (b != hash % num_bucket)
+			num_spilled++;
+		bucket->fp[bucket->n] = get_bucket_fp(hash);
+		bucket->ent[bucket->n].flags = ent->flags & ~(FLAG_COLLISION);
+		bucket->ent[bucket->n].location = ent->location;
+		bucket->n++;
+	}
+
+	free(pt->seed_table);
+	pt->seed_table = (seed_entry_t *) table;
+	pt->num_seed_entry = (uint32_t) (num_bucket * PT_BUCKET_UNIT);
+#ifdef MEMSCALE
+	pt->num_seed_load = pt->num_seed_entry;
+#endif
+	pt->format = PT_FORMAT_BUCKET;
+
+	/* the seed table follows the header and loc_table in the file and on shm.
+	   pad loc_table to keep the buckets cache-line aligned there. */
+	num_loc_entry = (pt->num_loc_entry + 15) & ~15U;
+	if (num_loc_entry != pt->num_loc_entry) {
+		loc_table = (uint32_t *) realloc(pt->loc_table, num_loc_entry * sizeof(uint32_t));
+		assert(loc_table);
+		memset(loc_table + pt->num_loc_entry, 0, (num_loc_entry - pt->num_loc_entry) * sizeof(uint32_t));
+		pt->loc_table = loc_table;
+		pt->num_loc_entry = num_loc_entry;
+	}
+
+	printf("[Rebuilding#3] done. #overflowed_bucket: %u #spilled_entry: %u\n", num_overflow, num_spilled);
+	fflush(stdout);
+}
+
 void rebuild_perfect_table_for_mapping(perfect_table_t *pt) {
 	uint32_t *loc_table = NULL;
 	uint32_t *multi_loc_map = NULL;
@@ -991,6 +1067,9 @@ void rebuild_perfect_table_for_mapping(perfect_table_t *pt) {
 	mode_build = 0; /* mode_build is related to multi_location */
 	free(idx_list);
 	free(node_list);
+
+	if (build_format == PT_FORMAT_BUCKET)
+		convert_to_bucket_table(pt);
 }
 
 #if 0
@@ -1333,6 +1412,8 @@ int __perfect_build_index(const char *pt_fn, uint8_t *ref_string,
 	seed_entry_t *seed_table;
 	
 	assert(sizeof(perfect_table_t) % 64 == 0);
+	assert(sizeof(seed_bucket_t) == 64);
+	memset(&pt, 0, sizeof(perfect_table_t));
 
 	/* initialize global statistics */
 	total_added_entry = 0;
@@ -1428,7 +1509,10 @@ int __perfect_build_index(const char *pt_fn, uint8_t *ref_string,
 	err_fwrite(seed_table, sizeof(seed_entry_t), pt.num_seed_entry, fp);
 	err_fflush(fp);
 	err_fclose(fp);
-	free(seed_table);
+	if (is_bucket_table(&pt))
+		_mm_free(seed_table);
+	else
+		free(seed_table);
 	free(loc_table);
 	printf("Done\n");
 	fflush(stdout);
@@ -1436,7 +1520,8 @@ int __perfect_build_index(const char *pt_fn, uint8_t *ref_string,
 	return 0;
 }
 
-int perfect_build_index(const char *prefix, int seed_len, double slack)
+/* build a table for each length of the family. the reference is loaded once. */
+int perfect_build_index(const char *prefix, const int *seed_len, int n, double slack)
 {
 	clock_t t;
 	int64_t seq_len;
@@ -1448,14 +1533,17 @@ int perfect_build_index(const char *prefix, int seed_len, double slack)
   	uint8_t *ref_string;
 
 	char file_name[PATH_MAX];
+	int i;
 
 	anns = ann_restore(prefix, &seq_len, &n_seqs);
 	ambs = amb_restore(prefix, &seq_len, &n_holes);
 	load_ref_string(prefix, &ref_string);
 	
-	snprintf(file_name, PATH_MAX, "%s.perfect.%d", prefix, seed_len);
-	__perfect_build_index(file_name, ref_string, seq_len, slack, seed_len, 
-							anns, n_seqs, ambs, n_holes);
+	for (i = 0; i < n; ++i) {
+		snprintf(file_name, PATH_MAX, "%s.perfect.%d", prefix, seed_len[i]);
+		__perfect_build_index(file_name, ref_string, seq_len, slack, seed_len[i], 
+								anns, n_seqs, ambs, n_holes);
+	}
 	_mm_free(ref_string);
 	free(ambs);
 
@@ -1715,6 +1803,33 @@ void stat_perfect_table(struct perfect_table *pt) {
 	fflush(stdout);
 }
 
+static void stat_bucket_table(perfect_table_t *pt) {
+	int64_t num_bucket = get_num_bucket(pt);
+	int64_t dist[PT_BUCKET_SLOTS + 1] = {0,};
+	int64_t b, total = 0, num_overflow = 0;
+	seed_bucket_t *bucket;
+	int i;
+
+	for (b = 0; b < num_bucket; ++b) {
+		bucket = get_seed_bucket(pt, b);
+		if (!bucket)
+			break;
+		dist[bucket->n]++;
+		total += bucket->n;
+		if (bucket->overflow)
+			num_overflow++;
+	}
+
+	printf("STATISTICS OF PERFECT TABLE (BUCKET FORMAT)\n");
+	printf("seed_len: %u seq_len: %u #bucket: %ld #entry: %ld (%.2f%%) #overflowed: %ld (%.2f%%) #loc_entry: %u\n",
+			pt->seed_len, pt->seq_len, num_bucket, total, 
+			(float) total * 100 / (num_bucket * PT_BUCKET_SLOTS),
+			num_overflow, (float) num_overflow * 100 / num_bucket, pt->num_loc_entry);
+	for (i = 0; i <= PT_BUCKET_SLOTS; ++i)
+		printf("  %d slots used: %16ld (%.2f%%)\n", i, dist[i], (float) dist[i] * 100 / num_bucket);
+	fflush(stdout);
+}
+
 perfect_table_t *load_perfect_table(const char *prefix, int len, uint8_t **ref_string, FMI_search *fmi);
 
 void display_perfect_table_stat(char *prefix, int seed_len) {
@@ -1724,6 +1839,10 @@ void display_perfect_table_stat(char *prefix, int seed_len) {
 	load_ref_string(prefix, &ref_string);
 	load_perfect_table(prefix, seed_len, &ref_string, NULL); 
 	pt = perfect_table;
+	if (is_bucket_table(pt)) {
+		stat_bucket_table(pt);
+		return;
+	}
 	show_perfect_table(pt);
 
 	printf("Statistics of perfect table: start\n");
@@ -1734,33 +1853,37 @@ void display_perfect_table_stat(char *prefix, int seed_len) {
 }
 
 void usage_perfect_index() {
-	fprintf(stderr, "Usage: bwa-mem2 perfect-index [-l seed_length] [-s slack] <prefix>\n");
+	fprintf(stderr, "Usage: bwa-mem2 perfect-index [-l seed_length[,seed_length...]] [-s slack] [-L] <prefix>\n");
+	fprintf(stderr, "       -l 151,125,100 ==> build a family of tables, <prefix>.perfect.151, .125 and .100\n");
 	fprintf(stderr, "       -s (float) ==> the hash table will have (slack) * (length of reference sequence) entries\n");
+	fprintf(stderr, "       -L ==> write the BST format instead of the cache-line bucket format\n");
 }
 
 int perfect_index(int argc, char *argv[]) // the "perfect-index" command
 {
 	int c;
-	int seed_len = -1;
+	int seed_len[PT_FAMILY_MAX], n_seed_len = 0, i;
 	double slack = 1.1;
 	int opt_display_stat = 0;
 	char *prefix = 0, *str;
-	while ((c = getopt(argc, argv, "l:s:d")) >= 0) {
+	while ((c = getopt(argc, argv, "l:s:dL")) >= 0) {
 		if (c == 'l') {
-			seed_len = atoi(optarg);
-			if (seed_len <= 0) {
-				fprintf(stderr, "ERROR: the seed length should be larger than 0, but %d is given.\n", seed_len);
+			n_seed_len = parse_perfect_family(optarg, seed_len);
+			if (n_seed_len <= 0) {
+				fprintf(stderr, "ERROR: the seed length should be larger than 0 (up to %d lengths), but %s is given.\n", 
+								PT_FAMILY_MAX, optarg);
 				return -1;
 			}
 		} else if (c == 's') slack = atof(optarg);
 		else if (c == 'd') opt_display_stat = 1;
+		else if (c == 'L') build_format = 0;
 		else {
 			usage_perfect_index();
 			return -1;
 		}	
 	}
 			
-	if (seed_len <= 0) {
+	if (n_seed_len <= 0) {
 		fprintf(stderr, "ERROR: the seed length must be given.\n");
 		usage_perfect_index();
 		return -1;
@@ -1772,12 +1895,15 @@ int perfect_index(int argc, char *argv[]) // the "perfect-index" command
 	}
 	
 	if (opt_display_stat) {
-		display_perfect_table_stat(argv[optind], seed_len);
+		for (i = 0; i < n_seed_len; ++i) {
+			display_perfect_table_stat(argv[optind], seed_len[i]);
+			free_perfect_table();
+		}
 		return 0;
 	}
 
 	mode_build = 1;
-	perfect_build_index(argv[optind], seed_len, slack);
+	perfect_build_index(argv[optind], seed_len, n_seed_len, slack);
 	mode_build = 0;
 	return 0;
 }
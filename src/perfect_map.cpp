@@ -83,6 +83,9 @@ void set_perfect_profile_rid(int n_seq) {
 #endif
 
 perfect_table_t *perfect_table;
+perfect_table_t *perfect_family[PT_FAMILY_MAX];
+int perfect_family_len[PT_FAMILY_MAX];
+int perfect_family_n;
 int perfect_table_seed_len; /* PT_SEED_LEN_NO_TABLE means perfect_match is off.
                                PT_SEED_LEN_AUTO_TABLE means auto detection of seedlen.
 							   This variable is set before the table is loaded. */
@@ -94,110 +97,160 @@ static FMI_search *perfect_auto_load_fmi;
 #ifdef USE_SHM
 int __shm_remove(int m);
 
-static int ____load_perfect_table_from_shm(char *file_name, int len, perfect_table_t **ret_ptr) {
-	perfect_table_t *pt;
+/* members of the family are placed back-to-back in BWA_SHM_PERFECT.
+   lens[i] not found on the shm is left NULL (e.g., out of the memory budget). */
+static int ____load_perfect_family_from_shm(const int *lens, int n, perfect_table_t **pts) {
 	perfect_table_t *shm_ptr = NULL;
-	uint8_t *ptr = NULL;
+	uint8_t *ptr;
+	int i, j, num_found = 0;
+
+	for (i = 0; i < n; ++i)
+		pts[i] = NULL;
 
 #ifdef MEMSCALE
-	if (bwa_shm_info->perfect_on == 0) {
-		*ret_ptr = NULL;
+	if (bwa_shm_info->perfect_on == 0)
 		return 0;
-	}
 #endif
 
-	pt = (perfect_table_t *)_mm_malloc(sizeof(perfect_table_t), 64);
-	if (!pt)
-		return -1;
-
 	if (bwa_shm_open(BWA_SHM_PERFECT) >= 0) {
 		shm_ptr = (perfect_table_t *) bwa_shm_map(BWA_SHM_PERFECT);
 	} else
 		fprintf(stderr, "[bwa_shm] failed to open BWA_SHM_PERFECT\n");
 
 	if (!shm_ptr) return -1;
-	
-	if (shm_ptr->seed_len != len) {
+
+	ptr = (uint8_t *) shm_ptr;
+	for (j = 0; j < bwa_shm_info->pt_family_n; ++j) {
+		perfect_table_t *head = (perfect_table_t *) ptr;
+		for (i = 0; i < n; ++i) {
+			if (pts[i] || head->seed_len != lens[i])
+				continue;
+			pts[i] = (perfect_table_t *)_mm_malloc(sizeof(perfect_table_t), 64);
+			if (!pts[i])
+				goto err_alloc;
+			__lpt_link_shm_to_pt(pts[i], head);
+			num_found++;
+		}
+		ptr += __lpt_shm_size(head);
+	}
+
+	if (num_found == 0) {
 		fprintf(stderr, "[bwa_shm] perfect_table for different seed length is on memory. (%d != %d)\n",
-							shm_ptr->seed_len, len);
+							shm_ptr->seed_len, lens[0]);
 		__bwa_shm_remove(BWA_SHM_PERFECT); /* try to remove */	
 		return -1;
 	}
 
-	__lpt_link_shm_to_pt(pt, shm_ptr);
+	for (i = 0; i < n; ++i)
+		if (pts[i] == NULL)
+			fprintf(stderr, "[bwa_shm] perfect_table for seed length %d is not on memory.\n", lens[i]);
 
-	*ret_ptr = pt;
 	return 0;
+
+err_alloc:
+	for (i = 0; i < n; ++i) {
+		if (pts[i]) _mm_free(pts[i]);
+		pts[i] = NULL;
+	}
+	return -1;
 }
 
-int ____load_perfect_table_on_shm(char *file_name, int len, 
+/* load the family on a single shm region. only the last member can be partially loaded 
+   (num_seed_load > 0, MEMSCALE). pts can be NULL for bwa_shm_load. */
+int ____load_perfect_family_on_shm(const char *prefix, const int *lens, int n,
 									uint32_t num_seed_load __maybe_unused, 
-									perfect_table_t **ret_ptr) 
+									perfect_table_t **pts) 
 {
-	perfect_table_t *pt, *shm_ptr = NULL;
-	FILE *fp;
-	int pct;
-	size_t shm_size;
-	uint32_t num_loaded;
-	int fd;
+	perfect_table_t head[PT_FAMILY_MAX], tmp, *pt;
+	FILE *fp[PT_FAMILY_MAX];
+	char file_name[PATH_MAX];
+	uint8_t *shm_ptr = NULL, *ptr;
+	size_t shm_size, size_front = 0;
+	int i;
 
-	pt = (perfect_table_t *)_mm_malloc(sizeof(perfect_table_t), 64);
-	if (!pt)
+	assert(n > 0 && n <= PT_FAMILY_MAX);
+	if (n > 1 && use_mmap(BWA_SHM_PERFECT)) {
+		fprintf(stderr, "%s: mmap()ed perfect table supports a single seed length\n", __func__);
 		return -1;
-
-	fp = xopen(file_name, "rb");
-	if (!fp) {
-		fprintf(stderr, "%s: failed to open %s\n", __func__, file_name);
-		goto err_struct_alloc;
 	}
 
-	__lpt_load_head(pt, fp);
+	for (i = 0; i < n; ++i) {
+		snprintf(file_name, PATH_MAX, "%s.perfect.%d", prefix, lens[i]);
+		fp[i] = xopen(file_name, "rb");
+		if (!fp[i]) {
+			fprintf(stderr, "%s: failed to open %s\n", __func__, file_name);
+			goto err_file_open;
+		}
+		__lpt_load_head(&head[i], fp[i]);
 #ifdef MEMSCALE
-	__lpt_set_num_seed_load(pt, num_seed_load);
+		if (i == n - 1)
+			__lpt_set_num_seed_load(&head[i], num_seed_load);
 #endif
-	bwa_shm_info->pt_seed_len = pt->seed_len;
-	bwa_shm_info->pt_num_loc_entry = pt->num_loc_entry;
-	bwa_shm_info->pt_num_seed_entry = pt->num_seed_entry;
+		if (i < n - 1)
+			size_front += __lpt_shm_size(&head[i]);
+	}
+
+	/* pt_seed_len and pt_num_* are for the last member */
+	bwa_shm_info->pt_family_n = n;
+	for (i = 0; i < n; ++i)
+		bwa_shm_info->pt_family_len[i] = head[i].seed_len;
+	bwa_shm_info->pt_family_size = size_front;
+	bwa_shm_info->pt_seed_len = head[n - 1].seed_len;
+	bwa_shm_info->pt_num_loc_entry = head[n - 1].num_loc_entry;
+	bwa_shm_info->pt_num_seed_entry = head[n - 1].num_seed_entry;
 #ifdef MEMSCALE
-	bwa_shm_info->pt_num_seed_entry_loaded = pt->num_seed_load; 
+	bwa_shm_info->pt_num_seed_entry_loaded = head[n - 1].num_seed_load; 
 #endif
 
-	shm_size = __lpt_shm_size(pt);
+	shm_size = size_front + __lpt_shm_size(&head[n - 1]);
 
 	fprintf(stderr, "INFO: shm_create for perfect table. size: %ld hugetlb_flag: %x\n", 
 					shm_size, bwa_shm_hugetlb_flags());
 	if (bwa_shm_create(BWA_SHM_PERFECT, shm_size) >= 0)
-		shm_ptr = (perfect_table_t *) bwa_shm_map(BWA_SHM_PERFECT);
+		shm_ptr = (uint8_t *) bwa_shm_map(BWA_SHM_PERFECT);
 
 	if (!shm_ptr) {
+		i = n;
 		goto err_file_open;
 	}
-	
-	__lpt_show_info(pt);
 
-	if (use_mmap(BWA_SHM_PERFECT) == 0) {
-		memcpy(shm_ptr, pt, sizeof(perfect_table_t));
-		__lpt_set_table_ptr(pt, shm_ptr);
+	ptr = shm_ptr;
+	for (i = 0; i < n; ++i) {
+		pt = pts ? (perfect_table_t *)_mm_malloc(sizeof(perfect_table_t), 64) : &tmp;
+		if (!pt) {
+			pt = &tmp;
+			pts[i] = NULL;
+		} else if (pts)
+			pts[i] = pt;
+		memcpy(pt, &head[i], sizeof(perfect_table_t));
 
-		__lpt_load_loc_table(pt, fp);
-		__lpt_load_seed_table(pt, fp);
-	} else {
-		__lpt_set_table_ptr(pt, shm_ptr);
-	}
+		__lpt_show_info(pt);
 
-	err_fclose(fp);	
+		if (use_mmap(BWA_SHM_PERFECT) == 0) {
+			memcpy(ptr, pt, sizeof(perfect_table_t));
+			__lpt_set_table_ptr(pt, (perfect_table_t *) ptr);
+
+			__lpt_load_loc_table(pt, fp[i]);
+			__lpt_load_seed_table(pt, fp[i]);
+		} else {
+			__lpt_set_table_ptr(pt, (perfect_table_t *) ptr);
+		}
+
+		ptr += __lpt_shm_size(pt);
+		err_fclose(fp[i]);
+	}
 
 	fprintf(stderr, "Reading perfect table: Done\n");
 	fflush(stderr);
 
-	if (ret_ptr) *ret_ptr = pt;
 	return 0;
 
 err_file_open:
-	fclose(fp);
-err_struct_alloc:
-	_mm_free(pt);
-	if (ret_ptr) *ret_ptr = NULL;
+	while (i > 0)
+		fclose(fp[--i]);
+	if (pts)
+		for (i = 0; i < n; ++i)
+			pts[i] = NULL;
 	return -1;
 }
 
@@ -263,24 +316,30 @@ err_struct_alloc:
 	return -1;
 }
 
-int __load_perfect_table(char *file_name, int len, perfect_table_t **ret_ptr) {
-	int ret;
+int __load_perfect_family(const char *prefix, const int *lens, int n, perfect_table_t **pts) {
+	char file_name[PATH_MAX];
+	int ret, i;
 	
 	if (bwa_shm_mode == BWA_SHM_MATCHED) {
-		ret = ____load_perfect_table_from_shm(file_name, len, ret_ptr);
+		ret = ____load_perfect_family_from_shm(lens, n, pts);
 		if (ret == 0) return 0;
 	}
 
 	if (bwa_shm_mode != BWA_SHM_DISABLE) {
-		ret = ____load_perfect_table_on_shm(file_name, len, 0, ret_ptr);
+		ret = ____load_perfect_family_on_shm(prefix, lens, n, 0, pts);
 		if (ret == 0) return 0;
 	}
 
 	/* ERROR or BWA_SHM_DISABLE */
-	return ____load_perfect_table_without_shm(file_name, len, ret_ptr); 
+	for (i = 0; i < n; ++i) {
+		snprintf(file_name, PATH_MAX, "%s.perfect.%d", prefix, lens[i]);
+		if (____load_perfect_table_without_shm(file_name, lens[i], &pts[i]))
+			return -1;
+	}
+	return 0;
 }
 #else /* !USE_SHM */
-int __load_perfect_table(char *file_name, int len, perfect_table_t **ret_ptr) {
+static int __load_perfect_table(char *file_name, int len, perfect_table_t **ret_ptr) {
 	perfect_table_t *pt;
 	FILE *fp;
 	int pct;
@@ -337,15 +396,51 @@ err_struct_alloc:
 	*ret_ptr = NULL;
 	return -1;
 }
+
+int __load_perfect_family(const char *prefix, const int *lens, int n, perfect_table_t **pts) {
+	char file_name[PATH_MAX];
+	int i;
+
+	for (i = 0; i < n; ++i) {
+		snprintf(file_name, PATH_MAX, "%s.perfect.%d", prefix, lens[i]);
+		if (__load_perfect_table(file_name, lens[i], &pts[i]))
+			return -1;
+	}
+	return 0;
+}
 #endif /* !USE_SHM */
 
+/* "151,125,100" => lens[] = {151, 125, 100}. sorted in descending order without duplicates.
+   return the number of lengths, or -1 for a wrong string. */
+int parse_perfect_family(const char *str, int *lens) {
+	int n = 0, i, j, len;
+	char *end;
+
+	while (*str) {
+		len = (int) strtol(str, &end, 10);
+		if (end == str || len <= 0 || (*end != ',' && *end != '\0'))
+			return -1;
+		for (i = 0; i < n && lens[i] > len; ++i);
+		if (i == n || lens[i] != len) {
+			if (n == PT_FAMILY_MAX)
+				return -1;
+			for (j = n; j > i; --j)
+				lens[j] = lens[j - 1];
+			lens[i] = len;
+			n++;
+		}
+		str = *end == ',' ? end + 1 : end;
+	}
+
+	return n > 0 ? n : -1;
+}
+
 void init_auto_load_perfect_table(const char *prefix, uint8_t **reference, FMI_search *fmi); 
 
 int load_perfect_table(const char *prefix, int len, 
 						uint8_t **reference, FMI_search *fmi)
 {
-	char file_name[PATH_MAX];
-	int ret;
+	int i;
 
 	if (reference == NULL || *reference == NULL) {
 		fprintf(stderr, "ERROR: reference for perfect table is not given.\n");
@@ -361,17 +456,29 @@ int load_perfect_table(const char *prefix, int len,
 		return -1;	
 	}
 	
-	snprintf(file_name, PATH_MAX, "%s.perfect.%d", prefix, len);
-
+	if (perfect_family_n == 0) {
+		perfect_family_len[0] = len;
+		perfect_family_n = 1;
+	}
 
-	if (__load_perfect_table(file_name, len, &perfect_table)) {
+	if (__load_perfect_family(prefix, perfect_family_len, perfect_family_n, perfect_family)) {
+		for (i = 0; i < perfect_family_n; ++i)
+			perfect_family[i] = NULL;
 		perfect_table = NULL;
 		perfect_table_seed_len = PT_SEED_LEN_NO_TABLE;
 		return -1;
 	}
 
-	if (perfect_table)
-		perfect_table->ref_string = *reference;
+	/* perfect_table is the longest one, and perfect_table_seed_len is the shortest one */
+	perfect_table = NULL;
+	for (i = 0; i < perfect_family_n; ++i) {
+		if (perfect_family[i] == NULL)
+			continue;
+		perfect_family[i]->ref_string = *reference;
+		if (perfect_table == NULL)
+			perfect_table = perfect_family[i];
+		perfect_table_seed_len = perfect_family[i]->seed_len;
+	}
 	if (fmi) fmi->perfect_table = perfect_table;
 
 #ifdef PERFECT_PROFILE
@@ -504,17 +611,24 @@ void free_perfect_table() {
 				);
 
 #endif
+	int i, on_shm = 0;
+
 	if (perfect_table == NULL) return;
 #ifdef USE_SHM
-	if (bwa_shm_unmap(BWA_SHM_PERFECT)) {
-		_mm_free(perfect_table->loc_table);
-		_mm_free(perfect_table->seed_table);
-	}
-#else
-	_mm_free(perfect_table->loc_table);
-	_mm_free(perfect_table->seed_table);
+	on_shm = bwa_shm_unmap(BWA_SHM_PERFECT) == 0;
 #endif
-	_mm_free(perfect_table);
+	for (i = 0; i < perfect_family_n; ++i) {
+		if (perfect_family[i] == NULL)
+			continue;
+		if (!on_shm) {
+			_mm_free(perfect_family[i]->loc_table);
+			_mm_free(perfect_family[i]->seed_table);
+		}
+		_mm_free(perfect_family[i]);
+		perfect_family[i] = NULL;
+	}
+	perfect_family_n = 0;
+	perfect_table = NULL;
 }
 
 #define seedcmp_find(pt, ent, seed, fw_less) \
@@ -580,15 +694,58 @@ out:
 	}
 }
 
-static int __find_perfect_match_entry(perfect_table_t *pt, 
-									 uint8_t *seed, int len, bseq1_perfect_t *ret) {
-	int64_t idx;
+static inline int __perfect_matched(seed_entry_t *ent, int fw_less, bseq1_perfect_t *ret) {
+	ret->location = ent->location;
+	if (is_fw_less_entry(ent) == fw_less) {
+		ret->flags = ent->flags & (~(FLAG_RC)) | (FLAG_VALID);
+		return FIND_PERFECT_FW_MATCHED;
+	} else {
+		ret->flags = ent->flags | (FLAG_RC) | (FLAG_VALID);
+		return FIND_PERFECT_RC_MATCHED;
+	}
+}
+
+/* lookup in the bucket format. see seed_bucket_t. */
+static int __find_perfect_match_bucket(perfect_table_t *pt, uint8_t *seed, int len, 
+									   int fw_less, uint64_t hash, bseq1_perfect_t *ret) {
+	uint64_t num_bucket = get_num_bucket(pt);
+	uint64_t b = hash % num_bucket;
+	uint16_t fp = get_bucket_fp(hash);
+	seed_bucket_t *bucket;
+	seed_entry_t ent;
+	int i;
+
+	while ((bucket = get_seed_bucket(pt, b)) != NULL) {
+		for (i = 0; i < PT_BUCKET_SLOTS; ++i) {
+			if (bucket->fp[i] != fp)
+				continue;
+			ent.flags = bucket->ent[i].flags;
+			ent.location = bucket->ent[i].location;
+			if (seedcmp_find(pt, (&ent), seed, fw_less) != 0)
+				continue;
+			/* found */
+			if (len == pt->seed_len)
+				return __perfect_matched(&ent, fw_less, ret);
+			else
+				return seedmatch_further(pt, &ent, seed, fw_less, len, ret);
+		}
+
+		if (!bucket->overflow)
+			break;
+		b = b + 1 == num_bucket ? 0 : b + 1;
+	}
+
+	return FIND_PERFECT_NOT_MATCHED;
+}
+
+/* lookup in the BST format */
+static int __find_perfect_match_bst(perfect_table_t *pt, uint8_t *seed, int len, 
+									int fw_less, uint64_t hash, bseq1_perfect_t *ret) {
+	int64_t idx = (int64_t) (hash % pt->num_seed_entry); /* == __get_hash_idx_seed() */
 	seed_entry_t *ent;
 	int pt_len = pt->seed_len;
-	int fw_less = __compare_fw_rc(seed, pt->seed_len);
 	int cmp;
 
-	idx = __get_hash_idx_seed(pt, seed, fw_less);
 	ent = get_seed_entry(pt, idx);
 
 	if (!is_hash_matched_entry(ent))
@@ -598,16 +755,10 @@ static int __find_perfect_match_entry(perfect_table_t *pt,
 		cmp = seedcmp_find(pt, ent, seed, fw_less);
 		if (cmp == 0) { /* found */
 			if (len == pt_len) {
-				ret->location = ent->location;
-				ret->flags = is_fw_less_entry(ent) == fw_less
-								? (ent->flags & (~(FLAG_RC)) | (FLAG_VALID))
-								: (ent->flags | (FLAG_RC) | (FLAG_VALID));
 #ifdef PERFECT_PROFILE
 				perfect_profile[idx]++;
 #endif
-				return is_fw_less_entry(ent) == fw_less
-							? FIND_PERFECT_FW_MATCHED
-							: FIND_PERFECT_RC_MATCHED;
+				return __perfect_matched(ent, fw_less, ret);
 			} else {
 				int retval = seedmatch_further(pt, ent, seed, fw_less, len, ret);
 #ifdef PERFECT_PROFILE
@@ -628,6 +779,59 @@ static int __find_perfect_match_entry(perfect_table_t *pt,
 	return FIND_PERFECT_NOT_MATCHED;
 }
 
+/* a lookup is split into the steps below, so that find_perfect_match_batch() 
+   can overlap the cache misses of many reads.
+   1. hash the seed (fw or rc, whichever is less)
+   2. the bucket or the root entry of BST
+   3. ref_string at the location of the (first candidate) entry
+   4. compare seeds and walk the BST or spilled buckets */
+static inline uint64_t __perfect_hash(perfect_table_t *pt, uint8_t *seed, int fw_less) {
+	return fw_less ? __get_hash64_fw(seed, pt->seed_len)
+				   : __get_hash64_rc(seed, pt->seed_len);
+}
+
+static inline void __perfect_prefetch_entry(perfect_table_t *pt, uint64_t hash) {
+	if (is_bucket_table(pt))
+		__builtin_prefetch(get_seed_bucket(pt, hash % get_num_bucket(pt)));
+	else
+		__builtin_prefetch(get_seed_entry(pt, hash % pt->num_seed_entry));
+}
+
+static inline void __perfect_prefetch_ref(perfect_table_t *pt, uint64_t hash) {
+	if (is_bucket_table(pt)) {
+		seed_bucket_t *bucket = get_seed_bucket(pt, hash % get_num_bucket(pt));
+		uint16_t fp = get_bucket_fp(hash);
+		int i;
+		if (!bucket)
+			return;
+		for (i = 0; i < PT_BUCKET_SLOTS; ++i) {
+			if (bucket->fp[i] == fp) {
+				__builtin_prefetch(pt->ref_string + bucket->ent[i].location);
+				return;
+			}
+		}
+	} else {
+		seed_entry_t *ent = get_seed_entry(pt, hash % pt->num_seed_entry);
+		if (is_hash_matched_entry(ent))
+			__builtin_prefetch(pt->ref_string + ent->location);
+	}
+}
+
+static inline int __find_perfect_match_hashed(perfect_table_t *pt, uint8_t *seed, int len, 
+											  int fw_less, uint64_t hash, bseq1_perfect_t *ret) {
+	if (is_bucket_table(pt))
+		return __find_perfect_match_bucket(pt, seed, len, fw_less, hash, ret);
+	else
+		return __find_perfect_match_bst(pt, seed, len, fw_less, hash, ret);
+}
+
+static int __find_perfect_match_entry(perfect_table_t *pt, 
+									 uint8_t *seed, int len, bseq1_perfect_t *ret) {
+	int fw_less = __compare_fw_rc(seed, pt->seed_len);
+	return __find_perfect_match_hashed(pt, seed, len, fw_less, 
+									   __perfect_hash(pt, seed, fw_less), ret);
+}
+
 static int seed_with_N(uint8_t *seed, int len) {
 	int ret = 0, i;
 	for (i = 0; i < len; ++i)
@@ -635,29 +839,108 @@ static int seed_with_N(uint8_t *seed, int len) {
 	return ret;
 }
 
-int find_perfect_match_entry(perfect_table_t *pt, bseq1_t *seq, int len) {
-	uint8_t *seed = (uint8_t *) seq->seq;
-
+/* returns the table to look up, or NULL with the result in *ret */
+static inline perfect_table_t *__perfect_table_for_seq(perfect_table_t *pt, uint8_t *seed, 
+													   int len, int *ret) {
 	/* NOTE: initial value of seq->perfect.exist is 0. */
 	if (len < perfect_table_seed_len) {
-		if (perfect_table_seed_len != PT_SEED_LEN_AUTO_TABLE)
-			return FIND_PERFECT_NO_TABLE;
-		else  {
+		if (perfect_table_seed_len != PT_SEED_LEN_AUTO_TABLE) {
+			*ret = FIND_PERFECT_NO_TABLE;
+			return NULL;
+		} else  {
 			auto_load_perfect_table(len);
 			if (len >= perfect_table_seed_len)
 				pt = perfect_table;
 		} 
 	}
 	
-	if (pt == NULL)
-		return FIND_PERFECT_NO_TABLE;
+	pt = perfect_table_for_len(pt, len);
+	if (pt == NULL) {
+		*ret = FIND_PERFECT_NO_TABLE;
+		return NULL;
+	}
+
+	if (seed_with_N(seed, len)) {
+		*ret = FIND_PERFECT_WITH_N;
+		return NULL;
+	}
 
-	if (seed_with_N(seed, len))
-		return FIND_PERFECT_WITH_N;
+	return pt;
+}
+
+int find_perfect_match_entry(perfect_table_t *pt, bseq1_t *seq, int len) {
+	uint8_t *seed = (uint8_t *) seq->seq;
+	int ret;
+
+	pt = __perfect_table_for_seq(pt, seed, len, &ret);
+	if (pt == NULL)
+		return ret;
 
 	return __find_perfect_match_entry(pt, seed, len, &seq->perfect);
 }
 
+/* find_perfect_match_entry() for seqs[0..n), the result of seqs[i] is in ret[i].
+   the lookups go step by step (see __perfect_hash()) over the whole block,
+   so that the cache misses of a step are issued together and overlap.
+   with MEMSCALE, pt can be NULL (no table on the memory). */
+void find_perfect_match_batch(perfect_table_t *pt, bseq1_t *seqs, int n, int *ret) {
+	perfect_table_t *pts[n];
+	uint64_t hash[n];
+	uint8_t fw_less[n];
+	int i;
+
+	for (i = 0; i < n; ++i) {
+		uint8_t *seed = (uint8_t *) seqs[i].seq;
+#ifdef MEMSCALE
+		if (pt == NULL) {
+			pts[i] = NULL;
+			ret[i] = FIND_PERFECT_NO_TABLE;
+			continue;
+		}
+#endif
+		pts[i] = __perfect_table_for_seq(pt, seed, seqs[i].l_seq, &ret[i]);
+		if (pts[i] == NULL)
+			continue;
+		fw_less[i] = __compare_fw_rc(seed, pts[i]->seed_len);
+		hash[i] = __perfect_hash(pts[i], seed, fw_less[i]);
+		__perfect_prefetch_entry(pts[i], hash[i]);
+	}
+
+	for (i = 0; i < n; ++i)
+		if (pts[i])
+			__perfect_prefetch_ref(pts[i], hash[i]);
+
+	for (i = 0; i < n; ++i)
+		if (pts[i])
+			ret[i] = __find_perfect_match_hashed(pts[i], (uint8_t *) seqs[i].seq, seqs[i].l_seq,
+												 fw_less[i], hash[i], &seqs[i].perfect);
+}
+
+/* for 'bench perfect': a private table which is not a member of the family */
+perfect_table_t *load_perfect_table_file(const char *file_name, uint8_t *ref_string) {
+	perfect_table_t *pt;
+#ifdef USE_SHM
+	if (____load_perfect_table_without_shm((char *) file_name, 0, &pt))
+		return NULL;
+#else
+	if (__load_perfect_table((char *) file_name, 0, &pt))
+		return NULL;
+#endif
+	pt->ref_string = ref_string;
+	return pt;
+}
+
+void destroy_perfect_table_file(perfect_table_t *pt) {
+	_mm_free(pt->seed_table);
+	_mm_free(pt->loc_table);
+	_mm_free(pt);
+}
+
+/* seed must not have N and len >= pt->seed_len */
+int find_perfect_match_seed(perfect_table_t *pt, uint8_t *seed, int len, bseq1_perfect_t *ret) {
+	return __find_perfect_match_entry(pt, seed, len, ret);
+}
+
 void init_mem_aln_perfect(mem_aln_perfect_t *a, int64_t pos, int len, int is_rev, const bntseq_t *bns, int seed_len) {
 	bntann1_t *ann;
 	/* find_perfect_match_entry() finds the exact locations for both of FW and RC matched cases.
@@ -697,6 +980,7 @@ static inline void init_mem_aln_perfect_multi_loc(mem_aln_perfect_v *av, uint32_
 /* av.a include FW matched entries first */
 mem_aln_perfect_v get_perfect_locations(bseq1_t *s, const bntseq_t *bns, perfect_table_t *pt) {
 	mem_aln_perfect_v av = {0, 0, 0};
+	pt = perfect_table_for_len(pt, s->l_seq);
 	uint32_t flags = s->perfect.flags;
 	int rc_matched = __is_rc_matched(flags);
 	uint32_t multi_loc = __get_multi_location(flags);
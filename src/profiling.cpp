@@ -89,7 +89,7 @@ int display_stats(int nthreads)
     uint64_t max, min;
     double avg;
 #ifdef PERFECT_MATCH
-	uint64_t sum_pprof[4];
+	uint64_t sum_pprof[NUM_PPROF_ENTRY];
 	uint64_t sum_pprof2[2];
 	uint64_t total_read = 0;
 #endif
@@ -145,6 +145,20 @@ int display_stats(int nthreads)
     fprintf(stderr, "\tMEM_PROCESS_SEQ() (Total compute time (Kernel + SAM)), avg: %0.2lf, (%0.2lf, %0.2lf)\n",
             avg*1.0/proc_freq, max*1.0/proc_freq, min*1.0/proc_freq);
 
+    {
+        static const char *name[KT_NUM_PHASE] = {"bwt", "aln", "sam", "fused"};
+        fprintf(stderr, "\n\tkt_for() phases, tail = first idle thread to the last one (sec):\n");
+        for (int p = 0; p < KT_NUM_PHASE; ++p) {
+            uint64_t n = tprof[KT_CALLS][p];
+            if (n == 0) continue;
+            fprintf(stderr, "\t--%-5s calls: %ld, wall avg: %0.4lf, tail avg: %0.4lf (%0.2lf%%), max: %0.4lf, batch: %ld\n",
+                    name[p], (long) n, tprof[KT_WALL][p]*1.0/proc_freq/n,
+                    tprof[KT_TAIL][p]*1.0/proc_freq/n,
+                    tprof[KT_WALL][p] ? 100.0*tprof[KT_TAIL][p]/tprof[KT_WALL][p] : 0.0,
+                    tprof[KT_TAIL_MAX][p]*1.0/proc_freq, (long) tprof[KT_BS][p]);
+        }
+    }
+
     fprintf(stderr, "\n\t SAM Processing time (sec):\n");
     find_opt(tprof[WORKER20], 1, &max, &min, &avg);
     fprintf(stderr, "\t--WORKER_SAM avg: %0.2lf, (%0.2lf, %0.2lf)\n",
@@ -186,11 +200,42 @@ int display_stats(int nthreads)
 	find_opt(tprof[DO_PERFECT_MATCH], nthreads, &max, &min, &avg);
     fprintf(stderr, "\t\tFIND_PERFECT_MATCH(), avg: %0.2lf, (%0.2lf, %0.2lf)\n",
             avg*1.0/proc_freq, max*1.0/proc_freq, min*1.0/proc_freq);
+	{
+		uint64_t sum = 0;
+		for (int i = 0; i < nthreads; ++i)
+			sum += tprof[DO_PERFECT_MATCH][i];
+		fprintf(stderr, "\t\tFIND_PERFECT_MATCH() per read: %0.1lf cycles\n",
+				total_read ? (double) sum / total_read : 0.0);
+	}
 #endif
     
 	find_opt(tprof[MEM_BWT], nthreads, &max, &min, &avg);
     fprintf(stderr, "\t\tSMEM+CHAIN compute avg: %0.2lf, (%0.2lf, %0.2lf)\n",
             avg*1.0/proc_freq, max*1.0/proc_freq, min*1.0/proc_freq);
+	{
+		uint64_t hit = 0, miss = 0;
+		for (int i = 0; i < nthreads; ++i)
+			hit += tprof[SMEM_CACHE_HIT][i], miss += tprof[SMEM_CACHE_MISS][i];
+		if (hit + miss > 0)
+			fprintf(stderr, "\t\tSMEM cache hits: %ld / %ld reads (%0.2lf%%)\n",
+					(long) hit, (long) (hit + miss), 100.0 * hit / (hit + miss));
+	}
+#ifdef SMEM_ACCEL
+	{
+		uint64_t n[2] = {0, 0}, cyc[2] = {0, 0}, skip = 0;
+		for (int i = 0; i < nthreads; ++i) {
+			for (int c = 0; c < 2; ++c)
+				n[c] += tprof[HIOCC_READ + c][i], cyc[c] += tprof[HIOCC_CYCLE + c][i];
+			skip += tprof[HIOCC_SKIP][i];
+		}
+		if (n[0] + n[1] > 0) {
+			fprintf(stderr, "\t\tLAST, reads w/o high-occ k-mer: %ld, avg %0.2lf us\n", (long) n[0],
+					n[0] ? cyc[0] * 1e6 / proc_freq / n[0] : 0.0);
+			fprintf(stderr, "\t\tLAST, reads w/  high-occ k-mer: %ld, avg %0.2lf us, pivots skipped: %ld\n",
+					(long) n[1], n[1] ? cyc[1] * 1e6 / proc_freq / n[1] : 0.0, (long) skip);
+		}
+	}
+#endif
 
 #if HIDE
     find_opt(tprof[MEM_COLLECT], nthreads, &max, &min, &avg);
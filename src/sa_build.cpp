@@ -0,0 +1,361 @@
+/*************************************************************************************
+                           The MIT License
+
+   BWA-MEM-SCALE (Memory-Scalable Sequence alignment using Burrows-Wheeler Transform),
+   Copyright (C) 2022 Electronics and Telecommunications Research Institute (ETRI), Changdae Kim.
+
+   Permission is hereby granted, free of charge, to any person obtaining
+   a copy of this software and associated documentation files (the
+   "Software"), to deal in the Software without restriction, including
+   without limitation the rights to use, copy, modify, merge, publish,
+   distribute, sublicense, and/or sell copies of the Software, and to
+   permit persons to whom the Software is furnished to do so, subject to
+   the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+
+   Contacts: Changdae Kim <cdkim@etri.re.kr>
+
+** This software builds upon BWA-MEM2, and includes several performance optimization techniques.
+   For BWA-MEM2, refer to the follows.
+
+   BWA-MEM2 (Sequence alignment using Burrows-Wheeler Transform)
+   Copyright ⓒ 2019 Intel Corporation, Heng Li
+   The MIT License
+   Website: https://github.com/bwa-mem2/bwa-mem2
+
+*****************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <algorithm>
+#include <vector>
+#include "sa_build.h"
+#include "kthread.h"
+#include "utils.h"
+
+#define SAB_NB (1L << (2 * SA_BUILD_K))   /* # buckets */
+#define SAB_SCAN_CHUNK (1L << 20)         /* suffix array entries per item of a scan */
+
+typedef struct {
+	uint64_t key;
+	int64_t pos;
+} sab_key_t;
+
+typedef struct {
+	int64_t beg, end;       /* sa[beg, end) is a group of unresolved suffixes */
+} sab_group_t;
+
+typedef struct {
+	const uint8_t *T;
+	int64_t *sa;
+	int64_t n;
+	int n_threads;
+
+	uint64_t *pac;          /* 2 bits per base, the first base in the highest bits */
+	int64_t n_chunk;        /* text ranges for bucketing */
+	int64_t *cnt;           /* [n_chunk][SAB_NB] counts, then scatter offsets */
+	int64_t *bucket;        /* [SAB_NB + 1] bucket boundaries in the suffix array */
+
+	std::vector<sab_key_t> *buf;            /* per thread */
+	std::vector<sab_group_t> *groups_t;     /* per thread, groups found */
+
+	/* prefix doubling */
+	int64_t h;
+	uint64_t *mark;         /* bit i: the rank of suffix i is needed */
+	std::vector<sab_group_t> groups;        /* sorted by beg */
+	std::vector<sab_key_t> *found_t;        /* per thread, (rank, pos) of marked suffixes */
+	std::vector<sab_key_t> found;           /* sorted by pos */
+} sab_t;
+
+static void sab_report(const char *phase, double t0, double alloc)
+{
+	fprintf(stderr, "[sa_build] %-10s %8.2f sec  allocated: %7.2f GB  peak RSS: %7.2f GB\n",
+			phase, realtime() - t0, alloc / (1024.0 * 1024.0 * 1024.0), peakrss() / (1024.0 * 1024.0 * 1024.0));
+}
+
+/* 32 bases from p; bases past the end read as 0 */
+static inline uint64_t sab_get(const uint64_t *pac, int64_t p)
+{
+	int64_t w = p >> 5;
+	int off = (p & 31) << 1;
+	uint64_t v = pac[w] << off;
+	if (off) v |= pac[w + 1] >> (64 - off);
+	return v;
+}
+
+/* SA_BUILD_W bases from p with the # bases left (up to SA_BUILD_W) in the low 6 bits.
+   keys compare as the suffixes do: a suffix ending inside the key has a smaller length
+   and is padded with 0, so it never compares greater than a longer one. */
+static inline uint64_t sab_key(const uint64_t *pac, int64_t n, int64_t p)
+{
+	int64_t l = n - p;
+	return (sab_get(pac, p) >> 6 << 6) | (uint64_t) (l < SA_BUILD_W ? l : SA_BUILD_W);
+}
+
+static inline bool sab_key_lt(const sab_key_t &a, const sab_key_t &b)
+{
+	return a.key < b.key;
+}
+
+static void sab_pack_worker(void *data, long i, long n, int tid)
+{
+	sab_t *s = (sab_t *) data;
+	for (long w = i; w < i + n; ++w) {
+		int64_t p = w << 5, e = p + 32 < s->n ? p + 32 : s->n;
+		uint64_t v = 0;
+		for (int64_t j = p; j < e; ++j)
+			v |= (uint64_t) (s->T[j] & 3) << (62 - ((j - p) << 1));
+		s->pac[w] = v;
+	}
+}
+
+static inline void sab_chunk_range(sab_t *s, long c, int64_t *beg, int64_t *end)
+{
+	*beg = s->n * c / s->n_chunk;
+	*end = s->n * (c + 1) / s->n_chunk;
+}
+
+static void sab_count_worker(void *data, long c, long n, int tid)
+{
+	sab_t *s = (sab_t *) data;
+	int64_t *cnt = s->cnt + c * SAB_NB, beg, end;
+	sab_chunk_range(s, c, &beg, &end);
+	for (int64_t p = beg; p < end; ++p)
+		cnt[sab_get(s->pac, p) >> (64 - 2 * SA_BUILD_K)]++;
+}
+
+static void sab_scatter_worker(void *data, long c, long n, int tid)
+{
+	sab_t *s = (sab_t *) data;
+	int64_t *off = s->cnt + c * SAB_NB, beg, end;
+	sab_chunk_range(s, c, &beg, &end);
+	for (int64_t p = beg; p < end; ++p)
+		s->sa[off[sab_get(s->pac, p) >> (64 - 2 * SA_BUILD_K)]++] = p;
+}
+
+/* sort sa[lo, lo + m) whose suffixes share the first depth bases */
+static void sab_sort(sab_t *s, int64_t lo, int64_t m, int64_t depth, int tid)
+{
+	std::vector<sab_key_t> &buf = s->buf[tid];
+	std::vector<sab_group_t> ties;
+	int64_t i, j;
+
+	if (m <= 1) return;
+	if (depth >= SA_BUILD_MAX_DEPTH) {
+		s->groups_t[tid].push_back(sab_group_t{lo, lo + m});
+		return;
+	}
+
+	if ((int64_t) buf.size() < m) buf.resize(m);
+	for (i = 0; i < m; ++i) {
+		buf[i].pos = s->sa[lo + i];
+		buf[i].key = sab_key(s->pac, s->n, buf[i].pos + depth);
+	}
+	std::sort(buf.begin(), buf.begin() + m, sab_key_lt);
+	for (i = 0; i < m; ++i)
+		s->sa[lo + i] = buf[i].pos;
+
+	/* equal keys of SA_BUILD_W bases go one level deeper. a shorter key is unique. */
+	for (i = 0; i < m; i = j) {
+		for (j = i + 1; j < m && buf[j].key == buf[i].key; ++j);
+		if (j - i > 1)
+			ties.push_back(sab_group_t{lo + i, lo + j});
+	}
+	for (i = 0; i < (int64_t) ties.size(); ++i)
+		sab_sort(s, ties[i].beg, ties[i].end - ties[i].beg, depth + SA_BUILD_W, tid);
+}
+
+static void sab_sort_worker(void *data, long b, long n, int tid)
+{
+	sab_t *s = (sab_t *) data;
+	for (long i = b; i < b + n; ++i)
+		sab_sort(s, s->bucket[i], s->bucket[i + 1] - s->bucket[i], 0, tid);
+}
+
+static void sab_mark_worker(void *data, long g, long n, int tid)
+{
+	sab_t *s = (sab_t *) data;
+	for (long k = g; k < g + n; ++k) {
+		for (int64_t r = s->groups[k].beg; r < s->groups[k].end; ++r) {
+			int64_t p = s->sa[r] + s->h;
+			if (p < s->n)
+				__atomic_fetch_or(&s->mark[p >> 6], 1ULL << (p & 63), __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/* the rank of sa[r]: r, or the last index of the group containing r */
+static inline int64_t sab_rank(sab_t *s, int64_t r)
+{
+	std::vector<sab_group_t>::iterator it = std::upper_bound(s->groups.begin(), s->groups.end(),
+			sab_group_t{r, r},
+			[](const sab_group_t &a, const sab_group_t &b) { return a.beg < b.beg; });
+	if (it != s->groups.begin() && r < (it - 1)->end)
+		return (it - 1)->end - 1;
+	return r;
+}
+
+static void sab_scan_worker(void *data, long c, long n, int tid)
+{
+	sab_t *s = (sab_t *) data;
+	int64_t beg = c * SAB_SCAN_CHUNK, end = (c + n) * SAB_SCAN_CHUNK;
+	if (end > s->n) end = s->n;
+	for (int64_t r = beg; r < end; ++r) {
+		int64_t p = s->sa[r];
+		if (s->mark[p >> 6] >> (p & 63) & 1)
+			s->found_t[tid].push_back(sab_key_t{(uint64_t) sab_rank(s, r), p});
+	}
+}
+
+static inline uint64_t sab_found_rank(sab_t *s, int64_t p)
+{
+	if (p == s->n) return 0; /* the empty suffix is the smallest */
+	std::vector<sab_key_t>::iterator it = std::lower_bound(s->found.begin(), s->found.end(),
+			sab_key_t{0, p},
+			[](const sab_key_t &a, const sab_key_t &b) { return a.pos < b.pos; });
+	assert(it != s->found.end() && it->pos == p);
+	return it->key + 1;
+}
+
+static void sab_refine_worker(void *data, long g, long n, int tid)
+{
+	sab_t *s = (sab_t *) data;
+	std::vector<sab_key_t> &buf = s->buf[tid];
+	for (long k = g; k < g + n; ++k) {
+		int64_t lo = s->groups[k].beg, m = s->groups[k].end - lo, i, j;
+		if ((int64_t) buf.size() < m) buf.resize(m);
+		for (i = 0; i < m; ++i) {
+			buf[i].pos = s->sa[lo + i];
+			assert(buf[i].pos + s->h <= s->n);
+			buf[i].key = sab_found_rank(s, buf[i].pos + s->h);
+		}
+		std::sort(buf.begin(), buf.begin() + m, sab_key_lt);
+		for (i = 0; i < m; i = j) {
+			s->sa[lo + i] = buf[i].pos;
+			for (j = i + 1; j < m && buf[j].key == buf[i].key; ++j)
+				s->sa[lo + j] = buf[j].pos;
+			if (j - i > 1)
+				s->groups_t[tid].push_back(sab_group_t{lo + i, lo + j});
+		}
+	}
+}
+
+/* collect the per-thread groups into s->groups, sorted by beg */
+static void sab_collect_groups(sab_t *s)
+{
+	s->groups.clear();
+	for (int t = 0; t < s->n_threads; ++t) {
+		s->groups.insert(s->groups.end(), s->groups_t[t].begin(), s->groups_t[t].end());
+		s->groups_t[t].clear();
+	}
+	std::sort(s->groups.begin(), s->groups.end(),
+			[](const sab_group_t &a, const sab_group_t &b) { return a.beg < b.beg; });
+}
+
+int sa_build_par(const uint8_t *T, int64_t *sa, int64_t n, int n_threads)
+{
+	sab_t s;
+	kt_pool_t *pool;
+	double t0, alloc;
+	int64_t i, b, n_words = (n >> 5) + 2, n_grouped = 0;
+	int t;
+
+	assert(n > 0 && n_threads > 0);
+	s.T = T, s.sa = sa, s.n = n, s.n_threads = n_threads;
+	s.n_chunk = n_threads;
+	s.buf = new std::vector<sab_key_t>[n_threads];
+	s.groups_t = new std::vector<sab_group_t>[n_threads];
+	s.found_t = new std::vector<sab_key_t>[n_threads];
+	pool = kt_pool_init(n_threads, 0);
+	alloc = (double) n * (sizeof(uint8_t) + sizeof(int64_t)); /* T and sa */
+
+	/* 1. pack */
+	t0 = realtime();
+	s.pac = (uint64_t *) calloc(n_words, sizeof(uint64_t));
+	assert(s.pac != NULL);
+	alloc += n_words * sizeof(uint64_t);
+	kt_pool_for(pool, sab_pack_worker, &s, (n + 31) >> 5, 1 << 16);
+	sab_report("pack", t0, alloc);
+
+	/* 2. bucket by the first SA_BUILD_K bases */
+	t0 = realtime();
+	s.cnt = (int64_t *) calloc(s.n_chunk * SAB_NB, sizeof(int64_t));
+	s.bucket = (int64_t *) malloc((SAB_NB + 1) * sizeof(int64_t));
+	assert(s.cnt != NULL && s.bucket != NULL);
+	alloc += (s.n_chunk + 1) * SAB_NB * sizeof(int64_t);
+	kt_pool_for(pool, sab_count_worker, &s, s.n_chunk, 1);
+	for (b = 0, i = 0; b < SAB_NB; ++b) {
+		s.bucket[b] = i;
+		for (int64_t c = 0; c < s.n_chunk; ++c) {
+			int64_t x = s.cnt[c * SAB_NB + b];
+			s.cnt[c * SAB_NB + b] = i;
+			i += x;
+		}
+	}
+	s.bucket[SAB_NB] = i;
+	assert(i == n);
+	kt_pool_for(pool, sab_scatter_worker, &s, s.n_chunk, 1);
+	free(s.cnt);
+	alloc -= s.n_chunk * SAB_NB * sizeof(int64_t);
+	sab_report("bucket", t0, alloc);
+
+	/* 3. sort buckets */
+	t0 = realtime();
+	kt_pool_for(pool, sab_sort_worker, &s, SAB_NB, 16);
+	free(s.bucket);
+	alloc -= (SAB_NB + 1) * sizeof(int64_t);
+	sab_collect_groups(&s);
+	for (i = 0; i < (int64_t) s.groups.size(); ++i)
+		n_grouped += s.groups[i].end - s.groups[i].beg;
+	fprintf(stderr, "[sa_build] %ld suffixes in %ld groups share at least %d bases\n",
+			n_grouped, (long) s.groups.size(), SA_BUILD_MAX_DEPTH);
+	sab_report("sort", t0, alloc);
+
+	/* 4. prefix doubling on the groups left */
+	t0 = realtime();
+	if (!s.groups.empty()) {
+		s.mark = (uint64_t *) calloc((n >> 6) + 1, sizeof(uint64_t));
+		assert(s.mark != NULL);
+		alloc += ((n >> 6) + 1) * sizeof(uint64_t);
+	}
+	for (s.h = SA_BUILD_MAX_DEPTH; !s.groups.empty(); s.h <<= 1) {
+		kt_pool_for(pool, sab_mark_worker, &s, s.groups.size(), 1);
+		kt_pool_for(pool, sab_scan_worker, &s, (n + SAB_SCAN_CHUNK - 1) / SAB_SCAN_CHUNK, 1);
+		s.found.clear();
+		for (t = 0; t < n_threads; ++t) {
+			s.found.insert(s.found.end(), s.found_t[t].begin(), s.found_t[t].end());
+			std::vector<sab_key_t>().swap(s.found_t[t]);
+		}
+		std::sort(s.found.begin(), s.found.end(),
+				[](const sab_key_t &a, const sab_key_t &b) { return a.pos < b.pos; });
+		memset(s.mark, 0, ((n >> 6) + 1) * sizeof(uint64_t));
+
+		kt_pool_for(pool, sab_refine_worker, &s, s.groups.size(), 1);
+		sab_collect_groups(&s);
+		fprintf(stderr, "[sa_build] h = %ld: %ld groups left\n", (long) s.h, (long) s.groups.size());
+	}
+	if (s.h > SA_BUILD_MAX_DEPTH) {
+		free(s.mark);
+		sab_report("refine", t0, alloc + s.found.capacity() * sizeof(sab_key_t));
+	}
+
+	free(s.pac);
+	kt_pool_destroy(pool);
+	delete[] s.buf;
+	delete[] s.groups_t;
+	delete[] s.found_t;
+	return 0;
+}
@@ -0,0 +1,65 @@
+/*************************************************************************************
+                           The MIT License
+
+   BWA-MEM-SCALE (Memory-Scalable Sequence alignment using Burrows-Wheeler Transform),
+   Copyright (C) 2022 Electronics and Telecommunications Research Institute (ETRI), Changdae Kim.
+
+   Permission is hereby granted, free of charge, to any person obtaining
+   a copy of this software and associated documentation files (the
+   "Software"), to deal in the Software without restriction, including
+   without limitation the rights to use, copy, modify, merge, publish,
+   distribute, sublicense, and/or sell copies of the Software, and to
+   permit persons to whom the Software is furnished to do so, subject to
+   the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+
+   Contacts: Changdae Kim <cdkim@etri.re.kr>
+
+** This software builds upon BWA-MEM2, and includes several performance optimization techniques.
+   For BWA-MEM2, refer to the follows.
+
+   BWA-MEM2 (Sequence alignment using Burrows-Wheeler Transform)
+   Copyright ⓒ 2019 Intel Corporation, Heng Li
+   The MIT License
+   Website: https://github.com/bwa-mem2/bwa-mem2
+
+*****************************************************************************************/
+
+#ifndef SA_BUILD_H
+#define SA_BUILD_H
+
+#include <stdint.h>
+
+/* Multi-threaded suffix array construction for 'index -t N'.
+   T[0, n) holds 2-bit codes (0..3). sa[0, n) receives the suffixes in
+   lexicographic order, i.e. the same array as saisxx() builds.
+
+   1. T is packed to 2 bits per base.
+   2. suffixes are bucketed by their first SA_BUILD_K bases (counting and
+      scattering are split by text ranges).
+   3. buckets are sorted in parallel, SA_BUILD_W bases per key, recursing
+      into ties. Ties still unresolved at SA_BUILD_MAX_DEPTH bases (long
+      repeats) are left as groups.
+   4. groups are refined by prefix doubling: a group sharing h bases is
+      sorted by the rank of suffix i+h, which is found by a scan of the suffix array.
+
+   Time and memory are reported per phase. Returns 0 on success. */
+
+#define SA_BUILD_K 10
+#define SA_BUILD_W 29
+#define SA_BUILD_MAX_DEPTH (SA_BUILD_W * 64)
+
+int sa_build_par(const uint8_t *T, int64_t *sa, int64_t n, int n_threads);
+
+#endif
@@ -0,0 +1,116 @@
+/*************************************************************************************
+                           The MIT License
+
+   BWA-MEM-SCALE (Memory-Scalable Sequence alignment using Burrows-Wheeler Transform),
+   Copyright (C) 2022 Electronics and Telecommunications Research Institute (ETRI), Changdae Kim.
+
+   Permission is hereby granted, free of charge, to any person obtaining
+   a copy of this software and associated documentation files (the
+   "Software"), to deal in the Software without restriction, including
+   without limitation the rights to use, copy, modify, merge, publish,
+   distribute, sublicense, and/or sell copies of the Software, and to
+   permit persons to whom the Software is furnished to do so, subject to
+   the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+
+   Contacts: Changdae Kim <cdkim@etri.re.kr>
+
+** This software builds upon BWA-MEM2, and includes several performance optimization techniques.
+   For BWA-MEM2, refer to the follows.
+
+   BWA-MEM2 (Sequence alignment using Burrows-Wheeler Transform)
+   Copyright ⓒ 2019 Intel Corporation, Heng Li
+   The MIT License
+   Website: https://github.com/bwa-mem2/bwa-mem2
+
+*****************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "smem_cache.h"
+
+#define SMEM_CACHE_ENT_BYTES 512    // expected bytes per entry, to size the slot table
+
+static inline uint64_t smem_cache_hash(const uint8_t *seq, int l_seq)
+{
+	uint64_t h = 0x9E3779B97F4A7C15ULL ^ (uint64_t)l_seq, x;
+	int i;
+	for (i = 0; i + 8 <= l_seq; i += 8) {
+		memcpy(&x, seq + i, 8);
+		h = (h ^ x) * 0xFF51AFD7ED558CCDULL;
+		h ^= h >> 32;
+	}
+	for (x = 0; i < l_seq; ++i)
+		x = x << 8 | seq[i];
+	h = (h ^ x) * 0xC4CEB9FE1A85EC53ULL;
+	return h ^ h >> 29;
+}
+
+smem_cache_t *smem_cache_init(int64_t size)
+{
+	smem_cache_t *c = (smem_cache_t *) calloc(1, sizeof(smem_cache_t));
+	size &= ~7LL;
+	c->size = size;
+	c->buf = (uint8_t *) malloc(size);
+	for (c->n_slot = 1024; c->n_slot < size / SMEM_CACHE_ENT_BYTES; c->n_slot <<= 1);
+	c->slot = (int64_t *) calloc(c->n_slot, sizeof(int64_t));
+	if (c->buf == NULL || c->slot == NULL) {
+		fprintf(stderr, "ERROR: unable to allocate %ld bytes for the SMEM cache\n", (long) size);
+		exit(EXIT_FAILURE);
+	}
+	return c;
+}
+
+void smem_cache_destroy(smem_cache_t *c)
+{
+	if (c == NULL) return;
+	free(c->buf);
+	free(c->slot);
+	free(c);
+}
+
+const smem_cache_ent_t *smem_cache_get(const smem_cache_t *c, const uint8_t *seq, int l_seq)
+{
+	uint64_t h = smem_cache_hash(seq, l_seq);
+	int64_t p = c->slot[h & (c->n_slot - 1)] - 1;
+	if (p < 0 || p < c->head - c->size) return NULL; // empty, or overwritten by the ring
+	const smem_cache_ent_t *e = (const smem_cache_ent_t *)(c->buf + p % c->size);
+	if (e->hash != h || e->l_seq != l_seq || memcmp(e + 1, seq, l_seq) != 0)
+		return NULL;
+	return e;
+}
+
+void smem_cache_put(smem_cache_t *c, const uint8_t *seq, int l_seq,
+					const SMEM *smem, int n_smem, const int64_t *coord, int64_t n_coord)
+{
+	int64_t len = sizeof(smem_cache_ent_t) + __smem_cache_seq_size(l_seq) +
+		n_smem * sizeof(SMEM) + n_coord * sizeof(int64_t);
+	if (len > c->size / 16) return; // a few repetitive reads must not flush the whole cache
+
+	/* entries never wrap around the end of the ring */
+	if (c->head % c->size + len > c->size)
+		c->head += c->size - c->head % c->size;
+
+	smem_cache_ent_t *e = (smem_cache_ent_t *)(c->buf + c->head % c->size);
+	e->hash = smem_cache_hash(seq, l_seq);
+	e->l_seq = l_seq;
+	e->n_smem = n_smem;
+	e->n_coord = n_coord;
+	memcpy(e + 1, seq, l_seq);
+	memcpy((void *) smem_cache_smem(e), smem, n_smem * sizeof(SMEM));
+	memcpy((void *) smem_cache_coord(e), coord, n_coord * sizeof(int64_t));
+	c->slot[e->hash & (c->n_slot - 1)] = c->head + 1;
+	c->head += len;
+}
@@ -0,0 +1,88 @@
+/*************************************************************************************
+                           The MIT License
+
+   BWA-MEM-SCALE (Memory-Scalable Sequence alignment using Burrows-Wheeler Transform),
+   Copyright (C) 2022 Electronics and Telecommunications Research Institute (ETRI), Changdae Kim.
+
+   Permission is hereby granted, free of charge, to any person obtaining
+   a copy of this software and associated documentation files (the
+   "Software"), to deal in the Software without restriction, including
+   without limitation the rights to use, copy, modify, merge, publish,
+   distribute, sublicense, and/or sell copies of the Software, and to
+   permit persons to whom the Software is furnished to do so, subject to
+   the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+
+   Contacts: Changdae Kim <cdkim@etri.re.kr>
+
+** This software builds upon BWA-MEM2, and includes several performance optimization techniques.
+   For BWA-MEM2, refer to the follows.
+
+   BWA-MEM2 (Sequence alignment using Burrows-Wheeler Transform)
+   Copyright ⓒ 2019 Intel Corporation, Heng Li
+   The MIT License
+   Website: https://github.com/bwa-mem2/bwa-mem2
+
+*****************************************************************************************/
+
+#ifndef SMEM_CACHE_HPP
+#define SMEM_CACHE_HPP
+
+#include <stdint.h>
+#include "FMI_search.h"
+
+/* Read-level SMEM cache ('mem -e'). Reads that repeat within a run (PCR or
+   optical duplicates, amplicons, adapter dimers) produce exactly the same SMEMs
+   and SA coordinates every time, so each worker thread keeps the SMEM list and
+   the coordinates of the reads it has seeded, keyed on the 2-bit read. A hit
+   skips the SMEM search and the SA lookup of the read.
+
+   Entries are appended to a ring of fixed size, and an open hash table of
+   slots points into the ring. When the ring wraps, the oldest entries are
+   overwritten; slots that still point to them are detected by their position
+   and treated as misses. Each thread owns its cache, so no locking is needed. */
+
+typedef struct {
+	uint64_t hash;
+	int32_t l_seq, n_smem;
+	int64_t n_coord;
+	/* followed by l_seq bases (padded to 8 bytes), SMEM[n_smem] and int64_t[n_coord] */
+} smem_cache_ent_t;
+
+typedef struct {
+	uint8_t *buf;
+	int64_t size, head;         // ring of size bytes; head: absolute offset of the next entry
+	int64_t *slot, n_slot;      // absolute offset + 1 of an entry, 0 if empty
+} smem_cache_t;
+
+#define __smem_cache_seq_size(l_seq) (((int64_t)(l_seq) + 7) & ~7LL)
+
+static inline const SMEM *smem_cache_smem(const smem_cache_ent_t *e)
+{
+	return (const SMEM *)((const uint8_t *)(e + 1) + __smem_cache_seq_size(e->l_seq));
+}
+
+static inline const int64_t *smem_cache_coord(const smem_cache_ent_t *e)
+{
+	return (const int64_t *)(smem_cache_smem(e) + e->n_smem);
+}
+
+smem_cache_t *smem_cache_init(int64_t size);
+void smem_cache_destroy(smem_cache_t *c);
+/* returns NULL on a miss; the entry stays valid until the next smem_cache_put() */
+const smem_cache_ent_t *smem_cache_get(const smem_cache_t *c, const uint8_t *seq, int l_seq);
+void smem_cache_put(smem_cache_t *c, const uint8_t *seq, int l_seq,
+					const SMEM *smem, int n_smem, const int64_t *coord, int64_t n_coord);
+
+#endif
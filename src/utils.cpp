@@ -305,3 +305,29 @@ double realtime()
 	gettimeofday(&tp, &tzp);
 	return tp.tv_sec + tp.tv_usec * 1e-6;
 }
+
+long peakrss(void)
+{
+	struct rusage r;
+	getrusage(RUSAGE_SELF, &r);
+#ifdef __linux__
+	return r.ru_maxrss * 1024;
+#else
+	return r.ru_maxrss;
+#endif
+}
+
+long currentrss(void)
+{
+#ifdef __linux__
+	long pages = 0;
+	FILE *fp = fopen("/proc/self/statm", "r");
+	if (fp) {
+		if (fscanf(fp, "%*s %ld", &pages) != 1) pages = 0;
+		fclose(fp);
+	}
+	return pages * sysconf(_SC_PAGESIZE);
+#else
+	return peakrss();
+#endif
+}
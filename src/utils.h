@@ -106,6 +106,8 @@ extern "C" {
 
 	double cputime();
 	double realtime();
+	long peakrss(void);
+	long currentrss(void);
 
 	void ks_introsort_64 (size_t n, uint64_t *a);
 	void ks_introsort_128(size_t n, pair64_t *a);